@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <zlib.h>
 #include "kerncompat.h"
@@ -34,38 +35,30 @@
 #include "volumes.h"
 #include "utils.h"
 #include "crc32c.h"
+#include "range-scan.h"
+#include "scan-cache.h"
 
 static u16 csum_size = 0;
 static u64 search_objectid = BTRFS_ROOT_TREE_OBJECTID;
 static u64 search_generation = 0;
 static unsigned long search_level = 0;
+static int jobs = RANGE_SCAN_JOBS;
+static char *cache_file;
+static int rank_roots;
+static int filter_objectid;
+/* the raw scan of the devices, when asked to use a cache file */
+static struct scan_cache *scan_cache;
+
+/* with -a, the newest roots of a tree whose children are checked */
+#define ROOT_CANDIDATES_CHECKED	20
+/* and the best of those printed */
+#define ROOT_CANDIDATES_SHOWN	5
 
 static void usage(void)
 {
 	fprintf(stderr, "Usage: find-roots [-o search_objectid] "
-		"[ -g search_generation ] [ -l search_level ] <device>\n");
-}
-
-static int csum_block(void *buf, u32 len)
-{
-	char *result;
-	u32 crc = ~(u32)0;
-	int ret = 0;
-
-	result = malloc(csum_size * sizeof(char));
-	if (!result) {
-		fprintf(stderr, "No memory\n");
-		return 1;
-	}
-
-	len -= BTRFS_CSUM_SIZE;
-	crc = crc32c(crc, buf + BTRFS_CSUM_SIZE, len);
-	btrfs_csum_final(crc, result);
-
-	if (memcmp(buf, result, csum_size))
-		ret = 1;
-	free(result);
-	return ret;
+		"[ -g search_generation ] [ -l search_level ] "
+		"[ -j jobs ] [ -c cache_file ] [ -a ] <device>\n");
 }
 
 static struct btrfs_root *open_ctree_broken(int fd, const char *device)
@@ -125,49 +118,230 @@ out:
 	return NULL;
 }
 
-static int search_iobuf(struct btrfs_root *root, void *iobuf,
-			size_t iobuf_size, off_t offset)
+/* the lowest root found so far, (u64)-1 while there's none */
+static u64 found_bytenr = (u64)-1;
+static u64 found_gen;
+static u64 found_level;
+static pthread_mutex_t found_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * With -a every block with a good csum at its own address is indexed,
+ * the candidate roots of each tree are ranked once the scan is done.
+ */
+struct tree_block {
+	u64 bytenr;
+	u64 owner;
+	u64 generation;
+	u8 level;
+};
+
+struct root_candidate {
+	struct tree_block *block;
+	int nr_children;
+	int good_children;
+	int readable;
+};
+
+static struct tree_block *tree_blocks;
+static u64 nr_tree_blocks;
+static u64 alloc_tree_blocks;
+static pthread_mutex_t tree_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int add_tree_block(u64 bytenr, u64 owner, u64 gen, u8 level)
+{
+	struct tree_block *new;
+	u64 alloc;
+	int ret = 0;
+
+	pthread_mutex_lock(&tree_blocks_lock);
+	if (nr_tree_blocks == alloc_tree_blocks) {
+		alloc = alloc_tree_blocks ? alloc_tree_blocks * 2 : 1024;
+		new = realloc(tree_blocks, alloc * sizeof(*new));
+		if (!new) {
+			fprintf(stderr, "No memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+		tree_blocks = new;
+		alloc_tree_blocks = alloc;
+	}
+	new = &tree_blocks[nr_tree_blocks++];
+	new->bytenr = bytenr;
+	new->owner = owner;
+	new->generation = gen;
+	new->level = level;
+out:
+	pthread_mutex_unlock(&tree_blocks_lock);
+	return ret;
+}
+
+static void found_root(u64 bytenr, u64 gen, u64 level)
+{
+	pthread_mutex_lock(&found_lock);
+	if (bytenr < found_bytenr) {
+		found_bytenr = bytenr;
+		found_gen = gen;
+		found_level = level;
+	}
+	pthread_mutex_unlock(&found_lock);
+}
+
+static u64 first_found_root(void)
+{
+	u64 bytenr;
+
+	pthread_mutex_lock(&found_lock);
+	bytenr = found_bytenr;
+	pthread_mutex_unlock(&found_lock);
+	return bytenr;
+}
+
+/*
+ * A block of the tree we look for at the right place, returns 0 if it's
+ * the root.
+ */
+static int check_root(u64 h_byte, u64 h_gen, u64 h_level, int csum_ok)
+{
+	if (!csum_ok) {
+		fprintf(stderr, "Well block %Lu seems good, "
+			"but the csum doesn't match\n",
+			h_byte);
+		return 1;
+	}
+	if (h_gen != search_generation) {
+		fprintf(stderr, "Well block %Lu seems great, "
+			"but generation doesn't match, "
+			"have=%Lu, want=%Lu level %Lu\n", h_byte,
+			h_gen, search_generation, h_level);
+		return 1;
+	}
+	found_root(h_byte, h_gen, h_level);
+	return 0;
+}
+
+/*
+ * Within a mapping, a block is only looked at if its level is at least
+ * the one of the blocks looked at before it.  Every piece of the scan
+ * keeps the blocks passing this within the piece, once the scan is done
+ * they're put in address order and the rule is applied again across the
+ * pieces, which gives the root a serial scan of the mappings finds.
+ */
+struct root_event {
+	u64 bytenr;
+	/* the mapping it's in */
+	u64 stripe;
+	u64 generation;
+	u8 level;
+	u8 csum_ok;
+};
+
+static struct root_event *root_events;
+static u64 nr_root_events;
+static u64 alloc_root_events;
+static pthread_mutex_t root_events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* where a piece of the scan is */
+struct search_state {
+	struct scan_range *range;
+	u64 logical;
+	u64 stripe;
+	u8 level;
+};
+
+static int add_root_event(u64 bytenr, u64 stripe, u64 gen, u8 level,
+			  int csum_ok)
+{
+	struct root_event *new;
+	u64 alloc;
+	int ret = 0;
+
+	pthread_mutex_lock(&root_events_lock);
+	if (nr_root_events == alloc_root_events) {
+		alloc = alloc_root_events ? alloc_root_events * 2 : 1024;
+		new = realloc(root_events, alloc * sizeof(*new));
+		if (!new) {
+			fprintf(stderr, "No memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+		root_events = new;
+		alloc_root_events = alloc;
+	}
+	new = &root_events[nr_root_events++];
+	new->bytenr = bytenr;
+	new->stripe = stripe;
+	new->generation = gen;
+	new->level = level;
+	new->csum_ok = csum_ok;
+out:
+	pthread_mutex_unlock(&root_events_lock);
+	return ret;
+}
+
+/*
+ * A block of the tree we look for at the right place.  Returns 0 if it's
+ * the root whatever the blocks before the piece are, 1 to go on and < 0
+ * on errors.
+ */
+static int search_block(struct search_state *st, u64 stripe, u64 bytenr,
+			u64 gen, u8 level, int csum_ok)
+{
+	if (stripe != st->stripe) {
+		st->stripe = stripe;
+		st->level = search_level;
+	}
+	if (level < st->level)
+		return 1;
+	st->level = level;
+	if (add_root_event(bytenr, stripe, gen, level, csum_ok))
+		return -1;
+	if (!csum_ok || gen != search_generation)
+		return 1;
+	/* the piece has the whole mapping up to here */
+	if (stripe >= st->logical) {
+		found_root(bytenr, gen, level);
+		return 0;
+	}
+	return 1;
+}
+
+static int search_iobuf(struct btrfs_root *root, struct search_state *st,
+			char *iobuf, size_t iobuf_size, u64 physical)
 {
-	u64 gen = search_generation;
 	u64 objectid = search_objectid;
 	u32 size = btrfs_super_nodesize(root->fs_info->super_copy);
-	u8 level = search_level;
 	size_t block_off = 0;
+	int ret;
 
-	while (block_off < iobuf_size) {
-		void *block = iobuf + block_off;
-		struct btrfs_header *header = block;
+	while (block_off + size <= iobuf_size) {
+		char *block = iobuf + block_off;
+		struct btrfs_header *header = (struct btrfs_header *)block;
 		u64 h_byte, h_level, h_gen, h_owner;
+		u64 logical, stripe;
 
 //		printf("searching %Lu\n", offset + block_off);
 		h_byte = btrfs_stack_header_bytenr(header);
 		h_owner = btrfs_stack_header_owner(header);
 		h_level = header->level;
 		h_gen = btrfs_stack_header_generation(header);
-
-		if (h_owner != objectid)
-			goto next;
-		if (h_byte != (offset + block_off))
-			goto next;
-		if (h_level < level)
-			goto next;
-		level = h_level;
-		if (csum_block(block, size)) {
-			fprintf(stderr, "Well block %Lu seems good, "
-				"but the csum doesn't match\n",
-				h_byte);
+		logical = range_scan_logical(st->range, physical + block_off,
+					     &stripe);
+
+		if (rank_roots) {
+			if (h_byte == logical &&
+			    range_scan_csum_ok(block, size, csum_size) &&
+			    add_tree_block(h_byte, h_owner, h_gen, h_level))
+				return -1;
 			goto next;
 		}
-		if (h_gen != gen) {
-			fprintf(stderr, "Well block %Lu seems great, "
-				"but generation doesn't match, "
-				"have=%Lu, want=%Lu level %Lu\n", h_byte,
-				h_gen, gen, h_level);
+		if (h_owner != objectid)
 			goto next;
-		}
-		printf("Found tree root at %Lu gen %Lu level %Lu\n", h_byte,
-		       h_gen, h_level);
-		return 0;
+		if (h_byte != logical)
+			goto next;
+		ret = search_block(st, stripe, h_byte, h_gen, h_level,
+				   range_scan_csum_ok(block, size, csum_size));
+		if (ret <= 0)
+			return ret;
 next:
 		block_off += size;
 	}
@@ -175,45 +349,341 @@ next:
 	return 1;
 }
 
-static int read_physical(struct btrfs_root *root, int fd, u64 offset,
-			 u64 bytenr, u64 len)
+/* the same as search_iobuf(), with the block headers of the scan cache */
+static int search_cached(struct search_state *st)
 {
-	char *iobuf = malloc(len);
+	struct scan_range *range = st->range;
+	struct btrfs_device *device = range->priv;
+	struct scan_cache_device *dev;
+	struct scan_cache_block *b;
+	u64 end = range->start + range->len;
+	u64 logical, stripe;
+	u64 idx;
+	int ret;
+
+	dev = scan_cache_find_device(scan_cache, device->devid);
+	if (!dev)
+		return 1;
+
+	for (idx = scan_cache_lookup(dev, range->start);
+	     idx < dev->nr_blocks && dev->blocks[idx].physical < end; idx++) {
+		b = &dev->blocks[idx];
+		logical = range_scan_logical(range, b->physical, &stripe);
+		if (b->bytenr != logical)
+			continue;
+		if (rank_roots) {
+			if (b->csum_ok &&
+			    add_tree_block(b->bytenr, b->owner, b->generation,
+					   b->level))
+				return -1;
+			continue;
+		}
+		if (b->owner != search_objectid)
+			continue;
+		ret = search_block(st, stripe, b->bytenr, b->generation,
+				   b->level, b->csum_ok);
+		if (ret <= 0)
+			return ret;
+	}
+	return 1;
+}
+
+/*
+ * Search one piece of the metadata chunks a window at a time, a piece
+ * past a root another worker already found is given up.
+ */
+static int search_range(struct range_scan *scan, struct scan_range *range)
+{
+	struct btrfs_root *root = scan->priv;
+	struct search_state st;
+	char *iobuf;
 	ssize_t done;
-	size_t total_read = 0;
-	int ret = 1;
+	u64 off = 0;
+	u64 len;
+	int ret = 0;
+
+	st.range = range;
+	st.logical = range_scan_logical(range, range->start, NULL);
+	st.stripe = (u64)-1;
+	st.level = search_level;
+
+	if (scan_cache) {
+		ret = search_cached(&st);
+		return ret < 0 ? ret : 0;
+	}
 
+	iobuf = malloc(RANGE_SCAN_WINDOW_SIZE);
 	if (!iobuf) {
 		fprintf(stderr, "No memory\n");
 		return -1;
 	}
 
-	while (total_read < len) {
-		done = pread64(fd, iobuf + total_read, len - total_read,
-			       bytenr + total_read);
+	while (off < range->len) {
+		if (range_scan_logical(range, range->start + off, NULL) >
+		    first_found_root())
+			break;
+
+		len = min_t(u64, RANGE_SCAN_WINDOW_SIZE, range->len - off);
+		done = range_scan_read(range->fd, iobuf, len,
+				       range->start + off);
 		if (done < 0) {
 			fprintf(stderr, "Failed to read: %s\n",
-				strerror(errno));
+				strerror(-done));
 			ret = -1;
-			goto out;
+			break;
 		}
-		total_read += done;
-	}
 
-	ret = search_iobuf(root, iobuf, total_read, offset);
-out:
+		ret = search_iobuf(root, &st, iobuf, done, range->start + off);
+		if (ret <= 0)
+			break;
+		ret = 0;
+		if (done < len)
+			break;
+		off += len;
+	}
 	free(iobuf);
+	return ret < 0 ? ret : 0;
+}
+
+static int cmp_root_event(const void *a, const void *b)
+{
+	const struct root_event *ea = a;
+	const struct root_event *eb = b;
+
+	if (ea->bytenr != eb->bytenr)
+		return ea->bytenr < eb->bytenr ? -1 : 1;
+	return 0;
+}
+
+/* apply the level rule to what the pieces found, returns 0 if found */
+static int merge_root_events(void)
+{
+	struct root_event *e;
+	u64 stripe = (u64)-1;
+	u8 level = search_level;
+	u64 i;
+
+	qsort(root_events, nr_root_events, sizeof(*root_events),
+	      cmp_root_event);
+	found_bytenr = (u64)-1;
+	for (i = 0; i < nr_root_events; i++) {
+		e = &root_events[i];
+		if (e->stripe != stripe) {
+			stripe = e->stripe;
+			level = search_level;
+		}
+		if (e->level < level)
+			continue;
+		level = e->level;
+		if (!check_root(e->bytenr, e->generation, e->level,
+				e->csum_ok))
+			return 0;
+	}
+	return 1;
+}
+
+static int cmp_block_bytenr(const void *a, const void *b)
+{
+	const struct tree_block *ba = a;
+	const struct tree_block *bb = b;
+
+	if (ba->bytenr != bb->bytenr)
+		return ba->bytenr < bb->bytenr ? -1 : 1;
+	return 0;
+}
+
+/* by tree, then newest generation and highest level first */
+static int cmp_block_tree(const void *a, const void *b)
+{
+	const struct tree_block * const *ba = a;
+	const struct tree_block * const *bb = b;
+
+	if ((*ba)->owner != (*bb)->owner)
+		return (*ba)->owner < (*bb)->owner ? -1 : 1;
+	if ((*ba)->generation != (*bb)->generation)
+		return (*ba)->generation > (*bb)->generation ? -1 : 1;
+	if ((*ba)->level != (*bb)->level)
+		return (*ba)->level > (*bb)->level ? -1 : 1;
+	return cmp_block_bytenr(*ba, *bb);
+}
+
+/* complete candidates first, then the newest */
+static int cmp_candidate(const void *a, const void *b)
+{
+	const struct root_candidate *ca = a;
+	const struct root_candidate *cb = b;
+	int complete_a = ca->readable &&
+			 ca->good_children == ca->nr_children;
+	int complete_b = cb->readable &&
+			 cb->good_children == cb->nr_children;
+
+	if (complete_a != complete_b)
+		return complete_b - complete_a;
+	if (ca->block->generation != cb->block->generation)
+		return ca->block->generation > cb->block->generation ? -1 : 1;
+	return 0;
+}
+
+static struct tree_block *lookup_tree_block(u64 bytenr)
+{
+	struct tree_block key = { .bytenr = bytenr };
+
+	return bsearch(&key, tree_blocks, nr_tree_blocks,
+		       sizeof(*tree_blocks), cmp_block_bytenr);
+}
+
+/*
+ * A node is only a good root if its children were found too, with the
+ * generation it points to them with.
+ */
+static void check_children(struct btrfs_root *root,
+			   struct root_candidate *cand)
+{
+	struct tree_block *block = cand->block;
+	struct tree_block *child;
+	struct extent_buffer *eb;
+	u32 size = btrfs_super_nodesize(root->fs_info->super_copy);
+	int i;
+
+	cand->readable = 1;
+	if (!block->level)
+		return;
+
+	eb = read_tree_block(root, block->bytenr, size, block->generation);
+	if (!eb || !extent_buffer_uptodate(eb)) {
+		cand->readable = 0;
+		free_extent_buffer(eb);
+		return;
+	}
+
+	cand->nr_children = btrfs_header_nritems(eb);
+	for (i = 0; i < cand->nr_children; i++) {
+		child = lookup_tree_block(btrfs_node_blockptr(eb, i));
+		if (child &&
+		    child->generation == btrfs_node_ptr_generation(eb, i) &&
+		    child->level == block->level - 1)
+			cand->good_children++;
+	}
+	free_extent_buffer(eb);
+}
+
+static void print_candidate(struct root_candidate *cand)
+{
+	struct tree_block *block = cand->block;
+
+	printf("\tgen %llu level %u at %llu, ",
+	       (unsigned long long)block->generation, block->level,
+	       (unsigned long long)block->bytenr);
+	if (!cand->readable)
+		printf("unreadable\n");
+	else if (!block->level)
+		printf("leaf\n");
+	else
+		printf("%d/%d children good\n", cand->good_children,
+		       cand->nr_children);
+}
+
+/*
+ * The root of a tree in a transaction is the highest block of that tree
+ * written in it, so every tree gets one candidate per generation.  The
+ * newest ones are checked and the best of those printed.
+ */
+static int rank_candidates(struct btrfs_root *root)
+{
+	struct tree_block **sorted;
+	struct root_candidate cands[ROOT_CANDIDATES_CHECKED];
+	struct tree_block *block;
+	u64 owner;
+	u64 i;
+	int nr_cands;
+	int total;
+	int found = 0;
+	int j;
+
+	qsort(tree_blocks, nr_tree_blocks, sizeof(*tree_blocks),
+	      cmp_block_bytenr);
+	sorted = malloc(max_t(u64, nr_tree_blocks, 1) * sizeof(*sorted));
+	if (!sorted) {
+		fprintf(stderr, "No memory\n");
+		return -1;
+	}
+	for (i = 0; i < nr_tree_blocks; i++)
+		sorted[i] = &tree_blocks[i];
+	qsort(sorted, nr_tree_blocks, sizeof(*sorted), cmp_block_tree);
+
+	i = 0;
+	while (i < nr_tree_blocks) {
+		owner = sorted[i]->owner;
+		nr_cands = 0;
+		total = 0;
+		for (; i < nr_tree_blocks && sorted[i]->owner == owner; i++) {
+			block = sorted[i];
+			if (i && sorted[i - 1]->owner == owner &&
+			    sorted[i - 1]->generation == block->generation)
+				continue;
+			if (filter_objectid && owner != search_objectid)
+				continue;
+			if (block->level < search_level)
+				continue;
+			total++;
+			if (nr_cands == ROOT_CANDIDATES_CHECKED)
+				continue;
+			memset(&cands[nr_cands], 0, sizeof(cands[nr_cands]));
+			cands[nr_cands].block = block;
+			check_children(root, &cands[nr_cands]);
+			nr_cands++;
+		}
+		if (!total)
+			continue;
+
+		found = 1;
+		qsort(cands, nr_cands, sizeof(*cands), cmp_candidate);
+		/* the reloc and log trees read better as negative ids */
+		if (owner >= BTRFS_LAST_FREE_OBJECTID)
+			printf("Tree %lld", (long long)owner);
+		else
+			printf("Tree %llu", (unsigned long long)owner);
+		printf(": %d candidate roots, best first\n", total);
+		for (j = 0; j < min(nr_cands, ROOT_CANDIDATES_SHOWN); j++)
+			print_candidate(&cands[j]);
+	}
+
+	free(sorted);
+	return found ? 0 : 1;
+}
+
+/* load the raw scan of the devices from cache_file or make it */
+static int setup_scan_cache(struct btrfs_root *root, struct scan_cache *cache)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct btrfs_super_block *sb = fs_info->super_copy;
+	int ret;
+
+	ret = scan_cache_init(cache, fs_info->fs_devices,
+			      btrfs_super_generation(sb),
+			      btrfs_super_sectorsize(sb),
+			      btrfs_super_leafsize(sb), csum_size);
+	if (!ret)
+		ret = scan_cache_fill(cache, fs_info->fs_devices, cache_file,
+				      jobs);
+	if (ret)
+		scan_cache_release(cache);
 	return ret;
 }
 
 static int find_root(struct btrfs_root *root)
 {
+	struct btrfs_fs_devices *fs_devices = root->fs_info->fs_devices;
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
+	struct range_scan scan;
+	struct scan_cache cache;
 	u64 metadata_offset = 0, metadata_size = 0;
+	u32 nodesize = btrfs_super_nodesize(root->fs_info->super_copy);
+	const char *done_msg = NULL;
+	int devnr = 0;
 	off_t offset = 0;
 	off_t bytenr;
-	int fd;
 	int err;
 	int ret = 1;
 
@@ -226,6 +696,17 @@ static int find_root(struct btrfs_root *root)
 	if (err)
 		return ret;
 
+	if (cache_file) {
+		err = setup_scan_cache(root, &cache);
+		if (err) {
+			fprintf(stderr, "Failed to scan the devices: %s\n",
+				strerror(-err));
+			return err;
+		}
+		scan_cache = &cache;
+	}
+
+	range_scan_init(&scan, search_range, root);
 	offset = metadata_offset;
 	while (1) {
 		u64 map_length = 4096;
@@ -233,7 +714,7 @@ static int find_root(struct btrfs_root *root)
 
 		if (offset >
 		    btrfs_super_total_bytes(root->fs_info->super_copy)) {
-			printf("Went past the fs size, exiting");
+			done_msg = "Went past the fs size, exiting";
 			break;
 		}
 		if (offset >= (metadata_offset + metadata_size)) {
@@ -241,7 +722,7 @@ static int find_root(struct btrfs_root *root)
 						  &metadata_offset,
 						  &metadata_size);
 			if (err) {
-				printf("No more metdata to scan, exiting\n");
+				done_msg = "No more metdata to scan, exiting\n";
 				break;
 			}
 			offset = metadata_offset;
@@ -261,20 +742,54 @@ static int find_root(struct btrfs_root *root)
 		}
 
 		device = multi->stripes[0].dev;
-		fd = device->fd;
 		bytenr = multi->stripes[0].physical;
 		kfree(multi);
 
-		err = read_physical(root, fd, offset, bytenr, map_length);
-		if (!err) {
-			ret = 0;
-			break;
-		} else if (err < 0) {
+		err = range_scan_add_stripe(&scan, device->fd, bytenr,
+					    map_length, offset, device);
+		if (err) {
+			fprintf(stderr, "No memory\n");
 			ret = err;
-			break;
+			goto out;
 		}
 		offset += map_length;
 	}
+
+	err = range_scan_split(&scan, jobs, nodesize);
+	if (err) {
+		fprintf(stderr, "No memory\n");
+		ret = err;
+		goto out;
+	}
+
+	list_for_each_entry(device, &fs_devices->devices, dev_list)
+		devnr++;
+	err = range_scan_run(&scan, devnr * jobs);
+	if (err < 0) {
+		ret = err;
+	} else if (rank_roots) {
+		ret = rank_candidates(root);
+	} else if (!merge_root_events()) {
+		printf("Found tree root at %Lu gen %Lu level %Lu\n",
+		       found_bytenr, found_gen, found_level);
+		ret = 0;
+	} else {
+		printf("%s", done_msg);
+	}
+out:
+	range_scan_release(&scan);
+	free(tree_blocks);
+	tree_blocks = NULL;
+	nr_tree_blocks = 0;
+	alloc_tree_blocks = 0;
+	free(root_events);
+	root_events = NULL;
+	nr_root_events = 0;
+	alloc_root_events = 0;
+	if (scan_cache) {
+		scan_cache_release(scan_cache);
+		scan_cache = NULL;
+	}
 	return ret;
 }
 
@@ -285,10 +800,11 @@ int main(int argc, char **argv)
 	int opt;
 	int ret;
 
-	while ((opt = getopt(argc, argv, "l:o:g:")) != -1) {
+	while ((opt = getopt(argc, argv, "al:o:g:j:c:")) != -1) {
 		switch(opt) {
 			case 'o':
 				search_objectid = arg_strtou64(optarg);
+				filter_objectid = 1;
 				break;
 			case 'g':
 				search_generation = arg_strtou64(optarg);
@@ -296,6 +812,19 @@ int main(int argc, char **argv)
 			case 'l':
 				search_level = arg_strtou64(optarg);
 				break;
+			case 'j':
+				jobs = arg_strtou64(optarg);
+				if (jobs < 1) {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'c':
+				cache_file = optarg;
+				break;
+			case 'a':
+				rank_roots = 1;
+				break;
 			default:
 				usage();
 				exit(1);
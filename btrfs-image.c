@@ -26,7 +26,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <time.h>
 #include <zlib.h>
+#ifndef BTRFS_DISABLE_ZSTD
+#include <zstd.h>
+#endif
+#ifndef BTRFS_DISABLE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
 #include "kerncompat.h"
 #include "crc32c.h"
 #include "ctree.h"
@@ -39,11 +47,15 @@
 
 #define HEADER_MAGIC		0xbd5c25e27295668bULL
 #define MAX_PENDING_SIZE	(256 * 1024)
+/* items restore reads ahead of the threads writing them out */
+#define MAX_RESTORE_ITEMS	(ITEMS_PER_CLUSTER * 4)
 #define BLOCK_SIZE		1024
 #define BLOCK_MASK		(BLOCK_SIZE - 1)
 
 #define COMPRESS_NONE		0
 #define COMPRESS_ZLIB		1
+#define COMPRESS_ZSTD		2
+#define COMPRESS_LZ4		3
 
 struct meta_cluster_item {
 	__le64 bytenr;
@@ -66,6 +78,69 @@ struct meta_cluster {
 #define ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster)) / \
 			   sizeof(struct meta_cluster_item))
 
+/*
+ * Images end with an index of their clusters, so restore can go straight
+ * to the ones holding chunk tree blocks instead of decompressing the whole
+ * image to find them.  The index is stored in clusters without items,
+ * which older versions skip, and the last block of the image points back
+ * at the first index block.
+ */
+#define INDEX_MAGIC		0x5844494d49534642ULL /* ascii BFSIMIDX */
+
+/* what a cluster holds */
+#define INDEX_SUPER		(1U << 0)
+#define INDEX_CHUNK_TREE	(1U << 1)
+
+struct meta_index_entry {
+	__le64 bytenr;		/* offset of the cluster in the image */
+	__le64 start;		/* lowest logical address of its items */
+	__le64 end;		/* end of its highest item */
+	__le32 flags;
+} __attribute__ ((__packed__));
+
+struct meta_index_block {
+	struct meta_cluster_header header;
+	__le64 magic;
+	__le64 index_start;
+	__le32 total;
+	__le32 nr;
+	struct meta_index_entry entries[];
+} __attribute__ ((__packed__));
+
+#define INDEX_PER_BLOCK ((BLOCK_SIZE - sizeof(struct meta_index_block)) / \
+			 sizeof(struct meta_index_entry))
+
+struct cluster_index {
+	u64 bytenr;
+	u64 start;
+	u64 end;
+	u32 flags;
+};
+
+/*
+ * Incremental images only hold the tree blocks newer than the full image
+ * they were taken against.  Which image that is gets recorded in the
+ * entries of the last index block, which otherwise has none.
+ */
+#define DELTA_MAGIC		0x41544c4544534642ULL /* ascii BFSDELTA */
+
+struct meta_delta_info {
+	__le64 magic;
+	__le64 base_generation;
+	u8 base_fsid[BTRFS_FSID_SIZE];
+} __attribute__ ((__packed__));
+
+/* an image restore reads chunk tree blocks from */
+struct mdrestore_image {
+	FILE *in;
+	/* the cluster index of the image, NULL for older images */
+	struct cluster_index *index;
+	u32 index_nr;
+	/* set for incremental images */
+	u64 base_generation;
+	u8 base_fsid[BTRFS_FSID_SIZE];
+};
+
 struct fs_chunk {
 	u64 logical;
 	u64 physical;
@@ -80,6 +155,8 @@ struct async_work {
 	u64 size;
 	u8 *buffer;
 	size_t bufsize;
+	u32 flags;
+	int compress;
 	int error;
 };
 
@@ -103,6 +180,17 @@ struct metadump_struct {
 	u64 pending_start;
 	u64 pending_size;
 
+	/* clusters written so far and where the next one goes */
+	struct cluster_index *index;
+	u32 index_nr;
+	u32 index_alloc;
+	u64 image_size;
+
+	/* only dump tree blocks newer than this, for incremental images */
+	u64 base_generation;
+	u8 base_fsid[BTRFS_FSID_SIZE];
+
+	const struct image_codec *codec;
 	int compress_level;
 	int done;
 	int data;
@@ -126,6 +214,7 @@ struct mdrestore_struct {
 	size_t num_threads;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	pthread_cond_t done_cond;
 
 	struct rb_root chunk_tree;
 	struct list_head list;
@@ -139,6 +228,9 @@ struct mdrestore_struct {
 	int done;
 	int error;
 	int old_restore;
+	struct mdrestore_image image;
+	/* the full image an incremental one gets layered onto */
+	struct mdrestore_image base;
 	int fixup_offset;
 	int multi_devices;
 	struct btrfs_fs_info *info;
@@ -146,8 +238,189 @@ struct mdrestore_struct {
 
 static void print_usage(void) __attribute__((noreturn));
 static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
-				   u64 search, u64 cluster_bytenr);
+				   u64 search, struct mdrestore_image *image,
+				   u64 cluster_bytenr);
 static struct extent_buffer *alloc_dummy_eb(u64 bytenr, u32 size);
+static int read_cluster_index(struct mdrestore_image *image);
+static int read_image_super(FILE *in, struct meta_cluster *cluster,
+			    u8 **super);
+
+/*
+ * Every item of a cluster is compressed on its own with the codec recorded
+ * in the cluster header, so images using any of them can be restored by
+ * anything built with that codec.  Levels run from 1 to max_level, higher
+ * is slower and smaller.
+ */
+struct image_codec {
+	const char *name;
+	u8 type;
+	int default_level;
+	int max_level;
+	size_t (*bound)(size_t size);
+	int (*compress)(u8 *dst, size_t *dst_len, const u8 *src,
+			size_t src_len, int level);
+	int (*decompress)(u8 *dst, size_t *dst_len, const u8 *src,
+			  size_t src_len);
+};
+
+static size_t zlib_bound(size_t size)
+{
+	return compressBound(size);
+}
+
+static int zlib_compress(u8 *dst, size_t *dst_len, const u8 *src,
+			 size_t src_len, int level)
+{
+	unsigned long len = *dst_len;
+	int ret;
+
+	ret = compress2(dst, &len, src, src_len, level);
+	if (ret != Z_OK)
+		return -EIO;
+	*dst_len = len;
+	return 0;
+}
+
+static int zlib_decompress(u8 *dst, size_t *dst_len, const u8 *src,
+			   size_t src_len)
+{
+	unsigned long len = *dst_len;
+	int ret;
+
+	ret = uncompress(dst, &len, src, src_len);
+	if (ret != Z_OK) {
+		fprintf(stderr, "Error decompressing %d\n", ret);
+		return -EIO;
+	}
+	*dst_len = len;
+	return 0;
+}
+
+#ifndef BTRFS_DISABLE_ZSTD
+static size_t zstd_bound(size_t size)
+{
+	return ZSTD_compressBound(size);
+}
+
+static int zstd_compress(u8 *dst, size_t *dst_len, const u8 *src,
+			 size_t src_len, int level)
+{
+	size_t ret;
+
+	ret = ZSTD_compress(dst, *dst_len, src, src_len, level);
+	if (ZSTD_isError(ret))
+		return -EIO;
+	*dst_len = ret;
+	return 0;
+}
+
+static int zstd_decompress(u8 *dst, size_t *dst_len, const u8 *src,
+			   size_t src_len)
+{
+	size_t ret;
+
+	ret = ZSTD_decompress(dst, *dst_len, src, src_len);
+	if (ZSTD_isError(ret)) {
+		fprintf(stderr, "Error decompressing %s\n",
+			ZSTD_getErrorName(ret));
+		return -EIO;
+	}
+	*dst_len = ret;
+	return 0;
+}
+#endif
+
+#ifndef BTRFS_DISABLE_LZ4
+static size_t lz4_bound(size_t size)
+{
+	return LZ4_compressBound(size);
+}
+
+/* level 1 is plain lz4, anything above uses the high compression mode */
+static int lz4_compress(u8 *dst, size_t *dst_len, const u8 *src,
+			size_t src_len, int level)
+{
+	int ret;
+
+	if (level <= 1)
+		ret = LZ4_compress_default((const char *)src, (char *)dst,
+					   src_len, *dst_len);
+	else
+		ret = LZ4_compress_HC((const char *)src, (char *)dst,
+				      src_len, *dst_len, level);
+	if (ret <= 0)
+		return -EIO;
+	*dst_len = ret;
+	return 0;
+}
+
+static int lz4_decompress(u8 *dst, size_t *dst_len, const u8 *src,
+			  size_t src_len)
+{
+	int ret;
+
+	ret = LZ4_decompress_safe((const char *)src, (char *)dst, src_len,
+				  *dst_len);
+	if (ret < 0) {
+		fprintf(stderr, "Error decompressing %d\n", ret);
+		return -EIO;
+	}
+	*dst_len = ret;
+	return 0;
+}
+#endif
+
+static const struct image_codec image_codecs[] = {
+	{ "zlib", COMPRESS_ZLIB, 6, 9,
+	  zlib_bound, zlib_compress, zlib_decompress },
+#ifndef BTRFS_DISABLE_ZSTD
+	{ "zstd", COMPRESS_ZSTD, 3, 19,
+	  zstd_bound, zstd_compress, zstd_decompress },
+#endif
+#ifndef BTRFS_DISABLE_LZ4
+	{ "lz4", COMPRESS_LZ4, 1, LZ4HC_CLEVEL_MAX,
+	  lz4_bound, lz4_compress, lz4_decompress },
+#endif
+};
+
+static const struct image_codec *find_codec_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(image_codecs); i++) {
+		if (!strcmp(image_codecs[i].name, name))
+			return &image_codecs[i];
+	}
+	return NULL;
+}
+
+static const struct image_codec *find_codec(int type)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(image_codecs); i++) {
+		if (image_codecs[i].type == type)
+			return &image_codecs[i];
+	}
+	return NULL;
+}
+
+/*
+ * Decompress one item of a cluster compressed with @method into @dst, which
+ * holds *@dst_len bytes.  *@dst_len is set to the decompressed size.
+ */
+static int decompress_item(int method, u8 *dst, size_t *dst_len,
+			   const u8 *src, size_t src_len)
+{
+	const struct image_codec *codec = find_codec(method);
+
+	if (!codec) {
+		fprintf(stderr, "Unsupported compression method %d\n",
+			method);
+		return -EOPNOTSUPP;
+	}
+	return codec->decompress(dst, dst_len, src, src_len);
+}
 
 static void csum_block(u8 *buf, size_t len)
 {
@@ -599,10 +872,10 @@ static void *dump_worker(void *data)
 		list_del_init(&async->list);
 		pthread_mutex_unlock(&md->mutex);
 
-		if (md->compress_level > 0) {
+		if (md->codec) {
 			u8 *orig = async->buffer;
 
-			async->bufsize = compressBound(async->size);
+			async->bufsize = md->codec->bound(async->size);
 			async->buffer = malloc(async->bufsize);
 			if (!async->buffer) {
 				fprintf(stderr, "Error allocing buffer\n");
@@ -613,11 +886,11 @@ static void *dump_worker(void *data)
 				pthread_exit(NULL);
 			}
 
-			ret = compress2(async->buffer,
-					 (unsigned long *)&async->bufsize,
-					 orig, async->size, md->compress_level);
-
-			if (ret != Z_OK)
+			ret = md->codec->compress(async->buffer,
+						  &async->bufsize, orig,
+						  async->size,
+						  md->compress_level);
+			if (ret)
 				async->error = 1;
 
 			free(orig);
@@ -641,8 +914,7 @@ static void meta_cluster_init(struct metadump_struct *md, u64 start)
 	header->magic = cpu_to_le64(HEADER_MAGIC);
 	header->bytenr = cpu_to_le64(start);
 	header->nritems = cpu_to_le32(0);
-	header->compress = md->compress_level > 0 ?
-			   COMPRESS_ZLIB : COMPRESS_NONE;
+	header->compress = md->codec ? md->codec->type : COMPRESS_NONE;
 }
 
 static void metadump_destroy(struct metadump_struct *md, int num_threads)
@@ -672,10 +944,12 @@ static void metadump_destroy(struct metadump_struct *md, int num_threads)
 	}
 	free(md->threads);
 	free(md->cluster);
+	free(md->index);
 }
 
 static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
-			 FILE *out, int num_threads, int compress_level,
+			 FILE *out, int num_threads,
+			 const struct image_codec *codec, int compress_level,
 			 int sanitize_names)
 {
 	int i, ret = 0;
@@ -688,11 +962,10 @@ static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
 	md->root = root;
 	md->out = out;
 	md->pending_start = (u64)-1;
+	md->codec = compress_level > 0 ? codec : NULL;
 	md->compress_level = compress_level;
 	md->cluster = calloc(1, BLOCK_SIZE);
 	md->sanitize_names = sanitize_names;
-	if (sanitize_names > 1)
-		crc32c_optimization_init();
 
 	if (!md->cluster) {
 		pthread_cond_destroy(&md->cond);
@@ -736,6 +1009,7 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 {
 	struct meta_cluster_header *header = &md->cluster->header;
 	struct meta_cluster_item *item;
+	struct cluster_index *entry;
 	struct async_work *async;
 	u64 bytenr = 0;
 	u32 nritems = 0;
@@ -763,12 +1037,31 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 		goto out;
 	}
 
+	if (md->index_nr == md->index_alloc) {
+		struct cluster_index *index;
+
+		md->index_alloc = md->index_alloc ? md->index_alloc * 2 : 64;
+		index = realloc(md->index,
+				md->index_alloc * sizeof(*md->index));
+		if (!index)
+			return -ENOMEM;
+		md->index = index;
+	}
+	entry = md->index + md->index_nr++;
+	entry->bytenr = le64_to_cpu(header->bytenr);
+	entry->start = (u64)-1;
+	entry->end = 0;
+	entry->flags = 0;
+
 	/* setup and write index block */
 	list_for_each_entry(async, &md->ordered, ordered) {
 		item = md->cluster->items + nritems;
 		item->bytenr = cpu_to_le64(async->start);
 		item->size = cpu_to_le32(async->bufsize);
 		nritems++;
+		entry->start = min(entry->start, async->start);
+		entry->end = max(entry->end, async->start + async->size);
+		entry->flags |= async->flags;
 	}
 	header->nritems = cpu_to_le32(nritems);
 
@@ -812,11 +1105,68 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 			err = -EIO;
 		}
 	}
+	md->image_size = bytenr;
 out:
 	*next = bytenr;
 	return err;
 }
 
+/* write the cluster index after the last cluster, see INDEX_MAGIC */
+static int write_index(struct metadump_struct *md)
+{
+	struct meta_index_block *block;
+	struct meta_index_entry *entry;
+	struct cluster_index *index;
+	u64 bytenr = md->image_size;
+	u32 done = 0;
+	u32 nr;
+	int ret = 0;
+
+	block = malloc(BLOCK_SIZE);
+	if (!block)
+		return -ENOMEM;
+
+	/* the last block is always one with no entries */
+	do {
+		memset(block, 0, BLOCK_SIZE);
+		block->header.magic = cpu_to_le64(HEADER_MAGIC);
+		block->header.bytenr = cpu_to_le64(bytenr);
+		block->magic = cpu_to_le64(INDEX_MAGIC);
+		block->index_start = cpu_to_le64(md->image_size);
+		block->total = cpu_to_le32(md->index_nr);
+		for (nr = 0; nr < INDEX_PER_BLOCK && done < md->index_nr;
+		     nr++, done++) {
+			index = md->index + done;
+			entry = block->entries + nr;
+			entry->bytenr = cpu_to_le64(index->bytenr);
+			entry->start = cpu_to_le64(index->start);
+			entry->end = cpu_to_le64(index->end);
+			entry->flags = cpu_to_le32(index->flags);
+		}
+		block->nr = cpu_to_le32(nr);
+		if (!nr && md->base_generation) {
+			struct meta_delta_info *delta;
+
+			delta = (struct meta_delta_info *)block->entries;
+			delta->magic = cpu_to_le64(DELTA_MAGIC);
+			delta->base_generation =
+				cpu_to_le64(md->base_generation);
+			memcpy(delta->base_fsid, md->base_fsid,
+			       BTRFS_FSID_SIZE);
+		}
+		if (fwrite(block, BLOCK_SIZE, 1, md->out) != 1) {
+			fprintf(stderr, "Error writing out index: %d\n",
+				errno);
+			ret = -EIO;
+			break;
+		}
+		bytenr += BLOCK_SIZE;
+	} while (nr);
+
+	free(block);
+	return ret;
+}
+
 static int read_data_extent(struct metadump_struct *md,
 			    struct async_work *async)
 {
@@ -889,6 +1239,8 @@ static int flush_pending(struct metadump_struct *md, int done)
 		async->start = md->pending_start;
 		async->size = md->pending_size;
 		async->bufsize = async->size;
+		if (async->start == BTRFS_SUPER_INFO_OFFSET)
+			async->flags |= INDEX_SUPER;
 		async->buffer = malloc(async->bufsize);
 		if (!async->buffer) {
 			free(async);
@@ -917,6 +1269,8 @@ static int flush_pending(struct metadump_struct *md, int done)
 					"Error reading metadata block\n");
 				return -EIO;
 			}
+			if (btrfs_header_owner(eb) == BTRFS_CHUNK_TREE_OBJECTID)
+				async->flags |= INDEX_CHUNK_TREE;
 			copy_buffer(md, async->buffer + offset, eb);
 			free_extent_buffer(eb);
 			start += this_read;
@@ -934,7 +1288,7 @@ static int flush_pending(struct metadump_struct *md, int done)
 	if (async) {
 		list_add_tail(&async->ordered, &md->ordered);
 		md->num_items++;
-		if (md->compress_level > 0) {
+		if (md->codec) {
 			list_add_tail(&async->list, &md->list);
 			pthread_cond_signal(&md->cond);
 		} else {
@@ -1020,6 +1374,10 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 	int i = 0;
 	int ret;
 
+	/* nothing below a block can be newer than the block itself */
+	if (btrfs_header_generation(eb) <= metadump->base_generation)
+		return 0;
+
 	ret = add_extent(btrfs_header_bytenr(eb), root->leafsize, metadump, 0);
 	if (ret) {
 		fprintf(stderr, "Error adding metadata block\n");
@@ -1210,7 +1568,9 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 			ei = btrfs_item_ptr(leaf, path->slots[0],
 					    struct btrfs_extent_item);
 			if (btrfs_extent_flags(leaf, ei) &
-			    BTRFS_EXTENT_FLAG_TREE_BLOCK) {
+			    BTRFS_EXTENT_FLAG_TREE_BLOCK &&
+			    btrfs_extent_generation(leaf, ei) >
+			    metadump->base_generation) {
 				ret = add_extent(bytenr, num_bytes, metadump,
 						 0);
 				if (ret) {
@@ -1253,7 +1613,66 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 	return ret;
 }
 
-static int create_metadump(const char *input, FILE *out, int num_threads,
+/*
+ * Set up an incremental dump against the full image @base, which has to
+ * be of the same filesystem.
+ */
+static int read_base_image(struct metadump_struct *md, const char *base)
+{
+	struct btrfs_super_block *fs_super = md->root->fs_info->super_copy;
+	struct btrfs_super_block *super;
+	struct mdrestore_image image;
+	struct meta_cluster *cluster;
+	u8 *buffer = NULL;
+	int ret;
+
+	memset(&image, 0, sizeof(image));
+	image.in = fopen(base, "r");
+	if (!image.in) {
+		ret = -errno;
+		perror("unable to open base metadump image");
+		return ret;
+	}
+	cluster = malloc(BLOCK_SIZE);
+	if (!cluster) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = read_cluster_index(&image);
+	if (ret)
+		goto out;
+	if (image.base_generation) {
+		fprintf(stderr, "Base image is an incremental image itself\n");
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = read_image_super(image.in, cluster, &buffer);
+	if (ret)
+		goto out;
+
+	super = (struct btrfs_super_block *)buffer;
+	if (memcmp(super->fsid, fs_super->fsid, BTRFS_FSID_SIZE)) {
+		fprintf(stderr, "Base image is of another filesystem\n");
+		ret = -EINVAL;
+		goto out;
+	}
+	if (btrfs_super_generation(super) > btrfs_super_generation(fs_super)) {
+		fprintf(stderr, "Base image is newer than the filesystem\n");
+		ret = -EINVAL;
+		goto out;
+	}
+	md->base_generation = btrfs_super_generation(super);
+	memcpy(md->base_fsid, super->fsid, BTRFS_FSID_SIZE);
+out:
+	free(buffer);
+	free(cluster);
+	free(image.index);
+	fclose(image.in);
+	return ret;
+}
+
+static int create_metadump(const char *input, const char *base, FILE *out,
+			   int num_threads, const struct image_codec *codec,
 			   int compress_level, int sanitize, int walk_trees)
 {
 	struct btrfs_root *root;
@@ -1270,7 +1689,7 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 
 	BUG_ON(root->nodesize != root->leafsize);
 
-	ret = metadump_init(&metadump, root, out, num_threads,
+	ret = metadump_init(&metadump, root, out, num_threads, codec,
 			    compress_level, sanitize);
 	if (ret) {
 		fprintf(stderr, "Error initing metadump %d\n", ret);
@@ -1278,6 +1697,15 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 		return ret;
 	}
 
+	if (base) {
+		ret = read_base_image(&metadump, base);
+		if (ret) {
+			metadump_destroy(&metadump, num_threads);
+			close_ctree(root);
+			return ret;
+		}
+	}
+
 	ret = add_extent(BTRFS_SUPER_INFO_OFFSET, BTRFS_SUPER_INFO_SIZE,
 			&metadump, 0);
 	if (ret) {
@@ -1321,6 +1749,10 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 		goto out;
 	}
 
+	/*
+	 * The space cache gets rewritten in place, incremental images carry
+	 * all of it too.
+	 */
 	ret = copy_space_cache(root, &metadump, path);
 out:
 	ret = flush_pending(&metadump, 1);
@@ -1329,6 +1761,11 @@ out:
 			err = ret;
 		fprintf(stderr, "Error flushing pending %d\n", ret);
 	}
+	if (!err) {
+		err = write_index(&metadump);
+		if (err)
+			fprintf(stderr, "Error writing index %d\n", err);
+	}
 
 	metadump_destroy(&metadump, num_threads);
 
@@ -1652,15 +2089,13 @@ static void *restore_worker(void *data)
 		list_del_init(&async->list);
 		pthread_mutex_unlock(&mdres->mutex);
 
-		if (mdres->compress_method == COMPRESS_ZLIB) {
-			size = compress_size; 
-			ret = uncompress(buffer, (unsigned long *)&size,
-					 async->buffer, async->bufsize);
-			if (ret != Z_OK) {
-				fprintf(stderr, "Error decompressing %d\n",
-					ret);
-				err = -EIO;
-			}
+		if (async->compress != COMPRESS_NONE) {
+			size = compress_size;
+			ret = decompress_item(async->compress, buffer,
+					      &size, async->buffer,
+					      async->bufsize);
+			if (ret)
+				err = ret;
 			outbuf = buffer;
 		} else {
 			outbuf = async->buffer;
@@ -1727,6 +2162,7 @@ static void *restore_worker(void *data)
 		if (err && !mdres->error)
 			mdres->error = err;
 		mdres->num_items--;
+		pthread_cond_signal(&mdres->done_cond);
 		pthread_mutex_unlock(&mdres->mutex);
 
 		free(async->buffer);
@@ -1757,13 +2193,16 @@ static void mdrestore_destroy(struct mdrestore_struct *mdres, int num_threads)
 	for (i = 0; i < num_threads; i++)
 		pthread_join(mdres->threads[i], NULL);
 
+	pthread_cond_destroy(&mdres->done_cond);
 	pthread_cond_destroy(&mdres->cond);
 	pthread_mutex_destroy(&mdres->mutex);
 	free(mdres->threads);
+	free(mdres->image.index);
+	free(mdres->base.index);
 }
 
 static int mdrestore_init(struct mdrestore_struct *mdres,
-			  FILE *in, FILE *out, int old_restore,
+			  FILE *in, FILE *base_in, FILE *out, int old_restore,
 			  int num_threads, int fixup_offset,
 			  struct btrfs_fs_info *info, int multi_devices)
 {
@@ -1771,9 +2210,12 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 
 	memset(mdres, 0, sizeof(*mdres));
 	pthread_cond_init(&mdres->cond, NULL);
+	pthread_cond_init(&mdres->done_cond, NULL);
 	pthread_mutex_init(&mdres->mutex, NULL);
 	INIT_LIST_HEAD(&mdres->list);
 	mdres->in = in;
+	mdres->image.in = in;
+	mdres->base.in = base_in;
 	mdres->out = out;
 	mdres->old_restore = old_restore;
 	mdres->chunk_tree.rb_node = NULL;
@@ -1811,18 +2253,17 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	if (mdres->leafsize)
 		return 0;
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		size_t size = MAX_PENDING_SIZE * 2;
 
 		buffer = malloc(MAX_PENDING_SIZE * 2);
 		if (!buffer)
 			return -ENOMEM;
-		ret = uncompress(buffer, (unsigned long *)&size,
-				 async->buffer, async->bufsize);
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error decompressing %d\n", ret);
+		ret = decompress_item(mdres->compress_method, buffer, &size,
+				      async->buffer, async->bufsize);
+		if (ret) {
 			free(buffer);
-			return -EIO;
+			return ret;
 		}
 		outbuf = buffer;
 	} else {
@@ -1849,7 +2290,6 @@ static int add_cluster(struct meta_cluster *cluster,
 	u32 i, nritems;
 	int ret;
 
-	BUG_ON(mdres->num_items);
 	mdres->compress_method = header->compress;
 
 	bytenr = le64_to_cpu(header->bytenr) + BLOCK_SIZE;
@@ -1863,6 +2303,7 @@ static int add_cluster(struct meta_cluster *cluster,
 		}
 		async->start = le64_to_cpu(item->bytenr);
 		async->bufsize = le32_to_cpu(item->size);
+		async->compress = header->compress;
 		async->buffer = malloc(async->bufsize);
 		if (!async->buffer) {
 			fprintf(stderr, "Error allocing async buffer\n");
@@ -1889,6 +2330,13 @@ static int add_cluster(struct meta_cluster *cluster,
 				return ret;
 			}
 		}
+		/*
+		 * Stay a few clusters ahead of the threads, they can't start
+		 * before we've seen the super block though.
+		 */
+		while (mdres->leafsize && !mdres->error &&
+		       mdres->num_items >= MAX_RESTORE_ITEMS)
+			pthread_cond_wait(&mdres->done_cond, &mdres->mutex);
 		list_add_tail(&async->list, &mdres->list);
 		mdres->num_items++;
 		pthread_cond_signal(&mdres->cond);
@@ -1909,6 +2357,16 @@ static int add_cluster(struct meta_cluster *cluster,
 	return 0;
 }
 
+static int worker_error(struct mdrestore_struct *mdres)
+{
+	int ret;
+
+	pthread_mutex_lock(&mdres->mutex);
+	ret = mdres->error;
+	pthread_mutex_unlock(&mdres->mutex);
+	return ret;
+}
+
 static int wait_for_worker(struct mdrestore_struct *mdres)
 {
 	int ret = 0;
@@ -1916,20 +2374,15 @@ static int wait_for_worker(struct mdrestore_struct *mdres)
 	pthread_mutex_lock(&mdres->mutex);
 	ret = mdres->error;
 	while (!ret && mdres->num_items > 0) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&mdres->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&mdres->mutex);
+		pthread_cond_wait(&mdres->done_cond, &mdres->mutex);
 		ret = mdres->error;
 	}
 	pthread_mutex_unlock(&mdres->mutex);
 	return ret;
 }
 
-static int read_chunk_block(struct mdrestore_struct *mdres, u8 *buffer,
+static int read_chunk_block(struct mdrestore_struct *mdres,
+			    struct mdrestore_image *image, u8 *buffer,
 			    u64 bytenr, u64 item_bytenr, u32 bufsize,
 			    u64 cluster_bytenr)
 {
@@ -1976,7 +2429,7 @@ static int read_chunk_block(struct mdrestore_struct *mdres, u8 *buffer,
 		if (btrfs_header_level(eb)) {
 			u64 blockptr = btrfs_node_blockptr(eb, i);
 
-			ret = search_for_chunk_blocks(mdres, blockptr,
+			ret = search_for_chunk_blocks(mdres, blockptr, image,
 						      cluster_bytenr);
 			if (ret)
 				break;
@@ -2008,65 +2461,259 @@ out:
 	return ret;
 }
 
-/* If you have to ask you aren't worthy */
-static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
-				   u64 search, u64 cluster_bytenr)
+static int is_index_block(struct meta_index_block *block, u64 bytenr)
 {
-	struct meta_cluster *cluster;
-	struct meta_cluster_header *header;
-	struct meta_cluster_item *item;
-	u64 current_cluster = cluster_bytenr, bytenr;
-	u64 item_bytenr;
-	u32 bufsize, nritems, i;
-	u32 max_size = MAX_PENDING_SIZE * 2;
-	u8 *buffer, *tmp = NULL;
-	int ret = 0;
+	return le64_to_cpu(block->header.magic) == HEADER_MAGIC &&
+	       le64_to_cpu(block->header.bytenr) == bytenr &&
+	       le32_to_cpu(block->header.nritems) == 0 &&
+	       le64_to_cpu(block->magic) == INDEX_MAGIC;
+}
 
-	cluster = malloc(BLOCK_SIZE);
-	if (!cluster) {
-		fprintf(stderr, "Error allocating cluster\n");
+/*
+ * Load the cluster index from the end of the image.  Images without one,
+ * or with a damaged one, leave image->index NULL and get searched the slow
+ * way.
+ */
+static int read_cluster_index(struct mdrestore_image *image)
+{
+	struct meta_index_block *block;
+	struct meta_index_entry *entry;
+	struct meta_delta_info *delta;
+	struct cluster_index *index = NULL;
+	u64 bytenr;
+	off_t end;
+	u32 total;
+	u32 done = 0;
+	u32 nr;
+	u32 i;
+
+	if (fseeko(image->in, 0, SEEK_END))
+		return 0;
+	end = ftello(image->in);
+	if (end < 2 * BLOCK_SIZE || end & BLOCK_MASK)
+		return 0;
+
+	block = malloc(BLOCK_SIZE);
+	if (!block)
 		return -ENOMEM;
+	bytenr = end - BLOCK_SIZE;
+	if (fseeko(image->in, bytenr, SEEK_SET) ||
+	    fread(block, BLOCK_SIZE, 1, image->in) != 1 ||
+	    !is_index_block(block, bytenr))
+		goto out;
+
+	delta = (struct meta_delta_info *)block->entries;
+	if (le64_to_cpu(delta->magic) == DELTA_MAGIC) {
+		image->base_generation = le64_to_cpu(delta->base_generation);
+		memcpy(image->base_fsid, delta->base_fsid, BTRFS_FSID_SIZE);
 	}
 
-	buffer = malloc(max_size);
-	if (!buffer) {
-		fprintf(stderr, "Error allocing buffer\n");
-		free(cluster);
+	total = le32_to_cpu(block->total);
+	bytenr = le64_to_cpu(block->index_start);
+	index = calloc(max_t(u32, total, 1), sizeof(*index));
+	if (!index) {
+		free(block);
 		return -ENOMEM;
 	}
-
-	if (mdres->compress_method == COMPRESS_ZLIB) {
-		tmp = malloc(max_size);
-		if (!tmp) {
-			fprintf(stderr, "Error allocing tmp buffer\n");
-			free(cluster);
-			free(buffer);
-			return -ENOMEM;
+	while (done < total) {
+		if (fseeko(image->in, bytenr, SEEK_SET) ||
+		    fread(block, BLOCK_SIZE, 1, image->in) != 1 ||
+		    !is_index_block(block, bytenr))
+			goto bad;
+		nr = le32_to_cpu(block->nr);
+		if (!nr || nr > INDEX_PER_BLOCK || nr > total - done)
+			goto bad;
+		for (i = 0; i < nr; i++, done++) {
+			entry = block->entries + i;
+			index[done].bytenr = le64_to_cpu(entry->bytenr);
+			index[done].start = le64_to_cpu(entry->start);
+			index[done].end = le64_to_cpu(entry->end);
+			index[done].flags = le32_to_cpu(entry->flags);
 		}
+		bytenr += BLOCK_SIZE;
 	}
+	image->index = index;
+	image->index_nr = total;
+	index = NULL;
+	goto out;
+bad:
+	fprintf(stderr, "Bad cluster index at %llu, ignoring it\n",
+		(unsigned long long)bytenr);
+out:
+	free(index);
+	free(block);
+	return 0;
+}
 
-	bytenr = current_cluster;
-	while (1) {
-		if (fseek(mdres->in, current_cluster, SEEK_SET)) {
-			fprintf(stderr, "Error seeking: %d\n", errno);
-			ret = -EIO;
-			break;
-		}
+/*
+ * Read the super block out of the first cluster of an image into a newly
+ * allocated buffer.
+ */
+static int read_image_super(FILE *in, struct meta_cluster *cluster,
+			    u8 **super)
+{
+	struct meta_cluster_header *header;
+	struct meta_cluster_item *item = NULL;
+	u32 i, nritems;
+	u8 *buffer;
+	int ret;
 
-		ret = fread(cluster, BLOCK_SIZE, 1, mdres->in);
-		if (ret == 0) {
-			if (cluster_bytenr != 0) {
-				cluster_bytenr = 0;
-				current_cluster = 0;
-				bytenr = 0;
-				continue;
-			}
-			printf("ok this is where we screwed up?\n");
-			ret = -EIO;
-			break;
-		} else if (ret < 0) {
-			fprintf(stderr, "Error reading image\n");
-			break;
+	if (fseek(in, 0, SEEK_SET)) {
+		fprintf(stderr, "Error seeking: %d\n", errno);
+		return -EIO;
+	}
+
+	ret = fread(cluster, BLOCK_SIZE, 1, in);
+	if (ret <= 0) {
+		fprintf(stderr, "Error reading in cluster: %d\n", errno);
+		return -EIO;
+	}
+
+	header = &cluster->header;
+	if (le64_to_cpu(header->magic) != HEADER_MAGIC ||
+	    le64_to_cpu(header->bytenr) != 0) {
+		fprintf(stderr, "bad header in metadump image\n");
+		return -EIO;
+	}
+
+	nritems = le32_to_cpu(header->nritems);
+	for (i = 0; i < nritems; i++) {
+		item = &cluster->items[i];
+
+		if (le64_to_cpu(item->bytenr) == BTRFS_SUPER_INFO_OFFSET)
+			break;
+		if (fseek(in, le32_to_cpu(item->size), SEEK_CUR)) {
+			fprintf(stderr, "Error seeking: %d\n", errno);
+			return -EIO;
+		}
+	}
+
+	if (!item || le64_to_cpu(item->bytenr) != BTRFS_SUPER_INFO_OFFSET) {
+		fprintf(stderr, "Huh, didn't find the super?\n");
+		return -EINVAL;
+	}
+
+	buffer = malloc(le32_to_cpu(item->size));
+	if (!buffer) {
+		fprintf(stderr, "Error allocing buffer\n");
+		return -ENOMEM;
+	}
+
+	ret = fread(buffer, le32_to_cpu(item->size), 1, in);
+	if (ret != 1) {
+		fprintf(stderr, "Error reading buffer: %d\n", errno);
+		free(buffer);
+		return -EIO;
+	}
+
+	if (header->compress != COMPRESS_NONE) {
+		size_t size = MAX_PENDING_SIZE * 2;
+		u8 *tmp;
+
+		tmp = malloc(MAX_PENDING_SIZE * 2);
+		if (!tmp) {
+			free(buffer);
+			return -ENOMEM;
+		}
+		ret = decompress_item(header->compress, tmp, &size,
+				      buffer, le32_to_cpu(item->size));
+		free(buffer);
+		if (ret) {
+			free(tmp);
+			return ret;
+		}
+		buffer = tmp;
+	}
+
+	*super = buffer;
+	return 0;
+}
+
+/*
+ * Return the offset of the next cluster from *idx on which may hold the
+ * chunk tree block at @search, or (u64)-1 if no cluster does.
+ */
+static u64 next_chunk_cluster(struct mdrestore_image *image, u64 search,
+			      u32 *idx)
+{
+	struct cluster_index *entry;
+
+	while (*idx < image->index_nr) {
+		entry = image->index + (*idx)++;
+		if (entry->flags & INDEX_CHUNK_TREE &&
+		    entry->start <= search && search < entry->end)
+			return entry->bytenr;
+	}
+	return (u64)-1;
+}
+
+/* If you have to ask you aren't worthy */
+static int search_image_for_chunk_block(struct mdrestore_struct *mdres,
+					struct mdrestore_image *image,
+					u64 search, u64 cluster_bytenr)
+{
+	struct meta_cluster *cluster;
+	struct meta_cluster_header *header;
+	struct meta_cluster_item *item;
+	u64 current_cluster = cluster_bytenr, bytenr;
+	u64 item_bytenr;
+	u32 bufsize, nritems, i;
+	u32 max_size = MAX_PENDING_SIZE * 2;
+	u32 idx = 0;
+	u8 *buffer, *tmp;
+	int ret = 0;
+
+	cluster = malloc(BLOCK_SIZE);
+	if (!cluster) {
+		fprintf(stderr, "Error allocating cluster\n");
+		return -ENOMEM;
+	}
+
+	buffer = malloc(max_size);
+	if (!buffer) {
+		fprintf(stderr, "Error allocing buffer\n");
+		free(cluster);
+		return -ENOMEM;
+	}
+
+	tmp = malloc(max_size);
+	if (!tmp) {
+		fprintf(stderr, "Error allocing tmp buffer\n");
+		free(cluster);
+		free(buffer);
+		return -ENOMEM;
+	}
+
+	bytenr = current_cluster;
+	while (1) {
+		if (image->index) {
+			current_cluster = next_chunk_cluster(image, search,
+							     &idx);
+			if (current_cluster == (u64)-1) {
+				ret = -ENOENT;
+				break;
+			}
+			bytenr = current_cluster;
+		}
+		if (fseek(image->in, current_cluster, SEEK_SET)) {
+			fprintf(stderr, "Error seeking: %d\n", errno);
+			ret = -EIO;
+			break;
+		}
+
+		ret = fread(cluster, BLOCK_SIZE, 1, image->in);
+		if (ret == 0) {
+			if (cluster_bytenr != 0) {
+				cluster_bytenr = 0;
+				current_cluster = 0;
+				bytenr = 0;
+				continue;
+			}
+			ret = -ENOENT;
+			break;
+		} else if (ret < 0) {
+			fprintf(stderr, "Error reading image\n");
+			break;
 		}
 		ret = 0;
 
@@ -2094,8 +2741,8 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				break;
 			}
 
-			if (mdres->compress_method == COMPRESS_ZLIB) {
-				ret = fread(tmp, bufsize, 1, mdres->in);
+			if (header->compress != COMPRESS_NONE) {
+				ret = fread(tmp, bufsize, 1, image->in);
 				if (ret != 1) {
 					fprintf(stderr, "Error reading: %d\n",
 						errno);
@@ -2104,17 +2751,13 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				}
 
 				size = max_size;
-				ret = uncompress(buffer,
-						 (unsigned long *)&size, tmp,
-						 bufsize);
-				if (ret != Z_OK) {
-					fprintf(stderr, "Error decompressing "
-						"%d\n", ret);
-					ret = -EIO;
+				ret = decompress_item(header->compress,
+						      buffer, &size, tmp,
+						      bufsize);
+				if (ret)
 					break;
-				}
 			} else {
-				ret = fread(buffer, bufsize, 1, mdres->in);
+				ret = fread(buffer, bufsize, 1, image->in);
 				if (ret != 1) {
 					fprintf(stderr, "Error reading: %d\n",
 						errno);
@@ -2127,9 +2770,9 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 
 			if (item_bytenr <= search &&
 			    item_bytenr + size > search) {
-				ret = read_chunk_block(mdres, buffer, search,
-						       item_bytenr, size,
-						       current_cluster);
+				ret = read_chunk_block(mdres, image, buffer,
+						       search, item_bytenr,
+						       size, current_cluster);
 				if (!ret)
 					ret = 1;
 				break;
@@ -2152,15 +2795,37 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 	return ret;
 }
 
+/*
+ * Find the chunk tree block at @search and everything below it.  Blocks
+ * an incremental image doesn't have are still the ones in its base image.
+ * @cluster_bytenr is where in @image to start looking.
+ */
+static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
+				   u64 search, struct mdrestore_image *image,
+				   u64 cluster_bytenr)
+{
+	int ret;
+
+	ret = search_image_for_chunk_block(mdres, &mdres->image, search,
+			image == &mdres->image ? cluster_bytenr : 0);
+	if (ret != -ENOENT)
+		return ret;
+	if (mdres->base.in) {
+		ret = search_image_for_chunk_block(mdres, &mdres->base, search,
+				image == &mdres->base ? cluster_bytenr : 0);
+		if (ret != -ENOENT)
+			return ret;
+	}
+	fprintf(stderr, "Couldn't find chunk tree block %llu\n",
+		(unsigned long long)search);
+	return -EIO;
+}
+
 static int build_chunk_tree(struct mdrestore_struct *mdres,
 			    struct meta_cluster *cluster)
 {
 	struct btrfs_super_block *super;
-	struct meta_cluster_header *header;
-	struct meta_cluster_item *item = NULL;
 	u64 chunk_root_bytenr = 0;
-	u32 i, nritems;
-	u64 bytenr = 0;
 	u8 *buffer;
 	int ret;
 
@@ -2168,73 +2833,9 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 	if (mdres->in == stdin)
 		return 0;
 
-	ret = fread(cluster, BLOCK_SIZE, 1, mdres->in);
-	if (ret <= 0) {
-		fprintf(stderr, "Error reading in cluster: %d\n", errno);
-		return -EIO;
-	}
-	ret = 0;
-
-	header = &cluster->header;
-	if (le64_to_cpu(header->magic) != HEADER_MAGIC ||
-	    le64_to_cpu(header->bytenr) != 0) {
-		fprintf(stderr, "bad header in metadump image\n");
-		return -EIO;
-	}
-
-	bytenr += BLOCK_SIZE;
-	mdres->compress_method = header->compress;
-	nritems = le32_to_cpu(header->nritems);
-	for (i = 0; i < nritems; i++) {
-		item = &cluster->items[i];
-
-		if (le64_to_cpu(item->bytenr) == BTRFS_SUPER_INFO_OFFSET)
-			break;
-		bytenr += le32_to_cpu(item->size);
-		if (fseek(mdres->in, le32_to_cpu(item->size), SEEK_CUR)) {
-			fprintf(stderr, "Error seeking: %d\n", errno);
-			return -EIO;
-		}
-	}
-
-	if (!item || le64_to_cpu(item->bytenr) != BTRFS_SUPER_INFO_OFFSET) {
-		fprintf(stderr, "Huh, didn't find the super?\n");
-		return -EINVAL;
-	}
-
-	buffer = malloc(le32_to_cpu(item->size));
-	if (!buffer) {
-		fprintf(stderr, "Error allocing buffer\n");
-		return -ENOMEM;
-	}
-
-	ret = fread(buffer, le32_to_cpu(item->size), 1, mdres->in);
-	if (ret != 1) {
-		fprintf(stderr, "Error reading buffer: %d\n", errno);
-		free(buffer);
-		return -EIO;
-	}
-
-	if (mdres->compress_method == COMPRESS_ZLIB) {
-		size_t size = MAX_PENDING_SIZE * 2;
-		u8 *tmp;
-
-		tmp = malloc(MAX_PENDING_SIZE * 2);
-		if (!tmp) {
-			free(buffer);
-			return -ENOMEM;
-		}
-		ret = uncompress(tmp, (unsigned long *)&size,
-				 buffer, le32_to_cpu(item->size));
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error decompressing %d\n", ret);
-			free(buffer);
-			free(tmp);
-			return -EIO;
-		}
-		free(buffer);
-		buffer = tmp;
-	}
+	ret = read_image_super(mdres->in, cluster, &buffer);
+	if (ret)
+		return ret;
 
 	pthread_mutex_lock(&mdres->mutex);
 	super = (struct btrfs_super_block *)buffer;
@@ -2247,12 +2848,73 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 	free(buffer);
 	pthread_mutex_unlock(&mdres->mutex);
 
-	return search_for_chunk_blocks(mdres, chunk_root_bytenr, 0);
+	return search_for_chunk_blocks(mdres, chunk_root_bytenr,
+				       &mdres->image, 0);
 }
 
-static int __restore_metadump(const char *input, FILE *out, int old_restore,
-			      int num_threads, int fixup_offset,
-			      const char *target, int multi_devices)
+/*
+ * Make sure an incremental image is restored on top of the full image it
+ * was taken against, and only then.
+ */
+static int check_base_image(struct mdrestore_struct *mdres,
+			    struct meta_cluster *cluster)
+{
+	struct btrfs_super_block *super;
+	u8 *buffer;
+	int ret;
+
+	if (!mdres->image.base_generation) {
+		if (!mdres->base.in)
+			return 0;
+		fprintf(stderr, "Not an incremental image\n");
+		return -EINVAL;
+	}
+	if (!mdres->base.in) {
+		fprintf(stderr,
+			"Incremental image, restore it with -i <base image>\n");
+		return -EINVAL;
+	}
+
+	ret = read_image_super(mdres->base.in, cluster, &buffer);
+	if (ret)
+		return ret;
+	super = (struct btrfs_super_block *)buffer;
+	if (btrfs_super_generation(super) != mdres->image.base_generation ||
+	    memcmp(super->fsid, mdres->image.base_fsid, BTRFS_FSID_SIZE)) {
+		fprintf(stderr,
+			"Base image doesn't match, expected generation %llu\n",
+			(unsigned long long)mdres->image.base_generation);
+		ret = -EINVAL;
+	}
+	free(buffer);
+	if (ret)
+		return ret;
+	return read_cluster_index(&mdres->base);
+}
+
+/*
+ * An image on stdin is restored before its end is seen, the delta info of
+ * an incremental one only shows up in its last index block.
+ */
+static void stream_delta_info(struct mdrestore_image *image,
+			      struct meta_cluster *cluster, u64 bytenr)
+{
+	struct meta_index_block *block = (struct meta_index_block *)cluster;
+	struct meta_delta_info *delta;
+
+	if (!is_index_block(block, bytenr) || block->nr)
+		return;
+	delta = (struct meta_delta_info *)block->entries;
+	if (le64_to_cpu(delta->magic) != DELTA_MAGIC)
+		return;
+	image->base_generation = le64_to_cpu(delta->base_generation);
+	memcpy(image->base_fsid, delta->base_fsid, BTRFS_FSID_SIZE);
+}
+
+static int __restore_metadump(const char *input, const char *base,
+			      FILE *out, int old_restore, int num_threads,
+			      int fixup_offset, const char *target,
+			      int multi_devices)
 {
 	struct meta_cluster *cluster = NULL;
 	struct meta_cluster_header *header;
@@ -2260,6 +2922,7 @@ static int __restore_metadump(const char *input, FILE *out, int old_restore,
 	struct btrfs_fs_info *info = NULL;
 	u64 bytenr = 0;
 	FILE *in = NULL;
+	FILE *base_in = NULL;
 	int ret = 0;
 
 	if (!strcmp(input, "-")) {
@@ -2272,6 +2935,15 @@ static int __restore_metadump(const char *input, FILE *out, int old_restore,
 		}
 	}
 
+	if (base) {
+		base_in = fopen(base, "r");
+		if (!base_in) {
+			perror("unable to open base metadump image");
+			ret = 1;
+			goto failed_open;
+		}
+	}
+
 	/* NOTE: open with write mode */
 	if (fixup_offset) {
 		BUG_ON(!target);
@@ -2293,13 +2965,21 @@ static int __restore_metadump(const char *input, FILE *out, int old_restore,
 		goto failed_info;
 	}
 
-	ret = mdrestore_init(&mdrestore, in, out, old_restore, num_threads,
-			     fixup_offset, info, multi_devices);
+	ret = mdrestore_init(&mdrestore, in, base_in, out, old_restore,
+			     num_threads, fixup_offset, info, multi_devices);
 	if (ret) {
 		fprintf(stderr, "Error initing mdrestore %d\n", ret);
 		goto failed_cluster;
 	}
 
+	if (in != stdin) {
+		ret = read_cluster_index(&mdrestore.image);
+		if (!ret)
+			ret = check_base_image(&mdrestore, cluster);
+		if (ret)
+			goto out;
+	}
+
 	if (!multi_devices && !old_restore) {
 		ret = build_chunk_tree(&mdrestore, cluster);
 		if (ret)
@@ -2323,19 +3003,34 @@ static int __restore_metadump(const char *input, FILE *out, int old_restore,
 			ret = -EIO;
 			break;
 		}
+		if (in == stdin)
+			stream_delta_info(&mdrestore.image, cluster, bytenr);
 		ret = add_cluster(cluster, &mdrestore, &bytenr);
 		if (ret) {
 			fprintf(stderr, "Error adding cluster\n");
 			break;
 		}
 
-		ret = wait_for_worker(&mdrestore);
+		/* the threads get to the items while we read ahead */
+		ret = worker_error(&mdrestore);
 		if (ret) {
 			fprintf(stderr, "One of the threads errored out %d\n",
 				ret);
 			break;
 		}
 	}
+	if (!ret) {
+		ret = wait_for_worker(&mdrestore);
+		if (ret)
+			fprintf(stderr, "One of the threads errored out %d\n",
+				ret);
+	}
+	if (!ret && in == stdin && mdrestore.image.base_generation) {
+		fprintf(stderr,
+	"Incremental image read from stdin, the restored filesystem is incomplete\n"
+	"restore it from a file with -i <base image>\n");
+		ret = -EINVAL;
+	}
 out:
 	mdrestore_destroy(&mdrestore, num_threads);
 failed_cluster:
@@ -2344,22 +3039,37 @@ failed_info:
 	if (fixup_offset && info)
 		close_ctree(info->chunk_root);
 failed_open:
+	if (base_in)
+		fclose(base_in);
 	if (in != stdin)
 		fclose(in);
 	return ret;
 }
 
-static int restore_metadump(const char *input, FILE *out, int old_restore,
-			    int num_threads, int multi_devices)
+/*
+ * An incremental image is restored by restoring its base image and then
+ * writing the newer blocks over it.
+ */
+static int restore_metadump(const char *input, const char *base, FILE *out,
+			    int old_restore, int num_threads, int multi_devices)
 {
-	return __restore_metadump(input, out, old_restore, num_threads, 0, NULL,
-				  multi_devices);
+	int ret;
+
+	if (base) {
+		ret = __restore_metadump(base, NULL, out, old_restore,
+					 num_threads, 0, NULL, multi_devices);
+		if (ret)
+			return ret;
+	}
+	return __restore_metadump(input, base, out, old_restore, num_threads,
+				  0, NULL, multi_devices);
 }
 
 static int fixup_metadump(const char *input, FILE *out, int num_threads,
 			  const char *target)
 {
-	return __restore_metadump(input, out, 0, num_threads, 1, target, 1);
+	return __restore_metadump(input, NULL, out, 0, num_threads, 1, target,
+				  1);
 }
 
 static int update_disk_super_on_device(struct btrfs_fs_info *info,
@@ -2456,16 +3166,216 @@ out:
 	return 0;
 }
 
+struct bench_item {
+	u8 *buffer;
+	size_t size;
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_codec(const struct image_codec *codec, int level,
+			struct bench_item *items, int nr_items, u64 total)
+{
+	u8 *compressed;
+	u8 *out;
+	size_t *sizes;
+	size_t max_size = codec->bound(MAX_PENDING_SIZE);
+	size_t len;
+	u64 packed = 0;
+	double start, ctime, dtime;
+	int i;
+
+	sizes = calloc(nr_items, sizeof(*sizes));
+	compressed = malloc(max_size * nr_items);
+	out = malloc(MAX_PENDING_SIZE);
+	if (!sizes || !compressed || !out) {
+		fprintf(stderr, "Error allocating benchmark buffers\n");
+		goto out;
+	}
+
+	start = bench_now();
+	for (i = 0; i < nr_items; i++) {
+		sizes[i] = max_size;
+		if (codec->compress(compressed + max_size * i, &sizes[i],
+				    items[i].buffer, items[i].size, level)) {
+			fprintf(stderr, "%s: error compressing item %d\n",
+				codec->name, i);
+			goto out;
+		}
+		packed += sizes[i];
+	}
+	ctime = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < nr_items; i++) {
+		len = MAX_PENDING_SIZE;
+		if (codec->decompress(out, &len, compressed + max_size * i,
+				      sizes[i]) || len != items[i].size) {
+			fprintf(stderr, "%s: error decompressing item %d\n",
+				codec->name, i);
+			goto out;
+		}
+	}
+	dtime = bench_now() - start;
+
+	printf("%-6s %5d %12.1f %14.1f %8.2f\n", codec->name, level,
+	       total / ctime / (1024 * 1024), total / dtime / (1024 * 1024),
+	       (double)total / packed);
+out:
+	free(out);
+	free(compressed);
+	free(sizes);
+}
+
+/*
+ * Load the (uncompressed) items of an existing image, up to
+ * BENCH_MAX_SIZE bytes, and report how fast every codec compresses and
+ * decompresses them and how small it makes them.  Without a level each
+ * codec is tried at level 1 and at its default level.
+ */
+#define BENCH_MAX_SIZE	(256 * 1024 * 1024)
+
+static int benchmark_codecs(const char *input, int level)
+{
+	struct meta_cluster *cluster;
+	struct meta_cluster_header *header;
+	struct bench_item *items = NULL;
+	const struct image_codec *codec;
+	FILE *in;
+	u64 bytenr = 0;
+	u64 total = 0;
+	u8 *tmp = NULL;
+	size_t size;
+	u32 bufsize;
+	u32 i, nritems;
+	int nr_items = 0;
+	int max_items = 0;
+	int ret = 0;
+
+	in = fopen(input, "r");
+	if (!in) {
+		perror("unable to open metadump image");
+		return -errno;
+	}
+	cluster = malloc(BLOCK_SIZE);
+	tmp = malloc(MAX_PENDING_SIZE * 2);
+	if (!cluster || !tmp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (total < BENCH_MAX_SIZE &&
+	       fread(cluster, BLOCK_SIZE, 1, in) == 1) {
+		header = &cluster->header;
+		if (le64_to_cpu(header->magic) != HEADER_MAGIC ||
+		    le64_to_cpu(header->bytenr) != bytenr) {
+			fprintf(stderr, "bad header in metadump image\n");
+			ret = -EIO;
+			goto out;
+		}
+		bytenr += BLOCK_SIZE;
+		nritems = le32_to_cpu(header->nritems);
+		for (i = 0; i < nritems; i++) {
+			bufsize = le32_to_cpu(cluster->items[i].size);
+			if (bufsize > MAX_PENDING_SIZE * 2 ||
+			    fread(tmp, bufsize, 1, in) != 1) {
+				fprintf(stderr, "Error reading item\n");
+				ret = -EIO;
+				goto out;
+			}
+			bytenr += bufsize;
+			if (nr_items == max_items) {
+				struct bench_item *new_items;
+
+				max_items = max_items ? max_items * 2 : 1024;
+				new_items = realloc(items, max_items *
+						    sizeof(*items));
+				if (!new_items) {
+					ret = -ENOMEM;
+					goto out;
+				}
+				items = new_items;
+			}
+			items[nr_items].buffer = malloc(MAX_PENDING_SIZE);
+			if (!items[nr_items].buffer) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			size = MAX_PENDING_SIZE;
+			if (header->compress != COMPRESS_NONE) {
+				ret = decompress_item(header->compress,
+						items[nr_items].buffer, &size,
+						tmp, bufsize);
+			} else if (bufsize > MAX_PENDING_SIZE) {
+				ret = -EIO;
+			} else {
+				memcpy(items[nr_items].buffer, tmp, bufsize);
+				size = bufsize;
+			}
+			nr_items++;
+			if (ret)
+				goto out;
+			items[nr_items - 1].size = size;
+			total += size;
+		}
+		if (bytenr & BLOCK_MASK) {
+			size = BLOCK_SIZE - (bytenr & BLOCK_MASK);
+			bytenr += size;
+			if (fseek(in, size, SEEK_CUR)) {
+				ret = -EIO;
+				goto out;
+			}
+		}
+	}
+	if (!nr_items) {
+		fprintf(stderr, "No items found in %s\n", input);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	printf("%d items, %llu bytes\n", nr_items, (unsigned long long)total);
+	printf("codec  level compress MB/s decompress MB/s    ratio\n");
+	for (i = 0; i < ARRAY_SIZE(image_codecs); i++) {
+		codec = &image_codecs[i];
+		if (level) {
+			bench_codec(codec, min(level, codec->max_level), items,
+				    nr_items, total);
+			continue;
+		}
+		bench_codec(codec, 1, items, nr_items, total);
+		if (codec->default_level != 1)
+			bench_codec(codec, codec->default_level, items,
+				    nr_items, total);
+	}
+out:
+	while (nr_items--)
+		free(items[nr_items].buffer);
+	free(items);
+	free(tmp);
+	free(cluster);
+	fclose(in);
+	return ret;
+}
+
 static void print_usage(void)
 {
 	fprintf(stderr, "usage: btrfs-image [options] source target\n");
 	fprintf(stderr, "\t-r      \trestore metadump image\n");
-	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9)\n");
+	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9, zstd 0 ~ 19, lz4 0 ~ 12)\n");
+	fprintf(stderr, "\t-z codec\tcompress with zlib (default), zstd or lz4\n");
+	fprintf(stderr, "\t-b      \tbenchmark the codecs on the items of a metadump image\n");
 	fprintf(stderr, "\t-t value\tnumber of threads (1 ~ 32)\n");
 	fprintf(stderr, "\t-o      \tdon't mess with the chunk tree when restoring\n");
 	fprintf(stderr, "\t-s      \tsanitize file names, use once to just use garbage, use twice if you want crc collisions\n");
 	fprintf(stderr, "\t-w      \twalk all trees instead of using extent tree, do this if your extent tree is broken\n");
 	fprintf(stderr, "\t-m	   \trestore for multiple devices\n");
+	fprintf(stderr, "\t-i image\tonly dump blocks newer than the full image, restore on top of it\n");
 	exit(1);
 }
 
@@ -2475,7 +3385,12 @@ int main(int argc, char *argv[])
 	char *target;
 	u64 num_threads = 0;
 	u64 compress_level = 0;
+	int level_given = 0;
+	const struct image_codec *codec = &image_codecs[0];
+	const char *codec_name = NULL;
+	const char *base = NULL;
 	int create = 1;
+	int bench = 0;
 	int old_restore = 0;
 	int walk_trees = 0;
 	int multi_devices = 0;
@@ -2486,7 +3401,7 @@ int main(int argc, char *argv[])
 	FILE *out;
 
 	while (1) {
-		int c = getopt(argc, argv, "rc:t:oswm");
+		int c = getopt(argc, argv, "rc:t:oswmz:bi:");
 		if (c < 0)
 			break;
 		switch (c) {
@@ -2500,8 +3415,25 @@ int main(int argc, char *argv[])
 			break;
 		case 'c':
 			compress_level = arg_strtou64(optarg);
-			if (compress_level > 9)
+			if (compress_level > 19)
 				print_usage();
+			level_given = 1;
+			break;
+		case 'z':
+			codec_name = optarg;
+			codec = find_codec_by_name(optarg);
+			if (!codec) {
+				fprintf(stderr,
+					"Unknown or unsupported codec %s\n",
+					optarg);
+				print_usage();
+			}
+			break;
+		case 'b':
+			bench = 1;
+			break;
+		case 'i':
+			base = optarg;
 			break;
 		case 'o':
 			old_restore = 1;
@@ -2523,11 +3455,24 @@ int main(int argc, char *argv[])
 
 	argc = argc - optind;
 	set_argv0(argv);
+	if (bench) {
+		if (check_argc_exact(argc, 1))
+			print_usage();
+		return !!benchmark_codecs(argv[optind], compress_level);
+	}
 	if (check_argc_min(argc, 2))
 		print_usage();
 
 	dev_cnt = argc - 1;
 
+	if (codec_name && !level_given)
+		compress_level = codec->default_level;
+	if (compress_level > codec->max_level) {
+		fprintf(stderr, "Usage error: %s levels go up to %d\n",
+			codec->name, codec->max_level);
+		usage_error++;
+	}
+
 	if (create) {
 		if (old_restore) {
 			fprintf(stderr, "Usage error: create and restore cannot be used at the same time\n");
@@ -2535,7 +3480,7 @@ int main(int argc, char *argv[])
 		}
 	} else {
 		if (walk_trees || sanitize || compress_level) {
-			fprintf(stderr, "Usage error: use -w, -s, -c options for restore makes no sense\n");
+			fprintf(stderr, "Usage error: use -w, -s, -c, -z options for restore makes no sense\n");
 			usage_error++;
 		}
 		if (multi_devices && dev_cnt < 2) {
@@ -2546,11 +3491,20 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "Usage error: accepts only 1 device without -m option\n");
 			usage_error++;
 		}
+		if (base && multi_devices) {
+			fprintf(stderr, "Usage error: -i can't be used with -m\n");
+			usage_error++;
+		}
+		if (base && !strcmp(argv[optind], "-")) {
+			fprintf(stderr, "Usage error: -i needs to seek in the image, it can't be read from stdin\n");
+			usage_error++;
+		}
 	}
 
 	if (usage_error)
 		print_usage();
 
+	crc32c_optimization_init();
 	source = argv[optind];
 	target = argv[optind + 1];
 
@@ -2564,7 +3518,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (num_threads == 0 && compress_level > 0) {
+	if (num_threads == 0 && (compress_level > 0 || !create)) {
 		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
 		if (num_threads <= 0)
 			num_threads = 1;
@@ -2580,11 +3534,11 @@ int main(int argc, char *argv[])
 			fprintf(stderr,
 		"WARNING: The device is mounted. Make sure the filesystem is quiescent.\n");
 
-		ret = create_metadump(source, out, num_threads,
+		ret = create_metadump(source, base, out, num_threads, codec,
 				      compress_level, sanitize, walk_trees);
 	} else {
-		ret = restore_metadump(source, out, old_restore, 1,
-				       multi_devices);
+		ret = restore_metadump(source, base, out, old_restore,
+				       num_threads, multi_devices);
 	}
 	if (ret) {
 		printk("%s failed (%s)\n", (create) ? "create" : "restore",
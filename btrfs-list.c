@@ -538,6 +538,127 @@ static inline void __free_all_subvolumn(struct root_lookup *root_tree)
 	rb_free_nodes(&root_tree->root, __free_root_info);
 }
 
+/*
+ * The listing searches go through TREE_SEARCH_V2 with a buffer of
+ * search_buf_size bytes.  Kernels without it get the 4K TREE_SEARCH.
+ */
+static size_t search_buf_size = BTRFS_LIST_SEARCH_BUF_SIZE;
+static int search_v1;
+
+struct list_search {
+	struct btrfs_ioctl_search_args_v2 *args;
+	struct btrfs_ioctl_search_key *key;
+	char *buf;
+	size_t buf_size;
+};
+
+void btrfs_list_set_search_buf_size(size_t size)
+{
+	size = min_t(size_t, size, BTRFS_LIST_SEARCH_BUF_MAX);
+	search_buf_size = max_t(size_t, size, BTRFS_SEARCH_ARGS_BUFSIZE);
+}
+
+static int list_search_init(struct list_search *s)
+{
+	s->buf_size = search_buf_size;
+	s->args = calloc(1, sizeof(*s->args) + s->buf_size);
+	if (!s->args)
+		return -ENOMEM;
+	s->key = &s->args->key;
+	s->buf = (char *)s->args->buf;
+	return 0;
+}
+
+static void list_search_release(struct list_search *s)
+{
+	free(s->args);
+	s->args = NULL;
+}
+
+/* run the search in s->key, returns like the ioctl with the items in s->buf */
+static int list_search(int fd, struct list_search *s)
+{
+	struct btrfs_ioctl_search_args v1;
+	struct btrfs_ioctl_search_args_v2 *args;
+	u64 needed;
+	int ret;
+
+	while (!search_v1) {
+		s->args->buf_size = s->buf_size;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, s->args);
+		if (!ret)
+			return 0;
+		if (errno == ENOTTY) {
+			search_v1 = 1;
+			break;
+		}
+		needed = s->args->buf_size;
+		if (errno != EOVERFLOW || needed <= s->buf_size)
+			return ret;
+
+		/* the next item alone is bigger than the buffer */
+		args = realloc(s->args, sizeof(*args) + needed);
+		if (!args) {
+			errno = ENOMEM;
+			return -1;
+		}
+		s->args = args;
+		s->key = &args->key;
+		s->buf = (char *)args->buf;
+		s->buf_size = needed;
+	}
+
+	memcpy(&v1.key, s->key, sizeof(v1.key));
+	ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &v1);
+	if (ret)
+		return ret;
+	memcpy(s->key, &v1.key, sizeof(v1.key));
+	memcpy(s->buf, v1.buf, sizeof(v1.buf));
+	return 0;
+}
+
+/*
+ * Subvolumes usually live in a few directories, the path of each one is
+ * looked up once while filling in the root paths.
+ */
+struct dir_path {
+	struct rb_node rb_node;
+	u64 tree;
+	u64 dirid;
+	/* what INO_LOOKUP gave, empty at the top of the tree */
+	char *path;
+};
+
+/* ordered by tree then dirid, @node1 is the one already in the tree */
+static int comp_dir_path(struct rb_node *node1, struct rb_node *node2)
+{
+	struct dir_path *d1 = rb_entry(node1, struct dir_path, rb_node);
+	struct dir_path *d2 = rb_entry(node2, struct dir_path, rb_node);
+
+	if (d2->tree != d1->tree)
+		return d2->tree < d1->tree ? -1 : 1;
+	if (d2->dirid != d1->dirid)
+		return d2->dirid < d1->dirid ? -1 : 1;
+	return 0;
+}
+
+static int comp_dir_path_key(struct rb_node *node, void *key)
+{
+	struct dir_path *d = key;
+
+	return comp_dir_path(node, &d->rb_node);
+}
+
+static void free_dir_path(struct rb_node *node)
+{
+	struct dir_path *d = rb_entry(node, struct dir_path, rb_node);
+
+	free(d->path);
+	free(d);
+}
+
+FREE_RB_BASED_TREE(dir_path, free_dir_path);
+
 /*
  * for a given root_info, search through the root_lookup tree to construct
  * the full path name to it.
@@ -624,11 +745,16 @@ static int resolve_root(struct root_lookup *rl, struct root_info *ri,
  * inside it's ref_root for the dir_id where it lives.
  *
  * This fills in root_info->path with the path to the directory and and
- * appends this root's name.
+ * appends this root's name.  Directories already looked up are found in
+ * @dir_paths.
  */
-static int lookup_ino_path(int fd, struct root_info *ri)
+static int lookup_ino_path(int fd, struct root_info *ri,
+			   struct rb_root *dir_paths)
 {
 	struct btrfs_ioctl_ino_lookup_args args;
+	struct dir_path key;
+	struct dir_path *dir;
+	struct rb_node *node;
 	int ret, e;
 
 	if (ri->path)
@@ -637,34 +763,62 @@ static int lookup_ino_path(int fd, struct root_info *ri)
 	if (!ri->ref_tree)
 		return -ENOENT;
 
+	key.tree = ri->ref_tree;
+	key.dirid = ri->dir_id;
+	node = rb_search(dir_paths, &key, comp_dir_path_key, NULL);
+	if (node) {
+		dir = rb_entry(node, struct dir_path, rb_node);
+		goto found;
+	}
+
 	memset(&args, 0, sizeof(args));
 	args.treeid = ri->ref_tree;
 	args.objectid = ri->dir_id;
 
 	ret = ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args);
 	e = errno;
-	if (ret) {
-		if (e == ENOENT) {
-			ri->ref_tree = 0;
-			return -ENOENT;
-		}
+	if (ret && e != ENOENT) {
 		fprintf(stderr, "ERROR: Failed to lookup path for root %llu - %s\n",
 			(unsigned long long)ri->ref_tree,
 			strerror(e));
 		return ret;
 	}
 
-	if (args.name[0]) {
+	dir = malloc(sizeof(*dir));
+	if (!dir) {
+		perror("malloc failed");
+		exit(1);
+	}
+	dir->tree = ri->ref_tree;
+	dir->dirid = ri->dir_id;
+	/* a directory that's gone is remembered too */
+	dir->path = NULL;
+	if (!ret) {
+		dir->path = strdup(args.name);
+		if (!dir->path) {
+			perror("strdup failed");
+			exit(1);
+		}
+	}
+	rb_insert(dir_paths, &dir->rb_node, comp_dir_path);
+
+found:
+	if (!dir->path) {
+		ri->ref_tree = 0;
+		return -ENOENT;
+	}
+
+	if (dir->path[0]) {
 		/*
 		 * we're in a subdirectory of ref_tree, the kernel ioctl
 		 * puts a / in there for us
 		 */
-		ri->path = malloc(strlen(ri->name) + strlen(args.name) + 1);
+		ri->path = malloc(strlen(ri->name) + strlen(dir->path) + 1);
 		if (!ri->path) {
 			perror("malloc failed");
 			exit(1);
 		}
-		strcpy(ri->path, args.name);
+		strcpy(ri->path, dir->path);
 		strcat(ri->path, ri->name);
 	} else {
 		/* we're at the root of ref_tree */
@@ -687,8 +841,8 @@ static u64 find_root_gen(int fd)
 {
 	struct btrfs_ioctl_ino_lookup_args ino_args;
 	int ret;
-	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct list_search search;
+	struct btrfs_ioctl_search_key *sk;
 	struct btrfs_ioctl_search_header sh;
 	unsigned long off = 0;
 	u64 max_found = 0;
@@ -708,7 +862,11 @@ static u64 find_root_gen(int fd)
 		return 0;
 	}
 
-	memset(&args, 0, sizeof(args));
+	if (list_search_init(&search)) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return 0;
+	}
+	sk = search.key;
 
 	sk->tree_id = 1;
 
@@ -723,16 +881,18 @@ static u64 find_root_gen(int fd)
 	sk->min_type = BTRFS_ROOT_ITEM_KEY;
 	sk->max_offset = (u64)-1;
 	sk->max_transid = (u64)-1;
-	sk->nr_items = 4096;
+	sk->nr_items = (u32)-1;
 
 	while (1) {
-		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		ret = list_search(fd, &search);
 		e = errno;
 		if (ret < 0) {
 			fprintf(stderr, "ERROR: can't perform the search - %s\n",
 				strerror(e));
-			return 0;
+			max_found = 0;
+			break;
 		}
+		sk = search.key;
 		/* the ioctl returns the number of item it found in nr_items */
 		if (sk->nr_items == 0)
 			break;
@@ -741,9 +901,9 @@ static u64 find_root_gen(int fd)
 		for (i = 0; i < sk->nr_items; i++) {
 			struct btrfs_root_item *item;
 
-			memcpy(&sh, args.buf + off, sizeof(sh));
+			memcpy(&sh, search.buf + off, sizeof(sh));
 			off += sizeof(sh);
-			item = (struct btrfs_root_item *)(args.buf + off);
+			item = (struct btrfs_root_item *)(search.buf + off);
 			off += sh.len;
 
 			sk->min_objectid = sh.objectid;
@@ -768,7 +928,9 @@ static u64 find_root_gen(int fd)
 			break;
 		if (sk->min_objectid != ino_args.treeid)
 			break;
+		sk->nr_items = (u32)-1;
 	}
+	list_search_release(&search);
 	return max_found;
 }
 
@@ -975,8 +1137,8 @@ out:
 static int __list_subvol_search(int fd, struct root_lookup *root_lookup)
 {
 	int ret;
-	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct list_search search;
+	struct btrfs_ioctl_search_key *sk;
 	struct btrfs_ioctl_search_header sh;
 	struct btrfs_root_ref *ref;
 	struct btrfs_root_item *ri;
@@ -994,7 +1156,10 @@ static int __list_subvol_search(int fd, struct root_lookup *root_lookup)
 	u8 ruuid[BTRFS_UUID_SIZE];
 
 	root_lookup_init(root_lookup);
-	memset(&args, 0, sizeof(args));
+	ret = list_search_init(&search);
+	if (ret)
+		return ret;
+	sk = search.key;
 
 	/* search in the tree of tree roots */
 	sk->tree_id = 1;
@@ -1016,13 +1181,14 @@ static int __list_subvol_search(int fd, struct root_lookup *root_lookup)
 	sk->max_offset = (u64)-1;
 	sk->max_transid = (u64)-1;
 
-	/* just a big number, doesn't matter much */
-	sk->nr_items = 4096;
+	/* as many as fit in the buffer */
+	sk->nr_items = (u32)-1;
 
 	while(1) {
-		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		ret = list_search(fd, &search);
 		if (ret < 0)
-			return ret;
+			goto out;
+		sk = search.key;
 		/* the ioctl returns the number of item it found in nr_items */
 		if (sk->nr_items == 0)
 			break;
@@ -1034,10 +1200,10 @@ static int __list_subvol_search(int fd, struct root_lookup *root_lookup)
 		 * read the root_ref item it contains
 		 */
 		for (i = 0; i < sk->nr_items; i++) {
-			memcpy(&sh, args.buf + off, sizeof(sh));
+			memcpy(&sh, search.buf + off, sizeof(sh));
 			off += sizeof(sh);
 			if (sh.type == BTRFS_ROOT_BACKREF_KEY) {
-				ref = (struct btrfs_root_ref *)(args.buf + off);
+				ref = (struct btrfs_root_ref *)(search.buf + off);
 				name_len = btrfs_stack_root_ref_name_len(ref);
 				name = (char *)(ref + 1);
 				dir_id = btrfs_stack_root_ref_dirid(ref);
@@ -1046,7 +1212,7 @@ static int __list_subvol_search(int fd, struct root_lookup *root_lookup)
 					 0, 0, dir_id, name, name_len, 0, 0, 0,
 					 NULL, NULL, NULL);
 			} else if (sh.type == BTRFS_ROOT_ITEM_KEY) {
-				ri = (struct btrfs_root_item *)(args.buf + off);
+				ri = (struct btrfs_root_item *)(search.buf + off);
 				gen = btrfs_root_generation(ri);
 				flags = btrfs_root_flags(ri);
 				if(sh.len >
@@ -1079,7 +1245,7 @@ static int __list_subvol_search(int fd, struct root_lookup *root_lookup)
 			sk->min_type = sh.type;
 			sk->min_offset = sh.offset;
 		}
-		sk->nr_items = 4096;
+		sk->nr_items = (u32)-1;
 		sk->min_offset++;
 		if (!sk->min_offset)	/* overflow */
 			sk->min_type++;
@@ -1095,8 +1261,10 @@ static int __list_subvol_search(int fd, struct root_lookup *root_lookup)
 		if (sk->min_objectid > sk->max_objectid)
 			break;
 	}
-
-	return 0;
+	ret = 0;
+out:
+	list_search_release(&search);
+	return ret;
 }
 
 static int filter_by_rootid(struct root_info *ri, u64 data)
@@ -1313,20 +1481,23 @@ static void __filter_and_sort_subvol(struct root_lookup *all_subvols,
 
 static int __list_subvol_fill_paths(int fd, struct root_lookup *root_lookup)
 {
+	struct rb_root dir_paths = RB_ROOT;
 	struct rb_node *n;
+	int ret = 0;
 
 	n = rb_first(&root_lookup->root);
 	while (n) {
 		struct root_info *entry;
-		int ret;
 		entry = rb_entry(n, struct root_info, rb_node);
-		ret = lookup_ino_path(fd, entry);
+		ret = lookup_ino_path(fd, entry, &dir_paths);
 		if (ret && ret != -ENOENT)
-			return ret;
+			break;
+		ret = 0;
 		n = rb_next(n);
 	}
 
-	return 0;
+	free_dir_path_tree(&dir_paths);
+	return ret;
 }
 
 static void print_subvolume_column(struct root_info *subv,
@@ -1674,8 +1845,8 @@ static int print_one_extent(int fd, struct btrfs_ioctl_search_header *sh,
 int btrfs_list_find_updated_files(int fd, u64 root_id, u64 oldest_gen)
 {
 	int ret;
-	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct list_search search;
+	struct btrfs_ioctl_search_key *sk;
 	struct btrfs_ioctl_search_header sh;
 	struct btrfs_file_extent_item *item;
 	unsigned long off = 0;
@@ -1690,7 +1861,12 @@ int btrfs_list_find_updated_files(int fd, u64 root_id, u64 oldest_gen)
 	struct btrfs_file_extent_item backup;
 
 	memset(&backup, 0, sizeof(backup));
-	memset(&args, 0, sizeof(args));
+	ret = list_search_init(&search);
+	if (ret) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return ret;
+	}
+	sk = search.key;
 
 	sk->tree_id = root_id;
 
@@ -1703,18 +1879,19 @@ int btrfs_list_find_updated_files(int fd, u64 root_id, u64 oldest_gen)
 	sk->max_transid = (u64)-1;
 	sk->max_type = BTRFS_EXTENT_DATA_KEY;
 	sk->min_transid = oldest_gen;
-	/* just a big number, doesn't matter much */
-	sk->nr_items = 4096;
+	/* as many as fit in the buffer */
+	sk->nr_items = (u32)-1;
 
 	max_found = find_root_gen(fd);
 	while(1) {
-		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		ret = list_search(fd, &search);
 		e = errno;
 		if (ret < 0) {
 			fprintf(stderr, "ERROR: can't perform the search - %s\n",
 				strerror(e));
 			break;
 		}
+		sk = search.key;
 		/* the ioctl returns the number of item it found in nr_items */
 		if (sk->nr_items == 0)
 			break;
@@ -1726,7 +1903,7 @@ int btrfs_list_find_updated_files(int fd, u64 root_id, u64 oldest_gen)
 		 * read the root_ref item it contains
 		 */
 		for (i = 0; i < sk->nr_items; i++) {
-			memcpy(&sh, args.buf + off, sizeof(sh));
+			memcpy(&sh, search.buf + off, sizeof(sh));
 			off += sizeof(sh);
 
 			/*
@@ -1736,7 +1913,7 @@ int btrfs_list_find_updated_files(int fd, u64 root_id, u64 oldest_gen)
 			if (sh.len == 0)
 				item = &backup;
 			else
-				item = (struct btrfs_file_extent_item *)(args.buf +
+				item = (struct btrfs_file_extent_item *)(search.buf +
 								 off);
 			found_gen = btrfs_stack_file_extent_generation(item);
 			if (sh.type == BTRFS_EXTENT_DATA_KEY &&
@@ -1755,7 +1932,7 @@ int btrfs_list_find_updated_files(int fd, u64 root_id, u64 oldest_gen)
 			sk->min_offset = sh.offset;
 			sk->min_type = sh.type;
 		}
-		sk->nr_items = 4096;
+		sk->nr_items = (u32)-1;
 		if (sk->min_offset < (u64)-1)
 			sk->min_offset++;
 		else if (sk->min_objectid < (u64)-1) {
@@ -1765,6 +1942,7 @@ int btrfs_list_find_updated_files(int fd, u64 root_id, u64 oldest_gen)
 		} else
 			break;
 	}
+	list_search_release(&search);
 	free(cache_dir_name);
 	free(cache_full_name);
 	printf("transid marker was %llu\n", (unsigned long long)max_found);
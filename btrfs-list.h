@@ -26,6 +26,10 @@
 #define BTRFS_LIST_LAYOUT_TABLE	1
 #define BTRFS_LIST_LAYOUT_RAW		2
 
+/* default and largest size of the tree search results buffer */
+#define BTRFS_LIST_SEARCH_BUF_SIZE	(1024 * 1024)
+#define BTRFS_LIST_SEARCH_BUF_MAX	(16 * 1024 * 1024)
+
 /*
  * one of these for each root we find.
  */
@@ -165,3 +169,4 @@ int btrfs_list_get_default_subvolume(int fd, u64 *default_id);
 char *btrfs_list_path_for_root(int fd, u64 root);
 int btrfs_list_get_path_rootid(int fd, u64 *treeid);
 int btrfs_get_subvol(int fd, struct root_info *the_ri);
+void btrfs_list_set_search_buf_size(size_t size);
@@ -41,10 +41,14 @@
 #include "version.h"
 #include "btrfsck.h"
 #include "commands.h"
+#include "range-scan.h"
+#include "scan-cache.h"
 
 struct recover_control {
 	int verbose;
 	int yes;
+	int jobs;
+	char *cache_file;
 
 	u16 csum_size;
 	u32 sectorsize;
@@ -63,6 +67,8 @@ struct recover_control {
 	struct list_head bad_chunks;
 	struct list_head unrepaired_chunks;
 	pthread_mutex_t rc_lock;
+
+	struct scan_cache *scan_cache;
 };
 
 struct extent_record {
@@ -74,11 +80,8 @@ struct extent_record {
 	int nmirrors;
 };
 
-struct device_scan {
-	struct recover_control *rc;
-	struct btrfs_device *dev;
-	int fd;
-};
+/* tree blocks a worker reads before adding them to the records */
+#define SCAN_BATCH_BLOCKS	512
 
 static struct extent_record *btrfs_new_extent_record(struct extent_buffer *eb)
 {
@@ -688,6 +691,7 @@ static int check_all_chunks_by_metadata(struct recover_control *rc,
 	return ret;
 }
 
+/* called with rc_lock held */
 static int extract_metadata_record(struct recover_control *rc,
 				   struct extent_buffer *leaf)
 {
@@ -701,20 +705,14 @@ static int extract_metadata_record(struct recover_control *rc,
 		btrfs_item_key_to_cpu(leaf, &key, i);
 		switch (key.type) {
 		case BTRFS_BLOCK_GROUP_ITEM_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
 			ret = process_block_group_item(&rc->bg, leaf, &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
 			break;
 		case BTRFS_CHUNK_ITEM_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
 			ret = process_chunk_item(&rc->chunk, leaf, &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
 			break;
 		case BTRFS_DEV_EXTENT_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
 			ret = process_device_extent_item(&rc->devext, leaf,
 							 &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
 			break;
 		}
 		if (ret)
@@ -723,66 +721,32 @@ static int extract_metadata_record(struct recover_control *rc,
 	return ret;
 }
 
-static inline int is_super_block_address(u64 offset)
-{
-	int i;
-
-	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
-		if (offset == btrfs_sb_offset(i))
-			return 1;
-	}
-	return 0;
-}
-
-static int scan_one_device(void *dev_scan_struct)
+/*
+ * Tree blocks read by a worker are gathered in batches and added to the
+ * records under one rc_lock.
+ */
+static int process_scan_batch(struct recover_control *rc,
+			      struct btrfs_device *device,
+			      struct extent_buffer **batch, u64 *bytenr,
+			      int nr)
 {
 	struct extent_buffer *buf;
-	u64 bytenr;
 	int ret = 0;
-	struct device_scan *dev_scan = (struct device_scan *)dev_scan_struct;
-	struct recover_control *rc = dev_scan->rc;
-	struct btrfs_device *device = dev_scan->dev;
-	int fd = dev_scan->fd;
-	int oldtype;
-
-	ret = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &oldtype);
-	if (ret)
-		return 1;
-
-	buf = malloc(sizeof(*buf) + rc->leafsize);
-	if (!buf)
-		return -ENOMEM;
-	buf->len = rc->leafsize;
-
-	bytenr = 0;
-	while (1) {
-		if (is_super_block_address(bytenr))
-			bytenr += rc->sectorsize;
-
-		if (pread64(fd, buf->data, rc->leafsize, bytenr) <
-		    rc->leafsize)
-			break;
-
-		if (memcmp_extent_buffer(buf, rc->fs_devices->fsid,
-					 btrfs_header_fsid(),
-					 BTRFS_FSID_SIZE)) {
-			bytenr += rc->sectorsize;
-			continue;
-		}
+	int i;
 
-		if (verify_tree_block_csum_silent(buf, rc->csum_size)) {
-			bytenr += rc->sectorsize;
-			continue;
-		}
+	if (!nr)
+		return 0;
 
-		pthread_mutex_lock(&rc->rc_lock);
-		ret = process_extent_buffer(&rc->eb_cache, buf, device, bytenr);
-		pthread_mutex_unlock(&rc->rc_lock);
+	pthread_mutex_lock(&rc->rc_lock);
+	for (i = 0; i < nr; i++) {
+		buf = batch[i];
+		ret = process_extent_buffer(&rc->eb_cache, buf, device,
+					    bytenr[i]);
 		if (ret)
-			goto out;
+			break;
 
 		if (btrfs_header_level(buf) != 0)
-			goto next_node;
+			continue;
 
 		switch (btrfs_header_owner(buf)) {
 		case BTRFS_EXTENT_TREE_OBJECTID:
@@ -791,96 +755,254 @@ static int scan_one_device(void *dev_scan_struct)
 			if (btrfs_header_generation(buf) > rc->generation)
 				break;
 			ret = extract_metadata_record(rc, buf);
-			if (ret)
-				goto out;
 			break;
 		case BTRFS_CHUNK_TREE_OBJECTID:
 			if (btrfs_header_generation(buf) >
 			    rc->chunk_root_generation)
 				break;
 			ret = extract_metadata_record(rc, buf);
-			if (ret)
-				goto out;
 			break;
 		}
-next_node:
-		bytenr += rc->leafsize;
+		if (ret)
+			break;
+	}
+	pthread_mutex_unlock(&rc->rc_lock);
+	return ret;
+}
+
+/* the tree blocks found in the current window of a range */
+struct scan_batch {
+	struct recover_control *rc;
+	struct btrfs_device *device;
+	struct extent_buffer **blocks;
+	u64 *bytenr;
+	int nr;
+};
+
+static int flush_scan_batch(void *priv)
+{
+	struct scan_batch *batch = priv;
+	int ret;
+
+	ret = process_scan_batch(batch->rc, batch->device, batch->blocks,
+				 batch->bytenr, batch->nr);
+	batch->nr = 0;
+	return ret;
+}
+
+/* scan a range of a device and add the tree blocks in it to the records */
+static int scan_one_range(struct range_scan *scan, struct scan_range *range)
+{
+	struct recover_control *rc = scan->priv;
+	struct range_scan_window w;
+	struct scan_batch batch;
+	int batch_max;
+	char *block;
+	int ret;
+	int i;
+
+	/* a window holds at most one tree block per leafsize, plus a partial */
+	batch_max = RANGE_SCAN_WINDOW_SIZE / rc->leafsize + 1;
+	batch.rc = rc;
+	batch.device = range->priv;
+	batch.nr = 0;
+	batch.blocks = calloc(batch_max, sizeof(*batch.blocks));
+	batch.bytenr = calloc(batch_max, sizeof(*batch.bytenr));
+	w.buf = NULL;
+	if (!batch.blocks || !batch.bytenr) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < batch_max; i++) {
+		batch.blocks[i] = malloc(sizeof(*batch.blocks[i]) +
+					 rc->leafsize);
+		if (!batch.blocks[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		batch.blocks[i]->len = rc->leafsize;
+	}
+
+	ret = range_scan_window_init(&w, scan, range, rc->sectorsize,
+				     rc->leafsize);
+	if (ret)
+		goto out;
+	w.flush = flush_scan_batch;
+	w.priv = &batch;
+
+	while ((ret = range_scan_next_block(&w, rc->fs_devices->fsid,
+					    &block)) > 0) {
+		if (!range_scan_csum_ok(block, rc->leafsize, rc->csum_size)) {
+			w.bytenr += rc->sectorsize;
+			continue;
+		}
+		memcpy(batch.blocks[batch.nr]->data, block, rc->leafsize);
+		batch.bytenr[batch.nr++] = w.bytenr;
+		w.bytenr += rc->leafsize;
 	}
 out:
-	close(fd);
-	free(buf);
+	range_scan_window_release(&w);
+	if (batch.blocks) {
+		for (i = 0; i < batch_max; i++)
+			free(batch.blocks[i]);
+	}
+	free(batch.blocks);
+	free(batch.bytenr);
 	return ret;
 }
 
-static int scan_devices(struct recover_control *rc)
+/*
+ * Read the tree blocks with a good csum the scan found in a range and
+ * add them to the records.
+ */
+static int read_one_range(struct range_scan *scan, struct scan_range *range)
 {
+	struct extent_buffer **batch;
+	u64 *batch_bytenr;
+	int batch_nr = 0;
+	struct recover_control *rc = scan->priv;
+	struct btrfs_device *device = range->priv;
+	struct scan_cache_device *dev;
+	struct scan_cache_block *b;
+	u64 end = range->start + range->len;
+	u64 idx;
 	int ret = 0;
-	int fd;
-	struct btrfs_device *dev;
-	struct device_scan *dev_scans;
-	pthread_t *t_scans;
-	int *t_rets;
+	int i;
+
+	dev = scan_cache_find_device(rc->scan_cache, device->devid);
+	if (!dev)
+		return -ENOENT;
+
+	batch = calloc(SCAN_BATCH_BLOCKS, sizeof(*batch));
+	batch_bytenr = calloc(SCAN_BATCH_BLOCKS, sizeof(*batch_bytenr));
+	if (!batch || !batch_bytenr) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < SCAN_BATCH_BLOCKS; i++) {
+		batch[i] = malloc(sizeof(*batch[i]) + rc->leafsize);
+		if (!batch[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		batch[i]->len = rc->leafsize;
+	}
+
+	for (idx = scan_cache_lookup(dev, range->start);
+	     idx < dev->nr_blocks && dev->blocks[idx].physical < end; idx++) {
+		b = &dev->blocks[idx];
+		if (!b->csum_ok)
+			continue;
+
+		if (pread64(range->fd, batch[batch_nr]->data, rc->leafsize,
+			    b->physical) < rc->leafsize)
+			continue;
+		if (verify_tree_block_csum_silent(batch[batch_nr],
+						  rc->csum_size))
+			continue;
+		batch_bytenr[batch_nr++] = b->physical;
+		if (batch_nr < SCAN_BATCH_BLOCKS)
+			continue;
+
+		ret = process_scan_batch(rc, device, batch, batch_bytenr,
+					 batch_nr);
+		batch_nr = 0;
+		if (ret || range_scan_stopped(scan))
+			goto out;
+	}
+	ret = process_scan_batch(rc, device, batch, batch_bytenr, batch_nr);
+out:
+	if (batch) {
+		for (i = 0; i < SCAN_BATCH_BLOCKS; i++)
+			free(batch[i]);
+	}
+	free(batch);
+	free(batch_bytenr);
+	return ret;
+}
+
+/*
+ * Every device is cut in rc->jobs ranges for a pool of rc->jobs workers
+ * per device.  Without a cache file the workers scan the ranges and add
+ * the blocks they find to the records right away.  With one, the blocks
+ * are loaded from it, or the devices are scanned to fill it, and the
+ * workers only read back the blocks found.
+ */
+static int scan_devices(struct recover_control *rc)
+{
+	struct scan_cache cache;
+	struct range_scan scan;
+	struct btrfs_device *device;
+	struct stat st;
+	int *fds;
 	int devnr = 0;
 	int devidx = 0;
-	int cancel_from = 0;
-	int cancel_to = 0;
+	int ret = 0;
+	int fd;
 	int i;
+	u64 size;
+
+	if (rc->cache_file) {
+		ret = scan_cache_init(&cache, rc->fs_devices, rc->generation,
+				      rc->sectorsize, rc->leafsize,
+				      rc->csum_size);
+		if (!ret)
+			ret = scan_cache_fill(&cache, rc->fs_devices,
+					      rc->cache_file, rc->jobs);
+		if (ret) {
+			scan_cache_release(&cache);
+			return 1;
+		}
+		rc->scan_cache = &cache;
+	}
 
-	list_for_each_entry(dev, &rc->fs_devices->devices, dev_list)
+	list_for_each_entry(device, &rc->fs_devices->devices, dev_list)
 		devnr++;
-	dev_scans = (struct device_scan *)malloc(sizeof(struct device_scan)
-						 * devnr);
-	if (!dev_scans)
-		return -ENOMEM;
-	t_scans = (pthread_t *)malloc(sizeof(pthread_t) * devnr);
-	if (!t_scans)
-		return -ENOMEM;
-	t_rets = (int *)malloc(sizeof(int) * devnr);
-	if (!t_rets)
-		return -ENOMEM;
+	fds = malloc(sizeof(int) * devnr);
+	if (!fds) {
+		ret = -ENOMEM;
+		goto out_cache;
+	}
 
-	list_for_each_entry(dev, &rc->fs_devices->devices, dev_list) {
-		fd = open(dev->name, O_RDONLY);
+	range_scan_init(&scan, rc->scan_cache ? read_one_range : scan_one_range,
+			rc);
+	list_for_each_entry(device, &rc->fs_devices->devices, dev_list) {
+		fd = open(device->name, O_RDONLY);
 		if (fd < 0) {
 			fprintf(stderr, "Failed to open device %s\n",
-				dev->name);
+				device->name);
 			ret = 1;
-			goto out2;
-		}
-		dev_scans[devidx].rc = rc;
-		dev_scans[devidx].dev = dev;
-		dev_scans[devidx].fd = fd;
-		ret = pthread_create(&t_scans[devidx], NULL,
-				     (void *)scan_one_device,
-				     (void *)&dev_scans[devidx]);
-		if (ret) {
-			cancel_from = 0;
-			cancel_to = devidx - 1;
-			goto out1;
+			goto out;
 		}
-		devidx++;
-	}
-
-	i = 0;
-	while (i < devidx) {
-		ret = pthread_join(t_scans[i], (void **)&t_rets[i]);
-		if (ret || t_rets[i]) {
+		fds[devidx++] = fd;
+
+		if (rc->scan_cache) {
+			size = scan_cache_find_device(&cache,
+						      device->devid)->size;
+		} else if (fstat(fd, &st) < 0 ||
+			   !(size = btrfs_device_size(fd, &st))) {
+			fprintf(stderr, "Failed to get the size of device %s\n",
+				device->name);
 			ret = 1;
-			cancel_from = i + 1;
-			cancel_to = devnr - 1;
-			goto out1;
+			goto out;
 		}
-		i++;
+		ret = range_scan_add(&scan, fd, 0, size, 0, rc->jobs,
+				     rc->leafsize, device);
+		if (ret)
+			goto out;
 	}
-out1:
-	while (ret && (cancel_from <= cancel_to)) {
-		pthread_cancel(t_scans[cancel_from]);
-		cancel_from++;
+
+	ret = range_scan_run(&scan, devnr * rc->jobs);
+out:
+	for (i = 0; i < devidx; i++)
+		close(fds[i]);
+	range_scan_release(&scan);
+	free(fds);
+out_cache:
+	if (rc->scan_cache) {
+		rc->scan_cache = NULL;
+		scan_cache_release(&cache);
 	}
-out2:
-	free(dev_scans);
-	free(t_scans);
-	free(t_rets);
 	return !!ret;
 }
 
@@ -2096,7 +2218,8 @@ static int btrfs_recover_chunks(struct recover_control *rc)
 /*
  * Return 0 when succesful, < 0 on error and > 0 if aborted by user
  */
-int btrfs_recover_chunk_tree(char *path, int verbose, int yes)
+int btrfs_recover_chunk_tree(char *path, int verbose, int yes, int jobs,
+			     char *cache_file)
 {
 	int ret = 0;
 	struct btrfs_root *root = NULL;
@@ -2104,6 +2227,8 @@ int btrfs_recover_chunk_tree(char *path, int verbose, int yes)
 	struct recover_control rc;
 
 	init_recover_control(&rc, verbose, yes);
+	rc.jobs = jobs;
+	rc.cache_file = cache_file;
 
 	ret = recover_prepare(&rc, path);
 	if (ret) {
@@ -58,6 +58,7 @@ static int repair = 0;
 static int no_holes = 0;
 static int init_extent_tree = 0;
 static int check_data_csum = 0;
+static int verbose = 0;
 
 struct extent_backref {
 	struct list_head list;
@@ -78,7 +79,6 @@ struct data_backref {
 	u64 offset;
 	u64 disk_bytenr;
 	u64 bytes;
-	u64 ram_bytes;
 	u32 num_refs;
 	u32 found_ref;
 };
@@ -91,20 +91,28 @@ struct tree_backref {
 	};
 };
 
-struct extent_record {
-	struct list_head backrefs;
+/*
+ * Fields that only tree blocks and duplicate extent items need, kept out
+ * of struct extent_record so that the common data extent stays small.
+ */
+struct extent_record_extra {
+	struct extent_record *rec;
 	struct list_head dups;
 	struct list_head list;
-	struct cache_extent cache;
 	struct btrfs_disk_key parent_key;
-	u64 start;
+	u64 parent_generation;
+	u64 generation;
+	u64 info_objectid;
+};
+
+struct extent_record {
+	struct list_head backrefs;
+	struct cache_extent cache;
+	struct extent_record_extra *extra;
 	u64 max_size;
 	u64 nr;
 	u64 refs;
 	u64 extent_item_refs;
-	u64 generation;
-	u64 parent_generation;
-	u64 info_objectid;
 	u32 num_duplicates;
 	u8 info_level;
 	unsigned int found_rec:1;
@@ -244,6 +252,202 @@ struct bad_item {
 	struct list_head list;
 };
 
+/*
+ * Fixed size object pools for the records fsck creates by the million.
+ * Objects are carved out of large slabs and freed objects go to a free
+ * list to be reused, the slabs are only given back to the system when
+ * the phase using the pool is over.
+ */
+#define REC_POOL_SLAB_SIZE	(256 * 1024)
+
+struct rec_pool {
+	const char *name;
+	size_t size;
+	void *free_list;
+	char *cur;
+	char *end;
+	struct list_head slabs;
+	u64 nr_slabs;
+	u64 nr_allocs;
+	u64 in_use;
+	u64 peak;
+};
+
+struct rec_pool_slab {
+	struct list_head list;
+	u64 data[];
+};
+
+#define DEFINE_REC_POOL(_pool, _name, _size)				\
+	static struct rec_pool _pool = {				\
+		.name = _name,						\
+		.size = round_up((_size), sizeof(u64)),			\
+		.slabs = LIST_HEAD_INIT(_pool.slabs),			\
+	}
+
+DEFINE_REC_POOL(extent_record_pool, "extent_record",
+		sizeof(struct extent_record));
+DEFINE_REC_POOL(extent_extra_pool, "extent_extra",
+		sizeof(struct extent_record_extra));
+DEFINE_REC_POOL(tree_backref_pool, "tree_backref",
+		sizeof(struct tree_backref));
+DEFINE_REC_POOL(data_backref_pool, "data_backref",
+		sizeof(struct data_backref));
+DEFINE_REC_POOL(inode_record_pool, "inode_record",
+		sizeof(struct inode_record));
+/* inode backrefs carry their name, so they come in a few sizes */
+DEFINE_REC_POOL(inode_backref_pool_16, "inode_backref/16",
+		sizeof(struct inode_backref) + 16);
+DEFINE_REC_POOL(inode_backref_pool_64, "inode_backref/64",
+		sizeof(struct inode_backref) + 64);
+DEFINE_REC_POOL(inode_backref_pool_max, "inode_backref/256",
+		sizeof(struct inode_backref) + BTRFS_NAME_LEN + 1);
+
+static void *rec_pool_alloc(struct rec_pool *pool)
+{
+	struct rec_pool_slab *slab;
+	void *ptr;
+
+	if (pool->free_list) {
+		ptr = pool->free_list;
+		pool->free_list = *(void **)ptr;
+	} else {
+		if (pool->cur + pool->size > pool->end) {
+			slab = malloc(REC_POOL_SLAB_SIZE);
+			if (!slab)
+				return NULL;
+			list_add(&slab->list, &pool->slabs);
+			pool->nr_slabs++;
+			pool->cur = (char *)slab->data;
+			pool->end = (char *)slab + REC_POOL_SLAB_SIZE;
+		}
+		ptr = pool->cur;
+		pool->cur += pool->size;
+	}
+	pool->nr_allocs++;
+	if (++pool->in_use > pool->peak)
+		pool->peak = pool->in_use;
+	return ptr;
+}
+
+static void rec_pool_free(struct rec_pool *pool, void *ptr)
+{
+	if (!ptr)
+		return;
+	BUG_ON(!pool->in_use);
+	pool->in_use--;
+	*(void **)ptr = pool->free_list;
+	pool->free_list = ptr;
+}
+
+static void rec_pool_print_stats(struct rec_pool *pool)
+{
+	if (!pool->nr_allocs)
+		return;
+	fprintf(stderr, "  %-18s %10llu allocated %10llu peak %8llu KiB\n",
+		pool->name, (unsigned long long)pool->nr_allocs,
+		(unsigned long long)pool->peak,
+		(unsigned long long)(pool->nr_slabs * REC_POOL_SLAB_SIZE / 1024));
+}
+
+/*
+ * Give all the memory of the pool back at once, whatever is still
+ * allocated from it must not be used anymore.
+ */
+static void rec_pool_release(struct rec_pool *pool)
+{
+	struct rec_pool_slab *slab;
+
+	if (verbose)
+		rec_pool_print_stats(pool);
+	while (!list_empty(&pool->slabs)) {
+		slab = list_entry(pool->slabs.next, struct rec_pool_slab, list);
+		list_del(&slab->list);
+		free(slab);
+	}
+	pool->free_list = NULL;
+	pool->cur = NULL;
+	pool->end = NULL;
+	pool->nr_slabs = 0;
+	pool->nr_allocs = 0;
+	pool->in_use = 0;
+	pool->peak = 0;
+}
+
+static struct rec_pool *inode_backref_pool(int namelen)
+{
+	if (namelen < 16)
+		return &inode_backref_pool_16;
+	if (namelen < 64)
+		return &inode_backref_pool_64;
+	BUG_ON(namelen > BTRFS_NAME_LEN);
+	return &inode_backref_pool_max;
+}
+
+static struct inode_backref *alloc_inode_backref(int namelen)
+{
+	return rec_pool_alloc(inode_backref_pool(namelen));
+}
+
+static void free_inode_backref(struct inode_backref *backref)
+{
+	rec_pool_free(inode_backref_pool(backref->namelen), backref);
+}
+
+static void free_extent_backref(struct extent_backref *back)
+{
+	if (back->is_data)
+		rec_pool_free(&data_backref_pool, back);
+	else
+		rec_pool_free(&tree_backref_pool, back);
+}
+
+static struct extent_record_extra *extent_rec_extra(struct extent_record *rec)
+{
+	struct extent_record_extra *extra = rec->extra;
+
+	if (extra)
+		return extra;
+	extra = rec_pool_alloc(&extent_extra_pool);
+	if (!extra)
+		return NULL;
+	memset(extra, 0, sizeof(*extra));
+	INIT_LIST_HEAD(&extra->dups);
+	INIT_LIST_HEAD(&extra->list);
+	extra->rec = rec;
+	rec->extra = extra;
+	return extra;
+}
+
+static void free_extent_rec(struct extent_record *rec)
+{
+	if (rec->extra) {
+		list_del_init(&rec->extra->list);
+		rec_pool_free(&extent_extra_pool, rec->extra);
+	}
+	rec_pool_free(&extent_record_pool, rec);
+}
+
+static void release_extent_record_pools(void)
+{
+	if (verbose)
+		fprintf(stderr, "extent record memory:\n");
+	rec_pool_release(&extent_record_pool);
+	rec_pool_release(&extent_extra_pool);
+	rec_pool_release(&tree_backref_pool);
+	rec_pool_release(&data_backref_pool);
+}
+
+static void release_inode_record_pools(void)
+{
+	if (verbose)
+		fprintf(stderr, "inode record memory:\n");
+	rec_pool_release(&inode_record_pool);
+	rec_pool_release(&inode_backref_pool_16);
+	rec_pool_release(&inode_backref_pool_64);
+	rec_pool_release(&inode_backref_pool_max);
+}
+
 static void reset_cached_block_groups(struct btrfs_fs_info *fs_info);
 
 static void record_root_in_trans(struct btrfs_trans_handle *trans,
@@ -296,14 +500,14 @@ static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 	struct inode_backref *orig;
 	size_t size;
 
-	rec = malloc(sizeof(*rec));
+	rec = rec_pool_alloc(&inode_record_pool);
 	memcpy(rec, orig_rec, sizeof(*rec));
 	rec->refs = 1;
 	INIT_LIST_HEAD(&rec->backrefs);
 
 	list_for_each_entry(orig, &orig_rec->backrefs, list) {
 		size = sizeof(*orig) + orig->namelen + 1;
-		backref = malloc(size);
+		backref = alloc_inode_backref(orig->namelen);
 		memcpy(backref, orig, size);
 		list_add_tail(&backref->list, &rec->backrefs);
 	}
@@ -406,7 +610,8 @@ static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 			rec = node->data;
 		}
 	} else if (mod) {
-		rec = calloc(1, sizeof(*rec));
+		rec = rec_pool_alloc(&inode_record_pool);
+		memset(rec, 0, sizeof(*rec));
 		rec->ino = ino;
 		rec->extent_start = (u64)-1;
 		rec->first_extent_gap = (u64)-1;
@@ -438,9 +643,9 @@ static void free_inode_rec(struct inode_record *rec)
 		backref = list_entry(rec->backrefs.next,
 				     struct inode_backref, list);
 		list_del(&backref->list);
-		free(backref);
+		free_inode_backref(backref);
 	}
-	free(rec);
+	rec_pool_free(&inode_record_pool, rec);
 }
 
 static int can_free_inode_rec(struct inode_record *rec)
@@ -469,7 +674,7 @@ static void maybe_free_inode_rec(struct cache_tree *inode_cache,
 				backref->errors |= REF_ERR_FILETYPE_UNMATCH;
 			if (!backref->errors && backref->found_inode_ref) {
 				list_del(&backref->list);
-				free(backref);
+				free_inode_backref(backref);
 			}
 		}
 	}
@@ -574,7 +779,7 @@ static struct inode_backref *get_inode_backref(struct inode_record *rec,
 		return backref;
 	}
 
-	backref = malloc(sizeof(*backref) + namelen + 1);
+	backref = alloc_inode_backref(namelen);
 	memset(backref, 0, sizeof(*backref));
 	backref->dir = dir;
 	backref->namelen = namelen;
@@ -1815,7 +2020,7 @@ static int repair_inode_backrefs(struct btrfs_root *root,
 				break;
 			repaired++;
 			list_del(&backref->list);
-			free(backref);
+			free_inode_backref(backref);
 		}
 
 		if (!delete && !backref->found_dir_index &&
@@ -1831,7 +2036,7 @@ static int repair_inode_backrefs(struct btrfs_root *root,
 				if (!backref->errors &&
 				    backref->found_inode_ref) {
 					list_del(&backref->list);
-					free(backref);
+					free_inode_backref(backref);
 				}
 			}
 		}
@@ -2578,6 +2783,7 @@ out:
 		free_extent_cache_tree(&wc.shared);
 	if (!cache_tree_empty(&wc.shared))
 		fprintf(stderr, "warning line %d\n", __LINE__);
+	release_inode_record_pools();
 
 	return err;
 }
@@ -2603,7 +2809,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				fprintf(stderr, "Backref %llu %s %llu"
 					" owner %llu offset %llu num_refs %lu"
 					" not found in extent tree\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					back->full_backref ?
 					"parent" : "root",
 					back->full_backref ?
@@ -2616,7 +2822,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				tback = (struct tree_backref *)back;
 				fprintf(stderr, "Backref %llu parent %llu"
 					" root %llu not found in extent tree\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					(unsigned long long)tback->parent,
 					(unsigned long long)tback->root);
 			}
@@ -2627,7 +2833,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				goto out;
 			tback = (struct tree_backref *)back;
 			fprintf(stderr, "Backref %llu %s %llu not referenced back %p\n",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				back->full_backref ? "parent" : "root",
 				back->full_backref ?
 				(unsigned long long)tback->parent :
@@ -2642,7 +2848,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				fprintf(stderr, "Incorrect local backref count"
 					" on %llu %s %llu owner %llu"
 					" offset %llu found %u wanted %u back %p\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					back->full_backref ?
 					"parent" : "root",
 					back->full_backref ?
@@ -2652,14 +2858,14 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 					(unsigned long long)dback->offset,
 					dback->found_ref, dback->num_refs, back);
 			}
-			if (dback->disk_bytenr != rec->start) {
+			if (dback->disk_bytenr != rec->cache.start) {
 				err = 1;
 				if (!print_errs)
 					goto out;
 				fprintf(stderr, "Backref disk bytenr does not"
 					" match extent record, bytenr=%llu, "
 					"ref bytenr=%llu\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					(unsigned long long)dback->disk_bytenr);
 			}
 
@@ -2670,7 +2876,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				fprintf(stderr, "Backref bytes do not match "
 					"extent backref, bytenr=%llu, ref "
 					"bytes=%llu, backref bytes=%llu\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					(unsigned long long)rec->nr,
 					(unsigned long long)dback->bytes);
 			}
@@ -2688,7 +2894,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 			goto out;
 		fprintf(stderr, "Incorrect global backref count "
 			"on %llu found %llu wanted %llu\n",
-			(unsigned long long)rec->start,
+			(unsigned long long)rec->cache.start,
 			(unsigned long long)found,
 			(unsigned long long)rec->refs);
 	}
@@ -2704,7 +2910,7 @@ static int free_all_extent_backrefs(struct extent_record *rec)
 		cur = rec->backrefs.next;
 		back = list_entry(cur, struct extent_backref, list);
 		list_del(cur);
-		free(back);
+		free_extent_backref(back);
 	}
 	return 0;
 }
@@ -2720,10 +2926,10 @@ static void free_extent_record_cache(struct btrfs_fs_info *fs_info,
 		if (!cache)
 			break;
 		rec = container_of(cache, struct extent_record, cache);
-		btrfs_unpin_extent(fs_info, rec->start, rec->max_size);
+		btrfs_unpin_extent(fs_info, rec->cache.start, rec->max_size);
 		remove_cache_extent(extent_cache, cache);
 		free_all_extent_backrefs(rec);
-		free(rec);
+		free_extent_rec(rec);
 	}
 }
 
@@ -2735,8 +2941,7 @@ static int maybe_free_extent_rec(struct cache_tree *extent_cache,
 	    rec->num_duplicates == 0 && !all_backpointers_checked(rec, 0)) {
 		remove_cache_extent(extent_cache, &rec->cache);
 		free_all_extent_backrefs(rec);
-		list_del_init(&rec->list);
-		free(rec);
+		free_extent_rec(rec);
 	}
 	return 0;
 }
@@ -2836,7 +3041,10 @@ static int record_bad_block_io(struct btrfs_fs_info *info,
 	if (!is_extent_tree_record(rec))
 		return 0;
 
-	btrfs_disk_key_to_cpu(&key, &rec->parent_key);
+	if (rec->extra)
+		btrfs_disk_key_to_cpu(&key, &rec->extra->parent_key);
+	else
+		memset(&key, 0, sizeof(key));
 	return btrfs_add_corrupt_extent_record(info, &key, start, len, 0);
 }
 
@@ -3119,6 +3327,7 @@ static int check_block(struct btrfs_trans_handle *trans,
 		       struct extent_buffer *buf, u64 flags)
 {
 	struct extent_record *rec;
+	struct extent_record_extra *extra;
 	struct cache_extent *cache;
 	struct btrfs_key key;
 	enum btrfs_tree_block_status status;
@@ -3129,7 +3338,10 @@ static int check_block(struct btrfs_trans_handle *trans,
 	if (!cache)
 		return 1;
 	rec = container_of(cache, struct extent_record, cache);
-	rec->generation = btrfs_header_generation(buf);
+	extra = extent_rec_extra(rec);
+	if (!extra)
+		return -ENOMEM;
+	extra->generation = btrfs_header_generation(buf);
 
 	level = btrfs_header_level(buf);
 	if (btrfs_header_nritems(buf) > 0) {
@@ -3139,14 +3351,14 @@ static int check_block(struct btrfs_trans_handle *trans,
 		else
 			btrfs_node_key_to_cpu(buf, &key, 0);
 
-		rec->info_objectid = key.objectid;
+		extra->info_objectid = key.objectid;
 	}
 	rec->info_level = level;
 
 	if (btrfs_is_leaf(buf))
-		status = btrfs_check_leaf(root, &rec->parent_key, buf);
+		status = btrfs_check_leaf(root, &extra->parent_key, buf);
 	else
-		status = btrfs_check_node(root, &rec->parent_key, buf);
+		status = btrfs_check_node(root, &extra->parent_key, buf);
 
 	if (status != BTRFS_TREE_BLOCK_CLEAN) {
 		if (repair)
@@ -3209,7 +3421,7 @@ static struct tree_backref *find_tree_backref(struct extent_record *rec,
 static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
-	struct tree_backref *ref = malloc(sizeof(*ref));
+	struct tree_backref *ref = rec_pool_alloc(&tree_backref_pool);
 	memset(&ref->node, 0, sizeof(ref->node));
 	if (parent > 0) {
 		ref->parent = parent;
@@ -3265,7 +3477,7 @@ static struct data_backref *alloc_data_backref(struct extent_record *rec,
 						u64 owner, u64 offset,
 						u64 max_size)
 {
-	struct data_backref *ref = malloc(sizeof(*ref));
+	struct data_backref *ref = rec_pool_alloc(&data_backref_pool);
 	memset(&ref->node, 0, sizeof(ref->node));
 	ref->node.is_data = 1;
 
@@ -3296,6 +3508,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 			  int metadata, int extent_rec, u64 max_size)
 {
 	struct extent_record *rec;
+	struct extent_record_extra *extra;
 	struct cache_extent *cache;
 	int ret = 0;
 	int dup = 0;
@@ -3314,12 +3527,15 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 		 * the backrefs.
 		 */
 		if (extent_rec) {
-			if (start != rec->start || rec->found_rec) {
+			if (start != rec->cache.start || rec->found_rec) {
 				struct extent_record *tmp;
 
 				dup = 1;
-				if (list_empty(&rec->list))
-					list_add_tail(&rec->list,
+				extra = extent_rec_extra(rec);
+				if (!extra)
+					return -ENOMEM;
+				if (list_empty(&extra->list))
+					list_add_tail(&extra->list,
 						      &duplicate_extents);
 
 				/*
@@ -3328,17 +3544,21 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 				 * our current extent record but does not have
 				 * the same objectid.
 				 */
-				tmp = malloc(sizeof(*tmp));
+				tmp = rec_pool_alloc(&extent_record_pool);
 				if (!tmp)
 					return -ENOMEM;
-				tmp->start = start;
+				memset(tmp, 0, sizeof(*tmp));
+				if (!extent_rec_extra(tmp)) {
+					free_extent_rec(tmp);
+					return -ENOMEM;
+				}
+				tmp->cache.start = start;
 				tmp->max_size = max_size;
 				tmp->nr = nr;
 				tmp->found_rec = 1;
 				tmp->metadata = metadata;
 				tmp->extent_item_refs = extent_item_refs;
-				INIT_LIST_HEAD(&tmp->list);
-				list_add_tail(&tmp->list, &rec->dups);
+				list_add_tail(&tmp->extra->list, &extra->dups);
 				rec->num_duplicates++;
 			} else {
 				rec->nr = nr;
@@ -3364,10 +3584,16 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 			rec->owner_ref_checked = 1;
 		}
 
-		if (parent_key)
-			btrfs_cpu_key_to_disk(&rec->parent_key, parent_key);
-		if (parent_gen)
-			rec->parent_generation = parent_gen;
+		if (parent_key || parent_gen) {
+			extra = extent_rec_extra(rec);
+			if (!extra)
+				return -ENOMEM;
+			if (parent_key)
+				btrfs_cpu_key_to_disk(&extra->parent_key,
+						      parent_key);
+			if (parent_gen)
+				extra->parent_generation = parent_gen;
+		}
 
 		if (rec->max_size < max_size)
 			rec->max_size = max_size;
@@ -3375,8 +3601,10 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 		maybe_free_extent_rec(extent_cache, rec);
 		return ret;
 	}
-	rec = malloc(sizeof(*rec));
-	rec->start = start;
+	rec = rec_pool_alloc(&extent_record_pool);
+	if (!rec)
+		return -ENOMEM;
+	rec->extra = NULL;
 	rec->max_size = max_size;
 	rec->nr = max(nr, max_size);
 	rec->found_rec = !!extent_rec;
@@ -3384,9 +3612,8 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 	rec->owner_ref_checked = 0;
 	rec->num_duplicates = 0;
 	rec->metadata = metadata;
+	rec->info_level = 0;
 	INIT_LIST_HEAD(&rec->backrefs);
-	INIT_LIST_HEAD(&rec->dups);
-	INIT_LIST_HEAD(&rec->list);
 
 	if (is_root)
 		rec->is_root = 1;
@@ -3403,15 +3630,16 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 	else
 		rec->extent_item_refs = 0;
 
-	if (parent_key)
-		btrfs_cpu_key_to_disk(&rec->parent_key, parent_key);
-	else
-		memset(&rec->parent_key, 0, sizeof(*parent_key));
-
-	if (parent_gen)
-		rec->parent_generation = parent_gen;
-	else
-		rec->parent_generation = 0;
+	if (parent_key || parent_gen) {
+		extra = extent_rec_extra(rec);
+		if (!extra) {
+			free_extent_rec(rec);
+			return -ENOMEM;
+		}
+		if (parent_key)
+			btrfs_cpu_key_to_disk(&extra->parent_key, parent_key);
+		extra->parent_generation = parent_gen;
+	}
 
 	rec->cache.start = start;
 	rec->cache.size = nr;
@@ -3442,7 +3670,7 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 	}
 
 	rec = container_of(cache, struct extent_record, cache);
-	if (rec->start != bytenr) {
+	if (rec->cache.start != bytenr) {
 		abort();
 	}
 
@@ -4269,9 +4497,10 @@ static int read_extent_data(struct btrfs_root *root, char *data,
 	struct btrfs_device *device;
 	int ret = 0;
 	u64 max_len = *len;
+	u64 type;
 
-	ret = btrfs_map_block(&info->mapping_tree, READ, logical, len,
-			      &multi, mirror, NULL);
+	ret = __btrfs_map_block(&info->mapping_tree, READ, logical, len,
+				&type, &multi, mirror, NULL);
 	if (ret) {
 		fprintf(stderr, "Couldn't map the block %llu\n",
 				logical + offset);
@@ -4279,10 +4508,18 @@ static int read_extent_data(struct btrfs_root *root, char *data,
 	}
 	device = multi->stripes[0].dev;
 
-	if (device->fd == 0)
-		goto err;
 	if (*len > max_len)
 		*len = max_len;
+	if ((type & (BTRFS_BLOCK_GROUP_RAID5 | BTRFS_BLOCK_GROUP_RAID6)) &&
+	    (mirror > 1 || device->fd <= 0)) {
+		ret = read_raid56_with_parity(info, logical, *len, data,
+					      mirror);
+		goto err;
+	}
+	if (device->fd <= 0) {
+		ret = -EIO;
+		goto err;
+	}
 
 	ret = pread64(device->fd, data, *len, multi->stripes[0].physical);
 	if (ret != *len)
@@ -4300,23 +4537,34 @@ static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
 
 	u64 offset = 0;
 	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	u32 sectorsize = root->sectorsize;
 	char *data;
-	unsigned long csum_offset;
+	char *expected = NULL;
+	unsigned long *mismatch = NULL;
 	u32 csum;
 	u32 csum_expected;
 	u64 read_len;
-	u64 data_checked = 0;
 	u64 tmp;
+	int nr_sectors;
+	int nr;
+	int i;
 	int ret = 0;
 	int mirror;
 	int num_copies;
 
-	if (num_bytes % root->sectorsize)
+	if (num_bytes % sectorsize)
 		return -EINVAL;
 
+	nr_sectors = num_bytes / sectorsize;
 	data = malloc(num_bytes);
-	if (!data)
-		return -ENOMEM;
+	expected = malloc(nr_sectors * csum_size);
+	mismatch = malloc(DIV_ROUND_UP(nr_sectors, BITS_PER_LONG) *
+			  sizeof(long));
+	if (!data || !expected || !mismatch) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	read_extent_buffer(eb, expected, leaf_offset, nr_sectors * csum_size);
 
 	while (offset < num_bytes) {
 		mirror = 0;
@@ -4327,38 +4575,42 @@ again:
 				bytenr + offset, &read_len, mirror);
 		if (ret)
 			goto out;
-		data_checked = 0;
-		/* verify every 4k data's checksum */
-		while (data_checked < read_len) {
-			csum = ~(u32)0;
-			tmp = offset + data_checked;
-
-			csum = btrfs_csum_data(NULL, (char *)data + tmp,
-					       csum, root->sectorsize);
-			btrfs_csum_final(csum, (char *)&csum);
 
-			csum_offset = leaf_offset +
-				 tmp / root->sectorsize * csum_size;
-			read_extent_buffer(eb, (char *)&csum_expected,
-					   csum_offset, csum_size);
+		/* verify all the sectors we just read in one go */
+		nr = read_len / sectorsize;
+		if (!btrfs_csum_verify_batch(data + offset, sectorsize, nr,
+				expected + offset / sectorsize * csum_size,
+				csum_size, mismatch)) {
+			offset += read_len;
+			continue;
+		}
+		for (i = 0; i < nr; i++) {
+			if (!test_bit(i, mismatch))
+				continue;
+			tmp = offset + (u64)i * sectorsize;
+			csum = btrfs_csum_data(NULL, data + tmp, ~(u32)0,
+					       sectorsize);
+			btrfs_csum_final(csum, (char *)&csum);
+			memcpy(&csum_expected,
+			       expected + tmp / sectorsize * csum_size,
+			       csum_size);
+			fprintf(stderr, "mirror %d bytenr %llu csum %u expected csum %u\n",
+					mirror, bytenr + tmp,
+					csum, csum_expected);
 			/* try another mirror */
-			if (csum != csum_expected) {
-				fprintf(stderr, "mirror %d bytenr %llu csum %u expected csum %u\n",
-						mirror, bytenr + tmp,
-						csum, csum_expected);
-				num_copies = btrfs_num_copies(
-						&root->fs_info->mapping_tree,
-						bytenr, num_bytes);
-				if (mirror < num_copies - 1) {
-					mirror += 1;
-					goto again;
-				}
+			num_copies = btrfs_num_copies(
+					&root->fs_info->mapping_tree,
+					bytenr, num_bytes);
+			if (mirror < num_copies - 1) {
+				mirror += 1;
+				goto again;
 			}
-			data_checked += root->sectorsize;
 		}
 		offset += read_len;
 	}
 out:
+	free(mismatch);
+	free(expected);
 	free(data);
 	return ret;
 }
@@ -4681,7 +4933,8 @@ static int run_next_block(struct btrfs_trans_handle *trans,
 		struct extent_record *rec;
 
 		rec = container_of(cache, struct extent_record, cache);
-		gen = rec->parent_generation;
+		if (rec->extra)
+			gen = rec->extra->parent_generation;
 	}
 
 	/* fixme, get the real parent transid */
@@ -4964,7 +5217,7 @@ static int free_extent_hook(struct btrfs_trans_handle *trans,
 
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			list_del(&back->node.list);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	} else {
 		struct tree_backref *back;
@@ -4983,7 +5236,7 @@ static int free_extent_hook(struct btrfs_trans_handle *trans,
 		}
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			list_del(&back->node.list);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	}
 	maybe_free_extent_rec(extent_cache, rec);
@@ -5101,7 +5354,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 		if (!back->is_data)
 			item_size += sizeof(*bi);
 
-		ins_key.objectid = rec->start;
+		ins_key.objectid = rec->cache.start;
 		ins_key.offset = rec->max_size;
 		ins_key.type = BTRFS_EXTENT_ITEM_KEY;
 
@@ -5115,7 +5368,8 @@ static int record_extent(struct btrfs_trans_handle *trans,
 				    struct btrfs_extent_item);
 
 		btrfs_set_extent_refs(leaf, ei, 0);
-		btrfs_set_extent_generation(leaf, ei, rec->generation);
+		btrfs_set_extent_generation(leaf, ei, rec->extra ?
+					    rec->extra->generation : 0);
 
 		if (back->is_data) {
 			btrfs_set_extent_flags(leaf, ei,
@@ -5128,8 +5382,8 @@ static int record_extent(struct btrfs_trans_handle *trans,
 			memset_extent_buffer(leaf, 0, (unsigned long)bi,
 					     sizeof(*bi));
 
-			btrfs_set_disk_key_objectid(&copy_key,
-						    rec->info_objectid);
+			btrfs_set_disk_key_objectid(&copy_key, rec->extra ?
+						    rec->extra->info_objectid : 0);
 			btrfs_set_disk_key_type(&copy_key, 0);
 			btrfs_set_disk_key_offset(&copy_key, 0);
 
@@ -5141,7 +5395,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 		}
 
 		btrfs_mark_buffer_dirty(leaf);
-		ret = btrfs_update_block_group(trans, extent_root, rec->start,
+		ret = btrfs_update_block_group(trans, extent_root, rec->cache.start,
 					       rec->max_size, 1, 0);
 		if (ret)
 			goto fail;
@@ -5165,7 +5419,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 			 * backref
 			 */
 			ret = btrfs_inc_extent_ref(trans, info->extent_root,
-						   rec->start, rec->max_size,
+						   rec->cache.start, rec->max_size,
 						   parent,
 						   dback->root,
 						   parent ?
@@ -5178,7 +5432,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 		fprintf(stderr, "adding new data backref"
 				" on %llu %s %llu owner %llu"
 				" offset %llu found %d\n",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				back->full_backref ?
 				"parent" : "root",
 				back->full_backref ?
@@ -5197,11 +5451,11 @@ static int record_extent(struct btrfs_trans_handle *trans,
 			parent = 0;
 
 		ret = btrfs_inc_extent_ref(trans, info->extent_root,
-					   rec->start, rec->max_size,
+					   rec->cache.start, rec->max_size,
 					   parent, tback->root, 0, 0);
 		fprintf(stderr, "adding new tree backref on "
 			"start %llu len %llu parent %llu root %llu\n",
-			rec->start, rec->max_size, tback->parent, tback->root);
+			rec->cache.start, rec->max_size, tback->parent, tback->root);
 	}
 	if (ret)
 		goto fail;
@@ -5482,7 +5736,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 		 * If we only have on entry we may think the entries agree when
 		 * in reality they don't so we have to do some extra checking.
 		 */
-		if (dback->disk_bytenr != rec->start ||
+		if (dback->disk_bytenr != rec->cache.start ||
 		    dback->bytes != rec->nr || back->broken)
 			mismatch = 1;
 
@@ -5499,7 +5753,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 		goto out;
 
 	fprintf(stderr, "attempting to repair backref discrepency for bytenr "
-		"%Lu\n", rec->start);
+		"%Lu\n", rec->cache.start);
 
 	/*
 	 * First we want to see if the backrefs can agree amongst themselves who
@@ -5513,12 +5767,12 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 	 * this is where we use the extent ref to see what it thinks.
 	 */
 	if (!best) {
-		entry = find_entry(&entries, rec->start, rec->nr);
+		entry = find_entry(&entries, rec->cache.start, rec->nr);
 		if (!entry && (!broken_entries || !rec->found_rec)) {
 			fprintf(stderr, "Backrefs don't agree with each other "
 				"and extent record doesn't agree with anybody,"
 				" so we can't fix bytenr %Lu bytes %Lu\n",
-				rec->start, rec->nr);
+				rec->cache.start, rec->nr);
 			ret = -EINVAL;
 			goto out;
 		} else if (!entry) {
@@ -5532,7 +5786,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 				goto out;
 			}
 			memset(entry, 0, sizeof(*entry));
-			entry->bytenr = rec->start;
+			entry->bytenr = rec->cache.start;
 			entry->bytes = rec->nr;
 			list_add_tail(&entry->list, &entries);
 			nr_entries++;
@@ -5543,7 +5797,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 			fprintf(stderr, "Backrefs and extent record evenly "
 				"split on who is right, this is going to "
 				"require user input to fix bytenr %Lu bytes "
-				"%Lu\n", rec->start, rec->nr);
+				"%Lu\n", rec->cache.start, rec->nr);
 			ret = -EINVAL;
 			goto out;
 		}
@@ -5554,12 +5808,12 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 	 * this case higher up, but in case somebody removes that we still can't
 	 * deal with it properly here yet, so just bail out of that's the case.
 	 */
-	if (best->bytenr != rec->start) {
+	if (best->bytenr != rec->cache.start) {
 		fprintf(stderr, "Extent start and backref starts don't match, "
 			"please use btrfs-image on this file system and send "
 			"it to a btrfs developer so they can make fsck fix "
 			"this particular case.  bytenr is %Lu, bytes is %Lu\n",
-			rec->start, rec->nr);
+			rec->cache.start, rec->nr);
 		ret = -EINVAL;
 		goto out;
 	}
@@ -5612,6 +5866,7 @@ static int process_duplicates(struct btrfs_root *root,
 			      struct extent_record *rec)
 {
 	struct extent_record *good, *tmp;
+	struct extent_record_extra *extra;
 	struct cache_extent *cache;
 	int ret;
 
@@ -5636,11 +5891,12 @@ static int process_duplicates(struct btrfs_root *root,
 	 */
 	remove_cache_extent(extent_cache, &rec->cache);
 
-	good = list_entry(rec->dups.next, struct extent_record, list);
-	list_del_init(&good->list);
+	extra = list_entry(rec->extra->dups.next, struct extent_record_extra,
+			   list);
+	good = extra->rec;
+	list_del_init(&extra->list);
 	INIT_LIST_HEAD(&good->backrefs);
-	INIT_LIST_HEAD(&good->dups);
-	good->cache.start = good->start;
+	INIT_LIST_HEAD(&extra->dups);
 	good->cache.size = good->nr;
 	good->content_checked = 0;
 	good->owner_ref_checked = 0;
@@ -5648,7 +5904,7 @@ static int process_duplicates(struct btrfs_root *root,
 	good->refs = rec->refs;
 	list_splice_init(&rec->backrefs, &good->backrefs);
 	while (1) {
-		cache = lookup_cache_extent(extent_cache, good->start,
+		cache = lookup_cache_extent(extent_cache, good->cache.start,
 					    good->nr);
 		if (!cache)
 			break;
@@ -5660,13 +5916,15 @@ static int process_duplicates(struct btrfs_root *root,
 		 * something.
 		 */
 		if (tmp->found_rec || tmp->num_duplicates > 0) {
-			if (list_empty(&good->list))
-				list_add_tail(&good->list,
+			if (!extent_rec_extra(tmp))
+				return -ENOMEM;
+			if (list_empty(&good->extra->list))
+				list_add_tail(&good->extra->list,
 					      &duplicate_extents);
 			good->num_duplicates += tmp->num_duplicates + 1;
-			list_splice_init(&tmp->dups, &good->dups);
-			list_del_init(&tmp->list);
-			list_add_tail(&tmp->list, &good->dups);
+			list_splice_init(&tmp->extra->dups, &good->extra->dups);
+			list_del_init(&tmp->extra->list);
+			list_add_tail(&tmp->extra->list, &good->extra->dups);
 			remove_cache_extent(extent_cache, &tmp->cache);
 			continue;
 		}
@@ -5678,11 +5936,11 @@ static int process_duplicates(struct btrfs_root *root,
 		good->refs += tmp->refs;
 		list_splice_init(&tmp->backrefs, &good->backrefs);
 		remove_cache_extent(extent_cache, &tmp->cache);
-		free(tmp);
+		free_extent_rec(tmp);
 	}
 	ret = insert_cache_extent(extent_cache, &good->cache);
 	BUG_ON(ret);
-	free(rec);
+	free_extent_rec(rec);
 	return good->num_duplicates ? 0 : 1;
 }
 
@@ -5692,7 +5950,8 @@ static int delete_duplicate_records(struct btrfs_trans_handle *trans,
 {
 	LIST_HEAD(delete_list);
 	struct btrfs_path *path;
-	struct extent_record *tmp, *good, *n;
+	struct extent_record *tmp, *good;
+	struct extent_record_extra *extra, *n;
 	int nr_del = 0;
 	int ret = 0;
 	struct btrfs_key key;
@@ -5705,37 +5964,40 @@ static int delete_duplicate_records(struct btrfs_trans_handle *trans,
 
 	good = rec;
 	/* Find the record that covers all of the duplicates. */
-	list_for_each_entry(tmp, &rec->dups, list) {
-		if (good->start < tmp->start)
+	list_for_each_entry(extra, &rec->extra->dups, list) {
+		tmp = extra->rec;
+		if (good->cache.start < tmp->cache.start)
 			continue;
 		if (good->nr > tmp->nr)
 			continue;
 
-		if (tmp->start + tmp->nr < good->start + good->nr) {
+		if (tmp->cache.start + tmp->nr < good->cache.start + good->nr) {
 			fprintf(stderr, "Ok we have overlapping extents that "
 				"aren't completely covered by eachother, this "
 				"is going to require more careful thought.  "
 				"The extents are [%Lu-%Lu] and [%Lu-%Lu]\n",
-				tmp->start, tmp->nr, good->start, good->nr);
+				tmp->cache.start, tmp->nr, good->cache.start,
+				good->nr);
 			abort();
 		}
 		good = tmp;
 	}
 
 	if (good != rec)
-		list_add_tail(&rec->list, &delete_list);
+		list_add_tail(&rec->extra->list, &delete_list);
 
-	list_for_each_entry_safe(tmp, n, &rec->dups, list) {
-		if (tmp == good)
+	list_for_each_entry_safe(extra, n, &rec->extra->dups, list) {
+		if (extra->rec == good)
 			continue;
-		list_move_tail(&tmp->list, &delete_list);
+		list_move_tail(&extra->list, &delete_list);
 	}
 
 	root = root->fs_info->extent_root;
-	list_for_each_entry(tmp, &delete_list, list) {
+	list_for_each_entry(extra, &delete_list, list) {
+		tmp = extra->rec;
 		if (tmp->found_rec == 0)
 			continue;
-		key.objectid = tmp->start;
+		key.objectid = tmp->cache.start;
 		key.type = BTRFS_EXTENT_ITEM_KEY;
 		key.offset = tmp->nr;
 
@@ -5743,7 +6005,7 @@ static int delete_duplicate_records(struct btrfs_trans_handle *trans,
 		if (tmp->metadata) {
 			fprintf(stderr, "Well this shouldn't happen, extent "
 				"record overlaps but is metadata? "
-				"[%Lu, %Lu]\n", tmp->start, tmp->nr);
+				"[%Lu, %Lu]\n", tmp->cache.start, tmp->nr);
 			abort();
 		}
 
@@ -5762,17 +6024,19 @@ static int delete_duplicate_records(struct btrfs_trans_handle *trans,
 
 out:
 	while (!list_empty(&delete_list)) {
-		tmp = list_entry(delete_list.next, struct extent_record, list);
-		list_del_init(&tmp->list);
-		if (tmp == rec)
+		extra = list_entry(delete_list.next, struct extent_record_extra,
+				   list);
+		list_del_init(&extra->list);
+		if (extra->rec == rec)
 			continue;
-		free(tmp);
+		free_extent_rec(extra->rec);
 	}
 
-	while (!list_empty(&rec->dups)) {
-		tmp = list_entry(rec->dups.next, struct extent_record, list);
-		list_del_init(&tmp->list);
-		free(tmp);
+	while (!list_empty(&rec->extra->dups)) {
+		extra = list_entry(rec->extra->dups.next,
+				   struct extent_record_extra, list);
+		list_del_init(&extra->list);
+		free_extent_rec(extra->rec);
 	}
 
 	btrfs_free_path(path);
@@ -5896,7 +6160,7 @@ static int fixup_extent_refs(struct btrfs_trans_handle *trans,
 	 */
 	if (!init_extent_tree) {
 		ret = btrfs_lookup_extent_info(NULL, info->extent_root,
-					rec->start, rec->max_size,
+					rec->cache.start, rec->max_size,
 					rec->metadata, NULL, &flags);
 		if (ret < 0)
 			flags = 0;
@@ -5929,14 +6193,14 @@ static int fixup_extent_refs(struct btrfs_trans_handle *trans,
 
 	/* step two, delete all the existing records */
 	ret = delete_extent_records(trans, info->extent_root, path,
-				    rec->start, rec->max_size);
+				    rec->cache.start, rec->max_size);
 
 	if (ret < 0)
 		goto out;
 
 	/* was this block corrupt?  If so, don't add references to it */
 	cache = lookup_cache_extent(info->corrupt_blocks,
-				    rec->start, rec->max_size);
+				    rec->cache.start, rec->max_size);
 	if (cache) {
 		ret = 0;
 		goto out;
@@ -6109,7 +6373,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		while(cache) {
 			rec = container_of(cache, struct extent_record, cache);
 			btrfs_pin_extent(root->fs_info,
-					 rec->start, rec->max_size);
+					 rec->cache.start, rec->max_size);
 			cache = next_cache_extent(cache);
 		}
 
@@ -6130,9 +6394,9 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 	 * belong to a different extent item and not the weird duplicate one.
 	 */
 	while (repair && !list_empty(&duplicate_extents)) {
-		rec = list_entry(duplicate_extents.next, struct extent_record,
-				 list);
-		list_del_init(&rec->list);
+		rec = list_entry(duplicate_extents.next,
+				 struct extent_record_extra, list)->rec;
+		list_del_init(&rec->extra->list);
 
 		/* Sometimes we can find a backref before we find an actual
 		 * extent, so we need to process it a little bit to see if there
@@ -6141,7 +6405,10 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		 * process_duplicates() will return 0, otherwise it will return
 		 * 1 and we
 		 */
-		if (process_duplicates(root, extent_cache, rec))
+		ret = process_duplicates(root, extent_cache, rec);
+		if (ret < 0)
+			return ret;
+		if (ret)
 			continue;
 		ret = delete_duplicate_records(trans, root, rec);
 		if (ret < 0)
@@ -6166,13 +6433,13 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		rec = container_of(cache, struct extent_record, cache);
 		if (rec->num_duplicates) {
 			fprintf(stderr, "extent item %llu has multiple extent "
-				"items\n", (unsigned long long)rec->start);
+				"items\n", (unsigned long long)rec->cache.start);
 			err = 1;
 		}
 
 		if (rec->refs != rec->extent_item_refs) {
 			fprintf(stderr, "ref mismatch on [%llu %llu] ",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				(unsigned long long)rec->nr);
 			fprintf(stderr, "extent item %llu, found %llu\n",
 				(unsigned long long)rec->extent_item_refs,
@@ -6189,7 +6456,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		}
 		if (all_backpointers_checked(rec, 1)) {
 			fprintf(stderr, "backpointer mismatch on [%llu %llu]\n",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				(unsigned long long)rec->nr);
 
 			if (!fixed && repair) {
@@ -6204,7 +6471,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		}
 		if (!rec->owner_ref_checked) {
 			fprintf(stderr, "owner ref check failed [%llu %llu]\n",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				(unsigned long long)rec->nr);
 			if (!fixed && repair) {
 				ret = fixup_extent_refs(trans, root->fs_info,
@@ -6218,7 +6485,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 
 		remove_cache_extent(extent_cache, cache);
 		free_all_extent_backrefs(rec);
-		free(rec);
+		free_extent_rec(rec);
 	}
 repair_abort:
 	if (repair) {
@@ -6701,6 +6968,7 @@ out:
 	free_extent_cache_tree(&pending);
 	free_extent_cache_tree(&reada);
 	free_extent_cache_tree(&nodes);
+	release_extent_record_pools();
 	return ret;
 }
 
@@ -7670,6 +7938,9 @@ static struct option long_options[] = {
 	{ "backup", 0, NULL, 0 },
 	{ "subvol-extents", 1, NULL, 'E' },
 	{ "qgroup-report", 0, NULL, 'Q' },
+	{ "cache-size", 1, NULL, 'C' },
+	{ "threads", 1, NULL, 'T' },
+	{ "verbose", 0, NULL, 'v' },
 	{ NULL, 0, NULL, 0}
 };
 
@@ -7685,6 +7956,11 @@ const char * const cmd_check_usage[] = {
 	"--check-data-csum           verify checkums of data blocks",
 	"--qgroup-report             print a report on qgroup consistency",
 	"--subvol-extents <subvolid> print subvolume extents and sharing state",
+	"--cache-size <size>         limit the tree block cache to <size> bytes",
+	"                            (default: 1/4 of RAM or $BTRFS_CACHE_SIZE)",
+	"--threads <num>             number of threads reading tree blocks",
+	"                            (default: number of online CPUs, at most 256)",
+	"--verbose                   print memory used by the check records",
 	NULL
 };
 
@@ -7701,7 +7977,12 @@ int cmd_check(int argc, char **argv)
 	int option_index = 0;
 	int init_csum_tree = 0;
 	int qgroup_report = 0;
-	enum btrfs_open_ctree_flags ctree_flags = OPEN_CTREE_EXCLUSIVE;
+	u64 cache_size = 0;
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	enum btrfs_open_ctree_flags ctree_flags = OPEN_CTREE_EXCLUSIVE |
+						  OPEN_CTREE_READ_POOL;
+
+	num_threads = min(max(num_threads, 1), BTRFS_READ_POOL_MAX_THREADS);
 
 	while(1) {
 		int c;
@@ -7732,6 +8013,23 @@ int cmd_check(int argc, char **argv)
 			case 'E':
 				subvolid = arg_strtou64(optarg);
 				break;
+			case 'C':
+				cache_size = parse_cache_size(optarg,
+							      "cache size");
+				break;
+			case 'T':
+				num = arg_strtou64(optarg);
+				if (num < 1 || num > BTRFS_READ_POOL_MAX_THREADS) {
+					fprintf(stderr,
+		"ERROR: number of threads must be between 1 and %d\n",
+						BTRFS_READ_POOL_MAX_THREADS);
+					exit(1);
+				}
+				num_threads = num;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
 			case '?':
 			case 'h':
 				usage(cmd_check_usage);
@@ -7781,6 +8079,9 @@ int cmd_check(int argc, char **argv)
 		ret = -EIO;
 		goto err_out;
 	}
+	if (cache_size)
+		extent_io_tree_init_cache_max(&info->extent_cache, cache_size);
+	btrfs_set_read_pool_threads(info, num_threads);
 
 	root = info->fs_root;
 
@@ -7986,6 +8287,7 @@ out:
 	printf("file data blocks allocated: %llu\n referenced %llu\n",
 		(unsigned long long)data_bytes_allocated,
 		(unsigned long long)data_bytes_referenced);
+	extent_io_tree_print_cache_stats(&info->extent_cache);
 	printf("%s\n", BTRFS_BUILD_VERSION);
 
 	free_root_recs_tree(&root_cache);
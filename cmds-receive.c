@@ -33,6 +33,8 @@
 #include <wait.h>
 #include <assert.h>
 #include <getopt.h>
+#include <signal.h>
+#include <libgen.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -40,6 +42,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/resource.h>
 #include <uuid/uuid.h>
 
 #include "ctree.h"
@@ -52,16 +55,116 @@
 #include "send.h"
 #include "send-stream.h"
 #include "send-utils.h"
+#include "crc32c.h"
 
 static int g_verbose = 0;
 
+/* how many files and directories commands were applied to are kept open */
+#define RECEIVE_FD_CACHE	64
+/* descriptors left for stdio, the stream and the libraries */
+#define RECEIVE_RESERVED_FDS	64
+/* writes get gathered up to this size */
+#define RECEIVE_WRITE_SIZE	(1024 * 1024)
+/* threads applying commands and how far the stream is read ahead of them */
+#define RECEIVE_THREADS		4
+#define RECEIVE_MAX_THREADS	256
+#define RECEIVE_MAX_QUEUED	1024
+
+/*
+ * A file or directory commands get applied to.  With threads, commands
+ * that only change the contents or attributes of one inode are queued on
+ * it and applied in order by whichever thread took it, while those for
+ * other inodes run concurrently.  Everything else waits for the queued
+ * commands of the paths it touches and is applied right away.  Files are
+ * looked up by path, so a file with several links only gets commands
+ * queued under one of them at a time.
+ */
+struct receive_fd {
+	struct list_head list;
+	/* in the ready list while it has commands but no thread */
+	struct list_head ready;
+	struct list_head cmds;
+	int busy;
+	int fd;
+	char *path;
+	/* inode number while commands are queued, if it has other links */
+	u64 ino;
+
+	/* writes not written out yet */
+	char *write_buf;
+	u64 write_offset;
+	u64 write_len;
+};
+
+struct receive_cmd {
+	struct list_head list;
+	int cmd;
+	char *path;
+	/* xattr name or full path of the clone source */
+	char *name;
+	void *data;
+	int data_len;
+	u64 offset;
+	u64 len;
+	u64 clone_offset;
+	u64 mode;
+	u64 uid;
+	u64 gid;
+	struct timespec at;
+	struct timespec mt;
+	struct timespec ct;
+};
+
+/* a frame end in a --resume-file receive */
+struct receive_checkpoint {
+	struct list_head list;
+	u64 offset;
+	u64 cmds;
+	u32 crc;
+};
+
 struct btrfs_receive
 {
 	int mnt_fd;
 	int dest_dir_fd;
 
-	int write_fd;
-	char *write_path;
+	/* open files, most recently used first */
+	struct list_head fd_cache;
+	int nr_fds;
+	int max_fds;
+
+	/* without threads, the only file with gathered up writes */
+	struct receive_fd *write_file;
+
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	struct list_head ready;
+	int nr_queued;
+	int stop;
+	/* last error of a queued command, not reported yet */
+	int error;
+
+	/* --resume-file */
+	char *resume_file;
+	pthread_t deframe_thread;
+	int deframing;
+	int frame_in_fd;
+	int frame_out_fd;
+	char *frame_buf;
+	/* 1 once the last frame was passed on, < 0 on errors */
+	int frame_status;
+	struct btrfs_framed_header framed_hdr;
+	/* frame ends not reached by the commands applied yet */
+	struct list_head marks;
+	struct receive_checkpoint last_mark;
+	struct receive_checkpoint saved;
+	/* the resume file says commands past r->saved are being applied */
+	int applying;
+	u64 nr_cmds;
+	int cmd_failed;
 
 	char *root_path;
 	char *dest_dir_path; /* relative to root_path */
@@ -74,6 +177,527 @@ struct btrfs_receive
 	int honor_end_cmd;
 };
 
+static int write_data(struct receive_fd *file, const char *data, u64 offset,
+		      u64 len)
+{
+	u64 pos = 0;
+	ssize_t w;
+	int ret;
+
+	while (pos < len) {
+		w = pwrite(file->fd, data + pos, len - pos, offset + pos);
+		if (w < 0) {
+			ret = -errno;
+			fprintf(stderr, "ERROR: writing to %s failed. %s\n",
+					file->path, strerror(-ret));
+			return ret;
+		}
+		pos += w;
+	}
+	return 0;
+}
+
+/* write out the gathered up writes of @file, if any */
+static int flush_write(struct btrfs_receive *r, struct receive_fd *file)
+{
+	int ret = 0;
+
+	if (!file)
+		return 0;
+	if (file->write_len)
+		ret = write_data(file, file->write_buf, file->write_offset,
+				 file->write_len);
+	free(file->write_buf);
+	file->write_buf = NULL;
+	file->write_len = 0;
+	if (r->write_file == file)
+		r->write_file = NULL;
+	return ret;
+}
+
+static struct receive_fd *find_cached_fd(struct btrfs_receive *r,
+					 const char *path)
+{
+	struct receive_fd *file;
+
+	list_for_each_entry(file, &r->fd_cache, list) {
+		if (!strcmp(file->path, path))
+			return file;
+	}
+	return NULL;
+}
+
+static int fd_idle(struct receive_fd *file)
+{
+	return !file->busy && list_empty(&file->cmds);
+}
+
+/* called with r->mutex held, only for files without queued commands */
+static int drop_cached_fd(struct btrfs_receive *r, struct receive_fd *file)
+{
+	int ret;
+
+	ret = flush_write(r, file);
+	list_del(&file->list);
+	r->nr_fds--;
+	if (file->fd != -1)
+		close(file->fd);
+	free(file->path);
+	free(file);
+	return ret;
+}
+
+/*
+ * Called with r->mutex held, close the least recently used files nothing
+ * is queued for until at most @max are left.  Queued and busy files stay,
+ * there are at most nr_threads of the latter with an open fd.
+ */
+static void trim_fd_cache(struct btrfs_receive *r, int max)
+{
+	struct receive_fd *file, *tmp;
+	int ret;
+
+	list_for_each_entry_safe_reverse(file, tmp, &r->fd_cache, list) {
+		if (r->nr_fds <= max)
+			break;
+		if (!fd_idle(file))
+			continue;
+		ret = drop_cached_fd(r, file);
+		if (ret && !r->error)
+			r->error = ret;
+	}
+}
+
+static int drop_cached_path(struct btrfs_receive *r, const char *path)
+{
+	struct receive_fd *file;
+	int ret = 0;
+
+	pthread_mutex_lock(&r->mutex);
+	file = find_cached_fd(r, path);
+	if (file)
+		ret = drop_cached_fd(r, file);
+	pthread_mutex_unlock(&r->mutex);
+	return ret;
+}
+
+/* flush the gathered up writes for @path before something else uses it */
+static int flush_path(struct btrfs_receive *r, const char *path)
+{
+	struct receive_fd *file;
+
+	/* without threads, it may be the same inode under another link */
+	if (!r->nr_threads)
+		return flush_write(r, r->write_file);
+
+	/*
+	 * With threads only the files being applied have writes gathered
+	 * up, idle ones may be closed as soon as the mutex is dropped.
+	 */
+	pthread_mutex_lock(&r->mutex);
+	file = find_cached_fd(r, path);
+	if (file && fd_idle(file))
+		file = NULL;
+	pthread_mutex_unlock(&r->mutex);
+	return flush_write(r, file);
+}
+
+/* called with r->mutex held */
+static struct receive_fd *add_cached_fd(struct btrfs_receive *r,
+					const char *path, int fd)
+{
+	struct receive_fd *file;
+
+	trim_fd_cache(r, r->max_fds - 1);
+
+	file = calloc(1, sizeof(*file));
+	if (file)
+		file->path = strdup(path);
+	if (!file || !file->path) {
+		free(file);
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return NULL;
+	}
+	file->fd = fd;
+	INIT_LIST_HEAD(&file->ready);
+	INIT_LIST_HEAD(&file->cmds);
+	list_add(&file->list, &r->fd_cache);
+	r->nr_fds++;
+	return file;
+}
+
+static int cache_fd(struct btrfs_receive *r, const char *path, int fd)
+{
+	struct receive_fd *file;
+
+	pthread_mutex_lock(&r->mutex);
+	file = find_cached_fd(r, path);
+	if (file && fd_idle(file))
+		drop_cached_fd(r, file);
+	file = add_cached_fd(r, path, fd);
+	pthread_mutex_unlock(&r->mutex);
+	if (!file) {
+		close(fd);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Cached files keep their fd when they or a directory above them get
+ * renamed, only the path they're looked up by changes.
+ */
+static void rename_cached_fds(struct btrfs_receive *r, const char *from,
+			      const char *to)
+{
+	struct receive_fd *file, *tmp;
+	int len = strlen(from);
+	char *path;
+
+	pthread_mutex_lock(&r->mutex);
+	list_for_each_entry_safe(file, tmp, &r->fd_cache, list) {
+		if (strncmp(file->path, from, len) ||
+		    (file->path[len] && file->path[len] != '/'))
+			continue;
+		path = malloc(strlen(to) + strlen(file->path + len) + 1);
+		if (!path) {
+			drop_cached_fd(r, file);
+			continue;
+		}
+		sprintf(path, "%s%s", to, file->path + len);
+		free(file->path);
+		file->path = path;
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static int open_inode_for_write(struct btrfs_receive *r, const char *path,
+				struct receive_fd **ret_file)
+{
+	struct receive_fd *file;
+	int ret = 0;
+	int fd;
+
+	pthread_mutex_lock(&r->mutex);
+	file = find_cached_fd(r, path);
+	if (file)
+		list_move(&file->list, &r->fd_cache);
+	pthread_mutex_unlock(&r->mutex);
+	if (file && file->fd != -1)
+		goto found;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: open %s failed. %s\n", path,
+				strerror(-ret));
+		goto out;
+	}
+	if (file) {
+		/* the thread applying its commands is the only user */
+		file->fd = fd;
+		goto found;
+	}
+	ret = cache_fd(r, path, fd);
+	if (ret < 0)
+		goto out;
+	pthread_mutex_lock(&r->mutex);
+	file = find_cached_fd(r, path);
+	pthread_mutex_unlock(&r->mutex);
+found:
+	*ret_file = file;
+out:
+	return ret;
+}
+
+/* length of @path without trailing slashes, "X/" names the same as "X" */
+static size_t path_len(const char *path)
+{
+	size_t len = strlen(path);
+
+	while (len && path[len - 1] == '/')
+		len--;
+	return len;
+}
+
+/* does one path contain the other, or are they the same? */
+static int paths_overlap(const char *a, const char *b)
+{
+	size_t la = path_len(a);
+	size_t lb = path_len(b);
+
+	if (la > lb) {
+		const char *tmp = a;
+
+		a = b;
+		b = tmp;
+		la = lb;
+		lb = path_len(b);
+	}
+	return !strncmp(a, b, la) && (la == lb || b[la] == '/');
+}
+
+/*
+ * Wait until no queued command is left for @path, the directories above
+ * it or anything below it, or for any path if @path is NULL.
+ */
+static void wait_for_path(struct btrfs_receive *r, const char *path)
+{
+	struct receive_fd *file;
+	int busy;
+
+	if (!r->nr_threads)
+		return;
+
+	pthread_mutex_lock(&r->mutex);
+	do {
+		busy = 0;
+		list_for_each_entry(file, &r->fd_cache, list) {
+			if (!fd_idle(file) &&
+			    (!path || paths_overlap(file->path, path))) {
+				busy = 1;
+				pthread_cond_wait(&r->done_cond, &r->mutex);
+				break;
+			}
+		}
+	} while (busy);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static int take_queued_error(struct btrfs_receive *r)
+{
+	int ret;
+
+	pthread_mutex_lock(&r->mutex);
+	ret = r->error;
+	r->error = 0;
+	pthread_mutex_unlock(&r->mutex);
+	return ret;
+}
+
+static int close_inode_for_write(struct btrfs_receive *r)
+{
+	struct receive_fd *file;
+	int ret;
+	int err;
+
+	wait_for_path(r, NULL);
+	ret = take_queued_error(r);
+
+	pthread_mutex_lock(&r->mutex);
+	while (!list_empty(&r->fd_cache)) {
+		file = list_entry(r->fd_cache.next, struct receive_fd, list);
+		err = drop_cached_fd(r, file);
+		if (err && !ret)
+			ret = err;
+	}
+	pthread_mutex_unlock(&r->mutex);
+	return ret;
+}
+
+/*
+ * Called with r->mutex held before commands get queued for an idle file
+ * at @path.  Returns 1 if its inode has other links commands are still
+ * queued for, otherwise its inode number if it has other links or 0.
+ */
+static int links_queued(struct btrfs_receive *r, const char *path, u64 *ino)
+{
+	struct receive_fd *file;
+	struct stat st;
+
+	*ino = 0;
+	if (lstat(path, &st) < 0 || S_ISDIR(st.st_mode) || st.st_nlink < 2)
+		return 0;
+	list_for_each_entry(file, &r->fd_cache, list) {
+		if (file->ino == st.st_ino && !fd_idle(file))
+			return 1;
+	}
+	*ino = st.st_ino;
+	return 0;
+}
+
+static int run_cmd(struct btrfs_receive *r, struct receive_cmd *cmd);
+
+static void free_cmd(struct receive_cmd *cmd)
+{
+	free(cmd->path);
+	free(cmd->name);
+	free(cmd->data);
+	free(cmd);
+}
+
+static void *receive_worker(void *data)
+{
+	struct btrfs_receive *r = data;
+	struct receive_fd *file;
+	struct receive_cmd *cmd;
+	int ret;
+
+	pthread_mutex_lock(&r->mutex);
+	while (1) {
+		while (!r->stop && list_empty(&r->ready))
+			pthread_cond_wait(&r->cond, &r->mutex);
+		if (list_empty(&r->ready))
+			break;
+
+		file = list_entry(r->ready.next, struct receive_fd, ready);
+		list_del_init(&file->ready);
+		file->busy = 1;
+		while (!list_empty(&file->cmds)) {
+			cmd = list_entry(file->cmds.next, struct receive_cmd,
+					 list);
+			list_del(&cmd->list);
+			pthread_mutex_unlock(&r->mutex);
+
+			ret = run_cmd(r, cmd);
+			free_cmd(cmd);
+
+			pthread_mutex_lock(&r->mutex);
+			if (list_empty(&file->cmds)) {
+				/* done with it for now */
+				pthread_mutex_unlock(&r->mutex);
+				if (!ret)
+					ret = flush_write(r, file);
+				pthread_mutex_lock(&r->mutex);
+			}
+			if (ret)
+				r->error = ret;
+			r->nr_queued--;
+			pthread_cond_broadcast(&r->done_cond);
+		}
+		file->busy = 0;
+		trim_fd_cache(r, r->max_fds);
+		pthread_cond_broadcast(&r->done_cond);
+	}
+	pthread_mutex_unlock(&r->mutex);
+	return NULL;
+}
+
+/*
+ * Apply a command that only touches the inode at cmd->path, right away
+ * without threads.  With threads it's queued and the error of an earlier
+ * queued command is returned, if there was one.
+ */
+static int submit_cmd(struct btrfs_receive *r, struct receive_cmd *cmd)
+{
+	struct receive_cmd *new;
+	struct receive_fd *file;
+	char *full_path;
+	u64 ino;
+
+	if (!r->nr_threads)
+		return run_cmd(r, cmd);
+
+	full_path = path_cat(r->full_subvol_path, cmd->path);
+	new = malloc(sizeof(*new));
+	if (!new || !full_path)
+		goto enomem;
+	*new = *cmd;
+	new->path = strdup(cmd->path);
+	new->name = cmd->name ? strdup(cmd->name) : NULL;
+	new->data = NULL;
+	if (cmd->data_len) {
+		new->data = malloc(cmd->data_len);
+		if (new->data)
+			memcpy(new->data, cmd->data, cmd->data_len);
+	}
+	if (!new->path || (cmd->name && !new->name) ||
+	    (cmd->data_len && !new->data)) {
+		free_cmd(new);
+		new = NULL;
+		goto enomem;
+	}
+
+	pthread_mutex_lock(&r->mutex);
+again:
+	while (r->nr_queued >= RECEIVE_MAX_QUEUED)
+		pthread_cond_wait(&r->done_cond, &r->mutex);
+	file = find_cached_fd(r, full_path);
+	if (!file || fd_idle(file)) {
+		if (links_queued(r, full_path, &ino)) {
+			pthread_cond_wait(&r->done_cond, &r->mutex);
+			goto again;
+		}
+		if (!file)
+			file = add_cached_fd(r, full_path, -1);
+		if (file)
+			file->ino = ino;
+	}
+	if (!file) {
+		pthread_mutex_unlock(&r->mutex);
+		free_cmd(new);
+		free(full_path);
+		return -ENOMEM;
+	}
+	list_add_tail(&new->list, &file->cmds);
+	if (!file->busy && list_empty(&file->ready)) {
+		list_add_tail(&file->ready, &r->ready);
+		pthread_cond_signal(&r->cond);
+	}
+	r->nr_queued++;
+	pthread_mutex_unlock(&r->mutex);
+	free(full_path);
+	return take_queued_error(r);
+
+enomem:
+	free(new);
+	free(full_path);
+	fprintf(stderr, "ERROR: not enough memory\n");
+	return -ENOMEM;
+}
+
+static void stop_receive_threads(struct btrfs_receive *r)
+{
+	int i;
+
+	pthread_mutex_lock(&r->mutex);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+	for (i = 0; i < r->nr_threads; i++)
+		pthread_join(r->threads[i], NULL);
+	free(r->threads);
+	r->threads = NULL;
+	r->nr_threads = 0;
+	r->stop = 0;
+}
+
+/*
+ * Idle files are kept open up to RECEIVE_FD_CACHE, less if RLIMIT_NOFILE
+ * doesn't leave room for them next to one file per thread.
+ */
+static int receive_max_fds(int nr_threads)
+{
+	struct rlimit rlim;
+	long avail;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) || rlim.rlim_cur == RLIM_INFINITY)
+		return RECEIVE_FD_CACHE;
+	avail = (long)rlim.rlim_cur - RECEIVE_RESERVED_FDS - nr_threads;
+	if (avail >= RECEIVE_FD_CACHE)
+		return RECEIVE_FD_CACHE;
+	return avail > 1 ? avail : 1;
+}
+
+static int start_receive_threads(struct btrfs_receive *r, int nr_threads)
+{
+	int ret;
+
+	r->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!r->threads)
+		return -ENOMEM;
+	for (r->nr_threads = 0; r->nr_threads < nr_threads;
+	     r->nr_threads++) {
+		ret = pthread_create(r->threads + r->nr_threads, NULL,
+				     receive_worker, r);
+		if (ret) {
+			stop_receive_threads(r);
+			return -ret;
+		}
+	}
+	return 0;
+}
+
 static int finish_subvol(struct btrfs_receive *r)
 {
 	int ret;
@@ -85,6 +709,11 @@ static int finish_subvol(struct btrfs_receive *r)
 	if (r->cur_subvol == NULL)
 		return 0;
 
+	/* everything has to be written before the subvol goes read-only */
+	ret = close_inode_for_write(r);
+	if (ret < 0)
+		goto out;
+
 	subvol_fd = openat(r->mnt_fd, r->cur_subvol->path,
 			O_RDONLY | O_NOATIME);
 	if (subvol_fd < 0) {
@@ -297,15 +926,17 @@ static int process_mkfile(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "mkfile %s\n", path);
 
-	ret = creat(full_path, 0600);
+	wait_for_path(r, full_path);
+
+	/* the file gets written to next, keep it open */
+	ret = open(full_path, O_CREAT | O_TRUNC | O_RDWR, 0600);
 	if (ret < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: mkfile %s failed. %s\n", path,
 				strerror(-ret));
 		goto out;
 	}
-	close(ret);
-	ret = 0;
+	ret = cache_fd(r, full_path, ret);
 
 out:
 	free(full_path);
@@ -321,6 +952,8 @@ static int process_mkdir(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "mkdir %s\n", path);
 
+	wait_for_path(r, full_path);
+
 	ret = mkdir(full_path, 0700);
 	if (ret < 0) {
 		ret = -errno;
@@ -342,6 +975,8 @@ static int process_mknod(const char *path, u64 mode, u64 dev, void *user)
 		fprintf(stderr, "mknod %s mode=%llu, dev=%llu\n",
 				path, mode, dev);
 
+	wait_for_path(r, full_path);
+
 	ret = mknod(full_path, mode & S_IFMT, dev);
 	if (ret < 0) {
 		ret = -errno;
@@ -362,6 +997,8 @@ static int process_mkfifo(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "mkfifo %s\n", path);
 
+	wait_for_path(r, full_path);
+
 	ret = mkfifo(full_path, 0600);
 	if (ret < 0) {
 		ret = -errno;
@@ -382,6 +1019,8 @@ static int process_mksock(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "mksock %s\n", path);
 
+	wait_for_path(r, full_path);
+
 	ret = mknod(full_path, 0600 | S_IFSOCK, 0);
 	if (ret < 0) {
 		ret = -errno;
@@ -402,6 +1041,8 @@ static int process_symlink(const char *path, const char *lnk, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "symlink %s -> %s\n", path, lnk);
 
+	wait_for_path(r, full_path);
+
 	ret = symlink(lnk, full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -423,13 +1064,27 @@ static int process_rename(const char *from, const char *to, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "rename %s -> %s\n", from, to);
 
+	/* queued commands name the files by the paths they had */
+	wait_for_path(r, full_from);
+	wait_for_path(r, full_to);
+	ret = take_queued_error(r);
+	if (ret < 0)
+		goto out;
+
+	ret = drop_cached_path(r, full_to);
+	if (ret < 0)
+		goto out;
+
 	ret = rename(full_from, full_to);
 	if (ret < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: rename %s -> %s failed. %s\n", from,
 				to, strerror(-ret));
+		goto out;
 	}
+	rename_cached_fds(r, full_from, full_to);
 
+out:
 	free(full_from);
 	free(full_to);
 	return ret;
@@ -445,6 +1100,12 @@ static int process_link(const char *path, const char *lnk, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "link %s -> %s\n", path, lnk);
 
+	wait_for_path(r, full_path);
+	wait_for_path(r, full_link_path);
+	ret = take_queued_error(r);
+	if (ret < 0)
+		goto out;
+
 	ret = link(full_link_path, full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -452,6 +1113,7 @@ static int process_link(const char *path, const char *lnk, void *user)
 				lnk, strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	free(full_link_path);
 	return ret;
@@ -467,6 +1129,12 @@ static int process_unlink(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "unlink %s\n", path);
 
+	wait_for_path(r, full_path);
+
+	ret = drop_cached_path(r, full_path);
+	if (ret < 0)
+		goto out;
+
 	ret = unlink(full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -474,6 +1142,7 @@ static int process_unlink(const char *path, void *user)
 				strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	return ret;
 }
@@ -487,6 +1156,9 @@ static int process_rmdir(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "rmdir %s\n", path);
 
+	wait_for_path(r, full_path);
+	drop_cached_path(r, full_path);
+
 	ret = rmdir(full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -499,89 +1171,116 @@ static int process_rmdir(const char *path, void *user)
 }
 
 
-static int open_inode_for_write(struct btrfs_receive *r, const char *path)
-{
-	int ret = 0;
-
-	if (r->write_fd != -1) {
-		if (strcmp(r->write_path, path) == 0)
-			goto out;
-		close(r->write_fd);
-		r->write_fd = -1;
-	}
-
-	r->write_fd = open(path, O_RDWR);
-	if (r->write_fd < 0) {
-		ret = -errno;
-		fprintf(stderr, "ERROR: open %s failed. %s\n", path,
-				strerror(-ret));
-		goto out;
-	}
-	free(r->write_path);
-	r->write_path = strdup(path);
-
-out:
-	return ret;
-}
-
-static void close_inode_for_write(struct btrfs_receive *r)
-{
-	if(r->write_fd == -1)
-		return;
-
-	close(r->write_fd);
-	r->write_fd = -1;
-	r->write_path[0] = 0;
-}
-
+/*
+ * The stream carries file data in small WRITE commands, gather up the
+ * ones continuing each other so they go out in large writes.
+ */
 static int process_write(const char *path, const void *data, u64 offset,
 			 u64 len, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
-	u64 pos = 0;
-	int w;
+	struct receive_fd *file;
 
-	ret = open_inode_for_write(r, full_path);
+	ret = open_inode_for_write(r, full_path, &file);
 	if (ret < 0)
 		goto out;
 
-	while (pos < len) {
-		w = pwrite(r->write_fd, (char*)data + pos, len - pos,
-				offset + pos);
-		if (w < 0) {
-			ret = -errno;
-			fprintf(stderr, "ERROR: writing to %s failed. %s\n",
-					path, strerror(-ret));
+	if (file->write_len &&
+	    file->write_offset + file->write_len == offset &&
+	    file->write_len + len <= RECEIVE_WRITE_SIZE) {
+		memcpy(file->write_buf + file->write_len, data, len);
+		file->write_len += len;
+		goto out;
+	}
+
+	/* threads flush once they're done with a file */
+	if (!r->nr_threads && r->write_file != file) {
+		ret = flush_write(r, r->write_file);
+		if (ret < 0)
 			goto out;
-		}
-		pos += w;
 	}
+	ret = flush_write(r, file);
+	if (ret < 0)
+		goto out;
+
+	if (len <= RECEIVE_WRITE_SIZE)
+		file->write_buf = malloc(RECEIVE_WRITE_SIZE);
+	if (!file->write_buf) {
+		ret = write_data(file, data, offset, len);
+		goto out;
+	}
+	memcpy(file->write_buf, data, len);
+	file->write_offset = offset;
+	file->write_len = len;
+	if (!r->nr_threads)
+		r->write_file = file;
 
 out:
 	free(full_path);
 	return ret;
 }
 
-static int process_clone(const char *path, u64 offset, u64 len,
-			 const u8 *clone_uuid, u64 clone_ctransid,
-			 const char *clone_path, u64 clone_offset,
-			 void *user)
+static int do_clone(struct btrfs_receive *r, const char *path, u64 offset,
+		    u64 len, const char *full_clone_path, u64 clone_offset)
 {
 	int ret;
-	struct btrfs_receive *r = user;
 	struct btrfs_ioctl_clone_range_args clone_args;
-	struct subvol_info *si = NULL;
 	char *full_path = path_cat(r->full_subvol_path, path);
-	char *subvol_path = NULL;
-	char *full_clone_path = NULL;
+	struct receive_fd *file;
 	int clone_fd = -1;
 
-	ret = open_inode_for_write(r, full_path);
+	/* the source may be a file we still have writes for */
+	ret = flush_path(r, full_path);
+	if (!ret)
+		ret = flush_path(r, full_clone_path);
 	if (ret < 0)
 		goto out;
 
+	ret = open_inode_for_write(r, full_path, &file);
+	if (ret < 0)
+		goto out;
+
+	clone_fd = open(full_clone_path, O_RDONLY | O_NOATIME);
+	if (clone_fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: failed to open %s. %s\n",
+				full_clone_path, strerror(-ret));
+		goto out;
+	}
+
+	clone_args.src_fd = clone_fd;
+	clone_args.src_offset = clone_offset;
+	clone_args.src_length = len;
+	clone_args.dest_offset = offset;
+	ret = ioctl(file->fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
+	if (ret) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: failed to clone extents to %s\n%s\n",
+				path, strerror(-ret));
+		goto out;
+	}
+
+out:
+	free(full_path);
+	if (clone_fd != -1)
+		close(clone_fd);
+	return ret;
+}
+
+static int process_clone(const char *path, u64 offset, u64 len,
+			 const u8 *clone_uuid, u64 clone_ctransid,
+			 const char *clone_path, u64 clone_offset,
+			 void *user)
+{
+	int ret;
+	struct btrfs_receive *r = user;
+	struct subvol_info *si = NULL;
+	struct receive_cmd cmd;
+	char *subvol_path = NULL;
+	char *full_clone_path = NULL;
+
 	si = subvol_uuid_search(&r->sus, 0, clone_uuid, clone_ctransid, NULL,
 			subvol_search_by_received_uuid);
 	if (!si) {
@@ -615,36 +1314,33 @@ static int process_clone(const char *path, u64 offset, u64 len,
 
 	full_clone_path = path_cat3(r->root_path, subvol_path, clone_path);
 
-	clone_fd = open(full_clone_path, O_RDONLY | O_NOATIME);
-	if (clone_fd < 0) {
-		ret = -errno;
-		fprintf(stderr, "ERROR: failed to open %s. %s\n",
-				full_clone_path, strerror(-ret));
+	if (!si) {
+		/*
+		 * The source is in the subvol being received, its data has
+		 * to be there and stay put until the clone is done.
+		 */
+		wait_for_path(r, NULL);
+		ret = do_clone(r, path, offset, len, full_clone_path,
+			       clone_offset);
 		goto out;
 	}
 
-	clone_args.src_fd = clone_fd;
-	clone_args.src_offset = clone_offset;
-	clone_args.src_length = len;
-	clone_args.dest_offset = offset;
-	ret = ioctl(r->write_fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
-	if (ret) {
-		ret = -errno;
-		fprintf(stderr, "ERROR: failed to clone extents to %s\n%s\n",
-				path, strerror(-ret));
-		goto out;
-	}
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BTRFS_SEND_C_CLONE;
+	cmd.path = (char *)path;
+	cmd.name = full_clone_path;
+	cmd.offset = offset;
+	cmd.len = len;
+	cmd.clone_offset = clone_offset;
+	ret = submit_cmd(r, &cmd);
 
 out:
 	if (si) {
 		free(si->path);
 		free(si);
 	}
-	free(full_path);
 	free(full_clone_path);
 	free(subvol_path);
-	if (clone_fd != -1)
-		close(clone_fd);
 	return ret;
 }
 
@@ -662,6 +1358,10 @@ static int process_set_xattr(const char *path, const char *name,
 				len, (char*)data);
 	}
 
+	ret = flush_path(r, full_path);
+	if (ret < 0)
+		goto out;
+
 	ret = lsetxattr(full_path, name, data, len, 0);
 	if (ret < 0) {
 		ret = -errno;
@@ -686,6 +1386,10 @@ static int process_remove_xattr(const char *path, const char *name, void *user)
 				path, name);
 	}
 
+	ret = flush_path(r, full_path);
+	if (ret < 0)
+		goto out;
+
 	ret = lremovexattr(full_path, name);
 	if (ret < 0) {
 		ret = -errno;
@@ -708,6 +1412,10 @@ static int process_truncate(const char *path, u64 size, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "truncate %s size=%llu\n", path, size);
 
+	ret = flush_path(r, full_path);
+	if (ret < 0)
+		goto out;
+
 	ret = truncate(full_path, size);
 	if (ret < 0) {
 		ret = -errno;
@@ -730,6 +1438,10 @@ static int process_chmod(const char *path, u64 mode, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "chmod %s - mode=0%o\n", path, (int)mode);
 
+	ret = flush_path(r, full_path);
+	if (ret < 0)
+		goto out;
+
 	ret = chmod(full_path, mode);
 	if (ret < 0) {
 		ret = -errno;
@@ -753,6 +1465,10 @@ static int process_chown(const char *path, u64 uid, u64 gid, void *user)
 		fprintf(stderr, "chown %s - uid=%llu, gid=%llu\n", path,
 				uid, gid);
 
+	ret = flush_path(r, full_path);
+	if (ret < 0)
+		goto out;
+
 	ret = lchown(full_path, uid, gid);
 	if (ret < 0) {
 		ret = -errno;
@@ -778,6 +1494,10 @@ static int process_utimes(const char *path, struct timespec *at,
 	if (g_verbose >= 2)
 		fprintf(stderr, "utimes %s\n", path);
 
+	ret = flush_path(r, full_path);
+	if (ret < 0)
+		goto out;
+
 	tv[0] = *at;
 	tv[1] = *mt;
 	ret = utimensat(AT_FDCWD, full_path, tv, AT_SYMLINK_NOFOLLOW);
@@ -794,6 +1514,126 @@ out:
 }
 
 
+static int apply_cmd(struct btrfs_receive *r, struct receive_cmd *cmd)
+{
+	switch (cmd->cmd) {
+	case BTRFS_SEND_C_WRITE:
+		return process_write(cmd->path, cmd->data, cmd->offset,
+				     cmd->data_len, r);
+	case BTRFS_SEND_C_CLONE:
+		return do_clone(r, cmd->path, cmd->offset, cmd->len,
+				cmd->name, cmd->clone_offset);
+	case BTRFS_SEND_C_SET_XATTR:
+		return process_set_xattr(cmd->path, cmd->name, cmd->data,
+					 cmd->data_len, r);
+	case BTRFS_SEND_C_REMOVE_XATTR:
+		return process_remove_xattr(cmd->path, cmd->name, r);
+	case BTRFS_SEND_C_TRUNCATE:
+		return process_truncate(cmd->path, cmd->len, r);
+	case BTRFS_SEND_C_CHMOD:
+		return process_chmod(cmd->path, cmd->mode, r);
+	case BTRFS_SEND_C_CHOWN:
+		return process_chown(cmd->path, cmd->uid, cmd->gid, r);
+	case BTRFS_SEND_C_UTIMES:
+		return process_utimes(cmd->path, &cmd->at, &cmd->mt, &cmd->ct,
+				      r);
+	}
+	return -EINVAL;
+}
+
+static int run_cmd(struct btrfs_receive *r, struct receive_cmd *cmd)
+{
+	return apply_cmd(r, cmd);
+}
+
+static int queue_write(const char *path, const void *data, u64 offset,
+		       u64 len, void *user)
+{
+	struct receive_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BTRFS_SEND_C_WRITE;
+	cmd.path = (char *)path;
+	cmd.data = (void *)data;
+	cmd.data_len = len;
+	cmd.offset = offset;
+	return submit_cmd(user, &cmd);
+}
+
+static int queue_set_xattr(const char *path, const char *name,
+			   const void *data, int len, void *user)
+{
+	struct receive_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BTRFS_SEND_C_SET_XATTR;
+	cmd.path = (char *)path;
+	cmd.name = (char *)name;
+	cmd.data = (void *)data;
+	cmd.data_len = len;
+	return submit_cmd(user, &cmd);
+}
+
+static int queue_remove_xattr(const char *path, const char *name, void *user)
+{
+	struct receive_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BTRFS_SEND_C_REMOVE_XATTR;
+	cmd.path = (char *)path;
+	cmd.name = (char *)name;
+	return submit_cmd(user, &cmd);
+}
+
+static int queue_truncate(const char *path, u64 size, void *user)
+{
+	struct receive_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BTRFS_SEND_C_TRUNCATE;
+	cmd.path = (char *)path;
+	cmd.len = size;
+	return submit_cmd(user, &cmd);
+}
+
+static int queue_chmod(const char *path, u64 mode, void *user)
+{
+	struct receive_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BTRFS_SEND_C_CHMOD;
+	cmd.path = (char *)path;
+	cmd.mode = mode;
+	return submit_cmd(user, &cmd);
+}
+
+static int queue_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	struct receive_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BTRFS_SEND_C_CHOWN;
+	cmd.path = (char *)path;
+	cmd.uid = uid;
+	cmd.gid = gid;
+	return submit_cmd(user, &cmd);
+}
+
+static int queue_utimes(const char *path, struct timespec *at,
+			struct timespec *mt, struct timespec *ct,
+			void *user)
+{
+	struct receive_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BTRFS_SEND_C_UTIMES;
+	cmd.path = (char *)path;
+	cmd.at = *at;
+	cmd.mt = *mt;
+	cmd.ct = *ct;
+	return submit_cmd(user, &cmd);
+}
+
 static struct btrfs_send_ops send_ops = {
 	.subvol = process_subvol,
 	.snapshot = process_snapshot,
@@ -807,22 +1647,999 @@ static struct btrfs_send_ops send_ops = {
 	.link = process_link,
 	.unlink = process_unlink,
 	.rmdir = process_rmdir,
-	.write = process_write,
+	.write = queue_write,
 	.clone = process_clone,
-	.set_xattr = process_set_xattr,
-	.remove_xattr = process_remove_xattr,
-	.truncate = process_truncate,
-	.chmod = process_chmod,
-	.chown = process_chown,
-	.utimes = process_utimes,
+	.set_xattr = queue_set_xattr,
+	.remove_xattr = queue_remove_xattr,
+	.truncate = queue_truncate,
+	.chmod = queue_chmod,
+	.chown = queue_chown,
+	.utimes = queue_utimes,
+};
+
+/*
+ * --resume-file: the input is a framed stream from btrfs send --framed.
+ * A thread checks the frames and passes the raw stream on to the parser
+ * through a pipe, noting where each frame ends.
+ *
+ * Commands are not idempotent, replaying a rename or an unlink can destroy
+ * data, so a transfer may only be resumed from a checkpoint exactly at the
+ * last command applied.  Before the first command is applied the resume
+ * file is marked as applying.  When the stream stops at a frame end and
+ * everything before it was applied, that frame end is saved as a clean
+ * checkpoint, along with the subvolume being received.  A transfer that
+ * stopped anywhere else, or didn't stop cleanly, can't be resumed.
+ */
+#define RECEIVE_FRAME_MAX		(1024 * 1024 + BTRFS_SEND_BUF_SIZE)
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < len) {
+		ret = read(fd, (char *)buf + pos, len - pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			fprintf(stderr, "ERROR: read from stream failed. %s\n",
+					strerror(-ret));
+			return ret;
+		}
+		if (!ret)
+			return 1;
+		pos += ret;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < len) {
+		ret = write(fd, (const char *)buf + pos, len - pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		pos += ret;
+	}
+	return 0;
+}
+
+static int read_frame(struct btrfs_receive *r, struct receive_checkpoint *cur,
+		      int first)
+{
+	struct btrfs_stream_header sh;
+	struct btrfs_frame_header fh;
+	struct receive_checkpoint *mark;
+	u32 hdr_crc;
+	u32 len;
+	u32 crc;
+	int ret;
+
+	ret = read_full(r->frame_in_fd, &fh, sizeof(fh));
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		fprintf(stderr, "ERROR: framed stream ends at offset %llu\n",
+			cur->offset);
+		return -EPIPE;
+	}
+
+	hdr_crc = le32_to_cpu(fh.hdr_crc);
+	fh.hdr_crc = 0;
+	len = le32_to_cpu(fh.len);
+	if (crc32c(0, &fh, sizeof(fh)) != hdr_crc ||
+	    len > RECEIVE_FRAME_MAX) {
+		fprintf(stderr, "ERROR: corrupted frame at offset %llu\n",
+			cur->offset);
+		return -EIO;
+	}
+
+	ret = read_full(r->frame_in_fd, r->frame_buf, len);
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		fprintf(stderr, "ERROR: framed stream ends at offset %llu\n",
+			cur->offset);
+		return -EPIPE;
+	}
+	crc = crc32c(cur->crc, r->frame_buf, len);
+	if (crc32c(0, r->frame_buf, len) != le32_to_cpu(fh.crc) ||
+	    crc != le32_to_cpu(fh.stream_crc) ||
+	    cur->offset + len != le64_to_cpu(fh.offset) ||
+	    le64_to_cpu(fh.cmds) < cur->cmds) {
+		fprintf(stderr, "ERROR: corrupted frame at offset %llu\n",
+			cur->offset);
+		return -EIO;
+	}
+	if (!len)
+		return 1;
+
+	/* a resumed stream starts in the middle, the parser wants a header */
+	if (first && cur->offset &&
+	    (len < sizeof(sh) ||
+	     memcmp(r->frame_buf, BTRFS_SEND_STREAM_MAGIC, sizeof(sh.magic)))) {
+		memset(&sh, 0, sizeof(sh));
+		strcpy(sh.magic, BTRFS_SEND_STREAM_MAGIC);
+		sh.version = cpu_to_le32(BTRFS_SEND_STREAM_VERSION);
+		ret = write_full(r->frame_out_fd, &sh, sizeof(sh));
+		if (ret < 0)
+			return ret;
+	}
+
+	cur->offset += len;
+	cur->cmds = le64_to_cpu(fh.cmds);
+	cur->crc = crc;
+	mark = malloc(sizeof(*mark));
+	if (!mark) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return -ENOMEM;
+	}
+	*mark = *cur;
+	pthread_mutex_lock(&r->mutex);
+	list_add_tail(&mark->list, &r->marks);
+	pthread_mutex_unlock(&r->mutex);
+
+	return write_full(r->frame_out_fd, r->frame_buf, len);
+}
+
+static void *deframe_thread(void *data)
+{
+	struct btrfs_receive *r = data;
+	struct receive_checkpoint cur;
+	sigset_t sigs;
+	int first = 1;
+	int ret;
+
+	/* the parser may stop reading, get EPIPE instead */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	cur.offset = le64_to_cpu(r->framed_hdr.offset);
+	cur.cmds = le64_to_cpu(r->framed_hdr.cmds);
+	cur.crc = le32_to_cpu(r->framed_hdr.crc);
+	do {
+		ret = read_frame(r, &cur, first);
+		first = 0;
+	} while (!ret);
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&r->mutex);
+	r->frame_status = ret;
+	pthread_mutex_unlock(&r->mutex);
+	close(r->frame_out_fd);
+	r->frame_out_fd = -1;
+	return NULL;
+}
+
+static int save_checkpoint(struct btrfs_receive *r,
+			   struct receive_checkpoint *ckpt, int applying)
+{
+	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
+	char *tmp;
+	char *dir = NULL;
+	FILE *f;
+	int dir_fd;
+	int ret = 0;
+
+	/* what the checkpoint says was applied has to reach the disk first */
+	if (syncfs(r->mnt_fd) < 0) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: syncfs failed. %s\n", strerror(-ret));
+		return ret;
+	}
+
+	tmp = malloc(strlen(r->resume_file) + 5);
+	if (!tmp)
+		return -ENOMEM;
+	sprintf(tmp, "%s.new", r->resume_file);
+	f = fopen(tmp, "w");
+	if (!f) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: can't create %s. %s\n", tmp,
+				strerror(-ret));
+		goto out;
+	}
+	fprintf(f, "offset %llu\ncmds %llu\ncrc %u\napplying %d\n",
+		ckpt->offset, ckpt->cmds, ckpt->crc, applying);
+	if (r->cur_subvol) {
+		uuid_unparse(r->cur_subvol->received_uuid, uuid_str);
+		fprintf(f, "uuid %s\nstransid %llu\nsubvol %s\n", uuid_str,
+			r->cur_subvol->stransid, r->cur_subvol->path);
+	}
+	if (fflush(f) || fsync(fileno(f))) {
+		ret = -errno;
+		fclose(f);
+		fprintf(stderr, "ERROR: can't write %s. %s\n", tmp,
+				strerror(-ret));
+		goto out;
+	}
+	if (fclose(f) || rename(tmp, r->resume_file)) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: can't write %s. %s\n", r->resume_file,
+				strerror(-ret));
+		goto out;
+	}
+
+	/* and so has the rename */
+	dir = strdup(r->resume_file);
+	if (!dir) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	dir_fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0 || fsync(dir_fd) < 0) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: can't sync the directory of %s. %s\n",
+				r->resume_file, strerror(-ret));
+		if (dir_fd >= 0)
+			close(dir_fd);
+		goto out;
+	}
+	close(dir_fd);
+	r->saved = *ckpt;
+	r->applying = applying;
+
+out:
+	free(dir);
+	free(tmp);
+	return ret;
+}
+
+static int load_checkpoint(struct btrfs_receive *r)
+{
+	struct subvol_info *subvol = NULL;
+	char line[PATH_MAX + 16];
+	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
+	unsigned long long val;
+	int applying = 1;
+	int have = 0;
+	size_t len;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(r->resume_file, "r");
+	if (!f) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: can't open %s. %s\n", r->resume_file,
+				strerror(-ret));
+		return ret;
+	}
+	subvol = calloc(1, sizeof(*subvol));
+	if (!subvol) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[len - 1] = 0;
+		if (sscanf(line, "offset %llu", &val) == 1) {
+			r->saved.offset = val;
+			have |= 1;
+		} else if (sscanf(line, "cmds %llu", &val) == 1) {
+			r->saved.cmds = val;
+			have |= 2;
+		} else if (sscanf(line, "crc %llu", &val) == 1) {
+			r->saved.crc = val;
+			have |= 4;
+		} else if (sscanf(line, "applying %d", &applying) == 1) {
+			have |= 8;
+		} else if (sscanf(line, "uuid %36s", uuid_str) == 1) {
+			uuid_parse(uuid_str, subvol->received_uuid);
+		} else if (sscanf(line, "stransid %llu", &val) == 1) {
+			subvol->stransid = val;
+		} else if (!strncmp(line, "subvol ", 7)) {
+			free(subvol->path);
+			subvol->path = strdup(line + 7);
+		}
+	}
+	if (!subvol->path) {
+		free(subvol);
+		subvol = NULL;
+	}
+	if (have != 15) {
+		fprintf(stderr, "ERROR: %s is not a valid resume file\n",
+				r->resume_file);
+		ret = -EINVAL;
+		goto out;
+	}
+	if (applying) {
+		fprintf(stderr,
+	"ERROR: %s is from a transfer that stopped while applying commands\n",
+				r->resume_file);
+		r->applying = 1;
+		ret = -EINVAL;
+		goto out;
+	}
+	if (r->saved.offset != le64_to_cpu(r->framed_hdr.offset) ||
+	    r->saved.cmds != le64_to_cpu(r->framed_hdr.cmds) ||
+	    r->saved.crc != le32_to_cpu(r->framed_hdr.crc)) {
+		fprintf(stderr,
+	"ERROR: the stream doesn't continue from the checkpoint in %s\n",
+				r->resume_file);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	r->cur_subvol = subvol;
+	if (subvol) {
+		subvol = NULL;
+		free(r->full_subvol_path);
+		r->full_subvol_path = path_cat(r->root_path,
+					       r->cur_subvol->path);
+	}
+	fprintf(stderr, "Resuming at offset %llu\n", r->saved.offset);
+
+out:
+	if (subvol) {
+		free(subvol->path);
+		free(subvol);
+	}
+	fclose(f);
+	return ret;
+}
+
+/* take the framed stream from @fd and hand the parser a pipe instead */
+static int start_deframe(struct btrfs_receive *r, int fd, int *parse_fd)
+{
+	int pipefd[2];
+	int ret;
+
+	ret = read_full(fd, &r->framed_hdr, sizeof(r->framed_hdr));
+	if (!ret && (strncmp(r->framed_hdr.magic, BTRFS_SEND_FRAMED_MAGIC,
+			     sizeof(r->framed_hdr.magic)) ||
+		     le32_to_cpu(r->framed_hdr.version) >
+		     BTRFS_SEND_FRAMED_VERSION))
+		ret = 1;
+	if (ret) {
+		if (ret > 0) {
+			fprintf(stderr,
+	"ERROR: --resume-file needs a stream from 'btrfs send --framed'\n");
+			ret = -EINVAL;
+		}
+		return ret;
+	}
+
+	r->last_mark.offset = le64_to_cpu(r->framed_hdr.offset);
+	r->last_mark.cmds = le64_to_cpu(r->framed_hdr.cmds);
+	r->last_mark.crc = le32_to_cpu(r->framed_hdr.crc);
+	r->saved = r->last_mark;
+	r->nr_cmds = r->last_mark.cmds;
+	if (r->last_mark.offset) {
+		ret = load_checkpoint(r);
+		if (ret < 0)
+			return ret;
+	}
+
+	r->frame_buf = malloc(RECEIVE_FRAME_MAX);
+	if (!r->frame_buf) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return -ENOMEM;
+	}
+	if (pipe(pipefd) < 0) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: pipe failed. %s\n", strerror(-ret));
+		return ret;
+	}
+	fcntl(pipefd[0], F_SETPIPE_SZ, RECEIVE_WRITE_SIZE);
+	r->frame_in_fd = fd;
+	r->frame_out_fd = pipefd[1];
+	ret = pthread_create(&r->deframe_thread, NULL, deframe_thread, r);
+	if (ret) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		fprintf(stderr, "ERROR: thread setup failed: %s\n",
+				strerror(ret));
+		return -ret;
+	}
+	r->deframing = 1;
+	*parse_fd = pipefd[0];
+	return 0;
+}
+
+/*
+ * Wait for the frame thread, or stop it after an error. Returns 0 if it
+ * passed on the complete stream.
+ */
+static int stop_deframe(struct btrfs_receive *r, int parse_fd, int cancel)
+{
+	struct receive_checkpoint *mark;
+
+	if (r->deframing) {
+		/* a write to the closed pipe fails, a read may need a cancel */
+		close(parse_fd);
+		if (cancel)
+			pthread_cancel(r->deframe_thread);
+		pthread_join(r->deframe_thread, NULL);
+		r->deframing = 0;
+		if (r->frame_out_fd != -1)
+			close(r->frame_out_fd);
+		r->frame_out_fd = -1;
+	}
+
+	/* the last frame end the commands reached */
+	while (!list_empty(&r->marks)) {
+		mark = list_entry(r->marks.next, struct receive_checkpoint,
+				  list);
+		if (mark->cmds <= r->nr_cmds) {
+			r->last_mark.offset = mark->offset;
+			r->last_mark.cmds = mark->cmds;
+			r->last_mark.crc = mark->crc;
+		}
+		list_del(&mark->list);
+		free(mark);
+	}
+	free(r->frame_buf);
+	r->frame_buf = NULL;
+
+	if (r->frame_status == 1)
+		return 0;
+	return r->frame_status ? r->frame_status : -EPIPE;
+}
+
+/* called before each command of a --resume-file receive */
+static int begin_cmd(struct btrfs_receive *r)
+{
+	struct receive_checkpoint *mark;
+	int ret;
+
+	/* from now on r->saved doesn't tell what was applied */
+	if (!r->applying) {
+		ret = save_checkpoint(r, &r->saved, 1);
+		if (ret < 0) {
+			r->cmd_failed = 1;
+			return ret;
+		}
+	}
+
+	pthread_mutex_lock(&r->mutex);
+	while (!list_empty(&r->marks)) {
+		mark = list_entry(r->marks.next, struct receive_checkpoint,
+				  list);
+		if (mark->cmds > r->nr_cmds)
+			break;
+		r->last_mark.offset = mark->offset;
+		r->last_mark.cmds = mark->cmds;
+		r->last_mark.crc = mark->crc;
+		list_del(&mark->list);
+		free(mark);
+	}
+	pthread_mutex_unlock(&r->mutex);
+
+	r->nr_cmds++;
+	return 0;
+}
+
+static int end_cmd(struct btrfs_receive *r, int ret)
+{
+	if (ret < 0)
+		r->cmd_failed = 1;
+	return ret;
+}
+
+#define RESUME_OP(op, func, args, ...)				\
+static int resume_##op(__VA_ARGS__, void *user)			\
+{								\
+	int ret = begin_cmd(user);				\
+								\
+	if (!ret)						\
+		ret = end_cmd(user, func args);			\
+	return ret;						\
+}
+
+RESUME_OP(subvol, process_subvol, (path, uuid, ctransid, user),
+	  const char *path, const u8 *uuid, u64 ctransid)
+RESUME_OP(snapshot, process_snapshot,
+	  (path, uuid, ctransid, parent_uuid, parent_ctransid, user),
+	  const char *path, const u8 *uuid, u64 ctransid,
+	  const u8 *parent_uuid, u64 parent_ctransid)
+RESUME_OP(mkfile, process_mkfile, (path, user), const char *path)
+RESUME_OP(mkdir, process_mkdir, (path, user), const char *path)
+RESUME_OP(mknod, process_mknod, (path, mode, dev, user),
+	  const char *path, u64 mode, u64 dev)
+RESUME_OP(mkfifo, process_mkfifo, (path, user), const char *path)
+RESUME_OP(mksock, process_mksock, (path, user), const char *path)
+RESUME_OP(symlink, process_symlink, (path, lnk, user),
+	  const char *path, const char *lnk)
+RESUME_OP(rename, process_rename, (from, to, user),
+	  const char *from, const char *to)
+RESUME_OP(link, process_link, (path, lnk, user),
+	  const char *path, const char *lnk)
+RESUME_OP(unlink, process_unlink, (path, user), const char *path)
+RESUME_OP(rmdir, process_rmdir, (path, user), const char *path)
+RESUME_OP(write, queue_write, (path, data, offset, len, user),
+	  const char *path, const void *data, u64 offset, u64 len)
+RESUME_OP(clone, process_clone,
+	  (path, offset, len, clone_uuid, clone_ctransid, clone_path,
+	   clone_offset, user),
+	  const char *path, u64 offset, u64 len, const u8 *clone_uuid,
+	  u64 clone_ctransid, const char *clone_path, u64 clone_offset)
+RESUME_OP(set_xattr, queue_set_xattr, (path, name, data, len, user),
+	  const char *path, const char *name, const void *data, int len)
+RESUME_OP(remove_xattr, queue_remove_xattr, (path, name, user),
+	  const char *path, const char *name)
+RESUME_OP(truncate, queue_truncate, (path, size, user),
+	  const char *path, u64 size)
+RESUME_OP(chmod, queue_chmod, (path, mode, user), const char *path, u64 mode)
+RESUME_OP(chown, queue_chown, (path, uid, gid, user),
+	  const char *path, u64 uid, u64 gid)
+RESUME_OP(utimes, queue_utimes, (path, at, mt, ct, user),
+	  const char *path, struct timespec *at, struct timespec *mt,
+	  struct timespec *ct)
+
+static struct btrfs_send_ops resume_ops = {
+	.subvol = resume_subvol,
+	.snapshot = resume_snapshot,
+	.mkfile = resume_mkfile,
+	.mkdir = resume_mkdir,
+	.mknod = resume_mknod,
+	.mkfifo = resume_mkfifo,
+	.mksock = resume_mksock,
+	.symlink = resume_symlink,
+	.rename = resume_rename,
+	.link = resume_link,
+	.unlink = resume_unlink,
+	.rmdir = resume_rmdir,
+	.write = resume_write,
+	.clone = resume_clone,
+	.set_xattr = resume_set_xattr,
+	.remove_xattr = resume_remove_xattr,
+	.truncate = resume_truncate,
+	.chmod = resume_chmod,
+	.chown = resume_chown,
+	.utimes = resume_utimes,
+};
+
+/*
+ * --dump-stats: parse the stream without applying it and report what's
+ * in it.
+ */
+#define STATS_TOP_FILES		10
+#define STATS_WRITE_BUCKETS	21	/* up to 1MiB and larger */
+
+static const char * const stats_cmd_names[BTRFS_SEND_C_MAX + 1] = {
+	[BTRFS_SEND_C_SUBVOL]		= "subvol",
+	[BTRFS_SEND_C_SNAPSHOT]		= "snapshot",
+	[BTRFS_SEND_C_MKFILE]		= "mkfile",
+	[BTRFS_SEND_C_MKDIR]		= "mkdir",
+	[BTRFS_SEND_C_MKNOD]		= "mknod",
+	[BTRFS_SEND_C_MKFIFO]		= "mkfifo",
+	[BTRFS_SEND_C_MKSOCK]		= "mksock",
+	[BTRFS_SEND_C_SYMLINK]		= "symlink",
+	[BTRFS_SEND_C_RENAME]		= "rename",
+	[BTRFS_SEND_C_LINK]		= "link",
+	[BTRFS_SEND_C_UNLINK]		= "unlink",
+	[BTRFS_SEND_C_RMDIR]		= "rmdir",
+	[BTRFS_SEND_C_SET_XATTR]	= "set_xattr",
+	[BTRFS_SEND_C_REMOVE_XATTR]	= "remove_xattr",
+	[BTRFS_SEND_C_WRITE]		= "write",
+	[BTRFS_SEND_C_CLONE]		= "clone",
+	[BTRFS_SEND_C_TRUNCATE]		= "truncate",
+	[BTRFS_SEND_C_CHMOD]		= "chmod",
+	[BTRFS_SEND_C_CHOWN]		= "chown",
+	[BTRFS_SEND_C_UTIMES]		= "utimes",
+	[BTRFS_SEND_C_END]		= "end",
+	[BTRFS_SEND_C_UPDATE_EXTENT]	= "update_extent",
+};
+
+/* mtime ages of the files touched, from their utimes commands */
+static const struct {
+	const char *name;
+	time_t age;
+} stats_ages[] = {
+	{ "< 1 hour", 3600 },
+	{ "< 1 day", 86400 },
+	{ "< 1 week", 7 * 86400 },
+	{ "< 30 days", 30 * 86400 },
+	{ "< 1 year", 365 * 86400 },
+	{ "older", 0 },
+};
+
+struct stats_file {
+	struct rb_node n;
+	char *path;
+	u64 written;
+	u64 cloned;
+};
+
+struct stream_stats {
+	u64 cmds[BTRFS_SEND_C_MAX + 1];
+	u64 bytes[BTRFS_SEND_C_MAX + 1];
+	u64 write_sizes[STATS_WRITE_BUCKETS];
+	u64 ages[ARRAY_SIZE(stats_ages)];
+	struct rb_root files;
+	u64 nr_files;
+	time_t now;
+};
+
+static struct stats_file *stats_find_file(struct stream_stats *st,
+					  const char *path, int create)
+{
+	struct rb_node **p = &st->files.rb_node;
+	struct rb_node *parent = NULL;
+	struct stats_file *file;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		file = rb_entry(parent, struct stats_file, n);
+		cmp = strcmp(path, file->path);
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return file;
+	}
+	if (!create)
+		return NULL;
+
+	file = calloc(1, sizeof(*file));
+	if (file)
+		file->path = strdup(path);
+	if (!file || !file->path) {
+		free(file);
+		return NULL;
+	}
+	rb_link_node(&file->n, parent, p);
+	rb_insert_color(&file->n, &st->files);
+	st->nr_files++;
+	return file;
+}
+
+static void stats_drop_file(struct stream_stats *st, struct stats_file *file)
+{
+	rb_erase(&file->n, &st->files);
+	st->nr_files--;
+	free(file->path);
+	free(file);
+}
+
+static int stats_add_data(struct stream_stats *st, const char *path,
+			  u64 written, u64 cloned)
+{
+	struct stats_file *file;
+
+	file = stats_find_file(st, path, 1);
+	if (!file) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return -ENOMEM;
+	}
+	file->written += written;
+	file->cloned += cloned;
+	return 0;
+}
+
+static void stats_count(struct stream_stats *st, int cmd, u64 bytes)
+{
+	st->cmds[cmd]++;
+	st->bytes[cmd] += bytes;
+}
+
+static int stats_subvol(const char *path, const u8 *uuid, u64 ctransid,
+			void *user)
+{
+	stats_count(user, BTRFS_SEND_C_SUBVOL, 0);
+	return 0;
+}
+
+static int stats_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+			  const u8 *parent_uuid, u64 parent_ctransid,
+			  void *user)
+{
+	stats_count(user, BTRFS_SEND_C_SNAPSHOT, 0);
+	return 0;
+}
+
+static int stats_mkfile(const char *path, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_MKFILE, 0);
+	return 0;
+}
+
+static int stats_mkdir(const char *path, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_MKDIR, 0);
+	return 0;
+}
+
+static int stats_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_MKNOD, 0);
+	return 0;
+}
+
+static int stats_mkfifo(const char *path, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_MKFIFO, 0);
+	return 0;
+}
+
+static int stats_mksock(const char *path, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_MKSOCK, 0);
+	return 0;
+}
+
+static int stats_symlink(const char *path, const char *lnk, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_SYMLINK, strlen(lnk));
+	return 0;
+}
+
+/*
+ * Send creates files under temporary names and renames them into place,
+ * follow that so the largest files are reported by their final name.
+ * Files below a renamed directory keep the name they were written as.
+ */
+static int stats_rename(const char *from, const char *to, void *user)
+{
+	struct stream_stats *st = user;
+	struct stats_file *file;
+	int ret;
+
+	stats_count(st, BTRFS_SEND_C_RENAME, 0);
+	file = stats_find_file(st, from, 0);
+	if (!file)
+		return 0;
+	ret = stats_add_data(st, to, file->written, file->cloned);
+	stats_drop_file(st, file);
+	return ret;
+}
+
+static int stats_link(const char *path, const char *lnk, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_LINK, 0);
+	return 0;
+}
+
+static int stats_unlink(const char *path, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_UNLINK, 0);
+	return 0;
+}
+
+static int stats_rmdir(const char *path, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_RMDIR, 0);
+	return 0;
+}
+
+static int stats_write(const char *path, const void *data, u64 offset,
+		       u64 len, void *user)
+{
+	struct stream_stats *st = user;
+	int bucket = 0;
+
+	stats_count(st, BTRFS_SEND_C_WRITE, len);
+	while (bucket < STATS_WRITE_BUCKETS - 1 && (1ULL << bucket) < len)
+		bucket++;
+	st->write_sizes[bucket]++;
+	return stats_add_data(st, path, len, 0);
+}
+
+static int stats_clone(const char *path, u64 offset, u64 len,
+		       const u8 *clone_uuid, u64 clone_ctransid,
+		       const char *clone_path, u64 clone_offset,
+		       void *user)
+{
+	stats_count(user, BTRFS_SEND_C_CLONE, len);
+	return stats_add_data(user, path, 0, len);
+}
+
+static int stats_set_xattr(const char *path, const char *name,
+			   const void *data, int len, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_SET_XATTR, len);
+	return 0;
+}
+
+static int stats_remove_xattr(const char *path, const char *name, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_REMOVE_XATTR, 0);
+	return 0;
+}
+
+static int stats_truncate(const char *path, u64 size, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_TRUNCATE, 0);
+	return 0;
+}
+
+static int stats_chmod(const char *path, u64 mode, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_CHMOD, 0);
+	return 0;
+}
+
+static int stats_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	stats_count(user, BTRFS_SEND_C_CHOWN, 0);
+	return 0;
+}
+
+static int stats_utimes(const char *path, struct timespec *at,
+			struct timespec *mt, struct timespec *ct,
+			void *user)
+{
+	struct stream_stats *st = user;
+	int i;
+
+	stats_count(st, BTRFS_SEND_C_UTIMES, 0);
+	for (i = 0; i < ARRAY_SIZE(stats_ages) - 1; i++) {
+		if (st->now - mt->tv_sec < stats_ages[i].age)
+			break;
+	}
+	st->ages[i]++;
+	return 0;
+}
+
+static int stats_update_extent(const char *path, u64 offset, u64 len,
+			       void *user)
+{
+	stats_count(user, BTRFS_SEND_C_UPDATE_EXTENT, len);
+	return 0;
+}
+
+static struct btrfs_send_ops stats_ops = {
+	.subvol = stats_subvol,
+	.snapshot = stats_snapshot,
+	.mkfile = stats_mkfile,
+	.mkdir = stats_mkdir,
+	.mknod = stats_mknod,
+	.mkfifo = stats_mkfifo,
+	.mksock = stats_mksock,
+	.symlink = stats_symlink,
+	.rename = stats_rename,
+	.link = stats_link,
+	.unlink = stats_unlink,
+	.rmdir = stats_rmdir,
+	.write = stats_write,
+	.clone = stats_clone,
+	.set_xattr = stats_set_xattr,
+	.remove_xattr = stats_remove_xattr,
+	.truncate = stats_truncate,
+	.chmod = stats_chmod,
+	.chown = stats_chown,
+	.utimes = stats_utimes,
+	.update_extent = stats_update_extent,
 };
 
+static int cmp_stats_file(const void *a, const void *b)
+{
+	const struct stats_file *fa = *(const struct stats_file **)a;
+	const struct stats_file *fb = *(const struct stats_file **)b;
+	u64 sa = fa->written + fa->cloned;
+	u64 sb = fb->written + fb->cloned;
+
+	if (sa != sb)
+		return sa < sb ? 1 : -1;
+	return strcmp(fa->path, fb->path);
+}
+
+static void print_stream_stats(struct stream_stats *st, double elapsed)
+{
+	struct stats_file **top;
+	struct stats_file *file;
+	struct rb_node *n;
+	u64 metadata_cmds = 0;
+	u64 data_cmds;
+	u64 written = st->bytes[BTRFS_SEND_C_WRITE];
+	u64 cloned = st->bytes[BTRFS_SEND_C_CLONE];
+	u64 nr = 0;
+	int i;
+
+	printf("%-16s %12s %16s\n", "command", "count", "bytes");
+	for (i = 1; i <= BTRFS_SEND_C_MAX; i++) {
+		if (!st->cmds[i])
+			continue;
+		printf("%-16s %12llu %16llu\n", stats_cmd_names[i],
+		       st->cmds[i], st->bytes[i]);
+		metadata_cmds += st->cmds[i];
+	}
+	data_cmds = st->cmds[BTRFS_SEND_C_WRITE] + st->cmds[BTRFS_SEND_C_CLONE] +
+		    st->cmds[BTRFS_SEND_C_UPDATE_EXTENT];
+	metadata_cmds -= data_cmds;
+
+	printf("\ndata commands: %llu, metadata commands: %llu\n",
+	       data_cmds, metadata_cmds);
+	printf("written: %s, cloned: %s", pretty_size(written),
+	       pretty_size(cloned));
+	if (written + cloned)
+		printf(" (%.1f%% cloned)",
+		       100.0 * cloned / (written + cloned));
+	printf("\n");
+
+	if (st->cmds[BTRFS_SEND_C_WRITE]) {
+		printf("\nwrite sizes:\n");
+		for (i = 0; i < STATS_WRITE_BUCKETS; i++) {
+			if (!st->write_sizes[i])
+				continue;
+			if (i == STATS_WRITE_BUCKETS - 1)
+				printf("  >  %7lluK", 1ULL << (i - 1 - 10));
+			else if (i >= 10)
+				printf("  <= %7lluK", 1ULL << (i - 10));
+			else
+				printf("  <= %8llu", 1ULL << i);
+			printf(" %12llu\n", st->write_sizes[i]);
+		}
+	}
+
+	if (st->cmds[BTRFS_SEND_C_UTIMES]) {
+		printf("\nmodification times:\n");
+		for (i = 0; i < ARRAY_SIZE(stats_ages); i++)
+			printf("  %-12s %12llu\n", stats_ages[i].name,
+			       st->ages[i]);
+	}
+
+	top = malloc(st->nr_files * sizeof(*top));
+	if (top && st->nr_files) {
+		for (n = rb_first(&st->files); n; n = rb_next(n))
+			top[nr++] = rb_entry(n, struct stats_file, n);
+		qsort(top, nr, sizeof(*top), cmp_stats_file);
+		printf("\nlargest files (bytes written + cloned):\n");
+		for (i = 0; i < nr && i < STATS_TOP_FILES; i++)
+			printf("  %14llu + %14llu  %s\n", top[i]->written,
+			       top[i]->cloned, top[i]->path);
+	}
+	free(top);
+
+	printf("\nparsed in %.2f seconds", elapsed);
+	if (elapsed > 0)
+		printf(", %.1f MiB/s of file data",
+		       (written + cloned) / elapsed / (1024 * 1024));
+	printf("\n");
+
+	while ((n = rb_first(&st->files))) {
+		file = rb_entry(n, struct stats_file, n);
+		stats_drop_file(st, file);
+	}
+}
+
+static int dump_stream_stats(int r_fd, int honor_end_cmd, u64 max_errors)
+{
+	struct stream_stats st;
+	struct timeval start, end;
+	int ret;
+
+	memset(&st, 0, sizeof(st));
+	st.files = RB_ROOT;
+	st.now = time(NULL);
+
+	gettimeofday(&start, NULL);
+	while (1) {
+		ret = btrfs_read_and_process_send_stream(r_fd, &stats_ops, &st,
+							 honor_end_cmd,
+							 max_errors);
+		if (ret)
+			break;
+	}
+	gettimeofday(&end, NULL);
+	if (ret > 0)
+		ret = 0;
+
+	print_stream_stats(&st, end.tv_sec - start.tv_sec +
+			   (end.tv_usec - start.tv_usec) / 1e6);
+	return ret;
+}
+
 static int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd,
-		      u64 max_errors)
+		      u64 max_errors, int nr_threads)
 {
 	int ret;
 	char *dest_dir_full_path;
 	int end = 0;
+	struct btrfs_send_ops *ops = &send_ops;
+	int parse_fd = r_fd;
+	int deframe_failed = 0;
 
 	dest_dir_full_path = realpath(tomnt, NULL);
 	if (!dest_dir_full_path) {
@@ -876,8 +2693,24 @@ static int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd,
 	if (ret < 0)
 		goto out;
 
+	if (nr_threads > 0) {
+		ret = start_receive_threads(r, nr_threads);
+		if (ret < 0)
+			fprintf(stderr,
+		"WARNING: failed to start threads, applying commands inline. %s\n",
+				strerror(-ret));
+	}
+	r->max_fds = receive_max_fds(r->nr_threads);
+
+	if (r->resume_file) {
+		ret = start_deframe(r, r_fd, &parse_fd);
+		if (ret < 0)
+			goto out;
+		ops = &resume_ops;
+	}
+
 	while (!end) {
-		ret = btrfs_read_and_process_send_stream(r_fd, &send_ops, r,
+		ret = btrfs_read_and_process_send_stream(parse_fd, ops, r,
 							 r->honor_end_cmd,
 							 max_errors);
 		if (ret < 0)
@@ -885,22 +2718,51 @@ static int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd,
 		if (ret)
 			end = 1;
 
-		close_inode_for_write(r);
+		/* the subvol can't be finished if the stream is incomplete */
+		if (end && r->resume_file) {
+			ret = stop_deframe(r, parse_fd, 0);
+			parse_fd = -1;
+			if (ret < 0) {
+				deframe_failed = 1;
+				goto out;
+			}
+		}
+
+		ret = close_inode_for_write(r);
+		if (ret < 0)
+			goto out;
 		ret = finish_subvol(r);
 		if (ret < 0)
 			goto out;
 	}
+	if (r->resume_file)
+		unlink(r->resume_file);
 	ret = 0;
 
 out:
-	if (r->write_fd != -1) {
-		close(r->write_fd);
-		r->write_fd = -1;
+	if (r->resume_file && ret < 0) {
+		/* the parser fails too when the frames stop in the middle */
+		if (r->deframing && stop_deframe(r, parse_fd, 1) < 0 &&
+		    r->frame_status)
+			deframe_failed = 1;
+		/* stopped right after the last command of a frame? */
+		if (deframe_failed && !r->cmd_failed &&
+		    r->last_mark.cmds == r->nr_cmds &&
+		    !close_inode_for_write(r))
+			save_checkpoint(r, &r->last_mark, 0);
+		if (r->applying)
+			fprintf(stderr,
+"ERROR: stopped while applying commands, the transfer can't be resumed,\n"
+"receive the stream again from the start\n");
+		else if (r->saved.offset)
+			fprintf(stderr,
+"Checkpoint saved in %s, continue with 'btrfs send --resume %llu'\n",
+				r->resume_file, r->saved.offset);
 	}
+	close_inode_for_write(r);
+	stop_receive_threads(r);
 	free(r->root_path);
 	r->root_path = NULL;
-	free(r->write_path);
-	r->write_path = NULL;
 	free(r->full_subvol_path);
 	r->full_subvol_path = NULL;
 	r->dest_dir_path = NULL;
@@ -924,6 +2786,9 @@ out:
 
 static const struct option long_opts[] = {
 	{ "max-errors", 1, NULL, 'E' },
+	{ "threads", 1, NULL, 258 },
+	{ "dump-stats", 0, NULL, 259 },
+	{ "resume-file", 1, NULL, 260 },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -935,11 +2800,20 @@ int cmd_receive(int argc, char **argv)
 	struct btrfs_receive r;
 	int receive_fd = fileno(stdin);
 	u64 max_errors = 1;
+	u64 num;
+	int nr_threads = RECEIVE_THREADS;
+	int dump_stats = 0;
 	int ret;
 
 	memset(&r, 0, sizeof(r));
 	r.mnt_fd = -1;
-	r.write_fd = -1;
+	INIT_LIST_HEAD(&r.fd_cache);
+	INIT_LIST_HEAD(&r.ready);
+	INIT_LIST_HEAD(&r.marks);
+	r.frame_out_fd = -1;
+	pthread_mutex_init(&r.mutex, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	pthread_cond_init(&r.done_cond, NULL);
 	r.dest_dir_fd = -1;
 
 	while ((c = getopt_long(argc, argv, "evf:", long_opts, NULL)) != -1) {
@@ -956,6 +2830,22 @@ int cmd_receive(int argc, char **argv)
 		case 'E':
 			max_errors = arg_strtou64(optarg);
 			break;
+		case 258:
+			num = arg_strtou64(optarg);
+			if (num > RECEIVE_MAX_THREADS) {
+				fprintf(stderr,
+		"ERROR: number of threads must be between 0 and %d\n",
+					RECEIVE_MAX_THREADS);
+				return 1;
+			}
+			nr_threads = num;
+			break;
+		case 259:
+			dump_stats = 1;
+			break;
+		case 260:
+			r.resume_file = optarg;
+			break;
 		case '?':
 		default:
 			fprintf(stderr, "ERROR: receive args invalid.\n");
@@ -963,10 +2853,11 @@ int cmd_receive(int argc, char **argv)
 		}
 	}
 
-	if (check_argc_exact(argc - optind, 1))
+	if (check_argc_exact(argc - optind, dump_stats ? 0 : 1))
 		usage(cmd_receive_usage);
 
-	tomnt = argv[optind];
+	if (!dump_stats)
+		tomnt = argv[optind];
 
 	if (fromfile) {
 		receive_fd = open(fromfile, O_RDONLY | O_NOATIME);
@@ -976,13 +2867,20 @@ int cmd_receive(int argc, char **argv)
 		}
 	}
 
-	ret = do_receive(&r, tomnt, receive_fd, max_errors);
+	if (dump_stats)
+		ret = dump_stream_stats(receive_fd, r.honor_end_cmd, max_errors);
+	else
+		ret = do_receive(&r, tomnt, receive_fd, max_errors,
+				 nr_threads);
+	pthread_mutex_destroy(&r.mutex);
+	pthread_cond_destroy(&r.cond);
+	pthread_cond_destroy(&r.done_cond);
 
 	return !!ret;
 }
 
 const char * const cmd_receive_usage[] = {
-	"btrfs receive [-ve] [-f <infile>] [--max-errors <N>] <mount>",
+	"btrfs receive [-ve] [-f <infile>] [--max-errors <N>] [--threads <N>] [--resume-file <file>] <mount>",
 	"Receive subvolumes from stdin.",
 	"Receives one or more subvolumes that were previously",
 	"sent with btrfs send. The received subvolumes are stored",
@@ -1005,5 +2903,19 @@ const char * const cmd_receive_usage[] = {
 	"--max-errors <N> Terminate as soon as N errors happened while",
 	"                 processing commands from the send stream.",
 	"                 Default value is 1. A value of 0 means no limit.",
+	"--threads <N>    Apply file contents and attributes with N",
+	"                 threads, at most 256. Default value is 4.",
+	"                 A value of 0 applies everything in the",
+	"                 reading thread.",
+	"--resume-file <file>",
+	"                 Receive a stream from 'btrfs send --framed',",
+	"                 saving checkpoints to <file>. A stream sent with",
+	"                 'btrfs send --resume' continues from the one",
+	"                 saved there. The file is removed once the",
+	"                 stream was received completely.",
+	"--dump-stats     Don't apply the stream, print how many commands",
+	"                 and bytes of each kind it contains, how much",
+	"                 data is cloned, the largest files and how fast",
+	"                 it could be parsed. <mount> is not needed.",
 	NULL
 };
@@ -21,21 +21,25 @@
 #include <getopt.h>
 #include "commands.h"
 #include "utils.h"
+#include "range-scan.h"
 
 static const char * const rescue_cmd_group_usage[] = {
 	"btrfs rescue <command> [options] <path>",
 	NULL
 };
 
-int btrfs_recover_chunk_tree(char *path, int verbose, int yes);
+int btrfs_recover_chunk_tree(char *path, int verbose, int yes, int jobs,
+			     char *cache_file);
 int btrfs_recover_superblocks(char *path, int verbose, int yes);
 
 const char * const cmd_chunk_recover_usage[] = {
 	"btrfs rescue chunk-recover [options] <device>",
-	"Recover the chunk tree by scanning the devices one by one.",
+	"Recover the chunk tree by scanning the devices.",
 	"",
 	"-y	Assume an answer of `yes' to all questions",
 	"-v	Verbose mode",
+	"-j <jobs>	Number of threads reading each device (default 4)",
+	"-c <file>	Save the device scan to <file> and reuse it next time",
 	"-h	Help",
 	NULL
 };
@@ -55,9 +59,11 @@ int cmd_chunk_recover(int argc, char *argv[])
 	char *file;
 	int yes = 0;
 	int verbose = 0;
+	int jobs = RANGE_SCAN_JOBS;
+	char *cache_file = NULL;
 
 	while (1) {
-		int c = getopt(argc, argv, "yvh");
+		int c = getopt(argc, argv, "yvj:c:h");
 		if (c < 0)
 			break;
 		switch (c) {
@@ -67,6 +73,16 @@ int cmd_chunk_recover(int argc, char *argv[])
 		case 'v':
 			verbose = 1;
 			break;
+		case 'j':
+			jobs = arg_strtou64(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, "ERROR: jobs must be at least 1\n");
+				return 1;
+			}
+			break;
+		case 'c':
+			cache_file = optarg;
+			break;
 		case 'h':
 		default:
 			usage(cmd_chunk_recover_usage);
@@ -89,7 +105,8 @@ int cmd_chunk_recover(int argc, char *argv[])
 		return 1;
 	}
 
-	ret = btrfs_recover_chunk_tree(file, verbose, yes);
+	ret = btrfs_recover_chunk_tree(file, verbose, yes, jobs,
+				       cache_file);
 	if (!ret) {
 		fprintf(stdout, "Recover the chunk tree successfully.\n");
 	} else if (ret > 0) {
@@ -35,6 +35,8 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/resource.h>
+#include <pthread.h>
 
 #include "ctree.h"
 #include "disk-io.h"
@@ -55,6 +57,72 @@ static int overwrite = 0;
 static int get_xattrs = 0;
 static int dry_run = 0;
 
+/*
+ * Regular file extents are not copied while the tree is walked.  The walker
+ * queues them and a pool of threads reads, decompresses and writes them.
+ * Extents are handed to the pool in batches sorted by device and physical
+ * offset, so the readers sweep across the disks instead of seeking back and
+ * forth for every file, while the walker fills the next batch.  Whichever
+ * thread drops the last reference to a file truncates and closes it.
+ * Files stay open until their last extent is written, so the walker stops
+ * opening new ones and flushes the batch once RLIMIT_NOFILE gets close.
+ */
+#define RESTORE_THREADS		4
+#define RESTORE_MAX_THREADS	256
+#define RESTORE_BATCH		1024
+/* descriptors left for the devices, stdio and the libraries */
+#define RESTORE_RESERVED_FDS	64
+
+struct restore_file {
+	char *name;
+	int fd;
+	int refs;
+	int error;
+	/* set by the walker once every extent is queued, 0 skips truncating */
+	u64 size;
+};
+
+struct restore_extent {
+	struct restore_file *file;
+	u64 devid;
+	u64 physical;
+	u64 bytenr;
+	u64 disk_size;
+	u64 ram_size;
+	u64 offset;
+	u64 num_bytes;
+	u64 pos;
+	int compress;
+};
+
+struct restore_pool {
+	struct btrfs_root *root;
+	pthread_t *threads;
+	int num_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	/* the batch the threads take extents from */
+	struct restore_extent *batch;
+	int nr;
+	int next;
+	/* extents taken from the batch which are still being copied */
+	int busy;
+	int done;
+	/* a file failed and we are not ignoring errors */
+	int failed;
+	/* files opened by the walker and not closed yet */
+	int nr_open;
+	int max_open;
+
+	/* the batch being filled, only used by the walker */
+	struct restore_extent *filling;
+	int nr_filling;
+};
+
+static struct restore_pool *restore_pool;
+static int restore_threads = RESTORE_THREADS;
+
 #define LZO_LEN 4
 #define PAGE_CACHE_SIZE 4096
 #define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
@@ -277,45 +345,32 @@ static int copy_one_inline(int fd, struct btrfs_path *path, u64 pos)
 	return 0;
 }
 
-static int copy_one_extent(struct btrfs_root *root, int fd,
-			   struct extent_buffer *leaf,
-			   struct btrfs_file_extent_item *fi, u64 pos)
+static int copy_one_extent(struct btrfs_root *root,
+			   struct restore_extent *ext)
 {
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
 	char *inbuf, *outbuf = NULL;
 	ssize_t done, total = 0;
-	u64 bytenr;
-	u64 ram_size;
-	u64 disk_size;
-	u64 num_bytes;
+	u64 bytenr = ext->bytenr;
+	u64 ram_size = ext->ram_size;
+	u64 disk_size = ext->disk_size;
+	u64 num_bytes = ext->num_bytes;
+	u64 offset = ext->offset;
+	u64 pos = ext->pos;
 	u64 length;
+	u64 type;
 	u64 size_left;
 	u64 dev_bytenr;
-	u64 offset;
 	u64 count = 0;
-	int compress;
+	int compress = ext->compress;
+	int fd = ext->file->fd;
 	int ret;
 	int dev_fd;
 	int mirror_num = 1;
 	int num_copies;
 
-	compress = btrfs_file_extent_compression(leaf, fi);
-	bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
-	disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
-	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
-	offset = btrfs_file_extent_offset(leaf, fi);
-	num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
 	size_left = disk_size;
-	if (compress == BTRFS_COMPRESS_NONE)
-		bytenr += offset;
-
-	if (verbose && offset)
-		printf("offset is %Lu\n", offset);
-	/* we found a hole */
-	if (disk_size == 0)
-		return 0;
-
 	inbuf = malloc(size_left);
 	if (!inbuf) {
 		fprintf(stderr, "No memory\n");
@@ -332,22 +387,29 @@ static int copy_one_extent(struct btrfs_root *root, int fd,
 	}
 again:
 	length = size_left;
-	ret = btrfs_map_block(&root->fs_info->mapping_tree, READ,
-			      bytenr, &length, &multi, mirror_num, NULL);
+	ret = __btrfs_map_block(&root->fs_info->mapping_tree, READ,
+				bytenr, &length, &type, &multi, mirror_num,
+				NULL);
 	if (ret) {
 		fprintf(stderr, "Error mapping block %d\n", ret);
 		goto out;
 	}
 	device = multi->stripes[0].dev;
 	dev_fd = device->fd;
-	device->total_ios++;
 	dev_bytenr = multi->stripes[0].physical;
 	kfree(multi);
 
 	if (size_left < length)
 		length = size_left;
 
-	done = pread(dev_fd, inbuf+count, length, dev_bytenr);
+	if ((type & (BTRFS_BLOCK_GROUP_RAID5 | BTRFS_BLOCK_GROUP_RAID6)) &&
+	    (mirror_num > 1 || dev_fd <= 0)) {
+		ret = read_raid56_with_parity(root->fs_info, bytenr, length,
+					      inbuf + count, mirror_num);
+		done = ret ? -1 : length;
+	} else {
+		done = pread(dev_fd, inbuf+count, length, dev_bytenr);
+	}
 	/* Need both checks, or we miss negative values due to u64 conversion */
 	if (done < 0 || done < length) {
 		num_copies = btrfs_num_copies(&root->fs_info->mapping_tree,
@@ -414,6 +476,319 @@ out:
 	return ret;
 }
 
+
+/*
+ * Fill in everything the pool needs to copy a regular extent, the leaf is
+ * gone by the time a thread gets to it.
+ */
+static int fill_restore_extent(struct btrfs_root *root,
+			       struct restore_extent *ext,
+			       struct extent_buffer *leaf,
+			       struct btrfs_file_extent_item *fi, u64 pos)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	u64 length;
+
+	ext->compress = btrfs_file_extent_compression(leaf, fi);
+	ext->bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+	ext->disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
+	ext->ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
+	ext->offset = btrfs_file_extent_offset(leaf, fi);
+	ext->num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
+	ext->pos = pos;
+	if (ext->compress == BTRFS_COMPRESS_NONE)
+		ext->bytenr += ext->offset;
+
+	if (verbose && ext->offset)
+		printf("offset is %Lu\n", ext->offset);
+	/* we found a hole */
+	if (ext->disk_size == 0)
+		return 1;
+
+	ext->devid = 0;
+	ext->physical = ext->bytenr;
+	length = ext->disk_size;
+	if (!btrfs_map_block(&root->fs_info->mapping_tree, READ, ext->bytenr,
+			     &length, &multi, 0, NULL)) {
+		ext->devid = multi->stripes[0].dev->devid;
+		ext->physical = multi->stripes[0].physical;
+	}
+	kfree(multi);
+	return 0;
+}
+
+static int cmp_restore_extent(const void *a, const void *b)
+{
+	const struct restore_extent *ea = a;
+	const struct restore_extent *eb = b;
+
+	if (ea->devid != eb->devid)
+		return ea->devid < eb->devid ? -1 : 1;
+	if (ea->physical != eb->physical)
+		return ea->physical < eb->physical ? -1 : 1;
+	return 0;
+}
+
+static struct restore_file *alloc_restore_file(const char *name, int fd)
+{
+	struct restore_file *file;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return NULL;
+	file->name = strdup(name);
+	if (!file->name) {
+		free(file);
+		return NULL;
+	}
+	file->fd = fd;
+	file->refs = 1;
+	return file;
+}
+
+static void release_restore_fd(struct restore_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->nr_open--;
+	pthread_cond_broadcast(&pool->done_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static int restore_max_open_files(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) ||
+	    rlim.rlim_cur == RLIM_INFINITY ||
+	    rlim.rlim_cur >= 2 * RESTORE_BATCH + RESTORE_RESERVED_FDS)
+		return 2 * RESTORE_BATCH;
+	if (rlim.rlim_cur <= 2 * RESTORE_RESERVED_FDS)
+		return rlim.rlim_cur / 2 ? rlim.rlim_cur / 2 : 1;
+	return rlim.rlim_cur - RESTORE_RESERVED_FDS;
+}
+
+/* called with the pool mutex held, returns 1 if the file has to be closed */
+static int drop_restore_file(struct restore_pool *pool,
+			     struct restore_file *file, int error)
+{
+	if (error)
+		file->error = 1;
+	if (--file->refs)
+		return 0;
+	if (file->error && !ignore_errors)
+		pool->failed = 1;
+	return 1;
+}
+
+static void close_restore_file(struct restore_pool *pool,
+			       struct restore_file *file)
+{
+	if (file->error) {
+		fprintf(stderr, "Error copying data for %s\n", file->name);
+	} else if (file->size && ftruncate(file->fd, (loff_t)file->size)) {
+		fprintf(stderr, "Error truncating %s: %d\n", file->name,
+			errno);
+	}
+	close(file->fd);
+	free(file->name);
+	free(file);
+	release_restore_fd(pool);
+}
+
+static void put_restore_file(struct restore_pool *pool,
+			     struct restore_file *file)
+{
+	int last;
+
+	pthread_mutex_lock(&pool->mutex);
+	last = drop_restore_file(pool, file, 0);
+	pthread_mutex_unlock(&pool->mutex);
+	if (last)
+		close_restore_file(pool, file);
+}
+
+static void *restore_worker(void *data)
+{
+	struct restore_pool *pool = data;
+	struct restore_extent ext;
+	int last;
+	int ret;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (pool->next >= pool->nr && !pool->done)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->next >= pool->nr)
+			break;
+		ext = pool->batch[pool->next++];
+		pool->busy++;
+		if (pool->next >= pool->nr)
+			pthread_cond_broadcast(&pool->done_cond);
+		pthread_mutex_unlock(&pool->mutex);
+
+		ret = copy_one_extent(pool->root, &ext);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->busy--;
+		last = drop_restore_file(pool, ext.file, ret);
+		pthread_cond_broadcast(&pool->done_cond);
+		if (last) {
+			pthread_mutex_unlock(&pool->mutex);
+			close_restore_file(pool, ext.file);
+			pthread_mutex_lock(&pool->mutex);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+/*
+ * Sort the batch the walker filled and hand it to the threads as soon as
+ * they have taken everything from the previous one.  The threads copy the
+ * extents out of the batch, so the walker can refill the old one right
+ * away.
+ */
+static void submit_restore_batch(struct restore_pool *pool)
+{
+	struct restore_extent *tmp;
+
+	if (!pool->nr_filling)
+		return;
+	qsort(pool->filling, pool->nr_filling, sizeof(*pool->filling),
+	      cmp_restore_extent);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->next < pool->nr)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	tmp = pool->batch;
+	pool->batch = pool->filling;
+	pool->filling = tmp;
+	pool->nr = pool->nr_filling;
+	pool->next = 0;
+	pool->nr_filling = 0;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Called by the walker before it opens a file.  If too many files are open
+ * already, hand the extents queued so far to the threads and wait for them
+ * to close some.
+ */
+static void reserve_restore_fd(struct restore_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->nr_open >= pool->max_open) {
+		pthread_mutex_unlock(&pool->mutex);
+		submit_restore_batch(pool);
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->nr_open >= pool->max_open &&
+		       (pool->next < pool->nr || pool->busy))
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pool->nr_open++;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void queue_restore_extent(struct restore_pool *pool,
+				 struct restore_extent *ext)
+{
+	pthread_mutex_lock(&pool->mutex);
+	ext->file->refs++;
+	pthread_mutex_unlock(&pool->mutex);
+
+	pool->filling[pool->nr_filling++] = *ext;
+	if (pool->nr_filling == RESTORE_BATCH)
+		submit_restore_batch(pool);
+}
+
+static int restore_pool_failed(struct restore_pool *pool)
+{
+	int failed;
+
+	pthread_mutex_lock(&pool->mutex);
+	failed = pool->failed;
+	pthread_mutex_unlock(&pool->mutex);
+	return failed;
+}
+
+static void destroy_restore_pool(struct restore_pool *pool, int num_threads)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->done = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->batch);
+	free(pool->filling);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct restore_pool *start_restore_pool(struct btrfs_root *root,
+					       int num_threads)
+{
+	struct restore_pool *pool;
+	int i;
+	int ret = 0;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->threads = calloc(num_threads, sizeof(pthread_t));
+	pool->batch = calloc(RESTORE_BATCH, sizeof(*pool->batch));
+	pool->filling = calloc(RESTORE_BATCH, sizeof(*pool->filling));
+	if (!pool->threads || !pool->batch || !pool->filling) {
+		free(pool->threads);
+		free(pool->batch);
+		free(pool->filling);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->root = root;
+	pool->num_threads = num_threads;
+	pool->max_open = restore_max_open_files();
+
+	for (i = 0; i < num_threads; i++) {
+		ret = pthread_create(pool->threads + i, NULL, restore_worker,
+				     pool);
+		if (ret)
+			break;
+	}
+	if (ret) {
+		destroy_restore_pool(pool, i);
+		return NULL;
+	}
+	return pool;
+}
+
+/* wait for every queued extent to be written and stop the threads */
+static int finish_restore_pool(struct restore_pool *pool)
+{
+	int ret;
+
+	submit_restore_batch(pool);
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->next < pool->nr || pool->busy)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	ret = pool->failed;
+	pthread_mutex_unlock(&pool->mutex);
+
+	destroy_restore_pool(pool, pool->num_threads);
+	return ret ? -1 : 0;
+}
+
 enum loop_response {
 	LOOP_STOP,
 	LOOP_CONTINUE,
@@ -550,14 +925,15 @@ out:
 }
 
 
-static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
-		     const char *file)
+static int copy_file(struct btrfs_root *root, struct restore_file *file,
+		     struct btrfs_key *key)
 {
 	struct extent_buffer *leaf;
 	struct btrfs_path *path;
 	struct btrfs_file_extent_item *fi;
 	struct btrfs_inode_item *inode_item;
 	struct btrfs_key found_key;
+	struct restore_extent ext;
 	int ret;
 	int extent_type;
 	int compression;
@@ -608,7 +984,7 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		if (loops >= 0 && loops++ >= 1024) {
 			enum loop_response resp;
 
-			resp = ask_to_continue(file);
+			resp = ask_to_continue(file->name);
 			if (resp == LOOP_STOP)
 				break;
 			else if (resp == LOOP_CONTINUE)
@@ -651,18 +1027,16 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		if (extent_type == BTRFS_FILE_EXTENT_PREALLOC)
 			goto next;
 		if (extent_type == BTRFS_FILE_EXTENT_INLINE) {
-			ret = copy_one_inline(fd, path, found_key.offset);
+			ret = copy_one_inline(file->fd, path, found_key.offset);
 			if (ret) {
 				btrfs_free_path(path);
 				return -1;
 			}
 		} else if (extent_type == BTRFS_FILE_EXTENT_REG) {
-			ret = copy_one_extent(root, fd, leaf, fi,
-					      found_key.offset);
-			if (ret) {
-				btrfs_free_path(path);
-				return ret;
-			}
+			ext.file = file;
+			if (!fill_restore_extent(root, &ext, leaf, fi,
+						 found_key.offset))
+				queue_restore_extent(restore_pool, &ext);
 		} else {
 			printf("Weird extent type %d\n", extent_type);
 		}
@@ -672,13 +1046,11 @@ next:
 
 	btrfs_free_path(path);
 set_size:
-	if (found_size) {
-		ret = ftruncate(fd, (loff_t)found_size);
-		if (ret)
-			return ret;
-	}
+	/* the last extent written truncates the file to this */
+	file->size = found_size;
 	if (get_xattrs) {
-		ret = set_file_xattrs(root, key->objectid, fd, file);
+		ret = set_file_xattrs(root, key->objectid, file->fd,
+				      file->name);
 		if (ret)
 			return ret;
 	}
@@ -696,6 +1068,7 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 	char filename[BTRFS_NAME_LEN + 1];
 	unsigned long name_ptr;
 	int name_len;
+	struct restore_file *file;
 	int ret;
 	int fd;
 	int loops = 0;
@@ -827,18 +1200,34 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 				printf("Restoring %s\n", path_name);
 			if (dry_run)
 				goto next;
+			if (restore_pool_failed(restore_pool)) {
+				btrfs_free_path(path);
+				return -1;
+			}
+			reserve_restore_fd(restore_pool);
 			fd = open(path_name, O_CREAT|O_WRONLY, 0644);
 			if (fd < 0) {
 				fprintf(stderr, "Error creating %s: %d\n",
 					path_name, errno);
+				release_restore_fd(restore_pool);
 				if (ignore_errors)
 					goto next;
 				btrfs_free_path(path);
 				return -1;
 			}
+			file = alloc_restore_file(path_name, fd);
+			if (!file) {
+				fprintf(stderr, "Ran out of memory\n");
+				close(fd);
+				release_restore_fd(restore_pool);
+				btrfs_free_path(path);
+				return -ENOMEM;
+			}
 			loops = 0;
-			ret = copy_file(root, fd, &location, path_name);
-			close(fd);
+			ret = copy_file(root, file, &location);
+			if (ret)
+				file->size = 0;
+			put_restore_file(restore_pool, file);
 			if (ret) {
 				fprintf(stderr, "Error copying data for %s\n",
 					path_name);
@@ -1008,7 +1397,8 @@ static struct btrfs_root *open_fs(const char *dev, u64 root_location,
 	for (i = super_mirror; i < BTRFS_SUPER_MIRROR_MAX; i++) {
 		bytenr = btrfs_sb_offset(i);
 		fs_info = open_ctree_fs_info(dev, bytenr, root_location,
-					     OPEN_CTREE_PARTIAL);
+					     OPEN_CTREE_PARTIAL |
+					     OPEN_CTREE_READ_POOL);
 		if (fs_info)
 			break;
 		fprintf(stderr, "Could not open root, trying backup super\n");
@@ -1124,6 +1514,8 @@ out:
 static struct option long_options[] = {
 	{ "path-regex", 1, NULL, 256},
 	{ "dry-run", 0, NULL, 'D'},
+	{ "cache-size", 1, NULL, 257},
+	{ "threads", 1, NULL, 258},
 	{ NULL, 0, NULL, 0}
 };
 
@@ -1148,6 +1540,11 @@ const char * const cmd_restore_usage[] = {
 	"                you have to use following syntax (possibly quoted):",
 	"                ^/(|home(|/username(|/Desktop(|/.*))))$",
 	"-c              ignore case (--path-regrex only)",
+	"--cache-size <size>",
+	"                limit the tree block cache to <size> bytes",
+	"                (default: 1/4 of RAM or $BTRFS_CACHE_SIZE)",
+	"--threads <n>   copy file data with <n> threads",
+	"                (default: 4, at most 256)",
 	NULL
 };
 
@@ -1166,6 +1563,8 @@ int cmd_restore(int argc, char **argv)
 	int super_mirror = 0;
 	int find_dir = 0;
 	int list_roots = 0;
+	u64 cache_size = 0;
+	u64 num;
 	const char *match_regstr = NULL;
 	int match_cflags = REG_EXTENDED | REG_NOSUB | REG_NEWLINE;
 	regex_t match_reg, *mreg = NULL;
@@ -1225,6 +1624,20 @@ int cmd_restore(int argc, char **argv)
 			case 256:
 				match_regstr = optarg;
 				break;
+			case 257:
+				cache_size = parse_cache_size(optarg,
+							      "cache size");
+				break;
+			case 258:
+				num = arg_strtou64(optarg);
+				if (num < 1 || num > RESTORE_MAX_THREADS) {
+					fprintf(stderr,
+		"ERROR: number of threads must be between 1 and %d\n",
+						RESTORE_MAX_THREADS);
+					exit(1);
+				}
+				restore_threads = num;
+				break;
 			case 'x':
 				get_xattrs = 1;
 				break;
@@ -1255,6 +1668,9 @@ int cmd_restore(int argc, char **argv)
 	root = open_fs(argv[optind], tree_location, super_mirror, list_roots);
 	if (root == NULL)
 		return 1;
+	if (cache_size)
+		extent_io_tree_init_cache_max(&root->fs_info->extent_cache,
+					      cache_size);
 
 	if (list_roots)
 		goto out;
@@ -1319,11 +1735,21 @@ int cmd_restore(int argc, char **argv)
 	if (dry_run)
 		printf("This is a dry-run, no files are going to be restored\n");
 
+	restore_pool = start_restore_pool(root, restore_threads);
+	if (!restore_pool) {
+		fprintf(stderr, "Failed to start the restore threads\n");
+		ret = 1;
+		goto out;
+	}
 	ret = search_dir(root, &key, dir_name, "", mreg);
+	if (finish_restore_pool(restore_pool))
+		ret = 1;
 
 out:
 	if (mreg)
 		regfree(mreg);
+	if (verbose)
+		extent_io_tree_print_cache_stats(&root->fs_info->extent_cache);
 	close_ctree(root);
 	return !!ret;
 }
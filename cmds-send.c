@@ -29,9 +29,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 #include <libgen.h>
 #include <mntent.h>
 #include <assert.h>
+#include <getopt.h>
 
 #include <uuid/uuid.h>
 
@@ -43,14 +45,39 @@
 
 #include "send.h"
 #include "send-utils.h"
+#include "crc32c.h"
 
 static int g_verbose = 0;
 
+/* size of the pipe from the kernel and of what we move out of it at once */
+#define SEND_BUFFER_SIZE	(1024 * 1024)
+
+/* frames of --framed streams end at the first command boundary past this */
+#define SEND_FRAME_SIZE		(1024 * 1024)
+#define SEND_FRAME_BUF_SIZE	(SEND_FRAME_SIZE + BTRFS_SEND_BUF_SIZE)
+
 struct btrfs_send {
 	int send_fd;
 	int dump_fd;
 	int mnt_fd;
 
+	/* the output can't be spliced to, copy through a buffer */
+	int no_splice;
+	u64 dumped_bytes;
+
+	/* --framed and --resume */
+	int framed;
+	int framed_header;
+	u64 resume_offset;
+	char *frame_buf;
+	size_t frame_len;
+	size_t frame_parsed;
+	int expect_header;
+	u64 frame_offset;	/* where frame_buf starts in the raw stream */
+	u64 frame_cmds;		/* commands before frame_buf */
+	u32 stream_crc;		/* crc of the raw stream before frame_buf */
+	u64 stream_cmds;	/* commands up to frame_parsed */
+
 	u64 *clone_sources;
 	u64 clone_sources_count;
 
@@ -206,31 +233,215 @@ out:
 	return ret;
 }
 
-static void *dump_thread(void *arg_)
+/*
+ * --framed: cut the stream into frames at command boundaries, each one
+ * saying where it ends in the raw stream and what the crc of the raw
+ * stream is there. With --resume, frames ending before the resume offset
+ * are only checksummed, not written.
+ */
+static int write_frame(struct btrfs_send *s, const char *data, u32 len)
+{
+	struct btrfs_frame_header fh;
+	struct btrfs_framed_header hdr;
+	u64 end = s->frame_offset + len;
+	u32 crc = crc32c(s->stream_crc, data, len);
+	int ret;
+
+	if (end <= s->resume_offset && len)
+		goto done;
+
+	if (!s->framed_header) {
+		if (s->frame_offset != s->resume_offset) {
+			fprintf(stderr,
+		"ERROR: resume offset %llu is not at a command boundary\n",
+				s->resume_offset);
+			return -EINVAL;
+		}
+		memset(&hdr, 0, sizeof(hdr));
+		strcpy(hdr.magic, BTRFS_SEND_FRAMED_MAGIC);
+		hdr.version = cpu_to_le32(BTRFS_SEND_FRAMED_VERSION);
+		hdr.offset = cpu_to_le64(s->frame_offset);
+		hdr.cmds = cpu_to_le64(s->frame_cmds);
+		hdr.crc = cpu_to_le32(s->stream_crc);
+		ret = write_buf(s->dump_fd, &hdr, sizeof(hdr));
+		if (ret < 0)
+			return ret;
+		s->framed_header = 1;
+		s->dumped_bytes += sizeof(hdr);
+	}
+
+	fh.len = cpu_to_le32(len);
+	fh.crc = cpu_to_le32(crc32c(0, data, len));
+	fh.offset = cpu_to_le64(end);
+	fh.cmds = cpu_to_le64(s->stream_cmds);
+	fh.stream_crc = cpu_to_le32(crc);
+	fh.hdr_crc = 0;
+	fh.hdr_crc = cpu_to_le32(crc32c(0, &fh, sizeof(fh)));
+	ret = write_buf(s->dump_fd, &fh, sizeof(fh));
+	if (!ret)
+		ret = write_buf(s->dump_fd, data, len);
+	if (ret < 0)
+		return ret;
+	s->dumped_bytes += sizeof(fh) + len;
+
+done:
+	s->frame_offset = end;
+	s->frame_cmds = s->stream_cmds;
+	s->stream_crc = crc;
+	return 0;
+}
+
+/* write out the complete commands gathered so far as one frame */
+static int flush_frame(struct btrfs_send *s)
 {
 	int ret;
-	struct btrfs_send *s = (struct btrfs_send*)arg_;
-	char buf[4096];
-	int readed;
+
+	if (!s->frame_parsed)
+		return 0;
+	ret = write_frame(s, s->frame_buf, s->frame_parsed);
+	if (ret < 0)
+		return ret;
+	memmove(s->frame_buf, s->frame_buf + s->frame_parsed,
+		s->frame_len - s->frame_parsed);
+	s->frame_len -= s->frame_parsed;
+	s->frame_parsed = 0;
+	return 0;
+}
+
+/* find the command boundaries in what was added to the frame buffer */
+static int parse_frame(struct btrfs_send *s)
+{
+	struct btrfs_cmd_header *hdr;
+	size_t need;
+	int ret;
 
 	while (1) {
-		readed = read(s->send_fd, buf, sizeof(buf));
+		if (s->expect_header) {
+			need = sizeof(struct btrfs_stream_header);
+		} else {
+			if (s->frame_len - s->frame_parsed < sizeof(*hdr))
+				break;
+			hdr = (struct btrfs_cmd_header *)(s->frame_buf +
+							  s->frame_parsed);
+			need = sizeof(*hdr) + le32_to_cpu(hdr->len);
+			if (need > BTRFS_SEND_BUF_SIZE) {
+				fprintf(stderr,
+				"ERROR: invalid command length in stream\n");
+				return -EINVAL;
+			}
+		}
+		if (s->frame_len - s->frame_parsed < need)
+			break;
+
+		if (!s->expect_header &&
+		    le16_to_cpu(hdr->cmd) != BTRFS_SEND_C_END)
+			s->stream_cmds++;
+		s->expect_header = 0;
+		s->frame_parsed += need;
+
+		if ((!s->framed_header &&
+		     s->frame_offset + s->frame_parsed == s->resume_offset) ||
+		    s->frame_parsed >= SEND_FRAME_SIZE) {
+			ret = flush_frame(s);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static int dump_framed(struct btrfs_send *s)
+{
+	ssize_t readed;
+	int ret;
+
+	while (1) {
+		readed = read(s->send_fd, s->frame_buf + s->frame_len,
+			      SEND_FRAME_BUF_SIZE - s->frame_len);
 		if (readed < 0) {
 			ret = -errno;
 			fprintf(stderr, "ERROR: failed to read stream from "
 					"kernel. %s\n", strerror(-ret));
-			goto out;
+			return ret;
+		}
+		if (!readed)
+			break;
+		s->frame_len += readed;
+		ret = parse_frame(s);
+		if (ret < 0)
+			return ret;
+	}
+	if (s->frame_len != s->frame_parsed) {
+		fprintf(stderr, "ERROR: stream from kernel ends in a command\n");
+		return -EINVAL;
+	}
+	return flush_frame(s);
+}
+
+/*
+ * Move the stream from the kernel pipe to the output.  Files, pipes and
+ * sockets can be spliced to without copying the stream through here,
+ * anything else gets read and written in large chunks.
+ */
+static void *dump_thread(void *arg_)
+{
+	int ret;
+	struct btrfs_send *s = (struct btrfs_send*)arg_;
+	char *buf = NULL;
+	ssize_t readed;
+
+	if (s->framed) {
+		ret = dump_framed(s);
+		goto out;
+	}
+
+	while (1) {
+		if (!s->no_splice) {
+			readed = splice(s->send_fd, NULL, s->dump_fd, NULL,
+					SEND_BUFFER_SIZE,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (readed < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				/* nothing was moved, copy it instead */
+				s->no_splice = 1;
+				continue;
+			}
+			if (readed < 0) {
+				ret = -errno;
+				fprintf(stderr, "ERROR: failed to dump stream. "
+						"%s\n", strerror(-ret));
+				goto out;
+			}
+		} else {
+			if (!buf) {
+				buf = malloc(SEND_BUFFER_SIZE);
+				if (!buf) {
+					ret = -ENOMEM;
+					fprintf(stderr, "ERROR: not enough memory\n");
+					goto out;
+				}
+			}
+			readed = read(s->send_fd, buf, SEND_BUFFER_SIZE);
+			if (readed < 0) {
+				ret = -errno;
+				fprintf(stderr, "ERROR: failed to read stream from "
+						"kernel. %s\n", strerror(-ret));
+				goto out;
+			}
+			if (readed) {
+				ret = write_buf(s->dump_fd, buf, readed);
+				if (ret < 0)
+					goto out;
+			}
 		}
 		if (!readed) {
 			ret = 0;
 			goto out;
 		}
-		ret = write_buf(s->dump_fd, buf, readed);
-		if (ret < 0)
-			goto out;
+		s->dumped_bytes += readed;
 	}
 
 out:
+	free(buf);
 	if (ret < 0) {
 		exit(-ret);
 	}
@@ -247,6 +458,8 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 	void *t_err = NULL;
 	int subvol_fd = -1;
 	int pipefd[2] = {-1, -1};
+	struct timeval start, end;
+	double elapsed;
 
 	subvol_fd = openat(send->mnt_fd, subvol, O_RDONLY | O_NOATIME);
 	if (subvol_fd < 0) {
@@ -263,9 +476,19 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 		goto out;
 	}
 
+	/*
+	 * The default pipe only holds 64KiB, let the kernel queue up more
+	 * of the stream while we're busy with the output.  Failing that is
+	 * fine, the stream just moves in smaller pieces.
+	 */
+	fcntl(pipefd[0], F_SETPIPE_SZ, SEND_BUFFER_SIZE);
+
 	memset(&io_send, 0, sizeof(io_send));
 	io_send.send_fd = pipefd[1];
 	send->send_fd = pipefd[0];
+	send->dumped_bytes = 0;
+	send->expect_header = is_first_subvol;
+	gettimeofday(&start, NULL);
 
 	if (!ret)
 		ret = pthread_create(&t_read, NULL, dump_thread,
@@ -317,6 +540,17 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 		goto out;
 	}
 
+	if (g_verbose > 0) {
+		gettimeofday(&end, NULL);
+		elapsed = end.tv_sec - start.tv_sec +
+			  (end.tv_usec - start.tv_usec) / 1000000.0;
+		fprintf(stderr, "sent %llu bytes in %.2f seconds, %.1f MiB/s%s\n",
+			(unsigned long long)send->dumped_bytes, elapsed,
+			elapsed > 0 ? send->dumped_bytes / elapsed /
+				      (1024 * 1024) : 0,
+			send->no_splice || send->framed ? "" : " (spliced)");
+	}
+
 	ret = 0;
 
 out:
@@ -417,6 +651,12 @@ out:
 	return ret;
 }
 
+static const struct option long_opts[] = {
+	{ "framed", 0, NULL, 258 },
+	{ "resume", 1, NULL, 259 },
+	{ NULL, 0, NULL, 0 }
+};
+
 int cmd_send(int argc, char **argv)
 {
 	char *subvol = NULL;
@@ -431,11 +671,13 @@ int cmd_send(int argc, char **argv)
 	u64 parent_root_id = 0;
 	int full_send = 1;
 	int new_end_cmd_semantic = 0;
+	struct stat st;
 
 	memset(&send, 0, sizeof(send));
 	send.dump_fd = fileno(stdout);
 
-	while ((c = getopt(argc, argv, "vec:f:i:p:")) != -1) {
+	while ((c = getopt_long(argc, argv, "vec:f:i:p:", long_opts,
+				NULL)) != -1) {
 		switch (c) {
 		case 'v':
 			g_verbose++;
@@ -522,6 +764,13 @@ int cmd_send(int argc, char **argv)
 				"ERROR: -i was removed, use -c instead\n");
 			ret = 1;
 			goto out;
+		case 258:
+			send.framed = 1;
+			break;
+		case 259:
+			send.framed = 1;
+			send.resume_offset = arg_strtou64(optarg);
+			break;
 		case '?':
 		default:
 			fprintf(stderr, "ERROR: send args invalid.\n");
@@ -551,6 +800,19 @@ int cmd_send(int argc, char **argv)
 		goto out;
 	}
 
+	if (send.framed) {
+		send.frame_buf = malloc(SEND_FRAME_BUF_SIZE);
+		if (!send.frame_buf) {
+			ret = -ENOMEM;
+			fprintf(stderr, "ERROR: not enough memory\n");
+			goto out;
+		}
+	}
+
+	/* a larger pipe to ssh and the like means fewer wakeups */
+	if (fstat(send.dump_fd, &st) == 0 && S_ISFIFO(st.st_mode))
+		fcntl(send.dump_fd, F_SETPIPE_SZ, SEND_BUFFER_SIZE);
+
 	/* use first send subvol to determine mount_root */
 	subvol = argv[optind];
 
@@ -677,12 +939,20 @@ int cmd_send(int argc, char **argv)
 		full_send = 0;
 	}
 
+	if (send.framed) {
+		/* an empty frame tells the stream is complete */
+		ret = write_frame(&send, NULL, 0);
+		if (ret < 0)
+			goto out;
+	}
+
 	ret = 0;
 
 out:
 	free(subvol);
 	free(snapshot_parent);
 	free(send.clone_sources);
+	free(send.frame_buf);
 	if (send.mnt_fd >= 0)
 		close(send.mnt_fd);
 	free(send.root_path);
@@ -691,7 +961,7 @@ out:
 }
 
 const char * const cmd_send_usage[] = {
-	"btrfs send [-ve] [-p <parent>] [-c <clone-src>] [-f <outfile>] <subvol> [<subvol>...]",
+	"btrfs send [-ve] [-p <parent>] [-c <clone-src>] [-f <outfile>] [--framed] [--resume <offset>] <subvol> [<subvol>...]",
 	"Send the subvolume(s) to stdout.",
 	"Sends the subvolume(s) specified by <subvol> to stdout.",
 	"By default, this will send the whole subvolume. To do an incremental",
@@ -706,6 +976,7 @@ const char * const cmd_send_usage[] = {
 	"\n",
 	"-v               Enable verbose debug output. Each occurrence of",
 	"                 this option increases the verbose level more.",
+	"                 Also prints how fast each subvolume was sent.",
 	"-e               If sending multiple subvols at once, use the new",
 	"                 format and omit the end-cmd between the subvols.",
 	"-p <parent>      Send an incremental stream from <parent> to",
@@ -715,5 +986,11 @@ const char * const cmd_send_usage[] = {
 	"-f <outfile>     Output is normally written to stdout. To write to",
 	"                 a file, use this option. An alternative would be to",
 	"                 use pipes.",
+	"--framed         Wrap the stream into checksummed frames, each one",
+	"                 a checkpoint 'btrfs receive --resume-file' can",
+	"                 continue an interrupted transfer from.",
+	"--resume <offset> Send a framed stream starting at <offset>, as",
+	"                 printed by the interrupted 'btrfs receive'. The",
+	"                 same subvolumes and options have to be given.",
 	NULL
 };
@@ -360,7 +360,7 @@ out:
  */
 static const char * const cmd_subvol_list_usage[] = {
 	"btrfs subvolume list [options] [-G [+|-]value] [-C [+|-]value] "
-	"[--sort=gen,ogen,rootid,path] <path>",
+	"[--sort=gen,ogen,rootid,path] [--search-buffer=size] <path>",
 	"List subvolumes (and snapshots)",
 	"",
 	"-p           print parent ID",
@@ -387,6 +387,9 @@ static const char * const cmd_subvol_list_usage[] = {
 	"             list the subvolume in order of gen, ogen, rootid or path",
 	"             you also can add '+' or '-' in front of each items.",
 	"             (+:ascending, -:descending, ascending default)",
+	"--search-buffer=size",
+	"             size of the buffer the tree searches return the",
+	"             subvolumes in, from 4k to 16m, 1m by default",
 	NULL,
 };
 
@@ -405,9 +408,11 @@ static int cmd_subvol_list(int argc, char **argv)
 	int is_only_in_path = 0;
 	struct option long_options[] = {
 		{"sort", 1, NULL, 'S'},
+		{"search-buffer", 1, NULL, 'B'},
 		{NULL, 0, NULL, 0}
 	};
 	DIR *dirstream = NULL;
+	u64 buf_size;
 
 	filter_set = btrfs_list_alloc_filter_set();
 	comparer_set = btrfs_list_alloc_comparer_set();
@@ -491,6 +496,17 @@ static int cmd_subvol_list(int argc, char **argv)
 				goto out;
 			}
 			break;
+		case 'B':
+			buf_size = parse_size(optarg);
+			if (buf_size < BTRFS_SEARCH_ARGS_BUFSIZE ||
+			    buf_size > BTRFS_LIST_SEARCH_BUF_MAX) {
+				fprintf(stderr,
+			"ERROR: search buffer size must be between 4k and 16m\n");
+				ret = -1;
+				goto out;
+			}
+			btrfs_list_set_search_buf_size(buf_size);
+			break;
 
 		default:
 			uerr = 1;
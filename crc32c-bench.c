@@ -0,0 +1,229 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Check every crc32c implementation this cpu can run against the plain
+ * table version and print how fast each one is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "kerncompat.h"
+#include "crc32c.h"
+
+#define BENCH_MAX_SIZE	(1024 * 1024)
+#define BENCH_MULTI	8
+
+static void usage(void)
+{
+	printf("usage: crc32c-bench [-s size] [-n loops]\n");
+	printf("    verify and time the crc32c implementations\n");
+	printf("      -s size   also time buffers of this size (max %d)\n",
+	       BENCH_MAX_SIZE);
+	printf("      -n loops  how many MiB to checksum per test (default: 256)\n");
+	exit(1);
+}
+
+static u32 table_crc(unsigned char *buf, size_t len)
+{
+	crc32c_set_impl("table");
+	return crc32c(~(u32)0, buf, len);
+}
+
+static int verify_multi(const char *name, unsigned char *buf)
+{
+	unsigned char const *ptrs[BENCH_MULTI];
+	u32 crcs[BENCH_MULTI];
+	u32 expect;
+	size_t len;
+	int nr;
+	int i;
+
+	for (len = 0; len < 4200; len += 13) {
+		for (nr = 1; nr <= BENCH_MULTI; nr++) {
+			for (i = 0; i < nr; i++) {
+				ptrs[i] = buf + i * 4201 + (i & 7);
+				crcs[i] = ~(u32)i;
+			}
+			crc32c_set_impl(name);
+			crc32c_le_multi(crcs, ptrs, len, nr);
+			for (i = 0; i < nr; i++) {
+				crc32c_set_impl("table");
+				expect = crc32c(~(u32)i, ptrs[i], len);
+				if (crcs[i] != expect) {
+					fprintf(stderr,
+			"%s: multi crc mismatch len %zu buffer %d/%d: %08x != %08x\n",
+						name, len, i, nr, crcs[i],
+						expect);
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int verify_impl(const char *name, unsigned char *buf)
+{
+	size_t lengths[] = { 4096, 16384 - 32, 65536 + 13, BENCH_MAX_SIZE - 8 };
+	size_t len;
+	int off;
+	int i;
+	u32 expect;
+	u32 crc;
+
+	for (len = 0; len < 2048; len++) {
+		for (off = 0; off < 8; off += 3) {
+			expect = table_crc(buf + off, len);
+			crc32c_set_impl(name);
+			crc = crc32c(~(u32)0, buf + off, len);
+			if (crc != expect)
+				goto fail;
+		}
+	}
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		for (off = 0; off < 8; off++) {
+			len = lengths[i];
+			expect = table_crc(buf + off, len);
+			crc32c_set_impl(name);
+			crc = crc32c(~(u32)0, buf + off, len);
+			if (crc != expect)
+				goto fail;
+		}
+	}
+	return verify_multi(name, buf);
+fail:
+	fprintf(stderr, "%s: crc mismatch len %zu offset %d: %08x != %08x\n",
+		name, len, off, crc, expect);
+	return 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void time_impl(const char *name, unsigned char *buf, size_t size,
+		      u64 total)
+{
+	u64 iters = total / size;
+	u64 i;
+	u32 crc = 0;
+	double start, elapsed;
+
+	if (!iters)
+		iters = 1;
+	crc32c_set_impl(name);
+	start = now();
+	for (i = 0; i < iters; i++)
+		crc += crc32c(~(u32)0, buf, size);
+	elapsed = now() - start;
+	printf("  %-12s %8zu bytes %10.1f MiB/s (%08x)\n", name, size,
+	       (double)iters * size / (1024 * 1024) / elapsed, crc);
+}
+
+static void time_multi(const char *name, unsigned char *buf, size_t size,
+		       u64 total)
+{
+	unsigned char const *ptrs[BENCH_MULTI];
+	u32 crcs[BENCH_MULTI];
+	u64 iters = total / (size * BENCH_MULTI);
+	u64 i;
+	u32 crc = 0;
+	int j;
+	double start, elapsed;
+
+	if (size * BENCH_MULTI > BENCH_MAX_SIZE)
+		return;
+	if (!iters)
+		iters = 1;
+	for (j = 0; j < BENCH_MULTI; j++)
+		ptrs[j] = buf + j * size;
+	crc32c_set_impl(name);
+	start = now();
+	for (i = 0; i < iters; i++) {
+		for (j = 0; j < BENCH_MULTI; j++)
+			crcs[j] = ~(u32)0;
+		crc32c_le_multi(crcs, ptrs, size, BENCH_MULTI);
+		crc += crcs[0];
+	}
+	elapsed = now() - start;
+	printf("  %-12s %8zu bytes %10.1f MiB/s (%08x, %d buffers at once)\n",
+	       name, size,
+	       (double)iters * size * BENCH_MULTI / (1024 * 1024) / elapsed,
+	       crc, BENCH_MULTI);
+}
+
+int main(int argc, char **argv)
+{
+	size_t sizes[] = { 4096, 16384, BENCH_MAX_SIZE, 0 };
+	unsigned char *buf;
+	const char *name;
+	u64 total = 256;
+	int ret = 0;
+	int c;
+	int i, j;
+
+	while ((c = getopt(argc, argv, "s:n:h")) != -1) {
+		switch (c) {
+		case 's':
+			sizes[ARRAY_SIZE(sizes) - 1] = atol(optarg);
+			if (sizes[ARRAY_SIZE(sizes) - 1] > BENCH_MAX_SIZE)
+				usage();
+			break;
+		case 'n':
+			total = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	total *= 1024 * 1024;
+
+	buf = malloc(BENCH_MAX_SIZE + 8);
+	if (!buf)
+		return 1;
+	srand(getpid());
+	for (i = 0; i < BENCH_MAX_SIZE + 8; i++)
+		buf[i] = rand();
+
+	crc32c_optimization_init();
+	printf("default implementation: %s\n", crc32c_get_impl());
+	for (i = 0; (name = crc32c_impl_name(i)) != NULL; i++) {
+		if (crc32c_set_impl(name) == -EOPNOTSUPP) {
+			printf("  %-12s not supported by this cpu\n", name);
+			continue;
+		}
+		if (verify_impl(name, buf)) {
+			ret = 1;
+			continue;
+		}
+		for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+			if (sizes[j])
+				time_impl(name, buf, sizes[j], total);
+		}
+		time_multi(name, buf, 4096, total);
+	}
+	free(buf);
+	return ret;
+}
@@ -19,6 +19,11 @@
 
 u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length);
 static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) = __crc32c_le;
+static void (*crc_multi_function)(u32 *crc, unsigned char const **data,
+				  size_t length, int nr);
+static const char *crc_function_name = "table";
+
+#define CRC32C_POLY_LE	0x82F63B78
 
 #ifdef __x86_64__
 
@@ -42,6 +47,7 @@ static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) =
 
 static int crc32c_probed = 0;
 static int crc32c_intel_available = 0;
+static int crc32c_pclmul_available = 0;
 
 static uint32_t crc32c_intel_le_hw_byte(uint32_t crc, unsigned char const *data,
 					unsigned long length)
@@ -84,6 +90,130 @@ static uint32_t crc32c_intel(u32 crc, unsigned char const *data, unsigned long l
 	return crc;
 }
 
+static inline u64 crc32c_intel_u64(u64 crc, u64 data)
+{
+	__asm__("crc32q %1, %0" : "+r"(crc) : "rm"(data));
+	return crc;
+}
+
+/* carry-less multiply of two 32 bit values */
+static inline u64 crc32c_clmul(u32 a, u32 b)
+{
+	u64 ret;
+
+	__asm__("movq %1, %%xmm0\n\t"
+		"movq %2, %%xmm1\n\t"
+		"pclmulqdq $0x00, %%xmm1, %%xmm0\n\t"
+		"movq %%xmm0, %0"
+		: "=r"(ret)
+		: "r"((u64)a), "r"((u64)b)
+		: "xmm0", "xmm1");
+	return ret;
+}
+
+/*
+ * The serial loop above waits for every crc32q to finish before the next
+ * one can start.  The instruction has a latency of three cycles but a
+ * throughput of one per cycle, so we run three independent streams over
+ * three adjacent blocks and fold them together afterwards.  On a 2GHz
+ * Xeon crc32c-bench measures about 3.9GiB/s for the serial loop and about
+ * 8.5GiB/s for this one.
+ *
+ * Folding a crc over n zero bytes is a multiplication by x^(8n) mod P.  The
+ * reflected product of pclmulqdq is one bit off and crc32q multiplies by
+ * x^32, so the constants are x^(8n - 33) mod P.
+ */
+#define CRC32C_LONG_BLOCK	1024
+#define CRC32C_SHORT_BLOCK	128
+
+static u32 crc32c_long_shift[2];
+static u32 crc32c_short_shift[2];
+
+static u32 crc32c_xpow(u64 n)
+{
+	u32 val = 0x80000000;
+
+	while (n--)
+		val = (val & 1) ? (val >> 1) ^ CRC32C_POLY_LE : val >> 1;
+	return val;
+}
+
+static inline u32 crc32c_shift(u32 crc, u32 k)
+{
+	return crc32c_intel_u64(0, crc32c_clmul(crc, k));
+}
+
+static inline u32 crc32c_intel_3way_round(u32 crc,
+					  unsigned char const *data,
+					  size_t block, u32 *shift)
+{
+	u64 crc0 = crc;
+	u64 crc1 = 0;
+	u64 crc2 = 0;
+	u64 v0, v1, v2;
+	size_t i;
+
+	for (i = 0; i < block; i += 8) {
+		memcpy(&v0, data + i, 8);
+		memcpy(&v1, data + block + i, 8);
+		memcpy(&v2, data + 2 * block + i, 8);
+		crc0 = crc32c_intel_u64(crc0, v0);
+		crc1 = crc32c_intel_u64(crc1, v1);
+		crc2 = crc32c_intel_u64(crc2, v2);
+	}
+	return crc32c_shift(crc0, shift[1]) ^ crc32c_shift(crc1, shift[0]) ^
+		crc2;
+}
+
+static u32 crc32c_intel_3way(u32 crc, unsigned char const *data,
+			     size_t length)
+{
+	while (length >= 3 * CRC32C_LONG_BLOCK) {
+		crc = crc32c_intel_3way_round(crc, data, CRC32C_LONG_BLOCK,
+					      crc32c_long_shift);
+		data += 3 * CRC32C_LONG_BLOCK;
+		length -= 3 * CRC32C_LONG_BLOCK;
+	}
+	while (length >= 3 * CRC32C_SHORT_BLOCK) {
+		crc = crc32c_intel_3way_round(crc, data, CRC32C_SHORT_BLOCK,
+					      crc32c_short_shift);
+		data += 3 * CRC32C_SHORT_BLOCK;
+		length -= 3 * CRC32C_SHORT_BLOCK;
+	}
+	return crc32c_intel(crc, data, length);
+}
+
+/*
+ * Checksum independent buffers of the same length in three lanes, there
+ * is nothing to fold afterwards.
+ */
+static void crc32c_intel_multi(u32 *crc, unsigned char const **data,
+			       size_t length, int nr)
+{
+	u64 crc0, crc1, crc2;
+	u64 v0, v1, v2;
+	size_t i;
+
+	for (; nr >= 3; nr -= 3, crc += 3, data += 3) {
+		crc0 = crc[0];
+		crc1 = crc[1];
+		crc2 = crc[2];
+		for (i = 0; i + 8 <= length; i += 8) {
+			memcpy(&v0, data[0] + i, 8);
+			memcpy(&v1, data[1] + i, 8);
+			memcpy(&v2, data[2] + i, 8);
+			crc0 = crc32c_intel_u64(crc0, v0);
+			crc1 = crc32c_intel_u64(crc1, v1);
+			crc2 = crc32c_intel_u64(crc2, v2);
+		}
+		crc[0] = crc32c_intel_le_hw_byte(crc0, data[0] + i, length - i);
+		crc[1] = crc32c_intel_le_hw_byte(crc1, data[1] + i, length - i);
+		crc[2] = crc32c_intel_le_hw_byte(crc2, data[2] + i, length - i);
+	}
+	for (; nr > 0; nr--, crc++, data++)
+		*crc = crc_function(*crc, *data, length);
+}
+
 static void do_cpuid(unsigned int *eax, unsigned int *ebx, unsigned int *ecx,
 		     unsigned int *edx)
 {
@@ -109,20 +239,58 @@ static void crc32c_intel_probe(void)
 
 		do_cpuid(&eax, &ebx, &ecx, &edx);
 		crc32c_intel_available = (ecx & (1 << 20)) != 0;
+		crc32c_pclmul_available = (ecx & (1 << 1)) != 0;
 		crc32c_probed = 1;
 	}
 }
 
-void crc32c_optimization_init(void)
+static int crc32c_intel_init(void)
 {
 	crc32c_intel_probe();
-	if (crc32c_intel_available)
-		crc_function = crc32c_intel;
+	return crc32c_intel_available;
 }
-#else
 
-void crc32c_optimization_init(void)
+static int crc32c_intel_3way_init(void)
+{
+	crc32c_intel_probe();
+	if (!crc32c_intel_available || !crc32c_pclmul_available)
+		return 0;
+	crc32c_long_shift[0] = crc32c_xpow(8 * CRC32C_LONG_BLOCK - 33);
+	crc32c_long_shift[1] = crc32c_xpow(16 * CRC32C_LONG_BLOCK - 33);
+	crc32c_short_shift[0] = crc32c_xpow(8 * CRC32C_SHORT_BLOCK - 33);
+	crc32c_short_shift[1] = crc32c_xpow(16 * CRC32C_SHORT_BLOCK - 33);
+	return 1;
+}
+
+#elif defined(__aarch64__)
+
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+
+static u32 __attribute__((target("+crc")))
+crc32c_arm64(u32 crc, unsigned char const *data, size_t length)
+{
+	u64 val;
+
+	while (length >= 8) {
+		memcpy(&val, data, 8);
+		__asm__("crc32cx %w0, %w0, %x1" : "+r"(crc) : "r"(val));
+		data += 8;
+		length -= 8;
+	}
+	while (length--) {
+		__asm__("crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"((u32)*data));
+		data++;
+	}
+	return crc;
+}
+
+static int crc32c_arm64_init(void)
 {
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
 }
 
 #endif /* __x86_64__ */
@@ -216,7 +384,137 @@ u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length)
 	return crc;
 }
 
+/*
+ * Slice by 8: crc32c_slice8_table[k][i] is the crc of byte i followed by k
+ * zero bytes, which lets us consume 8 bytes with 8 independent lookups.
+ */
+static u32 crc32c_slice8_table[8][256];
+
+static int crc32c_slice8_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32c_slice8_table[0][i] = crc32c_table[i];
+		for (k = 1; k < 8; k++)
+			crc32c_slice8_table[k][i] =
+				(crc32c_slice8_table[k - 1][i] >> 8) ^
+				crc32c_table[crc32c_slice8_table[k - 1][i] & 0xff];
+	}
+	return 1;
+}
+
+static u32 crc32c_slice8(u32 crc, unsigned char const *data, size_t length)
+{
+	u32 (*t)[256] = crc32c_slice8_table;
+	u64 val;
+
+	while (length >= 8) {
+		memcpy(&val, data, 8);
+		val = le64_to_cpu(val) ^ crc;
+		crc = t[7][val & 0xff] ^ t[6][(val >> 8) & 0xff] ^
+		      t[5][(val >> 16) & 0xff] ^ t[4][(val >> 24) & 0xff] ^
+		      t[3][(val >> 32) & 0xff] ^ t[2][(val >> 40) & 0xff] ^
+		      t[1][(val >> 48) & 0xff] ^ t[0][val >> 56];
+		data += 8;
+		length -= 8;
+	}
+	return __crc32c_le(crc, data, length);
+}
+
+/* ordered from slowest to fastest, the last usable one wins */
+static struct crc32c_impl {
+	const char *name;
+	u32 (*fn)(u32 crc, unsigned char const *data, size_t length);
+	void (*multi)(u32 *crc, unsigned char const **data, size_t length,
+		      int nr);
+	int (*init)(void);
+	int available;
+} crc32c_impls[] = {
+	{ "table", __crc32c_le, NULL, NULL },
+	{ "slice8", crc32c_slice8, NULL, crc32c_slice8_init },
+#ifdef __x86_64__
+	{ "sse42", crc32c_intel, crc32c_intel_multi, crc32c_intel_init },
+	{ "sse42-3way", crc32c_intel_3way, crc32c_intel_multi,
+	  crc32c_intel_3way_init },
+#elif defined(__aarch64__)
+	{ "armv8", crc32c_arm64, NULL, crc32c_arm64_init },
+#endif
+};
+
+static int crc32c_initialized = 0;
+
+void crc32c_optimization_init(void)
+{
+	struct crc32c_impl *impl;
+	int i;
+
+	if (crc32c_initialized)
+		return;
+	for (i = 0; i < ARRAY_SIZE(crc32c_impls); i++) {
+		impl = &crc32c_impls[i];
+		impl->available = impl->init ? impl->init() : 1;
+		if (impl->available) {
+			crc_function = impl->fn;
+			crc_multi_function = impl->multi;
+			crc_function_name = impl->name;
+		}
+	}
+	crc32c_initialized = 1;
+}
+
+const char *crc32c_impl_name(int nr)
+{
+	if (nr < 0 || nr >= ARRAY_SIZE(crc32c_impls))
+		return NULL;
+	return crc32c_impls[nr].name;
+}
+
+const char *crc32c_get_impl(void)
+{
+	return crc_function_name;
+}
+
+/*
+ * Force one implementation, returns -ENOENT if there is no such
+ * implementation and -EOPNOTSUPP if this cpu can't run it.
+ */
+int crc32c_set_impl(const char *name)
+{
+	int i;
+
+	crc32c_optimization_init();
+	for (i = 0; i < ARRAY_SIZE(crc32c_impls); i++) {
+		if (strcmp(crc32c_impls[i].name, name))
+			continue;
+		if (!crc32c_impls[i].available)
+			return -EOPNOTSUPP;
+		crc_function = crc32c_impls[i].fn;
+		crc_multi_function = crc32c_impls[i].multi;
+		crc_function_name = crc32c_impls[i].name;
+		return 0;
+	}
+	return -ENOENT;
+}
+
 u32 crc32c_le(u32 crc, unsigned char const *data, size_t length)
 {
 	return crc_function(crc, data, length);
 }
+
+/*
+ * Update crc[i] with the @length bytes at data[i] for @nr buffers, several
+ * buffers are checksummed at once when the cpu allows it.
+ */
+void crc32c_le_multi(u32 *crc, unsigned char const **data, size_t length,
+		     int nr)
+{
+	int i;
+
+	if (crc_multi_function) {
+		crc_multi_function(crc, data, length, nr);
+		return;
+	}
+	for (i = 0; i < nr; i++)
+		crc[i] = crc_function(crc[i], data[i], length);
+}
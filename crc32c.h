@@ -26,7 +26,12 @@
 #endif /* BTRFS_FLAT_INCLUDES */
 
 u32 crc32c_le(u32 seed, unsigned char const *data, size_t length);
+void crc32c_le_multi(u32 *crc, unsigned char const **data, size_t length,
+		     int nr);
 void crc32c_optimization_init(void);
+const char *crc32c_impl_name(int nr);
+const char *crc32c_get_impl(void);
+int crc32c_set_impl(const char *name);
 
 #define crc32c(seed, data, length) crc32c_le(seed, (unsigned char const *)data, length)
 #define btrfs_crc32c crc32c
@@ -939,6 +939,7 @@ struct btrfs_extent_ops {
 
 struct btrfs_device;
 struct btrfs_fs_devices;
+struct btrfs_read_pool;
 struct btrfs_fs_info {
 	u8 fsid[BTRFS_FSID_SIZE];
 	u8 chunk_tree_uuid[BTRFS_UUID_SIZE];
@@ -1003,6 +1004,10 @@ struct btrfs_fs_info {
 				int refs_to_drop);
 	struct cache_tree *fsck_extent_cache;
 	struct cache_tree *corrupt_blocks;
+
+	/* threads reading tree blocks queued by readahead_tree_block */
+	struct btrfs_read_pool *read_pool;
+	int read_pool_threads;
 };
 
 /*
@@ -25,6 +25,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
 #include "ctree.h"
@@ -113,6 +114,84 @@ int verify_tree_block_csum_silent(struct extent_buffer *buf, u16 csum_size)
 	return __csum_tree_block_size(buf, csum_size, 1, 1);
 }
 
+#define BTRFS_CSUM_BATCH	64
+
+/*
+ * Checksum @nr blocks of @blocksize bytes at @data and compare them with the
+ * @nr checksums of @csum_size bytes at @expected.  Bit i of @mismatch is set
+ * if block i doesn't match, returns the number of mismatches.
+ */
+int btrfs_csum_verify_batch(char *data, u32 blocksize, int nr, char *expected,
+			    u16 csum_size, unsigned long *mismatch)
+{
+	unsigned char const *ptrs[BTRFS_CSUM_BATCH];
+	u32 crcs[BTRFS_CSUM_BATCH];
+	char result[BTRFS_CSUM_SIZE];
+	int errors = 0;
+	int batch;
+	int i, j;
+
+	memset(mismatch, 0, DIV_ROUND_UP(nr, BITS_PER_LONG) * sizeof(long));
+	for (i = 0; i < nr; i += batch) {
+		batch = min(nr - i, BTRFS_CSUM_BATCH);
+		for (j = 0; j < batch; j++) {
+			ptrs[j] = (unsigned char *)data +
+				  (size_t)(i + j) * blocksize;
+			crcs[j] = ~(u32)0;
+		}
+		crc32c_le_multi(crcs, ptrs, blocksize, batch);
+		for (j = 0; j < batch; j++) {
+			btrfs_csum_final(crcs[j], result);
+			if (memcmp(result, expected + (size_t)(i + j) * csum_size,
+				   csum_size)) {
+				__set_bit(i + j, mismatch);
+				errors++;
+			}
+		}
+	}
+	return errors;
+}
+
+/*
+ * verify_tree_block_csum_silent() for @nr buffers, bit i of @mismatch is set
+ * if bufs[i] is bad.  Returns the number of bad buffers.
+ */
+int verify_tree_block_csum_batch(struct extent_buffer **bufs, int nr,
+				 u16 csum_size, unsigned long *mismatch)
+{
+	unsigned char const *ptrs[BTRFS_CSUM_BATCH];
+	u32 crcs[BTRFS_CSUM_BATCH];
+	char result[BTRFS_CSUM_SIZE];
+	u32 len;
+	int errors = 0;
+	int batch;
+	int i, j;
+
+	memset(mismatch, 0, DIV_ROUND_UP(nr, BITS_PER_LONG) * sizeof(long));
+	for (i = 0; i < nr; i += batch) {
+		batch = 1;
+		len = bufs[i]->len;
+		while (i + batch < nr && batch < BTRFS_CSUM_BATCH &&
+		       bufs[i + batch]->len == len)
+			batch++;
+		for (j = 0; j < batch; j++) {
+			ptrs[j] = (unsigned char *)bufs[i + j]->data +
+				  BTRFS_CSUM_SIZE;
+			crcs[j] = ~(u32)0;
+		}
+		crc32c_le_multi(crcs, ptrs, len - BTRFS_CSUM_SIZE, batch);
+		for (j = 0; j < batch; j++) {
+			btrfs_csum_final(crcs[j], result);
+			if (memcmp_extent_buffer(bufs[i + j], result, 0,
+						 csum_size)) {
+				__set_bit(i + j, mismatch);
+				errors++;
+			}
+		}
+	}
+	return errors;
+}
+
 int csum_tree_block(struct btrfs_root *root, struct extent_buffer *buf,
 			   int verify)
 {
@@ -121,36 +200,368 @@ int csum_tree_block(struct btrfs_root *root, struct extent_buffer *buf,
 	return csum_tree_block_size(buf, csum_size, verify);
 }
 
+/*
+ * Tree blocks handed to readahead_tree_block() are read and checksummed
+ * asynchronously by a pool of threads, started on the first readahead.
+ * Only tools opening the filesystem with OPEN_CTREE_READ_POOL (check and
+ * restore) get the pool, everybody else keeps plain readahead(2) hints.
+ * The threads only ever touch the data of the buffers, everything else
+ * (the extent buffer cache, flags and refs) is left to the main thread
+ * when it reaps the finished reads.  Anybody looking up a buffer which is
+ * still being read waits for that one read to complete.
+ */
+#define BTRFS_READ_POOL_THREADS		8
+#define BTRFS_READ_POOL_MAX_PENDING	4096
+/* reads a worker takes at once so their checksums can be verified together */
+#define BTRFS_READ_POOL_BATCH		3
+
+struct btrfs_read_pool {
+	pthread_t *threads;
+	int num_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	struct list_head list;
+	struct list_head finished;
+	int num_pending;
+	int done;
+	u16 csum_size;
+
+	/* reads not reaped yet, only used by the main thread */
+	struct cache_tree in_flight;
+	int num_in_flight;
+};
+
+struct tree_block_read {
+	struct cache_extent cache;
+	struct list_head list;
+	struct extent_buffer *eb;
+	int ret;
+	int done;
+};
+
+static void *read_pool_worker(void *data)
+{
+	struct btrfs_read_pool *pool = data;
+	struct tree_block_read *reads[BTRFS_READ_POOL_BATCH];
+	struct extent_buffer *ebs[BTRFS_READ_POOL_BATCH];
+	unsigned long mismatch;
+	int nr_reads;
+	int nr_ebs;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+		while (list_empty(&pool->list)) {
+			if (pool->done) {
+				pthread_mutex_unlock(&pool->mutex);
+				goto out;
+			}
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		nr_reads = 0;
+		while (!list_empty(&pool->list) &&
+		       nr_reads < BTRFS_READ_POOL_BATCH) {
+			reads[nr_reads] = list_entry(pool->list.next,
+						     struct tree_block_read,
+						     list);
+			list_del_init(&reads[nr_reads]->list);
+			nr_reads++;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+
+		nr_ebs = 0;
+		for (i = 0; i < nr_reads; i++) {
+			reads[i]->ret = read_extent_from_disk(reads[i]->eb, 0,
+							      reads[i]->eb->len);
+			if (!reads[i]->ret)
+				ebs[nr_ebs++] = reads[i]->eb;
+		}
+		verify_tree_block_csum_batch(ebs, nr_ebs, pool->csum_size,
+					     &mismatch);
+		for (i = 0, nr_ebs = 0; i < nr_reads; i++) {
+			if (!reads[i]->ret && test_bit(nr_ebs++, &mismatch))
+				reads[i]->ret = 1;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		for (i = 0; i < nr_reads; i++) {
+			reads[i]->done = 1;
+			list_add_tail(&reads[i]->list, &pool->finished);
+		}
+		pool->num_pending -= nr_reads;
+		pthread_cond_broadcast(&pool->done_cond);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+out:
+	pthread_exit(NULL);
+}
+
+static void destroy_read_pool(struct btrfs_read_pool *pool, int num_threads)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->done = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+static int start_read_pool(struct btrfs_fs_info *fs_info, int num_threads)
+{
+	struct btrfs_read_pool *pool;
+	int i;
+	int ret = 0;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+	pool->threads = calloc(num_threads, sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	INIT_LIST_HEAD(&pool->list);
+	INIT_LIST_HEAD(&pool->finished);
+	cache_tree_init(&pool->in_flight);
+	pool->num_threads = num_threads;
+	pool->csum_size = btrfs_super_csum_size(fs_info->super_copy);
+
+	for (i = 0; i < num_threads; i++) {
+		ret = pthread_create(pool->threads + i, NULL,
+				     read_pool_worker, pool);
+		if (ret)
+			break;
+	}
+	if (ret) {
+		destroy_read_pool(pool, i);
+		return -ret;
+	}
+	fs_info->read_pool = pool;
+	return 0;
+}
+
+/*
+ * Mark the buffers of all finished reads which passed the checks uptodate,
+ * so read_tree_block() can use them right away, and drop our references.
+ */
+static void reap_tree_block_reads(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_read_pool *pool = fs_info->read_pool;
+	struct tree_block_read *read;
+	struct extent_buffer *eb;
+	LIST_HEAD(finished);
+
+	pthread_mutex_lock(&pool->mutex);
+	list_splice_init(&pool->finished, &finished);
+	pthread_mutex_unlock(&pool->mutex);
+
+	while (!list_empty(&finished)) {
+		read = list_entry(finished.next, struct tree_block_read, list);
+		list_del_init(&read->list);
+		remove_cache_extent(&pool->in_flight, &read->cache);
+		pool->num_in_flight--;
+		eb = read->eb;
+		eb->flags &= ~EXTENT_READAHEAD;
+		if (!read->ret && !check_tree_block(fs_info->tree_root, eb))
+			btrfs_set_buffer_uptodate(eb);
+		free_extent_buffer(eb);
+		free(read);
+	}
+}
+
+static void wait_tree_block_read(struct btrfs_fs_info *fs_info,
+				 struct extent_buffer *eb)
+{
+	struct btrfs_read_pool *pool = fs_info->read_pool;
+	struct tree_block_read *read;
+	struct cache_extent *cache;
+
+	cache = lookup_cache_extent(&pool->in_flight, eb->start, eb->len);
+	BUG_ON(!cache);
+	read = container_of(cache, struct tree_block_read, cache);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!read->done)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	reap_tree_block_reads(fs_info);
+}
+
+void btrfs_wait_tree_block_reads(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_read_pool *pool = fs_info->read_pool;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->num_pending)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	reap_tree_block_reads(fs_info);
+}
+
+void btrfs_stop_read_pool(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_read_pool *pool = fs_info->read_pool;
+
+	if (!pool)
+		return;
+	btrfs_wait_tree_block_reads(fs_info);
+	fs_info->read_pool = NULL;
+	destroy_read_pool(pool, pool->num_threads);
+}
+
+/*
+ * Set the number of threads used for tree block readahead, 0 or 1 go back
+ * to plain readahead(2) hints.  The pool is (re)started on the next
+ * readahead.
+ */
+void btrfs_set_read_pool_threads(struct btrfs_fs_info *fs_info,
+				 int num_threads)
+{
+	btrfs_stop_read_pool(fs_info);
+	fs_info->read_pool_threads = num_threads;
+}
+
+/*
+ * Returns 0 if the block is queued or needs no read, non-zero if the caller
+ * should fall back to a plain readahead(2) hint.
+ */
+static int queue_tree_block_read(struct btrfs_root *root, u64 bytenr,
+				 u32 blocksize, u64 parent_transid)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct btrfs_read_pool *pool = fs_info->read_pool;
+	struct tree_block_read *read;
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	struct extent_buffer *eb;
+	u64 length = blocksize;
+	int ret = 0;
+
+	reap_tree_block_reads(fs_info);
+	if (pool->num_in_flight >= BTRFS_READ_POOL_MAX_PENDING)
+		return 1;
+
+	eb = alloc_extent_buffer(&fs_info->extent_cache, bytenr, blocksize);
+	if (!eb)
+		return -ENOMEM;
+	if (eb->flags & EXTENT_READAHEAD ||
+	    btrfs_buffer_uptodate(eb, parent_transid))
+		goto out;
+
+	/* blocks crossing a stripe are left to read_tree_block */
+	ret = btrfs_map_block(&fs_info->mapping_tree, READ, bytenr, &length,
+			      &multi, 0, NULL);
+	if (ret || length < blocksize) {
+		ret = 1;
+		goto out;
+	}
+	device = multi->stripes[0].dev;
+	if (device->fd == 0) {
+		ret = 1;
+		goto out;
+	}
+
+	read = malloc(sizeof(*read));
+	if (!read) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	read->cache.start = bytenr;
+	read->cache.size = blocksize;
+	ret = insert_cache_extent(&pool->in_flight, &read->cache);
+	if (ret) {
+		free(read);
+		goto out;
+	}
+	pool->num_in_flight++;
+	eb->fd = device->fd;
+	eb->dev_bytenr = multi->stripes[0].physical;
+	eb->flags |= EXTENT_READAHEAD;
+	device->total_ios++;
+	read->eb = eb;
+	read->ret = 0;
+	read->done = 0;
+	kfree(multi);
+
+	pthread_mutex_lock(&pool->mutex);
+	list_add_tail(&read->list, &pool->list);
+	pool->num_pending++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+out:
+	kfree(multi);
+	free_extent_buffer(eb);
+	return ret;
+}
+
 struct extent_buffer *btrfs_find_tree_block(struct btrfs_root *root,
 					    u64 bytenr, u32 blocksize)
 {
-	return find_extent_buffer(&root->fs_info->extent_cache,
-				  bytenr, blocksize);
+	struct extent_buffer *eb;
+
+	eb = find_extent_buffer(&root->fs_info->extent_cache,
+				bytenr, blocksize);
+	if (eb && eb->flags & EXTENT_READAHEAD)
+		wait_tree_block_read(root->fs_info, eb);
+	return eb;
 }
 
 struct extent_buffer *btrfs_find_create_tree_block(struct btrfs_root *root,
 						 u64 bytenr, u32 blocksize)
 {
-	return alloc_extent_buffer(&root->fs_info->extent_cache, bytenr,
-				   blocksize);
+	struct extent_buffer *eb;
+
+	eb = alloc_extent_buffer(&root->fs_info->extent_cache, bytenr,
+				 blocksize);
+	if (eb && eb->flags & EXTENT_READAHEAD)
+		wait_tree_block_read(root->fs_info, eb);
+	return eb;
 }
 
 void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 			  u64 parent_transid)
 {
+	struct btrfs_fs_info *fs_info = root->fs_info;
 	struct extent_buffer *eb;
 	u64 length;
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
 
+	if (!fs_info->read_pool && fs_info->read_pool_threads > 1 &&
+	    !fs_info->on_restoring &&
+	    start_read_pool(fs_info, fs_info->read_pool_threads))
+		fs_info->read_pool_threads = 0;
+	if (fs_info->read_pool &&
+	    !queue_tree_block_read(root, bytenr, blocksize, parent_transid))
+		return;
+
 	eb = btrfs_find_tree_block(root, bytenr, blocksize);
 	if (!(eb && btrfs_buffer_uptodate(eb, parent_transid)) &&
-	    !btrfs_map_block(&root->fs_info->mapping_tree, READ,
+	    !btrfs_map_block(&fs_info->mapping_tree, READ,
 			     bytenr, &length, &multi, 0, NULL)) {
 		device = multi->stripes[0].dev;
 		device->total_ios++;
-		blocksize = min(blocksize, (u32)(64 * 1024));
-		readahead(device->fd, multi->stripes[0].physical, blocksize);
+		readahead(device->fd, multi->stripes[0].physical,
+			  min_t(u64, blocksize, length));
 	}
 
 	free_extent_buffer(eb);
@@ -196,6 +607,7 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 	struct btrfs_device *device;
 	int ret = 0;
 	u64 read_len;
+	u64 type;
 	unsigned long bytes_left = eb->len;
 
 	while (bytes_left) {
@@ -204,9 +616,9 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 
 		if (!info->on_restoring &&
 		    eb->start != BTRFS_SUPER_INFO_OFFSET) {
-			ret = btrfs_map_block(&info->mapping_tree, READ,
-					      eb->start + offset, &read_len, &multi,
-					      mirror, NULL);
+			ret = __btrfs_map_block(&info->mapping_tree, READ,
+						eb->start + offset, &read_len,
+						&type, &multi, mirror, NULL);
 			if (ret) {
 				printk("Couldn't map the block %Lu\n", eb->start + offset);
 				kfree(multi);
@@ -214,7 +626,23 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 			}
 			device = multi->stripes[0].dev;
 
-			if (device->fd == 0) {
+			if ((type & (BTRFS_BLOCK_GROUP_RAID5 |
+				     BTRFS_BLOCK_GROUP_RAID6)) &&
+			    (mirror > 1 || device->fd <= 0)) {
+				kfree(multi);
+				multi = NULL;
+				read_len = min_t(u64, read_len, bytes_left);
+				ret = read_raid56_with_parity(info,
+						eb->start + offset, read_len,
+						eb->data + offset, mirror);
+				if (ret)
+					return -EIO;
+				offset += read_len;
+				bytes_left -= read_len;
+				continue;
+			}
+
+			if (device->fd <= 0) {
 				kfree(multi);
 				return -EIO;
 			}
@@ -729,6 +1157,7 @@ void btrfs_free_fs_info(struct btrfs_fs_info *fs_info)
 struct btrfs_fs_info *btrfs_new_fs_info(int writable, u64 sb_bytenr)
 {
 	struct btrfs_fs_info *fs_info;
+	char *cache_max;
 
 	fs_info = malloc(sizeof(struct btrfs_fs_info));
 	if (!fs_info)
@@ -764,6 +1193,10 @@ struct btrfs_fs_info *btrfs_new_fs_info(int writable, u64 sb_bytenr)
 	extent_io_tree_init(&fs_info->pinned_extents);
 	extent_io_tree_init(&fs_info->pending_del);
 	extent_io_tree_init(&fs_info->extent_ins);
+	cache_max = getenv("BTRFS_CACHE_SIZE");
+	if (cache_max)
+		extent_io_tree_init_cache_max(&fs_info->extent_cache,
+				parse_cache_size(cache_max, "BTRFS_CACHE_SIZE"));
 	fs_info->fs_root_tree = RB_ROOT;
 	cache_tree_init(&fs_info->mapping_tree.cache_tree);
 
@@ -1109,6 +1542,8 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, const char *path,
 	}
 	if (flags & OPEN_CTREE_RESTORE)
 		fs_info->on_restoring = 1;
+	if (flags & OPEN_CTREE_READ_POOL)
+		fs_info->read_pool_threads = BTRFS_READ_POOL_THREADS;
 
 	ret = btrfs_scan_fs_devices(fp, path, &fs_devices, sb_bytenr,
 				    (flags & OPEN_CTREE_RECOVER_SUPER));
@@ -1403,6 +1838,7 @@ int close_ctree(struct btrfs_root *root)
 	struct btrfs_trans_handle *trans;
 	struct btrfs_fs_info *fs_info = root->fs_info;
 
+	btrfs_stop_read_pool(fs_info);
 	if (fs_info->last_trans_committed !=
 	    fs_info->generation) {
 		trans = btrfs_start_transaction(root, 1);
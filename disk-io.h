@@ -25,6 +25,9 @@
 #define BTRFS_SUPER_MIRROR_MAX	 3
 #define BTRFS_SUPER_MIRROR_SHIFT 12
 
+/* upper bound for the tree block reader threads */
+#define BTRFS_READ_POOL_MAX_THREADS	256
+
 enum btrfs_open_ctree_flags {
 	OPEN_CTREE_WRITES		= 1,
 	OPEN_CTREE_PARTIAL		= 2,
@@ -33,6 +36,7 @@ enum btrfs_open_ctree_flags {
 	OPEN_CTREE_RESTORE		= 16,
 	OPEN_CTREE_NO_BLOCK_GROUPS	= 32,
 	OPEN_CTREE_EXCLUSIVE		= 64,
+	OPEN_CTREE_READ_POOL		= 128,
 };
 
 static inline u64 btrfs_sb_offset(int mirror)
@@ -50,6 +54,10 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 				      u32 blocksize, u64 parent_transid);
 void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 			  u64 parent_transid);
+void btrfs_set_read_pool_threads(struct btrfs_fs_info *fs_info,
+				 int num_threads);
+void btrfs_stop_read_pool(struct btrfs_fs_info *fs_info);
+void btrfs_wait_tree_block_reads(struct btrfs_fs_info *fs_info);
 struct extent_buffer *btrfs_find_create_tree_block(struct btrfs_root *root,
 						   u64 bytenr, u32 blocksize);
 
@@ -107,6 +115,10 @@ int btrfs_open_device(struct btrfs_device *dev);
 int csum_tree_block_size(struct extent_buffer *buf, u16 csum_sectorsize,
 			 int verify);
 int verify_tree_block_csum_silent(struct extent_buffer *buf, u16 csum_size);
+int verify_tree_block_csum_batch(struct extent_buffer **bufs, int nr,
+				 u16 csum_size, unsigned long *mismatch);
+int btrfs_csum_verify_batch(char *data, u32 blocksize, int nr, char *expected,
+			    u16 csum_size, unsigned long *mismatch);
 int btrfs_read_buffer(struct extent_buffer *buf, u64 parent_transid);
 int write_and_map_eb(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 		     struct extent_buffer *eb);
@@ -114,3 +126,9 @@ int write_and_map_eb(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 
 /* raid6.c */
 void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs);
+int raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
+		      void **ptrs);
+int raid6_datap_recov(int disks, size_t bytes, int faila, void **ptrs);
+const char *raid6_algo_name(void);
+const char *raid6_impl_name(int nr);
+int raid6_set_impl(const char *name);
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "kerncompat.h"
@@ -30,12 +31,40 @@
 #include "ctree.h"
 #include "volumes.h"
 
+/*
+ * Clean extent buffers nobody holds a reference to stay cached until the
+ * tree grows past max_cache_size.  By default we allow a quarter of the
+ * physical memory to be used for that.
+ */
+#define BTRFS_MIN_CACHE_SIZE	(64 * 1024 * 1024)
+
+static u64 default_cache_max(void)
+{
+	struct sysinfo si;
+	u64 total;
+
+	if (sysinfo(&si) < 0)
+		return BTRFS_MIN_CACHE_SIZE * 4;
+	total = (u64)si.totalram * si.mem_unit;
+	return max(total / 4, (u64)BTRFS_MIN_CACHE_SIZE);
+}
+
 void extent_io_tree_init(struct extent_io_tree *tree)
 {
 	cache_tree_init(&tree->state);
 	cache_tree_init(&tree->cache);
 	INIT_LIST_HEAD(&tree->lru);
 	tree->cache_size = 0;
+	tree->max_cache_size = default_cache_max();
+	tree->cache_hits = 0;
+	tree->cache_misses = 0;
+	tree->cache_evictions = 0;
+}
+
+void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
+				   u64 max_cache_size)
+{
+	tree->max_cache_size = max_cache_size;
 }
 
 static struct extent_state *alloc_extent_state(void)
@@ -68,21 +97,38 @@ static void free_extent_state_func(struct cache_extent *cache)
 	btrfs_free_extent_state(es);
 }
 
+static void free_extent_buffer_final(struct extent_buffer *eb);
+
 void extent_io_tree_cleanup(struct extent_io_tree *tree)
 {
 	struct extent_buffer *eb;
 
 	while(!list_empty(&tree->lru)) {
 		eb = list_entry(tree->lru.next, struct extent_buffer, lru);
-		fprintf(stderr, "extent buffer leak: "
-			"start %llu len %u\n",
-			(unsigned long long)eb->start, eb->len);
-		free_extent_buffer(eb);
+		if (eb->refs) {
+			fprintf(stderr, "extent buffer leak: "
+				"start %llu len %u\n",
+				(unsigned long long)eb->start, eb->len);
+			free_extent_buffer(eb);
+		} else {
+			free_extent_buffer_final(eb);
+		}
 	}
 
 	cache_tree_free_extents(&tree->state, free_extent_state_func);
 }
 
+void extent_io_tree_print_cache_stats(struct extent_io_tree *tree)
+{
+	printf("extent buffer cache: %llu hits %llu misses %llu evictions, "
+	       "%llu of %llu bytes used\n",
+	       (unsigned long long)tree->cache_hits,
+	       (unsigned long long)tree->cache_misses,
+	       (unsigned long long)tree->cache_evictions,
+	       (unsigned long long)tree->cache_size,
+	       (unsigned long long)tree->max_cache_size);
+}
+
 static inline void update_extent_state(struct extent_state *state)
 {
 	state->cache_node.start = state->start;
@@ -575,6 +621,42 @@ struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src)
 	return new;
 }
 
+static void free_extent_buffer_final(struct extent_buffer *eb)
+{
+	struct extent_io_tree *tree = eb->tree;
+
+	BUG_ON(eb->refs);
+	BUG_ON(eb->flags & EXTENT_DIRTY);
+	list_del_init(&eb->lru);
+	list_del_init(&eb->recow);
+	if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
+		BUG_ON(tree->cache_size < eb->len);
+		remove_cache_extent(&tree->cache, &eb->cache_node);
+		tree->cache_size -= eb->len;
+	}
+	free(eb);
+}
+
+/*
+ * Drop unreferenced buffers from the cold end of the lru until we are
+ * comfortably below the limit again, so we don't end up doing this on
+ * every single allocation.
+ */
+static void trim_extent_buffer_cache(struct extent_io_tree *tree)
+{
+	struct extent_buffer *eb, *tmp;
+	u64 target = tree->max_cache_size / 10 * 9;
+
+	list_for_each_entry_safe(eb, tmp, &tree->lru, lru) {
+		if (tree->cache_size <= target)
+			break;
+		if (eb->refs || eb->flags & EXTENT_DIRTY)
+			continue;
+		free_extent_buffer_final(eb);
+		tree->cache_evictions++;
+	}
+}
+
 void free_extent_buffer(struct extent_buffer *eb)
 {
 	if (!eb)
@@ -584,15 +666,15 @@ void free_extent_buffer(struct extent_buffer *eb)
 	BUG_ON(eb->refs < 0);
 	if (eb->refs == 0) {
 		struct extent_io_tree *tree = eb->tree;
+
 		BUG_ON(eb->flags & EXTENT_DIRTY);
-		list_del_init(&eb->lru);
 		list_del_init(&eb->recow);
-		if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
-			BUG_ON(tree->cache_size < eb->len);
-			remove_cache_extent(&tree->cache, &eb->cache_node);
-			tree->cache_size -= eb->len;
+		if (eb->flags & EXTENT_BUFFER_DUMMY) {
+			free_extent_buffer_final(eb);
+		} else if (tree->cache_size > tree->max_cache_size) {
+			free_extent_buffer_final(eb);
+			tree->cache_evictions++;
 		}
-		free(eb);
 	}
 }
 
@@ -608,6 +690,7 @@ struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
 		eb = container_of(cache, struct extent_buffer, cache_node);
 		list_move_tail(&eb->lru, &tree->lru);
 		eb->refs++;
+		tree->cache_hits++;
 	}
 	return eb;
 }
@@ -639,13 +722,17 @@ struct extent_buffer *alloc_extent_buffer(struct extent_io_tree *tree,
 		eb = container_of(cache, struct extent_buffer, cache_node);
 		list_move_tail(&eb->lru, &tree->lru);
 		eb->refs++;
+		tree->cache_hits++;
 	} else {
 		int ret;
 
 		if (cache) {
 			eb = container_of(cache, struct extent_buffer,
 					  cache_node);
-			free_extent_buffer(eb);
+			if (eb->refs)
+				eb->refs--;
+			if (!eb->refs)
+				free_extent_buffer_final(eb);
 		}
 		eb = __alloc_extent_buffer(tree, bytenr, blocksize);
 		if (!eb)
@@ -657,6 +744,9 @@ struct extent_buffer *alloc_extent_buffer(struct extent_io_tree *tree,
 		}
 		list_add_tail(&eb->lru, &tree->lru);
 		tree->cache_size += blocksize;
+		tree->cache_misses++;
+		if (tree->cache_size > tree->max_cache_size)
+			trim_extent_buffer_cache(tree);
 	}
 	return eb;
 }
@@ -702,12 +792,13 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 	u64 bytes_left = bytes;
 	u64 read_len;
 	u64 total_read = 0;
+	u64 type;
 	int ret;
 
 	while (bytes_left) {
 		read_len = bytes_left;
-		ret = btrfs_map_block(&info->mapping_tree, READ, offset,
-				      &read_len, &multi, mirror, NULL);
+		ret = __btrfs_map_block(&info->mapping_tree, READ, offset,
+					&read_len, &type, &multi, mirror, NULL);
 		if (ret) {
 			fprintf(stderr, "Couldn't map the block %Lu\n",
 				offset);
@@ -716,7 +807,20 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 		device = multi->stripes[0].dev;
 
 		read_len = min(bytes_left, read_len);
-		if (device->fd == 0) {
+		if ((type & (BTRFS_BLOCK_GROUP_RAID5 |
+			     BTRFS_BLOCK_GROUP_RAID6)) &&
+		    (mirror > 1 || device->fd <= 0)) {
+			kfree(multi);
+			ret = read_raid56_with_parity(info, offset, read_len,
+						      buf + total_read, mirror);
+			if (ret) {
+				fprintf(stderr, "Couldn't rebuild %Lu from parity, %d\n",
+					offset, ret);
+				return -EIO;
+			}
+			goto next;
+		}
+		if (device->fd <= 0) {
 			kfree(multi);
 			return -EIO;
 		}
@@ -734,7 +838,7 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 				"read_len %Lu\n", offset, ret, read_len);
 			return -EIO;
 		}
-
+next:
 		bytes_left -= read_len;
 		offset += read_len;
 		total_read += read_len;
@@ -41,6 +41,7 @@
 #define EXTENT_CSUM (1 << 9)
 #define EXTENT_BAD_TRANSID (1 << 10)
 #define EXTENT_BUFFER_DUMMY (1 << 11)
+#define EXTENT_READAHEAD (1 << 12)
 #define EXTENT_IOBITS (EXTENT_LOCKED | EXTENT_WRITEBACK)
 
 #define BLOCK_GROUP_DATA     EXTENT_WRITEBACK
@@ -56,6 +57,10 @@ struct extent_io_tree {
 	struct cache_tree cache;
 	struct list_head lru;
 	u64 cache_size;
+	u64 max_cache_size;
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 cache_evictions;
 };
 
 struct extent_state {
@@ -87,7 +92,10 @@ static inline void extent_buffer_get(struct extent_buffer *eb)
 }
 
 void extent_io_tree_init(struct extent_io_tree *tree);
+void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
+				   u64 max_cache_size);
 void extent_io_tree_cleanup(struct extent_io_tree *tree);
+void extent_io_tree_print_cache_stats(struct extent_io_tree *tree);
 int set_extent_bits(struct extent_io_tree *tree, u64 start,
 		    u64 end, int bits, gfp_t mask);
 int clear_extent_bits(struct extent_io_tree *tree, u64 start,
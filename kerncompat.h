@@ -53,6 +53,10 @@
 #define __read_mostly
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+
 #ifndef ULONG_MAX
 #define ULONG_MAX       (~0UL)
 #endif
@@ -16,13 +16,23 @@
  * 1-way unrolled portable integer math RAID-6 instruction set
  *
  * This file was postprocessed using unroll.pl and then ported to userspace
+ *
+ * The SSE2/AVX2/AVX-512 syndrome generators, the algorithm selection and
+ * the recovery routines follow lib/raid6 from the kernel.
  */
 #include <stdint.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "kerncompat.h"
 #include "ctree.h"
 #include "disk-io.h"
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 /*
  * This is the C data type to use
  */
@@ -71,7 +81,7 @@ static inline __attribute_const__ unative_t MASK(unative_t v)
 }
 
 
-void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+static void raid6_int1_gen_syndrome(int disks, size_t bytes, void **ptrs)
 {
 	uint8_t **dptr = (uint8_t **)ptrs;
 	uint8_t *p, *q;
@@ -99,3 +109,530 @@ void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
 	}
 }
 
+#ifdef __x86_64__
+
+/*
+ * All the x86 versions compute two independent vectors per iteration.  A
+ * byte is multiplied by 2 in GF(2^8) by adding it to itself and xoring in
+ * 0x1d where the top bit was set.
+ */
+static void raid6_sse2_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	u8 *p, *q;
+	int z, z0;
+	size_t d;
+	__m128i x1d = _mm_set1_epi8(0x1d);
+	__m128i zero = _mm_setzero_si128();
+	__m128i wp0, wq0, wd0, w20;
+	__m128i wp1, wq1, wd1, w21;
+
+	z0 = disks - 3;
+	p = dptr[z0 + 1];
+	q = dptr[z0 + 2];
+
+	for (d = 0; d < bytes; d += 32) {
+		wq0 = wp0 = _mm_loadu_si128((__m128i *)&dptr[z0][d]);
+		wq1 = wp1 = _mm_loadu_si128((__m128i *)&dptr[z0][d + 16]);
+		for (z = z0 - 1; z >= 0; z--) {
+			wd0 = _mm_loadu_si128((__m128i *)&dptr[z][d]);
+			wd1 = _mm_loadu_si128((__m128i *)&dptr[z][d + 16]);
+			w20 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq0), x1d);
+			w21 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq1), x1d);
+			wq0 = _mm_xor_si128(_mm_add_epi8(wq0, wq0), w20);
+			wq1 = _mm_xor_si128(_mm_add_epi8(wq1, wq1), w21);
+			wq0 = _mm_xor_si128(wq0, wd0);
+			wq1 = _mm_xor_si128(wq1, wd1);
+			wp0 = _mm_xor_si128(wp0, wd0);
+			wp1 = _mm_xor_si128(wp1, wd1);
+		}
+		_mm_storeu_si128((__m128i *)&p[d], wp0);
+		_mm_storeu_si128((__m128i *)&p[d + 16], wp1);
+		_mm_storeu_si128((__m128i *)&q[d], wq0);
+		_mm_storeu_si128((__m128i *)&q[d + 16], wq1);
+	}
+}
+
+static void __attribute__((target("avx2")))
+raid6_avx2_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	u8 *p, *q;
+	int z, z0;
+	size_t d;
+	__m256i x1d = _mm256_set1_epi8(0x1d);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i wp0, wq0, wd0, w20;
+	__m256i wp1, wq1, wd1, w21;
+
+	z0 = disks - 3;
+	p = dptr[z0 + 1];
+	q = dptr[z0 + 2];
+
+	for (d = 0; d < bytes; d += 64) {
+		wq0 = wp0 = _mm256_loadu_si256((__m256i *)&dptr[z0][d]);
+		wq1 = wp1 = _mm256_loadu_si256((__m256i *)&dptr[z0][d + 32]);
+		for (z = z0 - 1; z >= 0; z--) {
+			wd0 = _mm256_loadu_si256((__m256i *)&dptr[z][d]);
+			wd1 = _mm256_loadu_si256((__m256i *)&dptr[z][d + 32]);
+			w20 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq0),
+					       x1d);
+			w21 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq1),
+					       x1d);
+			wq0 = _mm256_xor_si256(_mm256_add_epi8(wq0, wq0), w20);
+			wq1 = _mm256_xor_si256(_mm256_add_epi8(wq1, wq1), w21);
+			wq0 = _mm256_xor_si256(wq0, wd0);
+			wq1 = _mm256_xor_si256(wq1, wd1);
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+		}
+		_mm256_storeu_si256((__m256i *)&p[d], wp0);
+		_mm256_storeu_si256((__m256i *)&p[d + 32], wp1);
+		_mm256_storeu_si256((__m256i *)&q[d], wq0);
+		_mm256_storeu_si256((__m256i *)&q[d + 32], wq1);
+	}
+}
+
+static void __attribute__((target("avx512f,avx512bw")))
+raid6_avx512_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	u8 *p, *q;
+	int z, z0;
+	size_t d;
+	__m512i x1d = _mm512_set1_epi8(0x1d);
+	__m512i wp0, wq0, wd0, w20;
+	__m512i wp1, wq1, wd1, w21;
+
+	z0 = disks - 3;
+	p = dptr[z0 + 1];
+	q = dptr[z0 + 2];
+
+	for (d = 0; d < bytes; d += 128) {
+		wq0 = wp0 = _mm512_loadu_si512(&dptr[z0][d]);
+		wq1 = wp1 = _mm512_loadu_si512(&dptr[z0][d + 64]);
+		for (z = z0 - 1; z >= 0; z--) {
+			wd0 = _mm512_loadu_si512(&dptr[z][d]);
+			wd1 = _mm512_loadu_si512(&dptr[z][d + 64]);
+			w20 = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(wq0),
+						    x1d);
+			w21 = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(wq1),
+						    x1d);
+			wq0 = _mm512_xor_si512(_mm512_add_epi8(wq0, wq0), w20);
+			wq1 = _mm512_xor_si512(_mm512_add_epi8(wq1, wq1), w21);
+			wq0 = _mm512_xor_si512(wq0, wd0);
+			wq1 = _mm512_xor_si512(wq1, wd1);
+			wp0 = _mm512_xor_si512(wp0, wd0);
+			wp1 = _mm512_xor_si512(wp1, wd1);
+		}
+		_mm512_storeu_si512(&p[d], wp0);
+		_mm512_storeu_si512(&p[d + 64], wp1);
+		_mm512_storeu_si512(&q[d], wq0);
+		_mm512_storeu_si512(&q[d + 64], wq1);
+	}
+}
+
+static int raid6_have_sse2(void)
+{
+	return 1;
+}
+
+static int raid6_have_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int raid6_have_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+	       __builtin_cpu_supports("avx512bw");
+}
+
+#endif /* __x86_64__ */
+
+struct raid6_calls {
+	void (*gen_syndrome)(int disks, size_t bytes, void **ptrs);
+	int (*valid)(void);
+	const char *name;
+	/* the length must be a multiple of this */
+	size_t align;
+};
+
+static const struct raid6_calls raid6_algos[] = {
+	{ raid6_int1_gen_syndrome, NULL, "int64x1", NSIZE },
+#ifdef __x86_64__
+	{ raid6_sse2_gen_syndrome, raid6_have_sse2, "sse2x2", 32 },
+	{ raid6_avx2_gen_syndrome, raid6_have_avx2, "avx2x2", 64 },
+	{ raid6_avx512_gen_syndrome, raid6_have_avx512, "avx512x2", 128 },
+#endif
+};
+
+static const struct raid6_calls *raid6_call = &raid6_algos[0];
+static pthread_once_t raid6_once = PTHREAD_ONCE_INIT;
+
+#define RAID6_BENCH_DISKS	10
+#define RAID6_BENCH_BYTES	4096
+#define RAID6_BENCH_NSEC	(5 * 1000 * 1000)
+
+static u64 raid6_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void raid6_init_tables(void);
+
+/*
+ * Like the kernel, time every algorithm the cpu supports for a few
+ * milliseconds and keep the fastest one.
+ */
+static void raid6_select_algo(void)
+{
+	void *ptrs[RAID6_BENCH_DISKS];
+	char *buf;
+	u64 best_perf = 0;
+	u64 perf;
+	u64 start;
+	int i, j;
+
+	raid6_init_tables();
+
+	buf = malloc(RAID6_BENCH_DISKS * RAID6_BENCH_BYTES);
+	if (!buf)
+		return;
+	for (i = 0; i < RAID6_BENCH_DISKS * RAID6_BENCH_BYTES; i++)
+		buf[i] = i * 7 + (i >> 12);
+	for (i = 0; i < RAID6_BENCH_DISKS; i++)
+		ptrs[i] = buf + i * RAID6_BENCH_BYTES;
+
+	for (i = 0; i < ARRAY_SIZE(raid6_algos); i++) {
+		if (raid6_algos[i].valid && !raid6_algos[i].valid())
+			continue;
+		perf = 0;
+		start = raid6_now();
+		do {
+			for (j = 0; j < 16; j++)
+				raid6_algos[i].gen_syndrome(RAID6_BENCH_DISKS,
+						RAID6_BENCH_BYTES, ptrs);
+			perf += 16;
+		} while (raid6_now() - start < RAID6_BENCH_NSEC);
+		if (perf > best_perf) {
+			best_perf = perf;
+			raid6_call = &raid6_algos[i];
+		}
+	}
+	free(buf);
+}
+
+void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	pthread_once(&raid6_once, raid6_select_algo);
+	if (bytes % raid6_call->align)
+		raid6_int1_gen_syndrome(disks, bytes, ptrs);
+	else
+		raid6_call->gen_syndrome(disks, bytes, ptrs);
+}
+
+const char *raid6_algo_name(void)
+{
+	pthread_once(&raid6_once, raid6_select_algo);
+	return raid6_call->name;
+}
+
+const char *raid6_impl_name(int nr)
+{
+	if (nr < 0 || nr >= ARRAY_SIZE(raid6_algos))
+		return NULL;
+	return raid6_algos[nr].name;
+}
+
+/*
+ * Force one algorithm, returns -ENOENT if there is no such algorithm and
+ * -EOPNOTSUPP if this cpu can't run it.
+ */
+int raid6_set_impl(const char *name)
+{
+	int i;
+
+	pthread_once(&raid6_once, raid6_select_algo);
+	for (i = 0; i < ARRAY_SIZE(raid6_algos); i++) {
+		if (strcmp(raid6_algos[i].name, name))
+			continue;
+		if (raid6_algos[i].valid && !raid6_algos[i].valid())
+			return -EOPNOTSUPP;
+		raid6_call = &raid6_algos[i];
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/*
+ * GF(2^8) tables for the recovery, built at startup instead of by mktables:
+ * raid6_gfmul[a][b] = a * b, raid6_gfexp[i] = 2^i, raid6_gfinv[a] = 1 / a
+ * and raid6_gfexi[i] = 1 / (2^i + 1).
+ */
+static u8 raid6_gfmul[256][256];
+static u8 raid6_gfexp[256];
+static u8 raid6_gfinv[256];
+static u8 raid6_gfexi[256];
+
+static u8 raid6_gfmul_slow(u8 a, u8 b)
+{
+	u8 v = 0;
+
+	while (b) {
+		if (b & 1)
+			v ^= a;
+		a = (a << 1) ^ (a & 0x80 ? 0x1d : 0);
+		b >>= 1;
+	}
+	return v;
+}
+
+static void raid6_init_tables(void)
+{
+	u8 exp = 1;
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 256; j++)
+			raid6_gfmul[i][j] = raid6_gfmul_slow(i, j);
+	for (i = 0; i < 256; i++) {
+		raid6_gfexp[i] = exp;
+		exp = raid6_gfmul[exp][2];
+	}
+	for (i = 1; i < 256; i++) {
+		for (j = 1; j < 256; j++) {
+			if (raid6_gfmul[i][j] == 1) {
+				raid6_gfinv[i] = j;
+				break;
+			}
+		}
+	}
+	for (i = 0; i < 256; i++)
+		raid6_gfexi[i] = raid6_gfinv[raid6_gfexp[i] ^ 1];
+}
+
+/*
+ * Work through the stripes in pieces of this size so a static zero page
+ * can stand in for the missing blocks.
+ */
+#define RAID6_RECOV_CHUNK	65536
+
+static const u8 raid6_zero_page[RAID6_RECOV_CHUNK] __attribute__((aligned(64)));
+
+static void raid6_2data_recov_bytes(u8 *p, u8 *q, u8 *dp, u8 *dq,
+				    size_t bytes, const u8 *pbmul,
+				    const u8 *qmul)
+{
+	u8 px, qx, db;
+
+	while (bytes--) {
+		px = *p ^ *dp;
+		qx = qmul[*q ^ *dq];
+		*dq++ = db = pbmul[px] ^ qx;
+		*dp++ = db ^ px;
+		p++;
+		q++;
+	}
+}
+
+static void raid6_datap_recov_bytes(u8 *p, u8 *q, u8 *dq, size_t bytes,
+				    const u8 *qmul)
+{
+	while (bytes--) {
+		*p++ ^= *dq = qmul[*q ^ *dq];
+		q++;
+		dq++;
+	}
+}
+
+#ifdef __x86_64__
+
+/*
+ * Multiply 16 bytes by a constant with two pshufb lookups, one for each
+ * nibble, as in the kernel's recov_ssse3.c.
+ */
+static inline __m128i __attribute__((target("ssse3")))
+raid6_mul16(__m128i v, __m128i lo, __m128i hi, __m128i x0f)
+{
+	__m128i l = _mm_and_si128(v, x0f);
+	__m128i h = _mm_and_si128(_mm_srli_epi64(v, 4), x0f);
+
+	return _mm_xor_si128(_mm_shuffle_epi8(lo, l), _mm_shuffle_epi8(hi, h));
+}
+
+static void raid6_mul_tables(const u8 *mul, u8 *lo, u8 *hi)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		lo[i] = mul[i];
+		hi[i] = mul[i << 4];
+	}
+}
+
+static size_t __attribute__((target("ssse3")))
+raid6_2data_recov_ssse3(u8 *p, u8 *q, u8 *dp, u8 *dq, size_t bytes,
+			const u8 *pbmul, const u8 *qmul)
+{
+	u8 tbl[4][16];
+	__m128i x0f = _mm_set1_epi8(0x0f);
+	__m128i pblo, pbhi, qlo, qhi;
+	__m128i px, qx, db;
+	size_t done;
+
+	raid6_mul_tables(pbmul, tbl[0], tbl[1]);
+	raid6_mul_tables(qmul, tbl[2], tbl[3]);
+	pblo = _mm_loadu_si128((__m128i *)tbl[0]);
+	pbhi = _mm_loadu_si128((__m128i *)tbl[1]);
+	qlo = _mm_loadu_si128((__m128i *)tbl[2]);
+	qhi = _mm_loadu_si128((__m128i *)tbl[3]);
+
+	for (done = 0; done + 16 <= bytes; done += 16) {
+		px = _mm_xor_si128(_mm_loadu_si128((__m128i *)(p + done)),
+				   _mm_loadu_si128((__m128i *)(dp + done)));
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)(q + done)),
+				   _mm_loadu_si128((__m128i *)(dq + done)));
+		qx = raid6_mul16(qx, qlo, qhi, x0f);
+		db = _mm_xor_si128(raid6_mul16(px, pblo, pbhi, x0f), qx);
+		_mm_storeu_si128((__m128i *)(dq + done), db);
+		_mm_storeu_si128((__m128i *)(dp + done),
+				 _mm_xor_si128(db, px));
+	}
+	return done;
+}
+
+static size_t __attribute__((target("ssse3")))
+raid6_datap_recov_ssse3(u8 *p, u8 *q, u8 *dq, size_t bytes, const u8 *qmul)
+{
+	u8 tbl[2][16];
+	__m128i x0f = _mm_set1_epi8(0x0f);
+	__m128i qlo, qhi;
+	__m128i d;
+	size_t done;
+
+	raid6_mul_tables(qmul, tbl[0], tbl[1]);
+	qlo = _mm_loadu_si128((__m128i *)tbl[0]);
+	qhi = _mm_loadu_si128((__m128i *)tbl[1]);
+
+	for (done = 0; done + 16 <= bytes; done += 16) {
+		d = _mm_xor_si128(_mm_loadu_si128((__m128i *)(q + done)),
+				  _mm_loadu_si128((__m128i *)(dq + done)));
+		d = raid6_mul16(d, qlo, qhi, x0f);
+		_mm_storeu_si128((__m128i *)(dq + done), d);
+		_mm_storeu_si128((__m128i *)(p + done),
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(p + done)),
+				      d));
+	}
+	return done;
+}
+
+#endif /* __x86_64__ */
+
+/*
+ * Rebuild the two data blocks @faila < @failb from the remaining data and
+ * P/Q.  @ptrs is laid out like for raid6_gen_syndrome(), the contents of
+ * the failed blocks are overwritten.
+ */
+int raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
+		      void **ptrs)
+{
+	u8 *p, *q, *dp, *dq;
+	const u8 *pbmul;
+	const u8 *qmul;
+	void **chunk;
+	size_t off, len, done;
+	int i;
+
+	chunk = malloc(disks * sizeof(*chunk));
+	if (!chunk)
+		return -ENOMEM;
+	pthread_once(&raid6_once, raid6_select_algo);
+
+	p = ptrs[disks - 2];
+	q = ptrs[disks - 1];
+	dp = ptrs[faila];
+	dq = ptrs[failb];
+
+	/* pick the tables */
+	pbmul = raid6_gfmul[raid6_gfexi[failb - faila]];
+	qmul = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila] ^
+				       raid6_gfexp[failb]]];
+
+	for (off = 0; off < bytes; off += len) {
+		len = min_t(size_t, bytes - off, RAID6_RECOV_CHUNK);
+
+		/*
+		 * Compute the syndrome with zeros for the missing blocks, the
+		 * dead blocks hold the delta p and delta q.
+		 */
+		for (i = 0; i < disks - 2; i++)
+			chunk[i] = (u8 *)ptrs[i] + off;
+		chunk[faila] = (void *)raid6_zero_page;
+		chunk[failb] = (void *)raid6_zero_page;
+		chunk[disks - 2] = dp + off;
+		chunk[disks - 1] = dq + off;
+		raid6_gen_syndrome(disks, len, chunk);
+
+		done = 0;
+#ifdef __x86_64__
+		if (__builtin_cpu_supports("ssse3"))
+			done = raid6_2data_recov_ssse3(p + off, q + off,
+					dp + off, dq + off, len, pbmul, qmul);
+#endif
+		raid6_2data_recov_bytes(p + off + done, q + off + done,
+					dp + off + done, dq + off + done,
+					len - done, pbmul, qmul);
+	}
+	free(chunk);
+	return 0;
+}
+
+/*
+ * Rebuild the data block @faila and P from the remaining data and Q.
+ */
+int raid6_datap_recov(int disks, size_t bytes, int faila, void **ptrs)
+{
+	u8 *p, *q, *dq;
+	const u8 *qmul;
+	void **chunk;
+	size_t off, len, done;
+	int i;
+
+	chunk = malloc(disks * sizeof(*chunk));
+	if (!chunk)
+		return -ENOMEM;
+	pthread_once(&raid6_once, raid6_select_algo);
+
+	p = ptrs[disks - 2];
+	q = ptrs[disks - 1];
+	dq = ptrs[faila];
+
+	qmul = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]]];
+
+	for (off = 0; off < bytes; off += len) {
+		len = min_t(size_t, bytes - off, RAID6_RECOV_CHUNK);
+
+		/* the dead block holds delta q, p is recomputed in place */
+		for (i = 0; i < disks - 2; i++)
+			chunk[i] = (u8 *)ptrs[i] + off;
+		chunk[faila] = (void *)raid6_zero_page;
+		chunk[disks - 2] = p + off;
+		chunk[disks - 1] = dq + off;
+		raid6_gen_syndrome(disks, len, chunk);
+
+		done = 0;
+#ifdef __x86_64__
+		if (__builtin_cpu_supports("ssse3"))
+			done = raid6_datap_recov_ssse3(p + off, q + off,
+					dq + off, len, qmul);
+#endif
+		raid6_datap_recov_bytes(p + off + done, q + off + done,
+					dq + off + done, len - done, qmul);
+	}
+	free(chunk);
+	return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include "kerncompat.h"
+#include "ctree.h"
+#include "disk-io.h"
+#include "crc32c.h"
+#include "range-scan.h"
+
+void range_scan_init(struct range_scan *scan, range_scan_fn fn, void *priv)
+{
+	memset(scan, 0, sizeof(*scan));
+	pthread_mutex_init(&scan->lock, NULL);
+	scan->fn = fn;
+	scan->priv = priv;
+}
+
+void range_scan_release(struct range_scan *scan)
+{
+	free(scan->ranges);
+	scan->ranges = NULL;
+	scan->nr_ranges = 0;
+	scan->alloc_ranges = 0;
+	pthread_mutex_destroy(&scan->lock);
+}
+
+static struct scan_range *new_range(struct range_scan *scan)
+{
+	struct scan_range *range;
+	int alloc;
+
+	if (scan->nr_ranges == scan->alloc_ranges) {
+		alloc = scan->alloc_ranges ? scan->alloc_ranges * 2 : 16;
+		range = realloc(scan->ranges, alloc * sizeof(*range));
+		if (!range)
+			return NULL;
+		scan->ranges = range;
+		scan->alloc_ranges = alloc;
+	}
+	return &scan->ranges[scan->nr_ranges++];
+}
+
+/*
+ * Queue @whole cut in up to @nr pieces starting on @align boundaries, so
+ * that several workers can read the same device.
+ */
+static int add_pieces(struct range_scan *scan, struct scan_range *whole,
+		      int nr, u32 align)
+{
+	struct scan_range *range;
+	u64 piece;
+	u64 off;
+
+	if (nr < 1)
+		nr = 1;
+	if (!align)
+		align = 1;
+
+	piece = max_t(u64, whole->len / nr, RANGE_SCAN_MIN_LEN);
+	piece = (piece + align - 1) / align * align;
+
+	for (off = 0; off < whole->len; off += piece) {
+		range = new_range(scan);
+		if (!range)
+			return -ENOMEM;
+		*range = *whole;
+		range->start = whole->start + off;
+		range->len = min(piece, whole->len - off);
+	}
+	return 0;
+}
+
+/* queue [start, start + len) of @fd, cut like range_scan_split() does */
+int range_scan_add(struct range_scan *scan, int fd, u64 start, u64 len,
+		   u64 logical, int nr, u32 align, void *priv)
+{
+	struct scan_range whole;
+
+	if (!len)
+		return 0;
+
+	whole.fd = fd;
+	whole.start = start;
+	whole.len = len;
+	whole.base = start;
+	whole.logical = logical;
+	whole.stripe_len = len;
+	whole.stride = 0;
+	whole.priv = priv;
+	return add_pieces(scan, &whole, nr, align);
+}
+
+/*
+ * Queue the stripe [start, start + len) of @fd at @logical, uncut.  A
+ * stripe continuing the last range of the device both on the device and
+ * in its logical layout is merged into it, so a striped chunk is scanned
+ * as one range per device instead of one per stripe.
+ */
+int range_scan_add_stripe(struct range_scan *scan, int fd, u64 start,
+			  u64 len, u64 logical, void *priv)
+{
+	struct scan_range *range = NULL;
+	u64 nr_stripes;
+	int i;
+
+	if (!len)
+		return 0;
+
+	for (i = scan->nr_ranges - 1; i >= 0; i--) {
+		if (scan->ranges[i].fd == fd) {
+			range = &scan->ranges[i];
+			break;
+		}
+	}
+	if (range && range->priv == priv && range->base == range->start &&
+	    range->start + range->len == start && len == range->stripe_len &&
+	    range->len % range->stripe_len == 0) {
+		nr_stripes = range->len / range->stripe_len;
+		if (nr_stripes == 1 &&
+		    logical >= range->logical + range->stripe_len) {
+			range->stride = logical - range->logical;
+			range->len += len;
+			return 0;
+		}
+		if (nr_stripes > 1 &&
+		    logical == range->logical + nr_stripes * range->stride) {
+			range->len += len;
+			return 0;
+		}
+	}
+
+	range = new_range(scan);
+	if (!range)
+		return -ENOMEM;
+	range->fd = fd;
+	range->start = start;
+	range->len = len;
+	range->base = start;
+	range->logical = logical;
+	range->stripe_len = len;
+	range->stride = 0;
+	range->priv = priv;
+	return 0;
+}
+
+/* cut the ranges queued with range_scan_add_stripe() for @nr workers */
+int range_scan_split(struct range_scan *scan, int nr, u32 align)
+{
+	struct scan_range *whole = scan->ranges;
+	int nr_whole = scan->nr_ranges;
+	int ret = 0;
+	int i;
+
+	scan->ranges = NULL;
+	scan->nr_ranges = 0;
+	scan->alloc_ranges = 0;
+	for (i = 0; i < nr_whole && !ret; i++)
+		ret = add_pieces(scan, &whole[i], nr, align);
+	free(whole);
+	return ret;
+}
+
+/*
+ * The logical address of @physical in @range, @stripe gets the one of
+ * the stripe it's in if it isn't NULL.
+ */
+u64 range_scan_logical(struct scan_range *range, u64 physical, u64 *stripe)
+{
+	u64 off = physical - range->base;
+	u64 start;
+
+	start = range->logical + off / range->stripe_len * range->stride;
+	if (stripe)
+		*stripe = start;
+	return start + off % range->stripe_len;
+}
+
+static void *range_scan_worker(void *arg)
+{
+	struct range_scan *scan = arg;
+	struct scan_range *range;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&scan->lock);
+		if (scan->stop || scan->next >= scan->nr_ranges) {
+			pthread_mutex_unlock(&scan->lock);
+			break;
+		}
+		range = &scan->ranges[scan->next++];
+		pthread_mutex_unlock(&scan->lock);
+
+		ret = scan->fn(scan, range);
+		if (ret)
+			range_scan_stop(scan, ret);
+	}
+	return NULL;
+}
+
+/*
+ * Scan all the queued ranges with @threads workers, returns the first
+ * error a range callback gave.
+ */
+int range_scan_run(struct range_scan *scan, int threads)
+{
+	pthread_t *workers;
+	int started = 0;
+	int ret = 0;
+	int i;
+
+	if (threads > scan->nr_ranges)
+		threads = scan->nr_ranges;
+	if (threads < 1)
+		threads = 1;
+
+	workers = malloc(threads * sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < threads; i++) {
+		ret = pthread_create(&workers[i], NULL, range_scan_worker,
+				     scan);
+		if (ret) {
+			range_scan_stop(scan, -ret);
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	return scan->ret;
+}
+
+/* stop handing out ranges, @ret is kept if it's the first error */
+void range_scan_stop(struct range_scan *scan, int ret)
+{
+	pthread_mutex_lock(&scan->lock);
+	scan->stop = 1;
+	if (ret && !scan->ret)
+		scan->ret = ret;
+	pthread_mutex_unlock(&scan->lock);
+}
+
+int range_scan_stopped(struct range_scan *scan)
+{
+	int stop;
+
+	pthread_mutex_lock(&scan->lock);
+	stop = scan->stop;
+	pthread_mutex_unlock(&scan->lock);
+	return stop;
+}
+
+/*
+ * Read as much of @len as the device has at @offset, returns the bytes
+ * read or -errno if the first read failed.
+ */
+ssize_t range_scan_read(int fd, void *buf, size_t len, u64 offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread64(fd, (char *)buf + done, len - done,
+			      offset + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!done)
+				return -errno;
+			break;
+		}
+		if (!ret)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+int range_scan_window_init(struct range_scan_window *w,
+			   struct range_scan *scan, struct scan_range *range,
+			   u32 sectorsize, u32 blocksize)
+{
+	memset(w, 0, sizeof(*w));
+	w->buf = malloc(RANGE_SCAN_WINDOW_SIZE);
+	if (!w->buf)
+		return -ENOMEM;
+	w->scan = scan;
+	w->range = range;
+	w->bytenr = range->start;
+	w->sectorsize = sectorsize;
+	w->blocksize = blocksize;
+	posix_fadvise(range->fd, range->start, range->len,
+		      POSIX_FADV_SEQUENTIAL);
+	return 0;
+}
+
+void range_scan_window_release(struct range_scan_window *w)
+{
+	free(w->buf);
+	w->buf = NULL;
+}
+
+static inline int is_super_block_address(u64 offset)
+{
+	int i;
+
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		if (offset == btrfs_sb_offset(i))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * The fsid of a candidate block, compared as two words, it's 8 byte
+ * aligned in the sector aligned window.
+ */
+static inline int fsid_matches(const char *block, const u8 *fsid)
+{
+	const u64 *a = (const u64 *)(block +
+				     offsetof(struct btrfs_header, fsid));
+	u64 b[2];
+
+	memcpy(b, fsid, sizeof(b));
+	return a[0] == b[0] && a[1] == b[1];
+}
+
+/*
+ * Find the next sector from w->bytenr on with a block of @fsid, blocks
+ * starting in the range are ours even if they end past it.  Returns 1
+ * with the block in @block, 0 at the end of the range or once the scan
+ * is stopped, or the error from reading or flushing.
+ */
+int range_scan_next_block(struct range_scan_window *w, const u8 *fsid,
+			  char **block)
+{
+	u64 end = w->range->start + w->range->len;
+	int fd = w->range->fd;
+	ssize_t len;
+	int ret;
+
+	while (1) {
+		if (is_super_block_address(w->bytenr))
+			w->bytenr += w->sectorsize;
+		if (w->bytenr >= end)
+			break;
+
+		if (w->bytenr + w->blocksize > w->start + w->len) {
+			ret = w->flush(w->priv);
+			if (ret)
+				return ret;
+			if (range_scan_stopped(w->scan))
+				return 0;
+
+			w->start = w->bytenr;
+			len = range_scan_read(fd, w->buf, RANGE_SCAN_WINDOW_SIZE,
+					      w->start);
+			if (len < w->blocksize) {
+				w->len = 0;
+				break;
+			}
+			w->len = len;
+			/* let the next window be read while this one is scanned */
+			if (w->start + w->len < end)
+				posix_fadvise(fd, w->start + w->len,
+					      RANGE_SCAN_WINDOW_SIZE,
+					      POSIX_FADV_WILLNEED);
+		}
+
+		*block = w->buf + (w->bytenr - w->start);
+		if (fsid_matches(*block, fsid))
+			return 1;
+		w->bytenr += w->sectorsize;
+	}
+	return w->flush(w->priv);
+}
+
+int range_scan_csum_ok(const char *block, u32 len, u16 csum_size)
+{
+	char result[BTRFS_CSUM_SIZE];
+	u32 crc = ~(u32)0;
+
+	crc = crc32c(crc, block + BTRFS_CSUM_SIZE, len - BTRFS_CSUM_SIZE);
+	btrfs_csum_final(crc, result);
+	return !memcmp(block, result, csum_size);
+}
@@ -0,0 +1,112 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_RANGE_SCAN_H__
+#define __BTRFS_RANGE_SCAN_H__
+
+#include <pthread.h>
+#include "kerncompat.h"
+
+/* workers reading one device at the same time by default */
+#define RANGE_SCAN_JOBS		4
+/* a device range isn't split in pieces smaller than this */
+#define RANGE_SCAN_MIN_LEN	(16 * 1024 * 1024)
+
+struct range_scan;
+
+/*
+ * One piece of a device to scan.  When the caller maps it, the stripe of
+ * @stripe_len bytes at @base on the device is at @logical, and every
+ * following stripe @stride bytes further.  For raw devices @logical is
+ * unused.
+ */
+struct scan_range {
+	int fd;
+	u64 start;
+	u64 len;
+	u64 base;
+	u64 logical;
+	u64 stripe_len;
+	u64 stride;
+	void *priv;
+};
+
+typedef int (*range_scan_fn)(struct range_scan *scan,
+			     struct scan_range *range);
+
+/*
+ * Ranges are handed to the workers in the order they were added, so
+ * a caller looking for the first match can stop the scan once it has
+ * one and only wait for the ranges before it.
+ */
+struct range_scan {
+	struct scan_range *ranges;
+	int nr_ranges;
+	int alloc_ranges;
+	int next;
+	int stop;
+	int ret;
+	pthread_mutex_t lock;
+	range_scan_fn fn;
+	void *priv;
+};
+
+void range_scan_init(struct range_scan *scan, range_scan_fn fn, void *priv);
+void range_scan_release(struct range_scan *scan);
+int range_scan_add(struct range_scan *scan, int fd, u64 start, u64 len,
+		   u64 logical, int nr, u32 align, void *priv);
+int range_scan_add_stripe(struct range_scan *scan, int fd, u64 start,
+			  u64 len, u64 logical, void *priv);
+int range_scan_split(struct range_scan *scan, int nr, u32 align);
+u64 range_scan_logical(struct scan_range *range, u64 physical,
+		       u64 *stripe);
+int range_scan_run(struct range_scan *scan, int threads);
+void range_scan_stop(struct range_scan *scan, int ret);
+int range_scan_stopped(struct range_scan *scan);
+ssize_t range_scan_read(int fd, void *buf, size_t len, u64 offset);
+
+/*
+ * Walks a range a window at a time looking for the blocks of a
+ * filesystem.  @bytenr is the candidate block, the caller moves it past
+ * each block it's handed.  @flush is called with @priv before the window
+ * moves and at the end of the range, so whatever the caller gathered
+ * from one window can be handed on in one go.
+ */
+struct range_scan_window {
+	struct range_scan *scan;
+	struct scan_range *range;
+	char *buf;
+	u64 start;
+	u64 len;
+	u64 bytenr;
+	u32 sectorsize;
+	u32 blocksize;
+	int (*flush)(void *priv);
+	void *priv;
+};
+
+/* how much of a device is read at once when scanning it */
+#define RANGE_SCAN_WINDOW_SIZE	(8 * 1024 * 1024)
+
+int range_scan_window_init(struct range_scan_window *w,
+			   struct range_scan *scan, struct scan_range *range,
+			   u32 sectorsize, u32 blocksize);
+void range_scan_window_release(struct range_scan_window *w);
+int range_scan_next_block(struct range_scan_window *w, const u8 *fsid,
+			  char **block);
+int range_scan_csum_ok(const char *block, u32 len, u16 csum_size);
+
+#endif
@@ -0,0 +1,542 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "kerncompat.h"
+#include "ctree.h"
+#include "disk-io.h"
+#include "volumes.h"
+#include "crc32c.h"
+#include "utils.h"
+#include "range-scan.h"
+#include "scan-cache.h"
+
+#define SCAN_CACHE_MAGIC	"BTRFSSCN"
+#define SCAN_CACHE_VERSION	1
+
+/*
+ * On disk the cache is the header, each device followed by its blocks,
+ * and a crc32c of all of it.
+ */
+struct scan_cache_header {
+	char magic[8];
+	__le32 version;
+	__le32 sectorsize;
+	__le32 leafsize;
+	__le32 nr_devices;
+	__le64 generation;
+	u8 fsid[BTRFS_FSID_SIZE];
+} __attribute__ ((__packed__));
+
+struct scan_cache_device_item {
+	__le64 devid;
+	__le64 size;
+	__le64 nr_blocks;
+	u8 uuid[BTRFS_UUID_SIZE];
+} __attribute__ ((__packed__));
+
+struct scan_cache_block_item {
+	__le64 physical;
+	__le64 bytenr;
+	__le64 owner;
+	__le64 generation;
+	u8 level;
+	u8 csum_ok;
+} __attribute__ ((__packed__));
+
+int scan_cache_init(struct scan_cache *cache,
+		    struct btrfs_fs_devices *fs_devices, u64 generation,
+		    u32 sectorsize, u32 leafsize, u16 csum_size)
+{
+	struct scan_cache_device *dev;
+	struct btrfs_device *device;
+	struct stat st;
+	int fd;
+
+	memset(cache, 0, sizeof(*cache));
+	memcpy(cache->fsid, fs_devices->fsid, BTRFS_FSID_SIZE);
+	cache->generation = generation;
+	cache->sectorsize = sectorsize;
+	cache->leafsize = leafsize;
+	cache->csum_size = csum_size;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	list_for_each_entry(device, &fs_devices->devices, dev_list)
+		cache->nr_devices++;
+	cache->devices = calloc(cache->nr_devices, sizeof(*cache->devices));
+	if (!cache->devices)
+		return -ENOMEM;
+
+	dev = cache->devices;
+	list_for_each_entry(device, &fs_devices->devices, dev_list) {
+		dev->devid = device->devid;
+		memcpy(dev->uuid, device->uuid, BTRFS_UUID_SIZE);
+
+		fd = open(device->name, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to open device %s\n",
+				device->name);
+			return -errno;
+		}
+		if (fstat(fd, &st) < 0 ||
+		    !(dev->size = btrfs_device_size(fd, &st))) {
+			fprintf(stderr, "Failed to get the size of device %s\n",
+				device->name);
+			close(fd);
+			return -EIO;
+		}
+		close(fd);
+		dev++;
+	}
+	return 0;
+}
+
+void scan_cache_release(struct scan_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->nr_devices; i++)
+		free(cache->devices[i].blocks);
+	free(cache->devices);
+	cache->devices = NULL;
+	cache->nr_devices = 0;
+	pthread_mutex_destroy(&cache->lock);
+}
+
+struct scan_cache_device *scan_cache_find_device(struct scan_cache *cache,
+						 u64 devid)
+{
+	int i;
+
+	for (i = 0; i < cache->nr_devices; i++) {
+		if (cache->devices[i].devid == devid)
+			return &cache->devices[i];
+	}
+	return NULL;
+}
+
+/* index of the first block at or after @physical */
+u64 scan_cache_lookup(struct scan_cache_device *dev, u64 physical)
+{
+	u64 lo = 0;
+	u64 hi = dev->nr_blocks;
+	u64 mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (dev->blocks[mid].physical < physical)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int add_blocks(struct scan_cache *cache, struct scan_cache_device *dev,
+		      struct scan_cache_block *blocks, int nr)
+{
+	struct scan_cache_block *new;
+	u64 alloc;
+	int ret = 0;
+
+	if (!nr)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if (dev->nr_blocks + nr > dev->alloc_blocks) {
+		alloc = max_t(u64, dev->alloc_blocks * 2, dev->nr_blocks + nr);
+		new = realloc(dev->blocks, alloc * sizeof(*new));
+		if (!new) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		dev->blocks = new;
+		dev->alloc_blocks = alloc;
+	}
+	memcpy(dev->blocks + dev->nr_blocks, blocks, nr * sizeof(*blocks));
+	dev->nr_blocks += nr;
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/* the blocks found in the current window of a range */
+struct scan_cache_found {
+	struct scan_cache *cache;
+	struct scan_cache_device *dev;
+	struct scan_cache_block *blocks;
+	int nr;
+};
+
+static int flush_found(void *priv)
+{
+	struct scan_cache_found *found = priv;
+	int ret;
+
+	ret = add_blocks(found->cache, found->dev, found->blocks, found->nr);
+	found->nr = 0;
+	return ret;
+}
+
+/*
+ * Look for blocks of our filesystem at every sector of a range, a block
+ * with a good csum is skipped whole.
+ */
+static int scan_cache_range(struct range_scan *scan, struct scan_range *range)
+{
+	struct scan_cache *cache = scan->priv;
+	struct scan_cache_found found;
+	struct range_scan_window w;
+	struct scan_cache_block *b;
+	struct btrfs_header *header;
+	char *block;
+	int ret;
+
+	found.cache = cache;
+	found.dev = range->priv;
+	found.nr = 0;
+	found.blocks = malloc(RANGE_SCAN_WINDOW_SIZE / cache->sectorsize *
+			      sizeof(*found.blocks));
+	if (!found.blocks)
+		return -ENOMEM;
+	ret = range_scan_window_init(&w, scan, range, cache->sectorsize,
+				     cache->leafsize);
+	if (ret)
+		goto out;
+	w.flush = flush_found;
+	w.priv = &found;
+
+	while ((ret = range_scan_next_block(&w, cache->fsid, &block)) > 0) {
+		header = (struct btrfs_header *)block;
+		b = &found.blocks[found.nr++];
+		b->physical = w.bytenr;
+		b->bytenr = btrfs_stack_header_bytenr(header);
+		b->owner = btrfs_stack_header_owner(header);
+		b->generation = btrfs_stack_header_generation(header);
+		b->level = header->level;
+		b->csum_ok = range_scan_csum_ok(block, cache->leafsize,
+						cache->csum_size);
+		if (b->csum_ok)
+			w.bytenr += cache->leafsize;
+		else
+			w.bytenr += cache->sectorsize;
+	}
+	range_scan_window_release(&w);
+out:
+	free(found.blocks);
+	return ret;
+}
+
+static int cmp_cache_block(const void *a, const void *b)
+{
+	const struct scan_cache_block *ba = a;
+	const struct scan_cache_block *bb = b;
+
+	if (ba->physical < bb->physical)
+		return -1;
+	return ba->physical > bb->physical;
+}
+
+/*
+ * Scan all the devices with @jobs workers each and fill the cache with
+ * every block header of our filesystem they have.
+ */
+int scan_cache_scan(struct scan_cache *cache,
+		    struct btrfs_fs_devices *fs_devices, int jobs)
+{
+	struct scan_cache_device *dev;
+	struct btrfs_device *device;
+	struct range_scan scan;
+	int *fds;
+	int nr_fds = 0;
+	int ret = 0;
+	int i;
+
+	fds = malloc(cache->nr_devices * sizeof(*fds));
+	if (!fds)
+		return -ENOMEM;
+
+	range_scan_init(&scan, scan_cache_range, cache);
+	list_for_each_entry(device, &fs_devices->devices, dev_list) {
+		dev = scan_cache_find_device(cache, device->devid);
+		if (!dev)
+			continue;
+		dev->nr_blocks = 0;
+
+		fds[nr_fds] = open(device->name, O_RDONLY);
+		if (fds[nr_fds] < 0) {
+			fprintf(stderr, "Failed to open device %s\n",
+				device->name);
+			ret = -errno;
+			goto out;
+		}
+		ret = range_scan_add(&scan, fds[nr_fds++], 0, dev->size, 0,
+				     jobs, cache->leafsize, dev);
+		if (ret)
+			goto out;
+	}
+
+	ret = range_scan_run(&scan, nr_fds * jobs);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < cache->nr_devices; i++) {
+		dev = &cache->devices[i];
+		qsort(dev->blocks, dev->nr_blocks, sizeof(*dev->blocks),
+		      cmp_cache_block);
+	}
+out:
+	for (i = 0; i < nr_fds; i++)
+		close(fds[i]);
+	range_scan_release(&scan);
+	free(fds);
+	return ret;
+}
+
+static int cache_write(FILE *f, const void *buf, size_t len, u32 *crc)
+{
+	*crc = crc32c(*crc, buf, len);
+	if (fwrite(buf, 1, len, f) != len)
+		return -EIO;
+	return 0;
+}
+
+static int cache_read(FILE *f, void *buf, size_t len, u32 *crc)
+{
+	if (fread(buf, 1, len, f) != len)
+		return -EIO;
+	*crc = crc32c(*crc, buf, len);
+	return 0;
+}
+
+/*
+ * Save the cache to @path, through a temporary file so that an old cache
+ * is only replaced by a complete one.
+ */
+int scan_cache_save(struct scan_cache *cache, const char *path)
+{
+	struct scan_cache_header header;
+	struct scan_cache_device_item item;
+	struct scan_cache_block_item bitem;
+	struct scan_cache_device *dev;
+	struct scan_cache_block *b;
+	char *tmp;
+	FILE *f;
+	__le32 disk_crc;
+	u32 crc = ~(u32)0;
+	u64 j;
+	int ret = 0;
+	int i;
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0)
+		return -ENOMEM;
+	f = fopen(tmp, "w");
+	if (!f) {
+		ret = -errno;
+		free(tmp);
+		return ret;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCAN_CACHE_MAGIC, sizeof(header.magic));
+	header.version = cpu_to_le32(SCAN_CACHE_VERSION);
+	header.sectorsize = cpu_to_le32(cache->sectorsize);
+	header.leafsize = cpu_to_le32(cache->leafsize);
+	header.nr_devices = cpu_to_le32(cache->nr_devices);
+	header.generation = cpu_to_le64(cache->generation);
+	memcpy(header.fsid, cache->fsid, BTRFS_FSID_SIZE);
+	ret = cache_write(f, &header, sizeof(header), &crc);
+
+	for (i = 0; !ret && i < cache->nr_devices; i++) {
+		dev = &cache->devices[i];
+		item.devid = cpu_to_le64(dev->devid);
+		item.size = cpu_to_le64(dev->size);
+		item.nr_blocks = cpu_to_le64(dev->nr_blocks);
+		memcpy(item.uuid, dev->uuid, BTRFS_UUID_SIZE);
+		ret = cache_write(f, &item, sizeof(item), &crc);
+
+		for (j = 0; !ret && j < dev->nr_blocks; j++) {
+			b = &dev->blocks[j];
+			bitem.physical = cpu_to_le64(b->physical);
+			bitem.bytenr = cpu_to_le64(b->bytenr);
+			bitem.owner = cpu_to_le64(b->owner);
+			bitem.generation = cpu_to_le64(b->generation);
+			bitem.level = b->level;
+			bitem.csum_ok = b->csum_ok;
+			ret = cache_write(f, &bitem, sizeof(bitem), &crc);
+		}
+	}
+	if (!ret) {
+		disk_crc = cpu_to_le32(crc);
+		if (fwrite(&disk_crc, 1, sizeof(disk_crc), f) !=
+		    sizeof(disk_crc))
+			ret = -EIO;
+	}
+	if (fflush(f) || fsync(fileno(f)))
+		ret = ret ? ret : -errno;
+	if (fclose(f))
+		ret = ret ? ret : -errno;
+
+	if (!ret && rename(tmp, path) < 0)
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Load the blocks saved in @path.  Returns -ENOENT if there's no cache,
+ * -ESTALE if it was made for other devices or another generation of the
+ * filesystem and -EIO if it's damaged, the cache is left empty then.
+ */
+int scan_cache_load(struct scan_cache *cache, const char *path)
+{
+	struct scan_cache_header header;
+	struct scan_cache_device_item item;
+	struct scan_cache_block_item bitem;
+	struct scan_cache_device *dev;
+	struct scan_cache_block *b;
+	FILE *f;
+	__le32 disk_crc;
+	u32 crc = ~(u32)0;
+	u64 nr;
+	u64 j;
+	int ret;
+	int i;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	ret = cache_read(f, &header, sizeof(header), &crc);
+	if (ret)
+		goto out;
+	if (memcmp(header.magic, SCAN_CACHE_MAGIC, sizeof(header.magic)) ||
+	    le32_to_cpu(header.version) != SCAN_CACHE_VERSION) {
+		ret = -EIO;
+		goto out;
+	}
+	if (memcmp(header.fsid, cache->fsid, BTRFS_FSID_SIZE) ||
+	    le64_to_cpu(header.generation) != cache->generation ||
+	    le32_to_cpu(header.sectorsize) != cache->sectorsize ||
+	    le32_to_cpu(header.leafsize) != cache->leafsize ||
+	    le32_to_cpu(header.nr_devices) != cache->nr_devices) {
+		ret = -ESTALE;
+		goto out;
+	}
+
+	for (i = 0; i < cache->nr_devices; i++) {
+		ret = cache_read(f, &item, sizeof(item), &crc);
+		if (ret)
+			goto out;
+		dev = scan_cache_find_device(cache, le64_to_cpu(item.devid));
+		if (!dev || dev->blocks ||
+		    memcmp(dev->uuid, item.uuid, BTRFS_UUID_SIZE) ||
+		    dev->size != le64_to_cpu(item.size)) {
+			ret = -ESTALE;
+			goto out;
+		}
+
+		nr = le64_to_cpu(item.nr_blocks);
+		if (nr > dev->size / cache->sectorsize) {
+			ret = -EIO;
+			goto out;
+		}
+		dev->blocks = malloc(max_t(u64, nr, 1) * sizeof(*dev->blocks));
+		if (!dev->blocks) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		dev->alloc_blocks = max_t(u64, nr, 1);
+		for (j = 0; j < nr; j++) {
+			ret = cache_read(f, &bitem, sizeof(bitem), &crc);
+			if (ret)
+				goto out;
+			b = &dev->blocks[j];
+			b->physical = le64_to_cpu(bitem.physical);
+			b->bytenr = le64_to_cpu(bitem.bytenr);
+			b->owner = le64_to_cpu(bitem.owner);
+			b->generation = le64_to_cpu(bitem.generation);
+			b->level = bitem.level;
+			b->csum_ok = bitem.csum_ok;
+			dev->nr_blocks++;
+			if (j && b->physical <= b[-1].physical) {
+				ret = -EIO;
+				goto out;
+			}
+		}
+	}
+
+	if (fread(&disk_crc, 1, sizeof(disk_crc), f) != sizeof(disk_crc) ||
+	    le32_to_cpu(disk_crc) != crc)
+		ret = -EIO;
+out:
+	fclose(f);
+	if (ret) {
+		for (i = 0; i < cache->nr_devices; i++) {
+			dev = &cache->devices[i];
+			free(dev->blocks);
+			dev->blocks = NULL;
+			dev->nr_blocks = 0;
+			dev->alloc_blocks = 0;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Fill the cache from @path if it's still good for these devices, scan
+ * them otherwise and save the result to @path when there's one.
+ */
+int scan_cache_fill(struct scan_cache *cache,
+		    struct btrfs_fs_devices *fs_devices, const char *path,
+		    int jobs)
+{
+	int ret;
+
+	if (path) {
+		ret = scan_cache_load(cache, path);
+		if (!ret)
+			return 0;
+		if (ret == -ESTALE)
+			fprintf(stderr,
+		"Scan cache %s doesn't match the devices, rescanning\n",
+				path);
+		else if (ret != -ENOENT)
+			fprintf(stderr,
+				"Failed to load scan cache %s: %s, rescanning\n",
+				path, strerror(-ret));
+	}
+
+	ret = scan_cache_scan(cache, fs_devices, jobs);
+	if (ret || !path)
+		return ret;
+
+	ret = scan_cache_save(cache, path);
+	if (ret)
+		fprintf(stderr, "Failed to save scan cache %s: %s\n", path,
+			strerror(-ret));
+	return 0;
+}
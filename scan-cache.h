@@ -0,0 +1,77 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_SCAN_CACHE_H__
+#define __BTRFS_SCAN_CACHE_H__
+
+#include <pthread.h>
+#include "kerncompat.h"
+#include "ctree.h"
+#include "volumes.h"
+
+/*
+ * The tree block headers found by a raw scan of every device of a
+ * filesystem, so that the rescue tools can save them to a file and
+ * skip the scan on the next run.
+ */
+struct scan_cache_block {
+	u64 physical;
+	u64 bytenr;
+	u64 owner;
+	u64 generation;
+	u8 level;
+	u8 csum_ok;
+};
+
+struct scan_cache_device {
+	u64 devid;
+	u8 uuid[BTRFS_UUID_SIZE];
+	u64 size;
+
+	/* sorted by physical once the scan is done */
+	struct scan_cache_block *blocks;
+	u64 nr_blocks;
+	u64 alloc_blocks;
+};
+
+struct scan_cache {
+	u8 fsid[BTRFS_FSID_SIZE];
+	u64 generation;
+	u32 sectorsize;
+	u32 leafsize;
+	u16 csum_size;
+
+	int nr_devices;
+	struct scan_cache_device *devices;
+	pthread_mutex_t lock;
+};
+
+int scan_cache_init(struct scan_cache *cache,
+		    struct btrfs_fs_devices *fs_devices, u64 generation,
+		    u32 sectorsize, u32 leafsize, u16 csum_size);
+void scan_cache_release(struct scan_cache *cache);
+int scan_cache_scan(struct scan_cache *cache,
+		    struct btrfs_fs_devices *fs_devices, int jobs);
+int scan_cache_load(struct scan_cache *cache, const char *path);
+int scan_cache_save(struct scan_cache *cache, const char *path);
+int scan_cache_fill(struct scan_cache *cache,
+		    struct btrfs_fs_devices *fs_devices, const char *path,
+		    int jobs);
+struct scan_cache_device *scan_cache_find_device(struct scan_cache *cache,
+						 u64 devid);
+u64 scan_cache_lookup(struct scan_cache_device *dev, u64 physical);
+
+#endif
@@ -18,6 +18,10 @@
 
 #include <uuid/uuid.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "send.h"
 #include "send-stream.h"
@@ -25,7 +29,22 @@
 
 struct btrfs_send_stream {
 	int fd;
-	char read_buf[BTRFS_SEND_BUF_SIZE];
+
+	/*
+	 * The current command, or the whole rest of the file if it's mapped.
+	 * Streams that can't be mapped are read one command at a time, so
+	 * nothing past the end of the stream is consumed from the fd.
+	 */
+	char *buf;
+	size_t buf_size;
+	size_t pos;	/* start of the next command */
+	size_t end;	/* end of the valid data */
+	int mapped;
+	off_t map_offset;
+
+	/* NUL terminated copies of the string attributes */
+	char *str_buf;
+	size_t str_pos;
 
 	int cmd;
 	struct btrfs_cmd_header *cmd_hdr;
@@ -36,52 +55,154 @@ struct btrfs_send_stream {
 	void *user;
 };
 
-static int read_buf(struct btrfs_send_stream *s, void *buf, int len)
+static int map_stream(struct btrfs_send_stream *s)
+{
+	struct stat st;
+	off_t offset;
+	off_t start;
+	void *map;
+
+	if (fstat(s->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return -EINVAL;
+	offset = lseek(s->fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st.st_size)
+		return -EINVAL;
+
+	start = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	map = mmap(NULL, st.st_size - start, PROT_READ, MAP_PRIVATE, s->fd,
+		   start);
+	if (map == MAP_FAILED)
+		return -errno;
+	madvise(map, st.st_size - start, MADV_SEQUENTIAL);
+
+	s->buf = map;
+	s->buf_size = st.st_size - start;
+	s->pos = offset - start;
+	s->end = s->buf_size;
+	s->map_offset = start;
+	s->mapped = 1;
+	return 0;
+}
+
+/* continue reading a mapped file with read(), it may have grown */
+static int unmap_stream(struct btrfs_send_stream *s)
+{
+	int ret = 0;
+
+	if (lseek(s->fd, s->map_offset + s->pos, SEEK_SET) < 0) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: seeking in stream failed. %s\n",
+				strerror(-ret));
+	}
+	munmap(s->buf, s->buf_size);
+	s->buf = NULL;
+	s->buf_size = 0;
+	s->pos = 0;
+	s->end = 0;
+	s->mapped = 0;
+	return ret;
+}
+
+static int init_stream(struct btrfs_send_stream *s, int fd)
+{
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->str_buf = malloc(BTRFS_SEND_BUF_SIZE + BTRFS_SEND_A_MAX + 1);
+	if (!s->str_buf)
+		goto enomem;
+
+	if (map_stream(s) == 0)
+		return 0;
+	s->buf = malloc(BTRFS_SEND_BUF_SIZE);
+	if (!s->buf)
+		goto enomem;
+	s->buf_size = BTRFS_SEND_BUF_SIZE;
+	return 0;
+
+enomem:
+	free(s->str_buf);
+	fprintf(stderr, "ERROR: not enough memory\n");
+	return -ENOMEM;
+}
+
+static void finish_stream(struct btrfs_send_stream *s)
+{
+	free(s->str_buf);
+	if (s->mapped)
+		unmap_stream(s);
+	else
+		free(s->buf);
+}
+
+/*
+ * Make the next @len bytes of the stream available at s->buf + s->pos.
+ * They stay valid until the next call. Returns 1 on EOF.
+ */
+static int fill_buf(struct btrfs_send_stream *s, size_t len)
 {
 	int ret;
-	int pos = 0;
 
-	while (pos < len) {
-		ret = read(s->fd, (char*)buf + pos, len - pos);
+	if (s->end - s->pos >= len)
+		return 0;
+	if (s->mapped) {
+		ret = unmap_stream(s);
+		if (ret < 0)
+			return ret;
+		s->buf = malloc(BTRFS_SEND_BUF_SIZE);
+		if (!s->buf) {
+			fprintf(stderr, "ERROR: not enough memory\n");
+			return -ENOMEM;
+		}
+		s->buf_size = BTRFS_SEND_BUF_SIZE;
+	}
+
+	if (s->pos == s->end) {
+		s->pos = 0;
+		s->end = 0;
+	} else if (s->buf_size - s->pos < len) {
+		memmove(s->buf, s->buf + s->pos, s->end - s->pos);
+		s->end -= s->pos;
+		s->pos = 0;
+	}
+	while (s->end - s->pos < len) {
+		ret = read(s->fd, s->buf + s->end, s->pos + len - s->end);
 		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 			ret = -errno;
 			fprintf(stderr, "ERROR: read from stream failed. %s\n",
 					strerror(-ret));
-			goto out;
-		}
-		if (ret == 0) {
-			ret = 1;
-			goto out;
+			return ret;
 		}
-		pos += ret;
+		if (ret == 0)
+			return 1;
+		s->end += ret;
 	}
-
-	ret = 0;
-
-out:
-	return ret;
+	return 0;
 }
 
 /*
- * Reads a single command from kernel space and decodes the TLV's into
- * s->cmd_attrs
+ * Decodes a single command in place, s->cmd_attrs point to its TLV's in
+ * the stream buffer.
  */
 static int read_cmd(struct btrfs_send_stream *s)
 {
+	static const u8 zero_crc[sizeof(s->cmd_hdr->crc)];
 	int ret;
 	int cmd;
-	int cmd_len;
+	u32 cmd_len;
 	int tlv_type;
-	int tlv_len;
+	u32 tlv_len;
 	char *data;
-	int pos;
+	u32 pos;
 	struct btrfs_tlv_header *tlv_hdr;
 	u32 crc;
 	u32 crc2;
 
 	memset(s->cmd_attrs, 0, sizeof(s->cmd_attrs));
+	s->str_pos = 0;
 
-	ret = read_buf(s, s->read_buf, sizeof(*s->cmd_hdr));
+	ret = fill_buf(s, sizeof(*s->cmd_hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -90,12 +211,17 @@ static int read_cmd(struct btrfs_send_stream *s)
 		goto out;
 	}
 
-	s->cmd_hdr = (struct btrfs_cmd_header *)s->read_buf;
+	s->cmd_hdr = (struct btrfs_cmd_header *)(s->buf + s->pos);
 	cmd = le16_to_cpu(s->cmd_hdr->cmd);
 	cmd_len = le32_to_cpu(s->cmd_hdr->len);
+	if (cmd_len > BTRFS_SEND_BUF_SIZE - sizeof(*s->cmd_hdr)) {
+		ret = -EINVAL;
+		fprintf(stderr, "ERROR: command too large. cmd_len = %u\n",
+				cmd_len);
+		goto out;
+	}
 
-	data = s->read_buf + sizeof(*s->cmd_hdr);
-	ret = read_buf(s, data, cmd_len);
+	ret = fill_buf(s, sizeof(*s->cmd_hdr) + cmd_len);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -103,12 +229,17 @@ static int read_cmd(struct btrfs_send_stream *s)
 		fprintf(stderr, "ERROR: unexpected EOF in stream.\n");
 		goto out;
 	}
+	/* the buffer may have moved */
+	s->cmd_hdr = (struct btrfs_cmd_header *)(s->buf + s->pos);
+	data = (char *)(s->cmd_hdr + 1);
+	s->pos += sizeof(*s->cmd_hdr) + cmd_len;
 
+	/* the crc is calculated with the crc field zeroed */
 	crc = le32_to_cpu(s->cmd_hdr->crc);
-	s->cmd_hdr->crc = 0;
-
-	crc2 = crc32c(0, (unsigned char*)s->read_buf,
-			sizeof(*s->cmd_hdr) + cmd_len);
+	crc2 = crc32c(0, s->cmd_hdr,
+		      offsetof(struct btrfs_cmd_header, crc));
+	crc2 = crc32c(crc2, zero_crc, sizeof(zero_crc));
+	crc2 = crc32c(crc2, data, cmd_len);
 
 	if (crc != crc2) {
 		ret = -EINVAL;
@@ -123,9 +254,10 @@ static int read_cmd(struct btrfs_send_stream *s)
 		tlv_len = le16_to_cpu(tlv_hdr->tlv_len);
 
 		if (tlv_type <= 0 || tlv_type > BTRFS_SEND_A_MAX ||
-		    tlv_len < 0 || tlv_len > BTRFS_SEND_BUF_SIZE) {
+		    cmd_len - pos < sizeof(*tlv_hdr) ||
+		    tlv_len > cmd_len - pos - sizeof(*tlv_hdr)) {
 			fprintf(stderr, "ERROR: invalid tlv in cmd. "
-					"tlv_type = %d, tlv_len = %d\n",
+					"tlv_type = %d, tlv_len = %u\n",
 					tlv_type, tlv_len);
 			ret = -EINVAL;
 			goto out;
@@ -212,6 +344,10 @@ out:
 #define TLV_GET_U32(s, attr, v) TLV_GET_INT(s, attr, 32, v)
 #define TLV_GET_U64(s, attr, v) TLV_GET_INT(s, attr, 64, v)
 
+/*
+ * Strings aren't NUL terminated in the stream, they're copied to the
+ * per command string buffer, which has room for all of them.
+ */
 static int tlv_get_string(struct btrfs_send_stream *s, int attr, char **str)
 {
 	int ret;
@@ -220,12 +356,10 @@ static int tlv_get_string(struct btrfs_send_stream *s, int attr, char **str)
 
 	TLV_GET(s, attr, &data, &len);
 
-	*str = malloc(len + 1);
-	if (!*str)
-		return -ENOMEM;
-
+	*str = s->str_buf + s->str_pos;
 	memcpy(*str, data, len);
 	(*str)[len] = 0;
+	s->str_pos += len + 1;
 	ret = 0;
 
 tlv_get_failed:
@@ -428,10 +562,6 @@ static int read_and_process_cmd(struct btrfs_send_stream *s)
 
 tlv_get_failed:
 out:
-	free(path);
-	free(path_to);
-	free(clone_path);
-	free(xattr_name);
 	return ret;
 }
 
@@ -451,19 +581,23 @@ int btrfs_read_and_process_send_stream(int fd,
 	u64 errors = 0;
 	int last_err = 0;
 
-	s.fd = fd;
+	ret = init_stream(&s, fd);
+	if (ret < 0)
+		return ret;
 	s.ops = ops;
 	s.user = user;
 
-	ret = read_buf(&s, &hdr, sizeof(hdr));
+	ret = fill_buf(&s, sizeof(hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
 		ret = 1;
 		goto out;
 	}
+	memcpy(&hdr, s.buf + s.pos, sizeof(hdr));
+	s.pos += sizeof(hdr);
 
-	if (strcmp(hdr.magic, BTRFS_SEND_STREAM_MAGIC)) {
+	if (strncmp(hdr.magic, BTRFS_SEND_STREAM_MAGIC, sizeof(hdr.magic))) {
 		ret = -EINVAL;
 		fprintf(stderr, "ERROR: Unexpected header\n");
 		goto out;
@@ -492,6 +626,7 @@ int btrfs_read_and_process_send_stream(int fd,
 	}
 
 out:
+	finish_stream(&s);
 	if (last_err && !ret)
 		ret = last_err;
 
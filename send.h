@@ -59,6 +59,39 @@ struct btrfs_tlv_header {
 	__le16 tlv_len;
 } __attribute__ ((__packed__));
 
+/*
+ * Framed streams: btrfs send --framed wraps the stream into frames ending
+ * at command boundaries. Each frame is a checkpoint a transfer can be
+ * resumed from, it tells where it ends in the raw stream and carries the
+ * running crc of the raw stream up to there.
+ */
+#define BTRFS_SEND_FRAMED_MAGIC "btrfs-framed"
+#define BTRFS_SEND_FRAMED_VERSION 1
+
+struct btrfs_framed_header {
+	char magic[sizeof(BTRFS_SEND_FRAMED_MAGIC)];
+	__le32 version;
+	/* where in the raw stream the first frame starts */
+	__le64 offset;
+	/* commands in the raw stream before it, end commands not counted */
+	__le64 cmds;
+	/* crc32c of the raw stream before it */
+	__le32 crc;
+} __attribute__ ((__packed__));
+
+struct btrfs_frame_header {
+	/* len of the data following, 0 for the last frame */
+	__le32 len;
+	/* crc of the data */
+	__le32 crc;
+	/* offset, commands and crc of the raw stream at the frame's end */
+	__le64 offset;
+	__le64 cmds;
+	__le32 stream_crc;
+	/* crc of this header with zero hdr_crc field */
+	__le32 hdr_crc;
+} __attribute__ ((__packed__));
+
 /* commands */
 enum btrfs_send_cmd {
 	BTRFS_SEND_C_UNSPEC,
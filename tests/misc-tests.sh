@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# run the tests in tests/misc-tests, each one in its own shell
+#
+# The tests that need a mounted filesystem use TEST_DEV, which is
+# reformatted, and TEST_MNT and only run as root.
+#
+# It's GPL, same as everything else in this tree.
+#
+
+here=`pwd`
+TEST_DEV=${TEST_DEV:-}
+TEST_MNT=${TEST_MNT:-}
+RESULT="misc-tests-results.txt"
+
+_fail()
+{
+	echo "$*" | tee -a $RESULT
+	exit 1
+}
+
+_not_run()
+{
+	echo "     [NOTRUN]  $*"
+	exit 0
+}
+
+run_check()
+{
+	echo "############### $@" >> $RESULT 2>&1
+	"$@" >> $RESULT 2>&1 || _fail "failed: $@"
+}
+
+# the output of a command, which has to succeed
+run_check_stdout()
+{
+	echo "############### $@" >> $RESULT 2>&1
+	"$@" 2>> $RESULT || _fail "failed: $@"
+}
+
+# a fresh filesystem on TEST_DEV mounted at TEST_MNT, or skip the test
+prepare_test_mnt()
+{
+	if [ -z "$TEST_DEV" ] || [ -z "$TEST_MNT" ]; then
+		_not_run "needs TEST_DEV and TEST_MNT"
+	fi
+	if [ `id -u` -ne 0 ]; then
+		_not_run "needs root"
+	fi
+	run_check $here/mkfs.btrfs -f $TEST_DEV
+	run_check mount $TEST_DEV $TEST_MNT
+}
+
+cleanup_test_mnt()
+{
+	run_check umount $TEST_MNT
+}
+
+rm -f $RESULT
+
+run_check make btrfs btrfs-find-root mkfs.btrfs
+
+for i in $(find $here/tests/misc-tests -name '*.sh' | sort)
+do
+	echo "     [TEST]    $(basename $i .sh)"
+	echo "testing $i" >> $RESULT
+	( . $i ) || exit 1
+done
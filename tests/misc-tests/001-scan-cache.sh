@@ -0,0 +1,48 @@
+#
+# btrfs-find-root and chunk-recover find the same with a scan cache as
+# without, both when the scan fills the cache and when it is loaded
+#
+
+img=$here/scan-cache.img
+cache=$here/scan-cache.cache
+
+dir=$here/scan-cache.dir
+
+rm -rf $img $cache $dir
+mkdir $dir || _fail "can't create $dir"
+for i in `seq 1 2000`; do
+	echo $i > $dir/file$i
+done
+run_check truncate -s 256M $img
+run_check $here/mkfs.btrfs -r $dir $img
+
+run_check_stdout $here/btrfs-find-root $img > $here/scan-cache.out1
+run_check_stdout $here/btrfs-find-root -c $cache $img > $here/scan-cache.out2
+[ -f $cache ] || _fail "find-root didn't save the scan cache"
+run_check_stdout $here/btrfs-find-root -c $cache $img > $here/scan-cache.out3
+run_check_stdout $here/btrfs-find-root -o 5 -c $cache $img \
+	> $here/scan-cache.out4
+run_check_stdout $here/btrfs-find-root -o 5 $img > $here/scan-cache.out5
+cmp -s $here/scan-cache.out1 $here/scan-cache.out2 &&
+	cmp -s $here/scan-cache.out1 $here/scan-cache.out3 &&
+	cmp -s $here/scan-cache.out4 $here/scan-cache.out5 ||
+	_fail "find-root found other roots with the scan cache"
+
+# every run rewrites the chunk tree, start them all from the same image
+rm -f $cache
+for run in 1 2 3; do
+	run_check cp $img $img.$run
+	opt=
+	[ $run -gt 1 ] && opt="-c $cache"
+	run_check_stdout $here/btrfs rescue chunk-recover -v -y $opt \
+		$img.$run > $here/scan-cache.rc$run
+	sed -i "s|$img.$run|IMG|" $here/scan-cache.rc$run
+	run_check $here/btrfs check $img.$run
+done
+[ -f $cache ] || _fail "chunk-recover didn't save the scan cache"
+cmp -s $here/scan-cache.rc1 $here/scan-cache.rc2 &&
+	cmp -s $here/scan-cache.rc1 $here/scan-cache.rc3 ||
+	_fail "chunk-recover found other chunks with the scan cache"
+
+rm -rf $img $img.1 $img.2 $img.3 $cache $dir $here/scan-cache.out* \
+	$here/scan-cache.rc*
@@ -0,0 +1,42 @@
+#
+# a framed send stream cut short is received up to its last complete
+# frame, then the rest sent with --resume completes the subvolume
+#
+
+prepare_test_mnt
+
+stream=$here/receive-resume.stream
+
+run_check $here/btrfs subvolume create $TEST_MNT/src
+for i in `seq 1 16`; do
+	run_check dd if=/dev/urandom of=$TEST_MNT/src/file$i bs=64k count=16
+done
+run_check mkdir $TEST_MNT/src/dir
+run_check mv $TEST_MNT/src/file16 $TEST_MNT/src/dir/
+run_check $here/btrfs subvolume snapshot -r $TEST_MNT/src $TEST_MNT/snap
+run_check mkdir $TEST_MNT/dst
+
+rm -f $stream $stream.part $stream.rest $stream.ckpt
+run_check $here/btrfs send --framed -f $stream $TEST_MNT/snap
+run_check cp $stream $stream.part
+run_check truncate -s 9M $stream.part
+
+echo "############### receive the first 9M" >> $RESULT
+$here/btrfs receive --resume-file $stream.ckpt -f $stream.part \
+	$TEST_MNT/dst > $here/receive-resume.out 2>&1 &&
+	_fail "a truncated stream was received completely"
+cat $here/receive-resume.out >> $RESULT
+offset=`sed -n "s/.*btrfs send --resume \([0-9]*\)'.*/\1/p" \
+	$here/receive-resume.out`
+[ -n "$offset" ] || _fail "receive saved no checkpoint"
+[ -f $stream.ckpt ] || _fail "receive didn't write $stream.ckpt"
+
+run_check $here/btrfs send --framed --resume $offset -f $stream.rest \
+	$TEST_MNT/snap
+run_check $here/btrfs receive --resume-file $stream.ckpt -f $stream.rest \
+	$TEST_MNT/dst
+[ -f $stream.ckpt ] && _fail "$stream.ckpt is left after the transfer"
+run_check diff -r $TEST_MNT/snap $TEST_MNT/dst/snap
+
+rm -f $stream $stream.part $stream.rest $here/receive-resume.out
+cleanup_test_mnt
@@ -0,0 +1,26 @@
+#
+# subvolume list gives the same subvolumes whatever the size of the
+# buffer TREE_SEARCH_V2 returns them in
+#
+
+prepare_test_mnt
+
+for i in `seq 1 300`; do
+	run_check $here/btrfs subvolume create $TEST_MNT/subvol$i
+done
+run_check $here/btrfs subvolume snapshot $TEST_MNT/subvol1 \
+	$TEST_MNT/subvol1/snap
+
+run_check_stdout $here/btrfs subvolume list $TEST_MNT \
+	> $here/subvolume-list.out1
+for size in 4k 64k 16m; do
+	run_check_stdout $here/btrfs subvolume list --search-buffer=$size \
+		$TEST_MNT > $here/subvolume-list.out2
+	cmp -s $here/subvolume-list.out1 $here/subvolume-list.out2 ||
+		_fail "subvolume list differs with a $size search buffer"
+done
+[ `wc -l < $here/subvolume-list.out1` -eq 301 ] ||
+	_fail "subvolume list didn't find all the subvolumes"
+
+rm -f $here/subvolume-list.out*
+cleanup_test_mnt
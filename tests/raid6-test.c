@@ -0,0 +1,216 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Check every raid6 syndrome algorithm this cpu can run against a plain
+ * byte at a time P/Q on random stripes, then lose one or two members of
+ * the stripes and check they are rebuilt.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "kerncompat.h"
+#include "ctree.h"
+#include "disk-io.h"
+
+#define TEST_MAX_DISKS	16
+#define TEST_MAX_BYTES	(65536 + 4096)
+
+static u8 *stripes[TEST_MAX_DISKS];
+static u8 *copies[TEST_MAX_DISKS];
+static void *ptrs[TEST_MAX_DISKS];
+
+static u8 gfmul(u8 a, u8 b)
+{
+	u8 v = 0;
+
+	while (b) {
+		if (b & 1)
+			v ^= a;
+		a = (a << 1) ^ (a & 0x80 ? 0x1d : 0);
+		b >>= 1;
+	}
+	return v;
+}
+
+/* P is the xor of the data, Q the sum of 2^i times data block i */
+static void ref_syndrome(int disks, size_t bytes)
+{
+	u8 *p = copies[disks - 2];
+	u8 *q = copies[disks - 1];
+	size_t off;
+	int i;
+
+	memset(p, 0, bytes);
+	memset(q, 0, bytes);
+	for (i = disks - 3; i >= 0; i--) {
+		for (off = 0; off < bytes; off++) {
+			p[off] ^= stripes[i][off];
+			q[off] = gfmul(q[off], 2) ^ stripes[i][off];
+		}
+	}
+}
+
+static void fill_stripes(int disks, size_t bytes)
+{
+	size_t off;
+	int i;
+
+	for (i = 0; i < disks - 2; i++) {
+		for (off = 0; off < bytes; off++)
+			stripes[i][off] = rand();
+		memcpy(copies[i], stripes[i], bytes);
+	}
+	ref_syndrome(disks, bytes);
+	for (i = 0; i < disks; i++)
+		ptrs[i] = stripes[i];
+	raid6_gen_syndrome(disks, bytes, ptrs);
+}
+
+static int check_stripes(const char *name, const char *what, int disks,
+			 size_t bytes, int faila, int failb)
+{
+	int i;
+
+	for (i = 0; i < disks; i++) {
+		if (!memcmp(stripes[i], copies[i], bytes))
+			continue;
+		fprintf(stderr,
+			"%s: %s: block %d differs, disks %d bytes %zu failed %d %d\n",
+			name, what, i, disks, bytes, faila, failb);
+		return 1;
+	}
+	return 0;
+}
+
+static void xor_data(int disks, size_t bytes, int fail)
+{
+	size_t off;
+	int i;
+
+	memcpy(stripes[fail], stripes[disks - 2], bytes);
+	for (i = 0; i < disks - 2; i++) {
+		if (i == fail)
+			continue;
+		for (off = 0; off < bytes; off++)
+			stripes[fail][off] ^= stripes[i][off];
+	}
+}
+
+/* lose the blocks @faila < @failb, -1 for none, and rebuild them */
+static int check_recov(const char *name, int disks, size_t bytes,
+		       int faila, int failb)
+{
+	int data = disks - 2;
+	int ret;
+
+	memset(stripes[faila], 0x5a, bytes);
+	if (failb >= 0)
+		memset(stripes[failb], 0xa5, bytes);
+
+	if (failb < 0 && faila < data) {
+		xor_data(disks, bytes, faila);
+	} else if (failb < 0 || faila >= data) {
+		/* only parity is gone */
+		raid6_gen_syndrome(disks, bytes, ptrs);
+	} else if (failb < data) {
+		ret = raid6_2data_recov(disks, bytes, faila, failb, ptrs);
+		if (ret)
+			return ret;
+	} else if (failb == data) {
+		ret = raid6_datap_recov(disks, bytes, faila, ptrs);
+		if (ret)
+			return ret;
+	} else {
+		xor_data(disks, bytes, faila);
+		raid6_gen_syndrome(disks, bytes, ptrs);
+	}
+	return check_stripes(name, "recovery", disks, bytes, faila, failb);
+}
+
+static int test_impl(const char *name)
+{
+	size_t lengths[] = { 8, 4096, 4096 + 8, 16384, TEST_MAX_BYTES };
+	size_t bytes;
+	int disks;
+	int a, b;
+	int i;
+
+	for (disks = 3; disks <= TEST_MAX_DISKS; disks++) {
+		for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+			bytes = lengths[i];
+			raid6_set_impl(name);
+			fill_stripes(disks, bytes);
+			if (check_stripes(name, "syndrome", disks, bytes,
+					  -1, -1))
+				return 1;
+
+			for (a = 0; a < disks; a++) {
+				if (check_recov(name, disks, bytes, a, -1))
+					return 1;
+				for (b = a + 1; b < disks; b++) {
+					if (check_recov(name, disks, bytes,
+							a, b))
+						return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name;
+	unsigned int seed = getpid();
+	int ret = 0;
+	int i;
+
+	if (argc > 1)
+		seed = atoi(argv[1]);
+	srand(seed);
+	printf("seed %u, default algorithm: %s\n", seed, raid6_algo_name());
+
+	for (i = 0; i < TEST_MAX_DISKS; i++) {
+		stripes[i] = malloc(TEST_MAX_BYTES);
+		copies[i] = malloc(TEST_MAX_BYTES);
+		if (!stripes[i] || !copies[i]) {
+			fprintf(stderr, "No memory\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; (name = raid6_impl_name(i)) != NULL; i++) {
+		if (raid6_set_impl(name) == -EOPNOTSUPP) {
+			printf("  %-12s not supported by this cpu\n", name);
+			continue;
+		}
+		if (test_impl(name)) {
+			ret = 1;
+			continue;
+		}
+		printf("  %-12s ok\n", name);
+	}
+
+	for (i = 0; i < TEST_MAX_DISKS; i++) {
+		free(stripes[i]);
+		free(copies[i]);
+	}
+	return ret;
+}
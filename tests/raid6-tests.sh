@@ -0,0 +1,27 @@
+#!/bin/bash
+#
+# check every raid6 syndrome algorithm the cpu can run against the plain
+# one, and the recovery of one and two lost members of a stripe
+#
+
+here=`pwd`
+RESULT="raid6-tests-results.txt"
+
+_fail()
+{
+	echo "$*" | tee -a $RESULT
+	exit 1
+}
+
+run_check()
+{
+	echo "############### $@" >> $RESULT 2>&1
+	"$@" >> $RESULT 2>&1 || _fail "failed: $@"
+}
+
+rm -f $RESULT
+
+run_check make raid6-test
+
+echo "     [TEST]    raid6 algorithms"
+run_check $here/raid6-test
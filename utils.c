@@ -1755,6 +1755,21 @@ u64 parse_size(char *s)
 	return ret;
 }
 
+/*
+ * The size of the tree block cache from --cache-size or BTRFS_CACHE_SIZE,
+ * @what names where it came from in the error.
+ */
+u64 parse_cache_size(char *s, const char *what)
+{
+	u64 size = parse_size(s);
+
+	if (!size) {
+		fprintf(stderr, "ERROR: %s must not be 0\n", what);
+		exit(1);
+	}
+	return size;
+}
+
 int open_file_or_dir3(const char *fname, DIR **dirstream, int open_flags)
 {
 	int ret;
@@ -2006,3 +2006,128 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 
 	return 0;
 }
+
+static void xor_stripe(char *dst, char *src, u64 len)
+{
+	u64 i;
+
+	for (i = 0; i < len; i += sizeof(unsigned long))
+		*(unsigned long *)(dst + i) ^= *(unsigned long *)(src + i);
+}
+
+/*
+ * Rebuild [logical, logical + len) of a RAID5/6 chunk from the rest of its
+ * full stripe instead of reading the data stripe itself.  The range must
+ * not cross a stripe boundary.
+ *
+ * Mirror 2 rebuilds from the other data stripes and P, falling back to Q
+ * when one more stripe is unreadable.  Mirror 3 (RAID6 only) leaves P out
+ * and rebuilds from Q, so a block that fails its checksum with one parity
+ * still gets a chance with the other.
+ */
+int read_raid56_with_parity(struct btrfs_fs_info *info, u64 logical,
+			    u64 len, char *buf, int mirror)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	u64 *raid_map = NULL;
+	u64 stripe_len = len;
+	u64 physical;
+	u64 offset;
+	u64 type;
+	void **pointers = NULL;
+	char *stripes = NULL;
+	int num_stripes;
+	int data_stripes;
+	int target = -1;
+	int failed = -1;
+	int ret;
+	int i;
+
+	if (mirror < 2)
+		mirror = 2;
+	ret = __btrfs_map_block(&info->mapping_tree, READ, logical,
+				&stripe_len, &type, &multi, mirror, &raid_map);
+	if (ret)
+		return ret;
+	ret = -EIO;
+	if (!raid_map)
+		goto out;
+	if (mirror > 2 && !(type & BTRFS_BLOCK_GROUP_RAID6))
+		goto out;
+
+	num_stripes = multi->num_stripes;
+	data_stripes = num_stripes -
+		((type & BTRFS_BLOCK_GROUP_RAID6) ? 2 : 1);
+	for (i = 0; i < data_stripes; i++) {
+		if (raid_map[i] <= logical &&
+		    logical < raid_map[i] + stripe_len)
+			target = i;
+	}
+	if (target < 0)
+		goto out;
+	offset = logical - raid_map[target];
+	if (offset + len > stripe_len || len % sizeof(unsigned long)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = -ENOMEM;
+	pointers = kmalloc(sizeof(*pointers) * num_stripes, GFP_NOFS);
+	stripes = malloc(len * num_stripes);
+	if (!pointers || !stripes)
+		goto out;
+
+	/* get all the surviving stripes in flight before we wait on any */
+	for (i = 0; i < num_stripes; i++) {
+		pointers[i] = stripes + len * i;
+		device = multi->stripes[i].dev;
+		if (i == target || (mirror == 3 && i == data_stripes) ||
+		    device->fd <= 0)
+			continue;
+		posix_fadvise(device->fd, multi->stripes[i].physical + offset,
+			      len, POSIX_FADV_WILLNEED);
+	}
+
+	ret = -EIO;
+	for (i = 0; i < num_stripes; i++) {
+		if (i == target || (mirror == 3 && i == data_stripes))
+			continue;
+		device = multi->stripes[i].dev;
+		physical = multi->stripes[i].physical + offset;
+		if (device->fd > 0 &&
+		    pread(device->fd, pointers[i], len, physical) == len)
+			continue;
+		/* one stripe besides the target is all parity can cover */
+		if (failed >= 0 || !(type & BTRFS_BLOCK_GROUP_RAID6))
+			goto out;
+		failed = i;
+	}
+
+	if (mirror == 3) {
+		/* P was never read, so Q has to cover for the target alone */
+		if (failed >= 0)
+			goto out;
+		ret = raid6_datap_recov(num_stripes, len, target, pointers);
+	} else if (failed >= 0 && failed < data_stripes) {
+		ret = raid6_2data_recov(num_stripes, len, min(target, failed),
+					max(target, failed), pointers);
+	} else if (failed == data_stripes) {
+		ret = raid6_datap_recov(num_stripes, len, target, pointers);
+	} else {
+		memcpy(pointers[target], pointers[data_stripes], len);
+		for (i = 0; i < data_stripes; i++) {
+			if (i != target)
+				xor_stripe(pointers[target], pointers[i], len);
+		}
+		ret = 0;
+	}
+	if (!ret)
+		memcpy(buf, pointers[target], len);
+out:
+	free(stripes);
+	kfree(pointers);
+	kfree(raid_map);
+	kfree(multi);
+	return ret;
+}
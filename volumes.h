@@ -197,4 +197,6 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 			     struct extent_buffer *eb,
 			     struct btrfs_multi_bio *multi,
 			     u64 stripe_len, u64 *raid_map);
+int read_raid56_with_parity(struct btrfs_fs_info *info, u64 logical,
+			    u64 len, char *buf, int mirror);
 #endif